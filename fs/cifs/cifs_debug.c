@@ -104,6 +104,74 @@ void cifs_dump_mids(struct TCP_Server_Info *server)
 }
 #endif /* CONFIG_CIFS_DEBUG2 */
 
+#ifdef CONFIG_CIFS_STATS2
+/* the commands given their own histogram slot, slot 0 is everything else */
+static const __u8 cifs_hist_cmds[CIFS_HIST_CMDS] = {
+	0,	/* unused, slot 0 counts all other commands */
+	SMB_COM_READ_ANDX,
+	SMB_COM_WRITE_ANDX,
+	SMB_COM_NT_CREATE_ANDX,
+	SMB_COM_CLOSE,
+	SMB_COM_TRANSACTION2,
+	SMB_COM_NT_TRANSACT,
+	SMB_COM_LOCKING_ANDX,
+	SMB_COM_FLUSH,
+	SMB_COM_DELETE,
+	SMB_COM_RENAME,
+	SMB_COM_CREATE_DIRECTORY,
+	SMB_COM_DELETE_DIRECTORY,
+	SMB_COM_FIND_CLOSE2,
+	SMB_COM_SESSION_SETUP_ANDX,
+	SMB_COM_TREE_CONNECT_ANDX,
+};
+
+static int cifs_hist_slot(__u8 command)
+{
+	int i;
+
+	for (i = 1; i < CIFS_HIST_CMDS; i++)
+		if (cifs_hist_cmds[i] == command)
+			return i;
+	return 0;
+}
+
+/*
+ * Find the per tcon latency histogram for a request when it is sent, so
+ * that the demultiplex thread does not have to look the tcon up by uid and
+ * tid for every response.  NULL if the request is not on a tree connection.
+ */
+struct cifs_hist *
+cifs_hist_tcon_slot(struct cifsSesInfo *ses, __u16 tid, __u8 command)
+{
+	struct cifsTconInfo *tcon;
+	struct cifs_hist *hist = NULL;
+
+	read_lock(&cifs_tcp_ses_lock);
+	list_for_each_entry(tcon, &ses->tcon_list, tcon_list) {
+		if (tcon->tid == tid) {
+			hist = &tcon->cmd_latency[cifs_hist_slot(command)];
+			break;
+		}
+	}
+	read_unlock(&cifs_tcp_ses_lock);
+	return hist;
+}
+
+/* Account a response in the server histograms, from the demultiplex thread */
+void
+cifs_hist_record_rsp(struct TCP_Server_Info *server, __u8 command,
+		     s64 usecs, unsigned int req_bytes, unsigned int rsp_bytes)
+{
+	int slot = cifs_hist_slot(command);
+
+	if (usecs < 0)
+		usecs = 0;
+	cifs_hist_add(&server->cmd_latency[slot], usecs);
+	cifs_hist_add(&server->req_bytes[slot], req_bytes);
+	cifs_hist_add(&server->rsp_bytes[slot], rsp_bytes);
+}
+#endif /* CONFIG_CIFS_STATS2 */
+
 #ifdef CONFIG_PROC_FS
 static int cifs_debug_data_proc_show(struct seq_file *m, void *v)
 {
@@ -156,6 +224,12 @@ static int cifs_debug_data_proc_show(struct seq_file *m, void *v)
 				atomic_read(&server->inSend),
 				atomic_read(&server->num_waiters));
 #endif
+			if (server->cifsd_node == CIFSD_NODE_AUTO)
+				seq_printf(m, " cifsd node: auto (rx %d)",
+					   server->rx_node);
+			else if (server->cifsd_node >= 0)
+				seq_printf(m, " cifsd node: %d",
+					   server->cifsd_node);
 
 			seq_puts(m, "\n\tShares:");
 			j = 0;
@@ -393,6 +467,161 @@ static const struct file_operations cifs_stats_proc_fops = {
 };
 #endif /* STATS */
 
+#ifdef CONFIG_CIFS_STATS2
+static void cifs_hist_clear(struct cifs_hist *hist, int count)
+{
+	int i, j;
+
+	for (i = 0; i < count; i++)
+		for (j = 0; j < CIFS_HIST_BUCKETS; j++)
+			atomic_set(&hist[i].bucket[j], 0);
+}
+
+static ssize_t cifs_hist_proc_write(struct file *file,
+		const char __user *buffer, size_t count, loff_t *ppos)
+{
+	char c;
+	int rc;
+	struct TCP_Server_Info *server;
+	struct cifsSesInfo *ses;
+	struct cifsTconInfo *tcon;
+
+	rc = get_user(c, buffer);
+	if (rc)
+		return rc;
+
+	/* writing 0 clears all the histograms */
+	if (c == '0') {
+		read_lock(&cifs_tcp_ses_lock);
+		list_for_each_entry(server, &cifs_tcp_ses_list, tcp_ses_list) {
+			cifs_hist_clear(server->cmd_latency, CIFS_HIST_CMDS);
+			cifs_hist_clear(server->req_bytes, CIFS_HIST_CMDS);
+			cifs_hist_clear(server->rsp_bytes, CIFS_HIST_CMDS);
+			cifs_hist_clear(&server->queue_wait, 1);
+			cifs_hist_clear(&server->reconnect_time, 1);
+			cifs_hist_clear(&server->recover_time, 1);
+			cifs_hist_clear(&server->oplock_break_time, 1);
+			cifs_hist_clear(&server->oplock_break_wait, 1);
+			cifs_hist_clear(server->mount_time, CIFS_MOUNT_PHASES);
+			list_for_each_entry(ses, &server->smb_ses_list,
+					    smb_ses_list) {
+				list_for_each_entry(tcon, &ses->tcon_list,
+						    tcon_list)
+					cifs_hist_clear(tcon->cmd_latency,
+							CIFS_HIST_CMDS);
+			}
+		}
+		read_unlock(&cifs_tcp_ses_lock);
+	}
+
+	return count;
+}
+
+/*
+ * One line per non-empty histogram:
+ *	<server|tcon> <histogram> <command> <bucket 0> ... <bucket N> <name>
+ * the command is - for histograms which are not per command
+ */
+static void cifs_hist_show(struct seq_file *m, const char *type,
+			   const char *hist_name, int slot,
+			   struct cifs_hist *hist, const char *name)
+{
+	int i;
+	unsigned int n[CIFS_HIST_BUCKETS], any = 0;
+
+	for (i = 0; i < CIFS_HIST_BUCKETS; i++) {
+		n[i] = atomic_read(&hist->bucket[i]);
+		any |= n[i];
+	}
+	if (!any)
+		return;
+
+	seq_printf(m, "%s %s ", type, hist_name);
+	if (slot < 0)
+		seq_puts(m, "-");
+	else if (slot == 0)
+		seq_puts(m, "other");
+	else
+		seq_printf(m, "0x%02x", cifs_hist_cmds[slot]);
+	for (i = 0; i < CIFS_HIST_BUCKETS; i++)
+		seq_printf(m, " %u", n[i]);
+	seq_printf(m, " %s\n", name);
+}
+
+static const char *cifs_mount_phase_names[CIFS_MOUNT_PHASES] = {
+	[CIFS_MOUNT_CONNECT]	= "mount_connect_us",
+	[CIFS_MOUNT_SESSION]	= "mount_session_us",
+	[CIFS_MOUNT_TCON]	= "mount_tcon_us",
+	[CIFS_MOUNT_FSINFO]	= "mount_fsinfo_us",
+	[CIFS_MOUNT_PATH]	= "mount_path_us",
+	[CIFS_MOUNT_TOTAL]	= "mount_total_us",
+};
+
+static int cifs_hist_proc_show(struct seq_file *m, void *v)
+{
+	int i;
+	struct TCP_Server_Info *server;
+	struct cifsSesInfo *ses;
+	struct cifsTconInfo *tcon;
+
+	seq_printf(m, "# bucket n counts samples below 2^n usecs or bytes, "
+		      "the last bucket is unbounded\n"
+		      "# type histogram command bucket0..bucket%d name\n",
+		   CIFS_HIST_BUCKETS - 1);
+
+	read_lock(&cifs_tcp_ses_lock);
+	list_for_each_entry(server, &cifs_tcp_ses_list, tcp_ses_list) {
+		const char *host = server->hostname ? server->hostname : "";
+
+		cifs_hist_show(m, "server", "queue_wait_us", -1,
+			       &server->queue_wait, host);
+		cifs_hist_show(m, "server", "reconnect_us", -1,
+			       &server->reconnect_time, host);
+		cifs_hist_show(m, "server", "recover_us", -1,
+			       &server->recover_time, host);
+		cifs_hist_show(m, "server", "oplock_break_us", -1,
+			       &server->oplock_break_time, host);
+		cifs_hist_show(m, "server", "oplock_break_wait_us", -1,
+			       &server->oplock_break_wait, host);
+		for (i = 0; i < CIFS_MOUNT_PHASES; i++)
+			cifs_hist_show(m, "server", cifs_mount_phase_names[i],
+				       -1, &server->mount_time[i], host);
+		for (i = 0; i < CIFS_HIST_CMDS; i++) {
+			cifs_hist_show(m, "server", "latency_us", i,
+				       &server->cmd_latency[i], host);
+			cifs_hist_show(m, "server", "req_bytes", i,
+				       &server->req_bytes[i], host);
+			cifs_hist_show(m, "server", "rsp_bytes", i,
+				       &server->rsp_bytes[i], host);
+		}
+		list_for_each_entry(ses, &server->smb_ses_list, smb_ses_list) {
+			list_for_each_entry(tcon, &ses->tcon_list, tcon_list) {
+				for (i = 0; i < CIFS_HIST_CMDS; i++)
+					cifs_hist_show(m, "tcon", "latency_us",
+						       i, &tcon->cmd_latency[i],
+						       tcon->treeName);
+			}
+		}
+	}
+	read_unlock(&cifs_tcp_ses_lock);
+	return 0;
+}
+
+static int cifs_hist_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, cifs_hist_proc_show, NULL);
+}
+
+static const struct file_operations cifs_hist_proc_fops = {
+	.owner		= THIS_MODULE,
+	.open		= cifs_hist_proc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+	.write		= cifs_hist_proc_write,
+};
+#endif /* CONFIG_CIFS_STATS2 */
+
 static struct proc_dir_entry *proc_fs_cifs;
 static const struct file_operations cifsFYI_proc_fops;
 static const struct file_operations cifs_oplock_proc_fops;
@@ -415,6 +644,9 @@ cifs_proc_init(void)
 #ifdef CONFIG_CIFS_STATS
 	proc_create("Stats", 0, proc_fs_cifs, &cifs_stats_proc_fops);
 #endif /* STATS */
+#ifdef CONFIG_CIFS_STATS2
+	proc_create("Histograms", 0, proc_fs_cifs, &cifs_hist_proc_fops);
+#endif /* STATS2 */
 	proc_create("cifsFYI", 0, proc_fs_cifs, &cifsFYI_proc_fops);
 	proc_create("traceSMB", 0, proc_fs_cifs, &traceSMB_proc_fops);
 	proc_create("OplockEnabled", 0, proc_fs_cifs, &cifs_oplock_proc_fops);
@@ -441,6 +673,9 @@ cifs_proc_clean(void)
 	remove_proc_entry("traceSMB", proc_fs_cifs);
 #ifdef CONFIG_CIFS_STATS
 	remove_proc_entry("Stats", proc_fs_cifs);
+#endif
+#ifdef CONFIG_CIFS_STATS2
+	remove_proc_entry("Histograms", proc_fs_cifs);
 #endif
 	remove_proc_entry("MultiuserMount", proc_fs_cifs);
 	remove_proc_entry("OplockEnabled", proc_fs_cifs);
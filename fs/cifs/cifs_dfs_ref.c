@@ -21,6 +21,7 @@
 #include "cifsproto.h"
 #include "cifsfs.h"
 #include "dns_resolve.h"
+#include "dfs_cache.h"
 #include "cifs_debug.h"
 
 static LIST_HEAD(cifs_dfs_automount_list);
@@ -362,8 +363,12 @@ cifs_dfs_follow_mountpoint(struct dentry *dentry, struct nameidata *nd)
 					referrals[i].node_name, mnt));
 
 		/* complete mount procedure if we accured submount */
-		if (!IS_ERR(mnt))
+		if (!IS_ERR(mnt)) {
+			if (num_referrals > 1)
+				dfs_cache_set_target(full_path + 1,
+						     referrals[i].node_name);
 			break;
+		}
 	}
 
 	/* we need it cause for() above could exit without valid submount */
@@ -21,6 +21,8 @@
 
 #include <linux/list.h>
 #include <linux/string.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
 #include <keys/user-type.h>
 #include <linux/key-type.h>
 #include <linux/inet.h>
@@ -89,6 +91,216 @@ struct key_type cifs_spnego_key_type = {
 /* strlen of ";pid=0x" */
 #define PID_KEY_LEN		7
 
+/*
+ * Upcall results are cached per user and server, so that reconnecting
+ * many sessions after a server blip, or setting up several sessions of
+ * one user, does not run the helper each time. A cached blob is reused
+ * until its key expires (the helper can tie that to the ticket lifetime
+ * with keyctl_set_timeout) or CIFS_SPNEGO_CACHE_TIME passes, and for as
+ * long as the server accepts it. Servers that reject a replayed blob
+ * are marked so that they always get a fresh one.
+ */
+#define CIFS_SPNEGO_CACHE_TIME		(10 * 60 * HZ)
+#define CIFS_SPNEGO_CACHE_MAX_ENTRIES	256
+
+struct spnego_cache_entry {
+	struct list_head list;
+	struct key *key;	/* NULL while its upcall is in progress */
+	unsigned long expires;
+	unsigned int uses;
+	char desc[1];		/* key description, less the pid */
+};
+
+static LIST_HEAD(spnego_cache);
+static DEFINE_SPINLOCK(spnego_cache_lock);
+static DECLARE_WAIT_QUEUE_HEAD(spnego_cache_wait);
+static unsigned int spnego_cache_count;
+
+/* must be called with spnego_cache_lock held */
+static struct spnego_cache_entry *
+spnego_cache_find(const char *desc)
+{
+	struct spnego_cache_entry *sce;
+
+	list_for_each_entry(sce, &spnego_cache, list)
+		if (strcmp(sce->desc, desc) == 0)
+			return sce;
+	return NULL;
+}
+
+/* must be called with spnego_cache_lock held, returns the key to put */
+static struct key *
+spnego_cache_unlink(struct spnego_cache_entry *sce)
+{
+	struct key *key = sce->key;
+
+	list_del(&sce->list);
+	spnego_cache_count--;
+	kfree(sce);
+	return key;
+}
+
+static bool
+spnego_cache_settled(const char *desc)
+{
+	struct spnego_cache_entry *sce;
+	bool settled;
+
+	spin_lock(&spnego_cache_lock);
+	sce = spnego_cache_find(desc);
+	settled = (sce == NULL || sce->key != NULL);
+	spin_unlock(&spnego_cache_lock);
+	return settled;
+}
+
+/*
+ * Look up a cached key, or claim the entry for an upcall. Returns the key
+ * on a hit, NULL if the caller is to do the upcall (and, if *claimed is
+ * set, fill in the entry with spnego_cache_fill).
+ */
+static struct key *
+spnego_cache_get(const char *desc, bool *claimed)
+{
+	struct spnego_cache_entry *sce, *new;
+	struct key *key, *stale;
+
+	*claimed = false;
+	new = kmalloc(sizeof(struct spnego_cache_entry) + strlen(desc),
+		      GFP_KERNEL);
+again:
+	stale = NULL;
+	key = NULL;
+	spin_lock(&spnego_cache_lock);
+	sce = spnego_cache_find(desc);
+	if (sce && sce->key == NULL) {
+		/* someone else's upcall for the same user is in progress */
+		spin_unlock(&spnego_cache_lock);
+		wait_event(spnego_cache_wait, spnego_cache_settled(desc));
+		goto again;
+	}
+	if (sce && (time_after_eq(jiffies, sce->expires) ||
+		    key_validate(sce->key) < 0)) {
+		stale = spnego_cache_unlink(sce);
+		sce = NULL;
+	}
+	if (sce) {
+		list_move(&sce->list, &spnego_cache);
+		sce->key->type_data.x[0] = ++sce->uses;
+		key = key_get(sce->key);
+	} else if (new) {
+		if (spnego_cache_count >= CIFS_SPNEGO_CACHE_MAX_ENTRIES) {
+			/* evict the oldest settled entry, if there is one */
+			sce = list_entry(spnego_cache.prev,
+					 struct spnego_cache_entry, list);
+			if (sce->key && stale == NULL)
+				stale = spnego_cache_unlink(sce);
+		}
+		strcpy(new->desc, desc);
+		new->key = NULL;
+		new->uses = 0;
+		list_add(&new->list, &spnego_cache);
+		spnego_cache_count++;
+		new = NULL;
+		*claimed = true;
+	}
+	spin_unlock(&spnego_cache_lock);
+
+	if (stale) {
+		key_revoke(stale);
+		key_put(stale);
+	}
+	kfree(new);
+	return key;
+}
+
+/* complete an upcall claimed with spnego_cache_get */
+static void
+spnego_cache_fill(const char *desc, struct key *key)
+{
+	struct spnego_cache_entry *sce;
+
+	spin_lock(&spnego_cache_lock);
+	sce = spnego_cache_find(desc);
+	if (sce && sce->key == NULL) {
+		if (IS_ERR(key)) {
+			spnego_cache_unlink(sce);
+		} else {
+			sce->key = key_get(key);
+			sce->expires = jiffies + CIFS_SPNEGO_CACHE_TIME;
+			sce->uses = 1;
+			key->type_data.x[0] = 1;
+		}
+	}
+	spin_unlock(&spnego_cache_lock);
+	wake_up_all(&spnego_cache_wait);
+}
+
+/**
+ * cifs_put_spnego_key	-	done with a key from cifs_get_spnego_key
+ * @server:	server the session setup was sent to
+ * @key:	the key
+ * @rc:		result of the session setup
+ *
+ * A key that failed is dropped from the cache and revoked. Returns true if
+ * the server refused a blob we had already used before, in which case it
+ * is worth retrying with a fresh one.
+ */
+bool
+cifs_put_spnego_key(struct TCP_Server_Info *server, struct key *key, int rc)
+{
+	struct spnego_cache_entry *sce;
+	struct key *cached = NULL;
+	bool retry = false;
+
+	spin_lock(&spnego_cache_lock);
+	list_for_each_entry(sce, &spnego_cache, list) {
+		if (sce->key == key) {
+			if (rc != 0 && rc != -EAGAIN)
+				cached = spnego_cache_unlink(sce);
+			else
+				cached = ERR_PTR(-EEXIST); /* keep it */
+			break;
+		}
+	}
+	spin_unlock(&spnego_cache_lock);
+
+	if (cached == NULL || !IS_ERR(cached)) {
+		if (cached) {
+			if (rc == -EACCES && key->type_data.x[0] > 1) {
+				cFYI(1, ("server %s refused a reused SPNEGO "
+					 "blob", server->hostname));
+				server->spnego_noreuse = true;
+				retry = true;
+			}
+			key_put(cached);
+		}
+		key_revoke(key);
+	}
+	key_put(key);
+	return retry;
+}
+
+void
+cifs_spnego_cache_flush(void)
+{
+	struct spnego_cache_entry *sce;
+	struct key *key;
+
+	spin_lock(&spnego_cache_lock);
+	while (!list_empty(&spnego_cache)) {
+		sce = list_entry(spnego_cache.next, struct spnego_cache_entry,
+				 list);
+		key = spnego_cache_unlink(sce);
+		spin_unlock(&spnego_cache_lock);
+		if (key) {
+			key_revoke(key);
+			key_put(key);
+		}
+		spin_lock(&spnego_cache_lock);
+	}
+	spin_unlock(&spnego_cache_lock);
+}
+
 /* get a key struct with a SPNEGO security blob, suitable for session setup */
 struct key *
 cifs_get_spnego_key(struct cifsSesInfo *sesInfo)
@@ -98,6 +310,7 @@ cifs_get_spnego_key(struct cifsSesInfo *sesInfo)
 	size_t desc_len;
 	struct key *spnego_key;
 	const char *hostname = server->hostname;
+	bool claimed = false;
 
 	/* length of fields (with semicolons): ver=0xyz ip4=ipaddress
 	   host=hostname sec=mechanism uid=0xFF user=username */
@@ -145,11 +358,25 @@ cifs_get_spnego_key(struct cifsSesInfo *sesInfo)
 	dp = description + strlen(description);
 	sprintf(dp, ";user=%s", sesInfo->userName);
 
+	/* the same user to the same server can share a blob */
+	if (!server->spnego_noreuse) {
+		spnego_key = spnego_cache_get(description, &claimed);
+		if (spnego_key) {
+			cFYI(1, ("reusing cached key for %s", description));
+			goto out;
+		}
+	}
 	dp = description + strlen(description);
+
+	/* the pid is only for the helper to find the credential cache */
 	sprintf(dp, ";pid=0x%x", current->pid);
 
 	cFYI(1, ("key description = %s", description));
 	spnego_key = request_key(&cifs_spnego_key_type, description, "");
+	if (claimed) {
+		*dp = '\0';
+		spnego_cache_fill(description, spnego_key);
+	}
 
 #ifdef CONFIG_CIFS_DEBUG2
 	if (cifsFYI && !IS_ERR(spnego_key)) {
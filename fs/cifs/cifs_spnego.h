@@ -42,6 +42,9 @@ struct cifs_spnego_msg {
 #ifdef __KERNEL__
 extern struct key_type cifs_spnego_key_type;
 extern struct key *cifs_get_spnego_key(struct cifsSesInfo *sesInfo);
+extern bool cifs_put_spnego_key(struct TCP_Server_Info *server,
+				struct key *key, int rc);
+extern void cifs_spnego_cache_flush(void);
 #endif /* KERNEL */
 
 #endif /* _CIFS_SPNEGO_H */
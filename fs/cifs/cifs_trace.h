@@ -0,0 +1,297 @@
+/*
+ *   fs/cifs/cifs_trace.h -- tracepoints for the cifs client
+ *
+ *   The events take cifs internal structures, so this header has to be
+ *   included after cifsglob.h. cifs_trace.c creates the tracepoints.
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published
+ *   by the Free Software Foundation; either version 2.1 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See
+ *   the GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cifs
+
+#if !defined(_CIFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CIFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* revalidation decisions, see cifs_revalidate */
+#define CIFS_REVAL_UNCHANGED	0	/* pages kept, file unchanged */
+#define CIFS_REVAL_APPENDED	1	/* pages below old EOF kept */
+#define CIFS_REVAL_INVALIDATE	2	/* all pages dropped */
+#define CIFS_REVAL_DEFERRED	3	/* oplock break, left to revalidate */
+
+#define cifs_trace_host(server) \
+	((server)->hostname ? (server)->hostname : "")
+
+TRACE_EVENT(cifs_mid_alloc,
+
+	TP_PROTO(struct TCP_Server_Info *server, struct mid_q_entry *mid),
+
+	TP_ARGS(server, mid),
+
+	TP_STRUCT__entry(
+		__string(	host,	cifs_trace_host(server)	)
+		__field(	__u16,	mid			)
+		__field(	__u8,	command			)
+		__field(	__u16,	pid			)
+	),
+
+	TP_fast_assign(
+		__assign_str(host, cifs_trace_host(server));
+		__entry->mid		= mid->mid;
+		__entry->command	= mid->command;
+		__entry->pid		= mid->pid;
+	),
+
+	TP_printk("server %s mid %u cmd 0x%02x pid %u", __get_str(host),
+		  __entry->mid, __entry->command, __entry->pid)
+);
+
+TRACE_EVENT(cifs_send,
+
+	TP_PROTO(struct TCP_Server_Info *server, struct smb_hdr *smb,
+		 unsigned int bytes, int rc),
+
+	TP_ARGS(server, smb, bytes, rc),
+
+	TP_STRUCT__entry(
+		__string(	host,	cifs_trace_host(server)	)
+		__field(	__u16,	tid			)
+		__field(	__u16,	mid			)
+		__field(	__u8,	command			)
+		__field(	unsigned int,	bytes		)
+		__field(	int,	rc			)
+	),
+
+	TP_fast_assign(
+		__assign_str(host, cifs_trace_host(server));
+		__entry->tid		= smb->Tid;
+		__entry->mid		= smb->Mid;
+		__entry->command	= smb->Command;
+		__entry->bytes		= bytes;
+		__entry->rc		= rc;
+	),
+
+	TP_printk("server %s tid %u mid %u cmd 0x%02x bytes %u rc %d",
+		  __get_str(host), __entry->tid, __entry->mid,
+		  __entry->command, __entry->bytes, __entry->rc)
+);
+
+TRACE_EVENT(cifs_receive,
+
+	TP_PROTO(struct TCP_Server_Info *server, __u16 tid, __u16 mid,
+		 __u8 command, unsigned int bytes, s64 usecs),
+
+	TP_ARGS(server, tid, mid, command, bytes, usecs),
+
+	TP_STRUCT__entry(
+		__string(	host,	cifs_trace_host(server)	)
+		__field(	__u16,	tid			)
+		__field(	__u16,	mid			)
+		__field(	__u8,	command			)
+		__field(	unsigned int,	bytes		)
+		__field(	s64,	usecs			)
+	),
+
+	TP_fast_assign(
+		__assign_str(host, cifs_trace_host(server));
+		__entry->tid		= tid;
+		__entry->mid		= mid;
+		__entry->command	= command;
+		__entry->bytes		= bytes;
+		__entry->usecs		= usecs;
+	),
+
+	TP_printk("server %s tid %u mid %u cmd 0x%02x bytes %u latency %lldus",
+		  __get_str(host), __entry->tid, __entry->mid,
+		  __entry->command, __entry->bytes, __entry->usecs)
+);
+
+TRACE_EVENT(cifs_credit_wait,
+
+	TP_PROTO(struct TCP_Server_Info *server, int in_flight, s64 usecs),
+
+	TP_ARGS(server, in_flight, usecs),
+
+	TP_STRUCT__entry(
+		__string(	host,	cifs_trace_host(server)	)
+		__field(	int,	in_flight		)
+		__field(	s64,	usecs			)
+	),
+
+	TP_fast_assign(
+		__assign_str(host, cifs_trace_host(server));
+		__entry->in_flight	= in_flight;
+		__entry->usecs		= usecs;
+	),
+
+	TP_printk("server %s in flight %d waited %lldus", __get_str(host),
+		  __entry->in_flight, __entry->usecs)
+);
+
+TRACE_EVENT(cifs_reconnect,
+
+	TP_PROTO(struct TCP_Server_Info *server, int rc),
+
+	TP_ARGS(server, rc),
+
+	TP_STRUCT__entry(
+		__string(	host,	cifs_trace_host(server)	)
+		__field(	int,	rc			)
+	),
+
+	TP_fast_assign(
+		__assign_str(host, cifs_trace_host(server));
+		__entry->rc		= rc;
+	),
+
+	TP_printk("server %s rc %d", __get_str(host), __entry->rc)
+);
+
+TRACE_EVENT(cifs_oplock_break,
+
+	TP_PROTO(struct cifsTconInfo *tcon, __u16 netfid, __u8 level,
+		 bool release, int rc),
+
+	TP_ARGS(tcon, netfid, level, release, rc),
+
+	TP_STRUCT__entry(
+		__string(	host,	cifs_trace_host(tcon->ses->server) )
+		__field(	__u16,	tid			)
+		__field(	__u16,	netfid			)
+		__field(	__u8,	level			)
+		__field(	bool,	release			)
+		__field(	int,	rc			)
+	),
+
+	TP_fast_assign(
+		__assign_str(host, cifs_trace_host(tcon->ses->server));
+		__entry->tid		= tcon->tid;
+		__entry->netfid		= netfid;
+		__entry->level		= level;
+		__entry->release	= release;
+		__entry->rc		= rc;
+	),
+
+	TP_printk("server %s tid %u fid %u %s level %u rc %d",
+		  __get_str(host), __entry->tid, __entry->netfid,
+		  __entry->release ? "release" : "break", __entry->level,
+		  __entry->rc)
+);
+
+TRACE_EVENT(cifs_readpages,
+
+	TP_PROTO(struct inode *inode, loff_t offset, unsigned int pages,
+		 unsigned int bytes, int rc),
+
+	TP_ARGS(inode, offset, pages, bytes, rc),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,	dev			)
+		__field(	ino_t,	ino			)
+		__field(	loff_t,	offset			)
+		__field(	unsigned int,	pages		)
+		__field(	unsigned int,	bytes		)
+		__field(	int,	rc			)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->offset		= offset;
+		__entry->pages		= pages;
+		__entry->bytes		= bytes;
+		__entry->rc		= rc;
+	),
+
+	TP_printk("dev %d,%d ino %lu offset %lld pages %u bytes %u rc %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino, __entry->offset,
+		  __entry->pages, __entry->bytes, __entry->rc)
+);
+
+TRACE_EVENT(cifs_writepages,
+
+	TP_PROTO(struct inode *inode, loff_t offset, unsigned int pages,
+		 unsigned int bytes, int rc),
+
+	TP_ARGS(inode, offset, pages, bytes, rc),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,	dev			)
+		__field(	ino_t,	ino			)
+		__field(	loff_t,	offset			)
+		__field(	unsigned int,	pages		)
+		__field(	unsigned int,	bytes		)
+		__field(	int,	rc			)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->offset		= offset;
+		__entry->pages		= pages;
+		__entry->bytes		= bytes;
+		__entry->rc		= rc;
+	),
+
+	TP_printk("dev %d,%d ino %lu offset %lld pages %u bytes %u rc %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino, __entry->offset,
+		  __entry->pages, __entry->bytes, __entry->rc)
+);
+
+TRACE_EVENT(cifs_revalidate,
+
+	TP_PROTO(struct inode *inode, loff_t old_size, int decision),
+
+	TP_ARGS(inode, old_size, decision),
+
+	TP_STRUCT__entry(
+		__field(	dev_t,	dev			)
+		__field(	ino_t,	ino			)
+		__field(	loff_t,	old_size		)
+		__field(	loff_t,	new_size		)
+		__field(	int,	decision		)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->old_size	= old_size;
+		__entry->new_size	= i_size_read(inode);
+		__entry->decision	= decision;
+	),
+
+	TP_printk("dev %d,%d ino %lu size %lld -> %lld %s",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino, __entry->old_size,
+		  __entry->new_size,
+		  __print_symbolic(__entry->decision,
+			{ CIFS_REVAL_UNCHANGED,		"unchanged" },
+			{ CIFS_REVAL_APPENDED,		"appended" },
+			{ CIFS_REVAL_INVALIDATE,	"invalidate" },
+			{ CIFS_REVAL_DEFERRED,		"deferred" }))
+);
+
+#endif /* _CIFS_TRACE_H */
+
+/* this part must be outside the protection */
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE cifs_trace
+#include <trace/define_trace.h>
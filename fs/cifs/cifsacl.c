@@ -22,6 +22,10 @@
  */
 
 #include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/rbtree.h>
+#include <linux/key-type.h>
+#include <keys/user-type.h>
 #include "cifspdu.h"
 #include "cifsglob.h"
 #include "cifsacl.h"
@@ -128,6 +132,275 @@ int compare_sids(const struct cifs_sid *ctsid, const struct cifs_sid *cwsid)
 	return 1; /* sids compare/match */
 }
 
+#ifdef CONFIG_KEYS
+/*
+ * SID to uid/gid mapping. The owner and group SIDs of each security
+ * descriptor are mapped through a "cifs.idmap" key upcall to a local idmap
+ * helper (e.g. one asking winbind), and the results (including failures,
+ * for a shorter time) are cached so that we upcall only once per SID.
+ */
+static int
+cifs_idmap_key_instantiate(struct key *key, const void *data, size_t datalen)
+{
+	/* the helper returns the id as a binary uid_t/gid_t */
+	if (datalen != sizeof(uid_t))
+		return -EINVAL;
+
+	key->payload.value = *(uid_t *)data;
+	key->datalen = datalen;
+	return 0;
+}
+
+struct key_type cifs_idmap_key_type = {
+	.name		= "cifs.idmap",
+	.instantiate	= cifs_idmap_key_instantiate,
+	.match		= user_match,
+	.describe	= user_describe,
+};
+
+static struct rb_root uidtree = RB_ROOT;
+static struct rb_root gidtree = RB_ROOT;
+static DEFINE_SPINLOCK(sidmap_lock);
+static atomic_t sidmap_count = ATOMIC_INIT(0);
+
+/* bytes taken by a SID on the wire: revision, count, authority, sub auths */
+static inline unsigned int cifs_sid_len(const struct cifs_sid *psid)
+{
+	return 8 + psid->num_subauth * sizeof(__le32);
+}
+
+/* total order on SIDs, for the rb trees */
+static int cifs_sid_cmp(const struct cifs_sid *a, const struct cifs_sid *b)
+{
+	int i;
+
+	if (a->revision != b->revision)
+		return a->revision > b->revision ? 1 : -1;
+	if (a->num_subauth != b->num_subauth)
+		return a->num_subauth > b->num_subauth ? 1 : -1;
+	i = memcmp(a->authority, b->authority, NUM_AUTHS);
+	if (i)
+		return i;
+	for (i = 0; i < a->num_subauth; i++) {
+		if (a->sub_auth[i] != b->sub_auth[i])
+			return le32_to_cpu(a->sub_auth[i]) >
+			       le32_to_cpu(b->sub_auth[i]) ? 1 : -1;
+	}
+	return 0;
+}
+
+static struct cifs_sid_id *
+sid_map_search(struct rb_root *root, const struct cifs_sid *psid)
+{
+	struct rb_node *node = root->rb_node;
+	struct cifs_sid_id *entry;
+	int rc;
+
+	while (node) {
+		entry = rb_entry(node, struct cifs_sid_id, rbnode);
+		rc = cifs_sid_cmp(psid, &entry->sid);
+		if (rc < 0)
+			node = node->rb_left;
+		else if (rc > 0)
+			node = node->rb_right;
+		else
+			return entry;
+	}
+	return NULL;
+}
+
+static void
+sid_map_insert(struct rb_root *root, struct cifs_sid_id *new)
+{
+	struct rb_node **linkp = &root->rb_node;
+	struct rb_node *parent = NULL;
+	struct cifs_sid_id *entry;
+
+	while (*linkp) {
+		parent = *linkp;
+		entry = rb_entry(parent, struct cifs_sid_id, rbnode);
+		if (cifs_sid_cmp(&new->sid, &entry->sid) < 0)
+			linkp = &parent->rb_left;
+		else
+			linkp = &parent->rb_right;
+	}
+	rb_link_node(&new->rbnode, parent, linkp);
+	rb_insert_color(&new->rbnode, root);
+}
+
+/* "os:" or "gs:" followed by the SID in its usual S-1-5-21-... form */
+static char *sid_to_key_str(const struct cifs_sid *psid, int sidtype)
+{
+	int i;
+	unsigned long long authority = 0;
+	char *str, *p;
+
+	/* prefix, revision, 48 bit authority and 32 bit sub auths */
+	str = kmalloc(3 + 2 + 4 + 1 + 15 + psid->num_subauth * 11 + 1,
+		      GFP_KERNEL);
+	if (!str)
+		return NULL;
+
+	for (i = 0; i < NUM_AUTHS; i++)
+		authority = (authority << 8) | psid->authority[i];
+
+	p = str + sprintf(str, "%cs:S-%hhu-%llu",
+			  sidtype == SIDOWNER ? 'o' : 'g',
+			  psid->revision, authority);
+	for (i = 0; i < psid->num_subauth; i++)
+		p += sprintf(p, "-%u", le32_to_cpu(psid->sub_auth[i]));
+	return str;
+}
+
+/* upcall to map a SID, returns false if the helper could not map it */
+static bool sid_upcall(const struct cifs_sid *psid, int sidtype,
+		       unsigned long *pid)
+{
+	struct key *idkey;
+	char *desc;
+	bool mapped = false;
+
+	desc = sid_to_key_str(psid, sidtype);
+	if (!desc)
+		return false;
+
+	idkey = request_key(&cifs_idmap_key_type, desc, "");
+	if (IS_ERR(idkey)) {
+		cFYI(1, ("%s: can't map %s, rc %ld", __func__, desc,
+			 PTR_ERR(idkey)));
+	} else {
+		*pid = idkey->payload.value;
+		mapped = true;
+		key_put(idkey);
+	}
+	kfree(desc);
+	return mapped;
+}
+
+/*
+ * Map an owner or group SID to a uid or gid and store it in fattr. If the
+ * SID can not be mapped the mount's default uid/gid is left in place.
+ */
+static void sid_to_id(struct cifs_sb_info *cifs_sb, struct cifs_sid *psid,
+		      struct cifs_fattr *fattr, int sidtype)
+{
+	struct rb_root *root = sidtype == SIDOWNER ? &uidtree : &gidtree;
+	struct cifs_sid_id *entry, *new;
+	unsigned long id = 0;
+	bool mapped;
+
+	if (sidtype == SIDOWNER &&
+	    (cifs_sb->mnt_cifs_flags & CIFS_MOUNT_OVERR_UID))
+		return;
+	if (sidtype == SIDGROUP &&
+	    (cifs_sb->mnt_cifs_flags & CIFS_MOUNT_OVERR_GID))
+		return;
+
+	/* does not fit in a cifs_sid, so it can not be cached or compared */
+	if (psid->num_subauth > NUM_SUBAUTHS) {
+		cFYI(1, ("%s: SID with %d sub auths left unmapped", __func__,
+			 psid->num_subauth));
+		return;
+	}
+
+	spin_lock(&sidmap_lock);
+	entry = sid_map_search(root, psid);
+	if (entry && time_before(jiffies, entry->time +
+			(entry->mapped ? SID_MAP_EXPIRE : SID_MAP_RETRY))) {
+		mapped = entry->mapped;
+		id = entry->id;
+		spin_unlock(&sidmap_lock);
+		goto out;
+	}
+	spin_unlock(&sidmap_lock);
+
+	mapped = sid_upcall(psid, sidtype, &id);
+
+	new = kmalloc(sizeof(struct cifs_sid_id), GFP_KERNEL);
+	spin_lock(&sidmap_lock);
+	entry = sid_map_search(root, psid);
+	if (!entry && new) {
+		entry = new;
+		new = NULL;
+		memcpy(&entry->sid, psid, cifs_sid_len(psid));
+		sid_map_insert(root, entry);
+		atomic_inc(&sidmap_count);
+	}
+	if (entry) {
+		entry->id = id;
+		entry->mapped = mapped;
+		entry->time = jiffies;
+	}
+	spin_unlock(&sidmap_lock);
+	kfree(new);
+
+out:
+	if (!mapped)
+		return;
+	if (sidtype == SIDOWNER)
+		fattr->cf_uid = id;
+	else
+		fattr->cf_gid = id;
+}
+
+static void sid_map_prune(struct rb_root *root, int *nr_to_scan)
+{
+	struct rb_node *node;
+
+	while (*nr_to_scan > 0 && (node = rb_first(root)) != NULL) {
+		rb_erase(node, root);
+		kfree(rb_entry(node, struct cifs_sid_id, rbnode));
+		atomic_dec(&sidmap_count);
+		(*nr_to_scan)--;
+	}
+}
+
+static int cifs_idmap_shrinker(int nr_to_scan, gfp_t gfp_mask)
+{
+	if (nr_to_scan) {
+		spin_lock(&sidmap_lock);
+		sid_map_prune(&uidtree, &nr_to_scan);
+		sid_map_prune(&gidtree, &nr_to_scan);
+		spin_unlock(&sidmap_lock);
+	}
+	return atomic_read(&sidmap_count);
+}
+
+static struct shrinker cifs_idmap_shrinker_struct = {
+	.shrink = cifs_idmap_shrinker,
+	.seeks = DEFAULT_SEEKS,
+};
+
+int init_cifs_idmap(void)
+{
+	int rc;
+
+	rc = register_key_type(&cifs_idmap_key_type);
+	if (rc)
+		return rc;
+	register_shrinker(&cifs_idmap_shrinker_struct);
+	return 0;
+}
+
+void exit_cifs_idmap(void)
+{
+	int nr_to_scan = INT_MAX;
+
+	unregister_shrinker(&cifs_idmap_shrinker_struct);
+	unregister_key_type(&cifs_idmap_key_type);
+	spin_lock(&sidmap_lock);
+	sid_map_prune(&uidtree, &nr_to_scan);
+	sid_map_prune(&gidtree, &nr_to_scan);
+	spin_unlock(&sidmap_lock);
+}
+#else
+static inline void sid_to_id(struct cifs_sb_info *cifs_sb,
+			     struct cifs_sid *psid, struct cifs_fattr *fattr,
+			     int sidtype)
+{
+}
+#endif /* CONFIG_KEYS */
+
 
 /* copy ntsd, owner sid, and group sid from a security descriptor to another */
 static void copy_sec_desc(const struct cifs_ntsd *pntsd,
@@ -440,6 +713,12 @@ static int parse_sid(struct cifs_sid *psid, char *end_of_acl)
 		return -EINVAL;
 	}
 
+	/* and so must all of its sub auths */
+	if (end_of_acl < (char *)psid + cifs_sid_len(psid)) {
+		cERROR(1, ("ACL too small to parse SID sub auths %p", psid));
+		return -EINVAL;
+	}
+
 	if (psid->num_subauth) {
 #ifdef CONFIG_CIFS_DEBUG2
 		int i;
@@ -451,8 +730,6 @@ static int parse_sid(struct cifs_sid *psid, char *end_of_acl)
 				le32_to_cpu(psid->sub_auth[i])));
 		}
 
-		/* BB add length check to make sure that we do not have huge
-			num auths and therefore go off the end */
 		cFYI(1, ("RID 0x%x",
 			le32_to_cpu(psid->sub_auth[psid->num_subauth-1])));
 #endif
@@ -463,7 +740,8 @@ static int parse_sid(struct cifs_sid *psid, char *end_of_acl)
 
 
 /* Convert CIFS ACL to POSIX form */
-static int parse_sec_desc(struct cifs_ntsd *pntsd, int acl_len,
+static int parse_sec_desc(struct cifs_sb_info *cifs_sb,
+			  struct cifs_ntsd *pntsd, int acl_len,
 			  struct cifs_fattr *fattr)
 {
 	int rc;
@@ -495,6 +773,9 @@ static int parse_sec_desc(struct cifs_ntsd *pntsd, int acl_len,
 	if (rc)
 		return rc;
 
+	sid_to_id(cifs_sb, owner_sid_ptr, fattr, SIDOWNER);
+	sid_to_id(cifs_sb, group_sid_ptr, fattr, SIDGROUP);
+
 	if (dacloffset)
 		parse_dacl(dacl_ptr, end_of_acl, owner_sid_ptr,
 			   group_sid_ptr, fattr);
@@ -669,6 +950,50 @@ static int set_cifs_acl(struct cifs_ntsd *pnntsd, __u32 acllen,
 	return rc;
 }
 
+/*
+ * The mode bits and owner derived from a file's ACL are cached in its inode,
+ * keyed by the ChangeTime the server reported along with them. Changing the
+ * security descriptor updates ChangeTime, so as long as it is the same we
+ * can skip fetching and parsing the ACL again.
+ */
+static bool cifs_acl_cache_lookup(struct inode *inode, struct cifs_fattr *fattr)
+{
+	struct cifsInodeInfo *cifsi = CIFS_I(inode);
+	bool found = false;
+
+	spin_lock(&inode->i_lock);
+	if (cifsi->acl_valid &&
+	    timespec_equal(&cifsi->acl_ctime, &fattr->cf_ctime)) {
+		fattr->cf_mode = (fattr->cf_mode & ~S_IRWXUGO) |
+				 cifsi->acl_mode;
+		fattr->cf_uid = cifsi->acl_uid;
+		fattr->cf_gid = cifsi->acl_gid;
+		found = true;
+	}
+	spin_unlock(&inode->i_lock);
+	return found;
+}
+
+static void cifs_acl_cache_store(struct inode *inode, struct cifs_fattr *fattr)
+{
+	struct cifsInodeInfo *cifsi = CIFS_I(inode);
+
+	spin_lock(&inode->i_lock);
+	cifsi->acl_ctime = fattr->cf_ctime;
+	cifsi->acl_mode = fattr->cf_mode & S_IRWXUGO;
+	cifsi->acl_uid = fattr->cf_uid;
+	cifsi->acl_gid = fattr->cf_gid;
+	cifsi->acl_valid = true;
+	spin_unlock(&inode->i_lock);
+}
+
+static void cifs_acl_cache_invalidate(struct inode *inode)
+{
+	spin_lock(&inode->i_lock);
+	CIFS_I(inode)->acl_valid = false;
+	spin_unlock(&inode->i_lock);
+}
+
 /* Translate the CIFS ACL (simlar to NTFS ACL) for a file into mode bits */
 void
 cifs_acl_to_fattr(struct cifs_sb_info *cifs_sb, struct cifs_fattr *fattr,
@@ -677,9 +1002,17 @@ cifs_acl_to_fattr(struct cifs_sb_info *cifs_sb, struct cifs_fattr *fattr,
 	struct cifs_ntsd *pntsd = NULL;
 	u32 acllen = 0;
 	int rc = 0;
+	/* servers which do not return a ChangeTime can't be cached */
+	bool cacheable = inode && (fattr->cf_ctime.tv_sec ||
+				   fattr->cf_ctime.tv_nsec);
 
 	cFYI(DBG2, ("converting ACL to mode for %s", path));
 
+	if (cacheable && cifs_acl_cache_lookup(inode, fattr)) {
+		cFYI(DBG2, ("using cached ACL mode for %s", path));
+		return;
+	}
+
 	if (pfid)
 		pntsd = get_cifs_acl_by_fid(cifs_sb, *pfid, &acllen);
 	else
@@ -687,9 +1020,11 @@ cifs_acl_to_fattr(struct cifs_sb_info *cifs_sb, struct cifs_fattr *fattr,
 
 	/* if we can retrieve the ACL, now parse Access Control Entries, ACEs */
 	if (pntsd)
-		rc = parse_sec_desc(pntsd, acllen, fattr);
-	if (rc)
+		rc = parse_sec_desc(cifs_sb, pntsd, acllen, fattr);
+	if (rc) {
 		cFYI(1, ("parse sec desc failed rc = %d", rc));
+	} else if (pntsd && cacheable)
+		cifs_acl_cache_store(inode, fattr);
 
 	kfree(pntsd);
 	return;
@@ -705,6 +1040,8 @@ int mode_to_acl(struct inode *inode, const char *path, __u64 nmode)
 
 	cFYI(DBG2, ("set ACL from mode for %s", path));
 
+	cifs_acl_cache_invalidate(inode);
+
 	/* Get the security descriptor */
 	pntsd = get_cifs_acl(CIFS_SB(inode->i_sb), inode, path, &secdesclen);
 
@@ -22,6 +22,7 @@
 #ifndef _CIFSACL_H
 #define _CIFSACL_H
 
+#include <linux/rbtree.h>
 
 #define NUM_AUTHS 6 /* number of authority fields */
 #define NUM_SUBAUTHS 5 /* number of sub authority fields */
@@ -39,6 +40,13 @@
 #define ACCESS_ALLOWED	0
 #define ACCESS_DENIED	1
 
+#define SIDOWNER 1
+#define SIDGROUP 2
+
+/* how long a SID to uid/gid mapping (or failure to map) is cached */
+#define SID_MAP_EXPIRE (3600 * HZ)
+#define SID_MAP_RETRY (60 * HZ)
+
 struct cifs_ntsd {
 	__le16 revision; /* revision level */
 	__le16 type;
@@ -74,10 +82,22 @@ struct cifs_wksid {
 	char sidname[SIDNAMELENGTH];
 } __attribute__((packed));
 
+/* cached result of a cifs.idmap upcall */
+struct cifs_sid_id {
+	struct rb_node rbnode;
+	struct cifs_sid sid;
+	unsigned long id;
+	unsigned long time;	/* jiffies of the upcall */
+	bool mapped;		/* false if the upcall failed */
+};
+
 #ifdef CONFIG_CIFS_EXPERIMENTAL
 
 extern int match_sid(struct cifs_sid *);
 extern int compare_sids(const struct cifs_sid *, const struct cifs_sid *);
+#ifdef CONFIG_KEYS
+extern struct key_type cifs_idmap_key_type;
+#endif
 
 #endif /*  CONFIG_CIFS_EXPERIMENTAL */
 
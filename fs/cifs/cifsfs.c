@@ -36,6 +36,7 @@
 #include <linux/kthread.h>
 #include <linux/freezer.h>
 #include <linux/smp_lock.h>
+#include <linux/pagemap.h>
 #include "cifsfs.h"
 #include "cifspdu.h"
 #define DECLARE_GLOBALS_HERE
@@ -46,6 +47,7 @@
 #include <linux/mm.h>
 #include <linux/key-type.h>
 #include "dns_resolve.h"
+#include "dfs_cache.h"
 #include "cifs_spnego.h"
 #define CIFS_MAGIC_NUMBER 0xFF534D42	/* the first four bytes of SMB PDUs */
 
@@ -88,6 +90,26 @@ extern mempool_t *cifs_mid_poolp;
 
 extern struct kmem_cache *cifs_oplock_cachep;
 
+/* size the readahead window to this many reads of rsize */
+#define CIFS_READAHEAD_RSIZES 4
+
+/*
+ * Tell the flusher and page allocator that this mount is congested once
+ * all request slots to its server are in use, so they throttle and skip
+ * writing back to it rather than blocking behind a slow server.
+ */
+static int
+cifs_congested(void *congested_data, int bdi_bits)
+{
+	struct cifs_sb_info *cifs_sb = congested_data;
+	struct TCP_Server_Info *server = cifs_sb->tcon->ses->server;
+
+	if (atomic_read(&server->inFlight) >= cifs_max_pending ||
+	    server->tcpStatus == CifsNeedReconnect)
+		return bdi_bits;
+	return 0;
+}
+
 static int
 cifs_read_super(struct super_block *sb, void *data,
 		const char *devname, int silent)
@@ -103,6 +125,14 @@ cifs_read_super(struct super_block *sb, void *data,
 	if (cifs_sb == NULL)
 		return -ENOMEM;
 
+	cifs_sb->bdi.name = "cifs";
+	rc = bdi_init(&cifs_sb->bdi);
+	if (rc) {
+		kfree(sb->s_fs_info);
+		sb->s_fs_info = NULL;
+		return rc;
+	}
+
 #ifdef CONFIG_CIFS_DFS_UPCALL
 	/* copy mount params to sb for use in submounts */
 	/* BB: should we move this after the mount so we
@@ -115,6 +145,7 @@ cifs_read_super(struct super_block *sb, void *data,
 		int len = strlen(data);
 		cifs_sb->mountdata = kzalloc(len + 1, GFP_KERNEL);
 		if (cifs_sb->mountdata == NULL) {
+			bdi_destroy(&cifs_sb->bdi);
 			kfree(sb->s_fs_info);
 			sb->s_fs_info = NULL;
 			return -ENOMEM;
@@ -133,6 +164,35 @@ cifs_read_super(struct super_block *sb, void *data,
 		goto out_mount_failed;
 	}
 
+	/*
+	 * Number inodes locally unless the server numbers them. With the
+	 * unix extensions the server's UniqueId is used even without
+	 * serverino, and a counter could collide with those numbers.
+	 */
+	atomic_long_set(&cifs_sb->next_ino, ROOT_I);
+	cifs_sb->local_ino = !(cifs_sb->mnt_cifs_flags &
+			       CIFS_MOUNT_SERVER_INUM) &&
+			     !cifs_sb->tcon->unix_ext;
+
+	/*
+	 * Give the mount its own bdi, so that it is written back by its own
+	 * flusher thread and a slow server does not hold up dirty throttling
+	 * of every other filesystem on the box.
+	 */
+	cifs_sb->bdi.ra_pages = max_t(unsigned long,
+			default_backing_dev_info.ra_pages,
+			CIFS_READAHEAD_RSIZES * cifs_sb->rsize / PAGE_CACHE_SIZE);
+	cifs_sb->bdi.congested_fn = cifs_congested;
+	cifs_sb->bdi.congested_data = cifs_sb;
+	bdi_set_max_ratio(&cifs_sb->bdi, cifs_sb->dirty_ratio);
+	rc = bdi_register_dev(&cifs_sb->bdi, sb->s_dev);
+	if (rc) {
+		cERROR(1, ("cifs_read_super: bdi register failed rc %d", rc));
+		cifs_umount(sb, cifs_sb);
+		goto out_mount_failed;
+	}
+	sb->s_bdi = &cifs_sb->bdi;
+
 	sb->s_magic = CIFS_MAGIC_NUMBER;
 	sb->s_op = &cifs_super_ops;
 /*	if (cifs_sb->tcon->ses->server->maxBuf > MAX_CIFS_HDR_SIZE + 512)
@@ -183,6 +243,7 @@ out_mount_failed:
 		}
 #endif
 		unload_nls(cifs_sb->local_nls);
+		bdi_destroy(&cifs_sb->bdi);
 		kfree(cifs_sb);
 	}
 	return rc;
@@ -214,21 +275,27 @@ cifs_put_super(struct super_block *sb)
 #endif
 
 	unload_nls(cifs_sb->local_nls);
+	bdi_destroy(&cifs_sb->bdi);
 	kfree(cifs_sb);
 
 	unlock_kernel();
 }
 
+/*
+ * statfs results are cached per tree connection. A result younger than
+ * CIFS_STATFS_CACHE_TIME is returned as is; an older one, up to
+ * CIFS_STATFS_MAX_AGE, is returned while a fresh one is fetched in the
+ * background, so that frequent callers such as df or monitoring agents
+ * do not wait on the server each time.
+ */
+#define CIFS_STATFS_CACHE_TIME	HZ
+#define CIFS_STATFS_MAX_AGE	(30 * HZ)
+
 static int
-cifs_statfs(struct dentry *dentry, struct kstatfs *buf)
+cifs_query_statfs(int xid, struct cifsTconInfo *tcon, struct kstatfs *buf)
 {
-	struct super_block *sb = dentry->d_sb;
-	struct cifs_sb_info *cifs_sb = CIFS_SB(sb);
-	struct cifsTconInfo *tcon = cifs_sb->tcon;
+	int level = tcon->statfs_level;
 	int rc = -EOPNOTSUPP;
-	int xid;
-
-	xid = GetXid();
 
 	buf->f_type = CIFS_MAGIC_NUMBER;
 
@@ -243,9 +310,21 @@ cifs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	buf->f_files = 0;	/* undefined */
 	buf->f_ffree = 0;	/* unlimited */
 
+	/* once we know which level the server answers, only ask for that */
+	if (level == CIFS_STATFS_POSIX)
+		rc = CIFSSMBQFSPosixInfo(xid, tcon, buf);
+	else if (level == CIFS_STATFS_NT)
+		rc = CIFSSMBQFSInfo(xid, tcon, buf);
+	else if (level == CIFS_STATFS_OLD)
+		rc = SMBOldQFSInfo(xid, tcon, buf);
+	if (rc == 0)
+		return 0;
+
 	/*
 	 * We could add a second check for a QFS Unix capability bit
 	 */
+	level = CIFS_STATFS_POSIX;
+	rc = -EOPNOTSUPP;
 	if ((tcon->ses->capabilities & CAP_UNIX) &&
 	    (CIFS_POSIX_EXTENSIONS & le64_to_cpu(tcon->fsUnixInfo.Capability)))
 		rc = CIFSSMBQFSPosixInfo(xid, tcon, buf);
@@ -254,17 +333,105 @@ cifs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	 * Only need to call the old QFSInfo if failed on newer one,
 	 * e.g. by OS/2.
 	 **/
-	if (rc && (tcon->ses->capabilities & CAP_NT_SMBS))
+	if (rc && (tcon->ses->capabilities & CAP_NT_SMBS)) {
+		level = CIFS_STATFS_NT;
 		rc = CIFSSMBQFSInfo(xid, tcon, buf);
+	}
 
 	/*
 	 * Some old Windows servers also do not support level 103, retry with
 	 * older level one if old server failed the previous call or we
 	 * bypassed it because we detected that this was an older LANMAN sess
 	 */
-	if (rc)
+	if (rc) {
+		level = CIFS_STATFS_OLD;
 		rc = SMBOldQFSInfo(xid, tcon, buf);
+	}
 
+	tcon->statfs_level = rc ? CIFS_STATFS_UNKNOWN : level;
+	return rc;
+}
+
+static void
+cifs_statfs_store(struct cifsTconInfo *tcon, struct kstatfs *buf)
+{
+	spin_lock(&tcon->statfs_lock);
+	tcon->statfs_cache = *buf;
+	tcon->statfs_time = jiffies;
+	tcon->statfs_valid = true;
+	spin_unlock(&tcon->statfs_lock);
+}
+
+static void
+cifs_statfs_refresh(struct slow_work *work)
+{
+	struct cifsTconInfo *tcon = container_of(work, struct cifsTconInfo,
+						 statfs_work);
+	struct kstatfs buf;
+	int rc, xid;
+
+	memset(&buf, 0, sizeof(buf));
+	xid = GetXid();
+	rc = cifs_query_statfs(xid, tcon, &buf);
+	if (rc == 0)
+		cifs_statfs_store(tcon, &buf);
+	FreeXid(xid);
+}
+
+static int
+cifs_statfs_get(struct slow_work *work)
+{
+	struct cifsTconInfo *tcon = container_of(work, struct cifsTconInfo,
+						 statfs_work);
+
+	write_lock(&cifs_tcp_ses_lock);
+	++tcon->tc_count;
+	write_unlock(&cifs_tcp_ses_lock);
+	return 0;
+}
+
+static void
+cifs_statfs_put(struct slow_work *work)
+{
+	struct cifsTconInfo *tcon = container_of(work, struct cifsTconInfo,
+						 statfs_work);
+
+	cifs_put_tcon(tcon);
+}
+
+const struct slow_work_ops cifs_statfs_ops = {
+	.get_ref	= cifs_statfs_get,
+	.put_ref	= cifs_statfs_put,
+	.execute	= cifs_statfs_refresh,
+};
+
+static int
+cifs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct cifs_sb_info *cifs_sb = CIFS_SB(sb);
+	struct cifsTconInfo *tcon = cifs_sb->tcon;
+	unsigned long age;
+	int rc;
+	int xid;
+
+	spin_lock(&tcon->statfs_lock);
+	if (tcon->statfs_valid) {
+		age = jiffies - tcon->statfs_time;
+		if (age < CIFS_STATFS_MAX_AGE) {
+			*buf = tcon->statfs_cache;
+			spin_unlock(&tcon->statfs_lock);
+			if (age >= CIFS_STATFS_CACHE_TIME)
+				slow_work_enqueue(&tcon->statfs_work);
+			return 0;
+		}
+	}
+	spin_unlock(&tcon->statfs_lock);
+
+	xid = GetXid();
+	rc = cifs_query_statfs(xid, tcon, buf);
+	if (rc == 0)
+		cifs_statfs_store(tcon, buf);
 	FreeXid(xid);
 	return 0;
 }
@@ -314,6 +481,8 @@ cifs_alloc_inode(struct super_block *sb)
 	cifs_inode->delete_pending = false;
 	cifs_inode->vfs_inode.i_blkbits = 14;  /* 2**14 = CIFS_MAX_MSGSIZE */
 	cifs_inode->server_eof = 0;
+	cifs_inode->acl_valid = false;
+	cifs_inode->ea_list = NULL;
 
 	/* Can not set i_flags here - they get immediately overwritten
 	   to zero by the VFS */
@@ -325,6 +494,7 @@ cifs_alloc_inode(struct super_block *sb)
 static void
 cifs_destroy_inode(struct inode *inode)
 {
+	kfree(CIFS_I(inode)->ea_list);
 	kmem_cache_free(cifs_inode_cachep, CIFS_I(inode));
 }
 
@@ -412,6 +582,8 @@ cifs_show_options(struct seq_file *s, struct vfsmount *m)
 		seq_printf(s, ",cifsacl");
 	if (cifs_sb->mnt_cifs_flags & CIFS_MOUNT_DYNPERM)
 		seq_printf(s, ",dynperm");
+	if (cifs_sb->mnt_cifs_flags & CIFS_MOUNT_APPEND_CACHE)
+		seq_printf(s, ",appendcache");
 	if (m->mnt_sb->s_flags & MS_POSIXACL)
 		seq_printf(s, ",acl");
 
@@ -711,6 +883,8 @@ const struct inode_operations cifs_file_inode_ops = {
 	.getattr = cifs_getattr, /* do we need this anymore? */
 	.rename = cifs_rename,
 	.permission = cifs_permission,
+	.fallocate = cifs_fallocate,
+	.fiemap = cifs_fiemap,
 #ifdef CONFIG_CIFS_XATTR
 	.setxattr = cifs_setxattr,
 	.getxattr = cifs_getxattr,
@@ -1037,13 +1211,22 @@ init_cifs(void)
 	if (rc)
 		goto out_unregister_key_type;
 #endif
-	rc = slow_work_register_user(THIS_MODULE);
+#if defined(CONFIG_CIFS_EXPERIMENTAL) && defined(CONFIG_KEYS)
+	rc = init_cifs_idmap();
 	if (rc)
 		goto out_unregister_resolver_key;
+#endif
+	rc = slow_work_register_user(THIS_MODULE);
+	if (rc)
+		goto out_exit_idmap;
 
 	return 0;
 
+ out_exit_idmap:
+#if defined(CONFIG_CIFS_EXPERIMENTAL) && defined(CONFIG_KEYS)
+	exit_cifs_idmap();
  out_unregister_resolver_key:
+#endif
 #ifdef CONFIG_CIFS_DFS_UPCALL
 	unregister_key_type(&key_type_dns_resolver);
  out_unregister_key_type:
@@ -1069,11 +1252,17 @@ exit_cifs(void)
 {
 	cFYI(DBG2, ("exit_cifs"));
 	cifs_proc_clean();
+#if defined(CONFIG_CIFS_EXPERIMENTAL) && defined(CONFIG_KEYS)
+	exit_cifs_idmap();
+#endif
 #ifdef CONFIG_CIFS_DFS_UPCALL
 	cifs_dfs_release_automount_timer();
+	dfs_cache_flush();
+	dns_resolver_cache_flush();
 	unregister_key_type(&key_type_dns_resolver);
 #endif
 #ifdef CONFIG_CIFS_UPCALL
+	cifs_spnego_cache_flush();
 	unregister_key_type(&cifs_spnego_key_type);
 #endif
 	unregister_filesystem(&cifs_fs_type);
@@ -19,6 +19,7 @@
 #include <linux/in.h>
 #include <linux/in6.h>
 #include <linux/slow-work.h>
+#include <linux/statfs.h>
 #include "cifs_fs_sb.h"
 #include "cifsacl.h"
 /*
@@ -48,6 +49,31 @@
  */
 #define CIFS_MAX_REQ 50
 
+/*
+ * Maximum number of threads, the caller and its slow_work helpers, that
+ * reopen the handles of one tree connection in parallel after a reconnect.
+ * Also limited to half of cifs_max_pending so that regular requests can
+ * still get onto the wire meanwhile.
+ */
+#define CIFS_MAX_REOPEN_THREADS 16
+
+/*
+ * While oplock breaks are pending on a server, requests other than those
+ * made to handle the breaks leave this many request slots free, since
+ * other clients of the files are stalled until the oplocks are released.
+ * Breaks write back dirty data a chunk (in pages) at a time, in turn.
+ */
+#define CIFS_OPLOCK_BREAK_SLOTS 4
+#define CIFS_OPLOCK_BREAK_CHUNK 256
+
+/*
+ * Limits for server side copy offload (FSCTL_SRV_COPYCHUNK).  Windows
+ * servers reject requests with more than 256 chunks, chunks larger than
+ * 1MB or more than 16MB in total, so stay well within those.
+ */
+#define CIFS_COPYCHUNK_MAX_CHUNKS 16
+#define CIFS_COPYCHUNK_CHUNK_SIZE (1024 * 1024)
+
 #define RFC1001_NAME_LEN 15
 #define RFC1001_NAME_LEN_WITH_NULL (RFC1001_NAME_LEN + 1)
 
@@ -118,6 +144,31 @@ struct cifs_cred {
 	struct cifs_ace *aces;
 };
 
+#ifdef CONFIG_CIFS_STATS2
+/*
+ * Log2 histograms shown in /proc/fs/cifs/Histograms.  Bucket n counts the
+ * samples (microseconds or bytes) below 2^n and at least 2^(n-1), the last
+ * bucket also counts everything larger.
+ */
+#define CIFS_HIST_BUCKETS 24
+
+struct cifs_hist {
+	atomic_t bucket[CIFS_HIST_BUCKETS];
+};
+
+/* SMB commands with their own histograms, all others are counted in slot 0 */
+#define CIFS_HIST_CMDS 16
+#endif /* CONFIG_CIFS_STATS2 */
+
+/* phases of cifs_mount, with their own histograms under CONFIG_CIFS_STATS2 */
+#define CIFS_MOUNT_CONNECT	0 /* getting a socket to the server */
+#define CIFS_MOUNT_SESSION	1 /* negotiate and session setup */
+#define CIFS_MOUNT_TCON		2 /* tree connect */
+#define CIFS_MOUNT_FSINFO	3 /* unix caps and fs info queries */
+#define CIFS_MOUNT_PATH		4 /* prefix path and DFS referral checks */
+#define CIFS_MOUNT_TOTAL	5 /* whole mount, per DFS referral hop */
+#define CIFS_MOUNT_PHASES	6
+
 /*
  *****************************************************************
  * Except the CIFS PDUs themselves all the
@@ -125,6 +176,10 @@ struct cifs_cred {
  *****************************************************************
  */
 
+/* values of TCP_Server_Info->cifsd_node other than a node number */
+#define CIFSD_NODE_ANY	-1	/* let the scheduler place cifsd */
+#define CIFSD_NODE_AUTO	-2	/* follow the node packets are received on */
+
 struct TCP_Server_Info {
 	struct list_head tcp_ses_list;
 	struct list_head smb_ses_list;
@@ -149,6 +204,10 @@ struct TCP_Server_Info {
 	bool svlocal:1;			/* local server or remote */
 	bool noblocksnd;		/* use blocking sendmsg */
 	bool noautotune;		/* do not autotune send buf sizes */
+	bool spnego_noreuse;	/* server rejected a reused SPNEGO blob */
+	int cifsd_node;		/* NUMA node to run cifsd on, or CIFSD_NODE_* */
+	int rx_node;		/* node the socket's packets arrive on */
+	void (*sk_data_ready)(struct sock *, int); /* socket's own callback */
 	atomic_t inFlight;  /* number of requests on the wire to server */
 #ifdef CONFIG_CIFS_STATS2
 	atomic_t inSend; /* requests trying to send */
@@ -156,6 +215,8 @@ struct TCP_Server_Info {
 #endif
 	enum statusEnum tcpStatus; /* what we think the status is */
 	struct mutex srv_mutex;
+	atomic_t send_waiters;	/* requests waiting for srv_mutex to send */
+	bool send_corked;	/* last send was with MSG_MORE */
 	struct task_struct *tsk;
 	char server_GUID[16];
 	char secMode;
@@ -183,6 +244,24 @@ struct TCP_Server_Info {
 	struct mac_key mac_signing_key;
 	char ntlmv2_hash[16];
 	unsigned long lstrp; /* when we got last response from this server */
+	struct slow_work reconnect_work; /* reestablish sessions, tcons and
+					    open files after reconnect */
+	struct task_struct *oplock_tsk; /* cifsoplockd, handles oplock breaks */
+	spinlock_t oplock_break_lock;
+	struct list_head oplock_break_q; /* files with a break to handle */
+	atomic_t oplock_breaks_pending; /* breaks queued or in progress */
+#ifdef CONFIG_CIFS_STATS2
+	struct cifs_hist cmd_latency[CIFS_HIST_CMDS]; /* usecs to response */
+	struct cifs_hist req_bytes[CIFS_HIST_CMDS];
+	struct cifs_hist rsp_bytes[CIFS_HIST_CMDS];
+	struct cifs_hist queue_wait; /* usecs waiting for a request slot */
+	struct cifs_hist reconnect_time; /* usecs until socket reconnected */
+	struct cifs_hist recover_time; /* usecs until files reopened */
+	struct cifs_hist oplock_break_time; /* usecs from break to release */
+	struct cifs_hist oplock_break_wait; /* usecs until cifsoplockd starts */
+	struct cifs_hist mount_time[CIFS_MOUNT_PHASES]; /* usecs per phase */
+	ktime_t reconnect_start;
+#endif /* CONFIG_CIFS_STATS2 */
 };
 
 /*
@@ -236,6 +315,13 @@ struct cifsSesInfo {
    which do not negotiate NTLM or POSIX dialects, but instead
    negotiate one of the older LANMAN dialects */
 #define CIFS_SES_LANMAN 8
+
+/* which QFS info level answers statfs on a tree connection */
+#define CIFS_STATFS_UNKNOWN	0
+#define CIFS_STATFS_POSIX	1	/* SMB_QUERY_POSIX_FS_INFO */
+#define CIFS_STATFS_NT		2	/* SMB_QUERY_FS_SIZE_INFO */
+#define CIFS_STATFS_OLD		3	/* SMB_INFO_ALLOCATION */
+
 /*
  * there is one of these for each connection to a resource on a particular
  * session
@@ -287,6 +373,7 @@ struct cifsTconInfo {
 	unsigned long long time_ffirst;
 	unsigned long long time_fnext;
 	unsigned long long time_fclose;
+	struct cifs_hist cmd_latency[CIFS_HIST_CMDS]; /* usecs to response */
 #endif /* CONFIG_CIFS_STATS2 */
 	__u64    bytes_read;
 	__u64    bytes_written;
@@ -295,6 +382,12 @@ struct cifsTconInfo {
 	FILE_SYSTEM_DEVICE_INFO fsDevInfo;
 	FILE_SYSTEM_ATTRIBUTE_INFO fsAttrInfo; /* ok if fs name truncated */
 	FILE_SYSTEM_UNIX_INFO fsUnixInfo;
+	spinlock_t statfs_lock;	/* protects statfs_cache and statfs_time */
+	struct kstatfs statfs_cache; /* last statfs result from the server */
+	unsigned long statfs_time; /* jiffies when statfs_cache was filled */
+	bool statfs_valid;
+	int statfs_level;	/* CIFS_STATFS_ level known to work */
+	struct slow_work statfs_work; /* refreshes statfs_cache */
 	bool ipc:1;		/* set if connection to IPC$ eg for RPC/PIPES */
 	bool retry:1;
 	bool nocase:1;
@@ -303,6 +396,7 @@ struct cifsTconInfo {
 				for this mount even if server would support */
 	bool local_lease:1; /* check leases (only) on local system not remote */
 	bool broken_posix_open; /* e.g. Samba server versions < 3.3.2, 3.2.9 */
+	bool broken_all_info2; /* server refuses QPathInfo level 0x3fa */
 	bool need_reconnect:1; /* connection reset, tid now invalid */
 	/* BB add field for back pointer to sb struct(s)? */
 };
@@ -315,6 +409,7 @@ struct cifsLockInfo {
 	struct list_head llist;	/* pointer to next cifsLockInfo */
 	__u64 offset;
 	__u64 length;
+	__u32 pid;	/* tgid of the locker, sent as the range owner */
 	__u8 type;
 };
 
@@ -353,10 +448,19 @@ struct cifsFileInfo {
 	bool closePend:1;	/* file is marked to close */
 	bool invalidHandle:1;	/* file closed via session abend */
 	bool oplock_break_cancelled:1;
+	bool oplock_break_flushing:1; /* break is part way through writeback */
 	atomic_t count;		/* reference count */
 	struct mutex fh_mutex; /* prevents reopen race after dead ses*/
 	struct cifs_search_info srch_inf;
-	struct slow_work oplock_break; /* slow_work job for oplock breaks */
+	struct cifs_search_info srch_next; /* FindNext response read ahead */
+	struct slow_work readdir_ahead; /* slow_work job reading srch_next */
+	unsigned long srch_next_flags;
+	int srch_next_rc;
+	struct list_head oplock_break_list; /* on server oplock_break_q */
+	struct list_head rlist; /* entry in a bulk reopen after reconnect */
+#ifdef CONFIG_CIFS_STATS2
+	ktime_t oplock_break_start; /* when the server sent the break */
+#endif
 };
 
 /* Take a reference on the file private data */
@@ -390,6 +494,16 @@ struct cifsInodeInfo {
 	bool delete_pending:1;		/* DELETE_ON_CLOSE is set */
 	u64  server_eof;		/* current file size on server */
 	u64  uniqueid;			/* server inode number */
+	/* mode and owner derived from the ACL (cifsacl), see cifsacl.c */
+	bool acl_valid:1;
+	umode_t acl_mode;
+	uid_t acl_uid;
+	gid_t acl_gid;
+	struct timespec acl_ctime;	/* ChangeTime they were derived at */
+	/* cached EAs (see xattr.c), an empty list if the file has none */
+	struct fealist *ea_list;
+	unsigned long ea_time;		/* jiffies when ea_list was fetched */
+	bool ea_oplock:1;		/* fetched while holding an oplock */
 	struct inode vfs_inode;
 };
 
@@ -441,6 +555,24 @@ static inline void cifs_stats_bytes_read(struct cifsTconInfo *tcon,
 
 #endif
 
+#ifdef CONFIG_CIFS_STATS2
+static inline void cifs_hist_add(struct cifs_hist *hist, u64 val)
+{
+	int n = fls64(val);
+
+	if (n >= CIFS_HIST_BUCKETS)
+		n = CIFS_HIST_BUCKETS - 1;
+	atomic_inc(&hist->bucket[n]);
+}
+
+static inline void cifs_hist_add_usecs(struct cifs_hist *hist, ktime_t start)
+{
+	s64 delta = ktime_us_delta(ktime_get(), start);
+
+	cifs_hist_add(hist, delta > 0 ? delta : 0);
+}
+#endif /* CONFIG_CIFS_STATS2 */
+
 /* one of these for every pending CIFS request to the server */
 struct mid_q_entry {
 	struct list_head qhead;	/* mids waiting on reply from this server */
@@ -448,9 +580,12 @@ struct mid_q_entry {
 	__u16 pid;		/* process id */
 	__u32 sequence_number;  /* for CIFS signing */
 	unsigned long when_alloc;  /* when mid was created */
+	ktime_t when_start;	/* for latency histograms and tracing */
 #ifdef CONFIG_CIFS_STATS2
 	unsigned long when_sent; /* time when smb send finished */
 	unsigned long when_received; /* when demux complete (taken off wire) */
+	unsigned int req_bytes;	/* length of the request on the wire */
+	struct cifs_hist *tcon_latency; /* slot of the tcon sent to, or NULL */
 #endif
 	struct task_struct *tsk;	/* task waiting for response */
 	struct smb_hdr *resp_buf;	/* response buffer */
@@ -487,6 +622,7 @@ struct dfs_info3_param {
 	int path_consumed;
 	int server_type;
 	int ref_flag;
+	unsigned int ttl; /* seconds the referral may be cached for */
 	char *path_name;
 	char *node_name;
 };
@@ -723,4 +859,5 @@ GLOBAL_EXTERN unsigned int cifs_min_rcv;    /* min size of big ntwrk buf pool */
 GLOBAL_EXTERN unsigned int cifs_min_small;  /* min size of small buf pool */
 GLOBAL_EXTERN unsigned int cifs_max_pending; /* MAX requests at once to server*/
 
-extern const struct slow_work_ops cifs_oplock_break_ops;
+extern const struct slow_work_ops cifs_reconnect_ops;
+extern const struct slow_work_ops cifs_statfs_ops;
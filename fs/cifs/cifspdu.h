@@ -1443,6 +1443,52 @@ struct reparse_data {
 	char	LinkNamesBuf[1];
 } __attribute__((packed));
 
+/*
+ * Data areas of the FSCTL_SRV_REQUEST_RESUME_KEY response and of the
+ * FSCTL_SRV_COPYCHUNK request and response (see MS-SMB 2.2.7.2).  The
+ * resume key of the source handle is opaque to the client, it is only
+ * passed back to the server in the copychunk request on the target handle.
+ */
+#define COPY_CHUNK_RES_KEY_SIZE 24
+
+struct resume_key_rsp {
+	char	ResumeKey[COPY_CHUNK_RES_KEY_SIZE];
+	__le32	ContextLength;	/* must be zero */
+	char	Context[4];	/* ignored, Windows sends 4 bytes of zero */
+} __attribute__((packed));
+
+struct copychunk {
+	__le64	SourceOffset;
+	__le64	TargetOffset;
+	__le32	Length;
+	__le32	Reserved;
+} __attribute__((packed));
+
+struct copychunk_ioctl_req {
+	char	SourceKey[COPY_CHUNK_RES_KEY_SIZE];
+	__le32	ChunkCount;
+	__le32	Reserved;
+	struct copychunk Chunks[0];
+} __attribute__((packed));
+
+struct copychunk_ioctl_rsp {
+	__le32	ChunksWritten;
+	__le32	ChunkBytesWritten;
+	__le32	TotalBytesWritten;
+} __attribute__((packed));
+
+/* FSCTL_SET_ZERO_DATA request */
+struct file_zero_data_information {
+	__le64	FileOffset;
+	__le64	BeyondFinalZero;
+} __attribute__((packed));
+
+/* FSCTL_QUERY_ALLOCATED_RANGES request, and array of these in response */
+struct file_allocated_range_buffer {
+	__le64	FileOffset;
+	__le64	Length;
+} __attribute__((packed));
+
 struct cifs_quota_data {
 	__u32	rsrvd1;  /* 0 */
 	__u32	sid_size;
@@ -2133,7 +2179,7 @@ typedef struct { /* data block encoding of response to level 263 QPathInfo */
 	__u8 DeletePending;
 	__u8 Directory;
 	__u16 Pad2;
-	__u64 IndexNumber;
+	__le64 IndexNumber;	/* only returned at level 0x3fa */
 	__le32 EASize;
 	__le32 AccessFlags;
 	__u64 IndexNumber1;
@@ -48,6 +48,8 @@ extern char *cifs_compose_mount_options(const char *sb_mountdata,
 		const char *fullpath, const struct dfs_info3_param *ref,
 		char **devname);
 /* extern void renew_parental_timestamps(struct dentry *direntry);*/
+extern void cifs_send_lock(struct TCP_Server_Info *server);
+extern void cifs_send_unlock(struct TCP_Server_Info *server);
 extern int SendReceive(const unsigned int /* xid */ , struct cifsSesInfo *,
 			struct smb_hdr * /* input */ ,
 			struct smb_hdr * /* out */ ,
@@ -63,13 +65,13 @@ extern int SendReceiveBlockingLock(const unsigned int xid,
 			struct smb_hdr *out_buf,
 			int *bytes_returned);
 extern int checkSMB(struct smb_hdr *smb, __u16 mid, unsigned int length);
+extern bool cifs_queue_oplock_break(struct cifsFileInfo *cfile);
+extern int cifs_oplock_break_thread(void *data);
 extern bool is_valid_oplock_break(struct smb_hdr *smb,
 				  struct TCP_Server_Info *);
 extern bool is_size_safe_to_change(struct cifsInodeInfo *, __u64 eof);
 extern struct cifsFileInfo *find_writable_file(struct cifsInodeInfo *);
-#ifdef CONFIG_CIFS_EXPERIMENTAL
 extern struct cifsFileInfo *find_readable_file(struct cifsInodeInfo *);
-#endif
 extern unsigned int smbCalcSize(struct smb_hdr *ptr);
 extern unsigned int smbCalcSize_LE(struct smb_hdr *ptr);
 extern int decode_negTokenInit(unsigned char *security_blob, int length,
@@ -103,6 +105,9 @@ extern void cifs_unix_basic_to_fattr(struct cifs_fattr *fattr,
 extern void cifs_fattr_to_inode(struct inode *inode, struct cifs_fattr *fattr);
 extern struct inode *cifs_iget(struct super_block *sb,
 			       struct cifs_fattr *fattr);
+extern u64 cifs_new_uniqueid(struct super_block *sb);
+extern void cifs_invalidate_changed(struct inode *inode, loff_t old_size,
+				    loff_t new_size);
 
 extern int cifs_get_inode_info(struct inode **pinode,
 			const unsigned char *search_path,
@@ -115,16 +120,30 @@ extern void cifs_acl_to_fattr(struct cifs_sb_info *cifs_sb,
 			      struct cifs_fattr *fattr, struct inode *inode,
 			      const char *path, const __u16 *pfid);
 extern int mode_to_acl(struct inode *inode, const char *path, __u64);
+#if defined(CONFIG_CIFS_EXPERIMENTAL) && defined(CONFIG_KEYS)
+extern int init_cifs_idmap(void);
+extern void exit_cifs_idmap(void);
+#endif
 
 extern int cifs_mount(struct super_block *, struct cifs_sb_info *, char *,
 			const char *);
 extern int cifs_umount(struct super_block *, struct cifs_sb_info *);
+extern void cifs_put_tcon(struct cifsTconInfo *tcon);
 extern void cifs_dfs_release_automount_timer(void);
 void cifs_proc_init(void);
 void cifs_proc_clean(void);
+#ifdef CONFIG_CIFS_STATS2
+extern struct cifs_hist *cifs_hist_tcon_slot(struct cifsSesInfo *ses,
+			__u16 tid, __u8 command);
+extern void cifs_hist_record_rsp(struct TCP_Server_Info *server, __u8 command,
+			s64 usecs, unsigned int req_bytes,
+			unsigned int rsp_bytes);
+#endif /* CONFIG_CIFS_STATS2 */
 
 extern int cifs_setup_session(unsigned int xid, struct cifsSesInfo *pSesInfo,
 			struct nls_table *nls_info);
+extern int cifs_reconnect_tcon(struct cifsTconInfo *tcon, int smb_command);
+extern void cifs_reopen_tcon_files(struct cifsTconInfo *tcon);
 extern int CIFSSMBNegotiate(unsigned int xid, struct cifsSesInfo *ses);
 
 extern int CIFSTCon(unsigned int xid, struct cifsSesInfo *ses,
@@ -141,6 +160,7 @@ extern int CIFSFindNext(const int xid, struct cifsTconInfo *tcon,
 
 extern int CIFSFindClose(const int, struct cifsTconInfo *tcon,
 			const __u16 search_handle);
+extern void cifs_readdir_ahead_discard(struct cifsFileInfo *cfile);
 
 extern int CIFSSMBQPathInfo(const int xid, struct cifsTconInfo *tcon,
 			const unsigned char *searchName,
@@ -322,6 +342,10 @@ extern int CIFSSMBLock(const int xid, struct cifsTconInfo *tcon,
 			const __u64 offset, const __u32 numUnlock,
 			const __u32 numLock, const __u8 lockType,
 			const bool waitFlag);
+extern int CIFSSMBLockv(const int xid, struct cifsTconInfo *tcon,
+			const __u16 netfid, const __u8 lock_type,
+			const __u32 num_unlock, const __u32 num_lock,
+			LOCKING_ANDX_RANGE *buf);
 extern int CIFSSMBPosixLock(const int xid, struct cifsTconInfo *tcon,
 			const __u16 smb_file_id, const int get_flag,
 			const __u64 len, struct file_lock *,
@@ -358,10 +382,38 @@ extern int CIFSSMBCopy(int xid,
 			const char *toName, const int flags,
 			const struct nls_table *nls_codepage,
 			int remap_special_chars);
+extern int CIFSSMBFsctl(const int xid, struct cifsTconInfo *tcon,
+			const __u16 netfid, const __u32 function,
+			const void *in_data, const __u32 in_len,
+			void *out_data, __u32 *out_len);
+extern int CIFSSMBGetResumeKey(const int xid, struct cifsTconInfo *tcon,
+			const __u16 netfid, char *key);
+extern int CIFSSMBCopyChunk(const int xid, struct cifsTconInfo *tcon,
+			const __u16 netfid, const char *src_key,
+			__u64 src_off, __u64 dst_off, __u32 len,
+			const __u32 chunk_size, __u32 *written);
+extern int CIFSSMBSetSparse(const int xid, struct cifsTconInfo *tcon,
+			const __u16 netfid);
+extern int CIFSSMBZeroData(const int xid, struct cifsTconInfo *tcon,
+			const __u16 netfid, __u64 offset, __u64 len);
+extern int CIFSSMBQueryAllocRanges(const int xid, struct cifsTconInfo *tcon,
+			const __u16 netfid, __u64 offset, __u64 len,
+			struct file_allocated_range_buffer *ranges,
+			unsigned int *count);
 extern int CIFSSMBNotify(const int xid, struct cifsTconInfo *tcon,
 			const int notify_subdirs, const __u16 netfid,
 			__u32 filter, struct file *file, int multishot,
 			const struct nls_table *nls_codepage);
+extern int CIFSSMBQAllEAsList(const int xid, struct cifsTconInfo *tcon,
+			const unsigned char *searchName,
+			struct fealist **plist,
+			const struct nls_table *nls_codepage,
+			int remap_special_chars);
+extern ssize_t cifs_fealist_names(const struct fealist *list, char *EAData,
+			size_t buf_size);
+extern ssize_t cifs_fealist_value(const struct fealist *list,
+			const char *ea_name, void *ea_value, size_t buf_size);
+extern void cifs_ea_cache_invalidate(struct inode *inode);
 extern ssize_t CIFSSMBQAllEAs(const int xid, struct cifsTconInfo *tcon,
 			const unsigned char *searchName, char *EAData,
 			size_t bufsize, const struct nls_table *nls_codepage,
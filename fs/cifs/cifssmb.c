@@ -32,6 +32,7 @@
 #include <linux/vfs.h>
 #include <linux/posix_acl_xattr.h>
 #include <asm/uaccess.h>
+#include <asm/unaligned.h>
 #include "cifspdu.h"
 #include "cifsglob.h"
 #include "cifsacl.h"
@@ -102,7 +103,7 @@ static void mark_open_files_invalid(struct cifsTconInfo *pTcon)
 }
 
 /* reconnect the socket, tcon, and smb session if needed */
-static int
+int
 cifs_reconnect_tcon(struct cifsTconInfo *tcon, int smb_command)
 {
 	int rc = 0;
@@ -199,10 +200,10 @@ cifs_reconnect_tcon(struct cifsTconInfo *tcon, int smb_command)
 		reset_cifs_unix_caps(0, tcon, NULL, NULL);
 
 	/*
-	 * Removed call to reopen open files here. It is safer (and faster) to
-	 * reopen files one at a time as needed in read and write.
-	 *
-	 * FIXME: what about file locks? don't we need to reclaim them ASAP?
+	 * Open files are not reopened here. After a reconnect of the socket
+	 * cifs_reconnect_work() reopens them (and reclaims their byte range
+	 * locks) in bulk, and any caller that needs a handle before then
+	 * reopens it itself in read and write.
 	 */
 
 out:
@@ -1688,6 +1689,56 @@ CIFSSMBLock(const int xid, struct cifsTconInfo *tcon,
 	return rc;
 }
 
+/*
+ * Send one LOCKING_ANDX carrying an array of ranges. The server processes
+ * the num_unlock ranges at the start of buf before the num_lock ranges that
+ * follow them. All ranges share lock_type, so shared and exclusive locks
+ * must go in separate requests. Never blocks on the server.
+ */
+int
+CIFSSMBLockv(const int xid, struct cifsTconInfo *tcon, const __u16 netfid,
+	     const __u8 lock_type, const __u32 num_unlock,
+	     const __u32 num_lock, LOCKING_ANDX_RANGE *buf)
+{
+	int rc = 0;
+	LOCK_REQ *pSMB = NULL;
+	struct kvec iov[2];
+	int resp_buf_type;
+	__u16 count;
+
+	cFYI(1, ("CIFSSMBLockv numLock %d numUnlock %d", num_lock, num_unlock));
+
+	rc = small_smb_init(SMB_COM_LOCKING_ANDX, 8, tcon, (void **) &pSMB);
+	if (rc)
+		return rc;
+
+	pSMB->Timeout = 0;
+	pSMB->NumberOfLocks = cpu_to_le16(num_lock);
+	pSMB->NumberOfUnlocks = cpu_to_le16(num_unlock);
+	pSMB->LockType = lock_type;
+	pSMB->AndXCommand = 0xFF;	/* none */
+	pSMB->Fid = netfid; /* netfid stays le */
+
+	count = (num_unlock + num_lock) * sizeof(LOCKING_ANDX_RANGE);
+	pSMB->hdr.smb_buf_length += count;
+	pSMB->ByteCount = cpu_to_le16(count);
+
+	/* ranges are sent straight from the caller's array */
+	iov[0].iov_base = (char *)pSMB;
+	iov[0].iov_len = pSMB->hdr.smb_buf_length + 4 - count;
+	iov[1].iov_base = (char *)buf;
+	iov[1].iov_len = count;
+
+	cifs_stats_inc(&tcon->num_locks);
+	rc = SendReceive2(xid, tcon->ses, iov, 2, &resp_buf_type, CIFS_NO_RESP);
+	if (rc)
+		cFYI(1, ("Send error in Lockv = %d", rc));
+
+	/* Note: On -EAGAIN error only caller can retry on handle based calls
+	since file handle passed in no longer valid */
+	return rc;
+}
+
 int
 CIFSSMBPosixLock(const int xid, struct cifsTconInfo *tcon,
 		const __u16 smb_file_id, const int get_flag, const __u64 len,
@@ -2028,7 +2079,7 @@ CIFSSMBCopy(const int xid, struct cifsTconInfo *tcon, const char *fromName,
 
 	cFYI(1, ("In CIFSSMBCopy"));
 copyRetry:
-	rc = smb_init(SMB_COM_COPY, 1, tcon, (void **) &pSMB,
+	rc = smb_init(SMB_COM_COPY, 3, tcon, (void **) &pSMB,
 			(void **) &pSMBr);
 	if (rc)
 		return rc;
@@ -2036,7 +2087,9 @@ copyRetry:
 	pSMB->BufferFormat = 0x04;
 	pSMB->Tid2 = target_tid;
 
-	pSMB->Flags = cpu_to_le16(flags & COPY_TREE);
+	/* overwrite the target if it exists, otherwise create it */
+	pSMB->OpenFunction = cpu_to_le16(SMBOPEN_OTRUNC | SMBOPEN_OCREATE);
+	pSMB->Flags = cpu_to_le16(flags & (COPY_TREE | COPY_MUST_BE_FILE));
 
 	if (pSMB->hdr.Flags2 & SMBFLG2_UNICODE) {
 		name_len = cifsConvertToUCS((__le16 *) pSMB->OldFileName,
@@ -2082,6 +2135,221 @@ copyRetry:
 	return rc;
 }
 
+/*
+ * Send an FSCTL on an open handle via NT_TRANSACT_IOCTL.  in_data (in_len
+ * bytes) is sent as the data area of the request.  If out_data is non-null
+ * *out_len is the size of that buffer on entry and is set to the number of
+ * bytes of response data copied into it on return, or -EOVERFLOW is
+ * returned if the response data does not fit.
+ */
+int
+CIFSSMBFsctl(const int xid, struct cifsTconInfo *tcon, const __u16 netfid,
+	     const __u32 function, const void *in_data, const __u32 in_len,
+	     void *out_data, __u32 *out_len)
+{
+	int rc = 0;
+	int bytes_returned;
+	TRANSACT_IOCTL_REQ *pSMB = NULL;
+	TRANSACT_IOCTL_RSP *pSMBr = NULL;
+	__u32 max_out = out_data ? *out_len : 0;
+	__u16 byte_count;
+
+	cFYI(1, ("In Fsctl 0x%x on fid %d", function, netfid));
+
+	if (in_len > CIFSMaxBufSize - MAX_CIFS_HDR_SIZE)
+		return -EINVAL;
+
+	rc = smb_init(SMB_COM_NT_TRANSACT, 23, tcon, (void **) &pSMB,
+		      (void **) &pSMBr);
+	if (rc)
+		return rc;
+
+	byte_count = 3 /* pad */ + in_len;
+	pSMB->MaxSetupCount = 4;
+	pSMB->Reserved = 0;
+	pSMB->TotalParameterCount = 0;
+	pSMB->ParameterCount = 0;
+	pSMB->ParameterOffset = 0;
+	pSMB->MaxParameterCount = cpu_to_le32(2);
+	pSMB->MaxDataCount = cpu_to_le32(max_out);
+	pSMB->TotalDataCount = cpu_to_le32(in_len);
+	pSMB->DataCount = pSMB->TotalDataCount;
+	pSMB->DataOffset = cpu_to_le32(offsetof(TRANSACT_IOCTL_REQ, Data) -
+				       4 /* for rfc1001 length itself */);
+	pSMB->SetupCount = 4;
+	pSMB->SubCommand = cpu_to_le16(NT_TRANSACT_IOCTL);
+	pSMB->FunctionCode = cpu_to_le32(function);
+	pSMB->IsFsctl = 1; /* FSCTL */
+	pSMB->IsRootFlag = 0;
+	pSMB->Fid = netfid; /* file handle always le */
+	if (in_len)
+		memcpy(pSMB->Data, in_data, in_len);
+	pSMB->hdr.smb_buf_length += byte_count;
+	pSMB->ByteCount = cpu_to_le16(byte_count);
+
+	rc = SendReceive(xid, tcon->ses, (struct smb_hdr *) pSMB,
+			 (struct smb_hdr *) pSMBr, &bytes_returned, 0);
+	if (rc) {
+		cFYI(1, ("Send error in Fsctl 0x%x = %d", function, rc));
+	} else if (out_data) {
+		/* ByteCount was converted from little endian in SendReceive */
+		char *end_of_smb = 2 /* sizeof byte count */ +
+				pSMBr->ByteCount + (char *)&pSMBr->ByteCount;
+		__u32 data_offset = le32_to_cpu(pSMBr->DataOffset);
+		__u32 data_count = le32_to_cpu(pSMBr->DataCount);
+
+		if (data_offset > end_of_smb - (char *)&pSMBr->hdr.Protocol ||
+		    data_count > end_of_smb - (char *)&pSMBr->hdr.Protocol -
+				 data_offset) {
+			cFYI(1, ("Fsctl response data beyond end of smb"));
+			rc = -EIO;
+			goto fsctl_out;
+		}
+		if (data_count > max_out) {
+			cFYI(1, ("Fsctl response data %u exceeds buffer %u",
+				 data_count, max_out));
+			rc = -EOVERFLOW;
+			goto fsctl_out;
+		}
+		memcpy(out_data, (char *)&pSMBr->hdr.Protocol + data_offset,
+		       data_count);
+		*out_len = data_count;
+	}
+
+fsctl_out:
+	cifs_buf_release(pSMB);
+
+	/* Note: On -EAGAIN error only caller can retry on handle based calls
+		since file handle passed in no longer valid */
+	return rc;
+}
+
+/* Get the key which identifies an open source file in copychunk requests */
+int
+CIFSSMBGetResumeKey(const int xid, struct cifsTconInfo *tcon,
+		    const __u16 netfid, char *key)
+{
+	int rc;
+	struct resume_key_rsp rsp;
+	__u32 len = sizeof(rsp);
+
+	rc = CIFSSMBFsctl(xid, tcon, netfid, FSCTL_SRV_REQUEST_RESUME_KEY,
+			  NULL, 0, &rsp, &len);
+	if (rc == 0 && len < COPY_CHUNK_RES_KEY_SIZE) {
+		cFYI(1, ("Resume key response too short %d", len));
+		rc = -EIO;
+	}
+	if (rc == 0)
+		memcpy(key, rsp.ResumeKey, COPY_CHUNK_RES_KEY_SIZE);
+	return rc;
+}
+
+/*
+ * Ask the server to copy len bytes from src_off in the file identified by
+ * src_key to dst_off in the target file netfid, split into chunks of at
+ * most chunk_size bytes.  Up to CIFS_COPYCHUNK_MAX_CHUNKS chunks are sent
+ * in one request, so callers must limit len accordingly.  On success
+ * *written is set to the number of bytes the server copied.
+ */
+int
+CIFSSMBCopyChunk(const int xid, struct cifsTconInfo *tcon,
+		 const __u16 netfid, const char *src_key, __u64 src_off,
+		 __u64 dst_off, __u32 len, const __u32 chunk_size,
+		 __u32 *written)
+{
+	int rc;
+	struct copychunk_ioctl_req *req;
+	struct copychunk_ioctl_rsp rsp;
+	__u32 rsp_len = sizeof(rsp);
+	__u32 count = 0;
+	__u32 this_len;
+
+	*written = 0;
+	if (len == 0 || chunk_size == 0 ||
+	    DIV_ROUND_UP(len, chunk_size) > CIFS_COPYCHUNK_MAX_CHUNKS)
+		return -EINVAL;
+
+	req = kzalloc(sizeof(*req) + CIFS_COPYCHUNK_MAX_CHUNKS *
+			sizeof(struct copychunk), GFP_KERNEL);
+	if (req == NULL)
+		return -ENOMEM;
+
+	memcpy(req->SourceKey, src_key, COPY_CHUNK_RES_KEY_SIZE);
+	while (len) {
+		this_len = min(len, chunk_size);
+		req->Chunks[count].SourceOffset = cpu_to_le64(src_off);
+		req->Chunks[count].TargetOffset = cpu_to_le64(dst_off);
+		req->Chunks[count].Length = cpu_to_le32(this_len);
+		src_off += this_len;
+		dst_off += this_len;
+		len -= this_len;
+		count++;
+	}
+	req->ChunkCount = cpu_to_le32(count);
+
+	rc = CIFSSMBFsctl(xid, tcon, netfid, FSCTL_SRV_COPYCHUNK, req,
+			  sizeof(*req) + count * sizeof(struct copychunk),
+			  &rsp, &rsp_len);
+	if (rc == 0) {
+		if (rsp_len < sizeof(rsp)) {
+			cFYI(1, ("Copychunk response too short %d", rsp_len));
+			rc = -EIO;
+		} else {
+			*written = le32_to_cpu(rsp.TotalBytesWritten);
+			cFYI(1, ("Copychunk wrote %d chunks, %d bytes",
+				 le32_to_cpu(rsp.ChunksWritten), *written));
+		}
+	}
+
+	kfree(req);
+	return rc;
+}
+
+/* Mark a file sparse so that zeroed ranges need not be allocated */
+int
+CIFSSMBSetSparse(const int xid, struct cifsTconInfo *tcon, const __u16 netfid)
+{
+	return CIFSSMBFsctl(xid, tcon, netfid, FSCTL_SET_SPARSE, NULL, 0,
+			    NULL, NULL);
+}
+
+/* Zero (and on sparse files deallocate) len bytes starting at offset */
+int
+CIFSSMBZeroData(const int xid, struct cifsTconInfo *tcon, const __u16 netfid,
+		__u64 offset, __u64 len)
+{
+	struct file_zero_data_information zero_data;
+
+	zero_data.FileOffset = cpu_to_le64(offset);
+	zero_data.BeyondFinalZero = cpu_to_le64(offset + len);
+	return CIFSSMBFsctl(xid, tcon, netfid, FSCTL_SET_ZERO_DATA, &zero_data,
+			    sizeof(zero_data), NULL, NULL);
+}
+
+/*
+ * Find which parts of the len bytes at offset are allocated on the server.
+ * *count is the number of entries in ranges on entry and is set to the
+ * number of allocated ranges returned.  Returns -EOVERFLOW if there are
+ * more ranges than that, rather than a truncated list.
+ */
+int
+CIFSSMBQueryAllocRanges(const int xid, struct cifsTconInfo *tcon,
+			const __u16 netfid, __u64 offset, __u64 len,
+			struct file_allocated_range_buffer *ranges,
+			unsigned int *count)
+{
+	int rc;
+	struct file_allocated_range_buffer query;
+	__u32 out_len = *count * sizeof(*ranges);
+
+	query.FileOffset = cpu_to_le64(offset);
+	query.Length = cpu_to_le64(len);
+	rc = CIFSSMBFsctl(xid, tcon, netfid, FSCTL_QUERY_ALLOCATED_RANGES,
+			  &query, sizeof(query), ranges, &out_len);
+	*count = rc ? 0 : out_len / sizeof(*ranges);
+	return rc;
+}
+
 int
 CIFSUnixCreateSymLink(const int xid, struct cifsTconInfo *tcon,
 		      const char *fromName, const char *toName,
@@ -3240,16 +3508,28 @@ CIFSSMBQPathInfo(const int xid, struct cifsTconInfo *tcon,
 		 int legacy /* old style infolevel */,
 		 const struct nls_table *nls_codepage, int remap)
 {
-/* level 263 SMB_QUERY_FILE_ALL_INFO */
+/* level 263 SMB_QUERY_FILE_ALL_INFO, or its passthrough equivalent 1018 */
 	TRANSACTION2_QPI_REQ *pSMB = NULL;
 	TRANSACTION2_QPI_RSP *pSMBr = NULL;
 	int rc = 0;
 	int bytes_returned;
 	int name_len;
-	__u16 params, byte_count;
+	__u16 params, byte_count, level;
 
 /* cFYI(1, ("In QPathInfo path %s", searchName)); */
 QPathInfoRetry:
+	/*
+	 * The passthrough level also returns the IndexNumber, which saves
+	 * the caller a separate query for the server inode number
+	 */
+	if (legacy)
+		level = SMB_INFO_STANDARD;
+	else if ((tcon->ses->capabilities & CAP_INFOLEVEL_PASSTHRU) &&
+		 !tcon->broken_all_info2)
+		level = SMB_FILE_ALL_INFO2;
+	else
+		level = SMB_QUERY_FILE_ALL_INFO;
+
 	rc = smb_init(SMB_COM_TRANSACTION2, 15, tcon, (void **) &pSMB,
 		      (void **) &pSMBr);
 	if (rc)
@@ -3287,10 +3567,7 @@ QPathInfoRetry:
 	byte_count = params + 1 /* pad */ ;
 	pSMB->TotalParameterCount = cpu_to_le16(params);
 	pSMB->ParameterCount = pSMB->TotalParameterCount;
-	if (legacy)
-		pSMB->InformationLevel = cpu_to_le16(SMB_INFO_STANDARD);
-	else
-		pSMB->InformationLevel = cpu_to_le16(SMB_QUERY_FILE_ALL_INFO);
+	pSMB->InformationLevel = cpu_to_le16(level);
 	pSMB->Reserved4 = 0;
 	pSMB->hdr.smb_buf_length += byte_count;
 	pSMB->ByteCount = cpu_to_le16(byte_count);
@@ -3299,6 +3576,13 @@ QPathInfoRetry:
 			 (struct smb_hdr *) pSMBr, &bytes_returned, 0);
 	if (rc) {
 		cFYI(1, ("Send error in QPathInfo = %d", rc));
+		if (level == SMB_FILE_ALL_INFO2 &&
+		    (rc == -EOPNOTSUPP || rc == -EINVAL)) {
+			cFYI(1, ("passthrough level refused, using 0x107"));
+			tcon->broken_all_info2 = true;
+			cifs_buf_release(pSMB);
+			goto QPathInfoRetry;
+		}
 	} else {		/* decode response */
 		rc = validate_t2((struct smb_t2_rsp *)pSMBr);
 
@@ -3312,6 +3596,7 @@ QPathInfoRetry:
 		else if (pFindData) {
 			int size;
 			__u16 data_offset = le16_to_cpu(pSMBr->t2.DataOffset);
+			__u16 data_count = le16_to_cpu(pSMBr->t2.DataCount);
 
 			/* On legacy responses we do not read the last field,
 			EAsize, fortunately since it varies by subdialect and
@@ -3324,6 +3609,12 @@ QPathInfoRetry:
 			memcpy((char *) pFindData,
 			       (char *) &pSMBr->hdr.Protocol +
 			       data_offset, size);
+			/* level 0x107 has other fields at this offset, and a
+			   short reply may not have got as far as it */
+			if (!legacy && (level != SMB_FILE_ALL_INFO2 ||
+			    data_count < offsetof(FILE_ALL_INFO, IndexNumber) +
+					 sizeof(pFindData->IndexNumber)))
+				pFindData->IndexNumber = 0;
 		} else
 		    rc = -ENOMEM;
 	}
@@ -3419,6 +3710,42 @@ UnixQPathInfoRetry:
 	return rc;
 }
 
+/*
+ * Number of entries to ask for in a FindFirst or FindNext. Ask for as
+ * many of the smallest possible entries of the level as fit in the
+ * response buffer we offer, so that the buffer and not the count limits
+ * how many come back in each response.
+ */
+static __u16
+cifs_search_count(struct cifsTconInfo *tcon, __u16 info_level)
+{
+	unsigned int bufsize = (tcon->ses->server->maxBuf -
+				MAX_CIFS_HDR_SIZE) & 0xFFFFFF00;
+	unsigned int entry_size;
+
+	switch (info_level) {
+	case SMB_FIND_FILE_INFO_STANDARD:
+		entry_size = sizeof(FIND_FILE_STANDARD_INFO);
+		break;
+	case SMB_FIND_FILE_DIRECTORY_INFO:
+		entry_size = sizeof(FILE_DIRECTORY_INFO);
+		break;
+	case SMB_FIND_FILE_FULL_DIRECTORY_INFO:
+		entry_size = sizeof(FILE_FULL_DIRECTORY_INFO);
+		break;
+	case SMB_FIND_FILE_ID_FULL_DIR_INFO:
+		entry_size = sizeof(SEARCH_ID_FULL_DIR_INFO);
+		break;
+	case SMB_FIND_FILE_BOTH_DIRECTORY_INFO:
+		entry_size = sizeof(FILE_BOTH_DIRECTORY_INFO);
+		break;
+	default:
+		entry_size = sizeof(FILE_UNIX_INFO);
+		break;
+	}
+	return clamp_t(unsigned int, bufsize / entry_size, 1, 0xFFFF);
+}
+
 /* xid, tcon, searchName and codepage are input parms, rest are returned */
 int
 CIFSFindFirst(const int xid, struct cifsTconInfo *tcon,
@@ -3496,7 +3823,8 @@ findFirstRetry:
 	pSMB->SearchAttributes =
 	    cpu_to_le16(ATTR_READONLY | ATTR_HIDDEN | ATTR_SYSTEM |
 			ATTR_DIRECTORY);
-	pSMB->SearchCount = cpu_to_le16(CIFSMaxBufSize/sizeof(FILE_UNIX_INFO));
+	pSMB->SearchCount = cpu_to_le16(cifs_search_count(tcon,
+						psrch_inf->info_level));
 	pSMB->SearchFlags = cpu_to_le16(CIFS_SEARCH_CLOSE_AT_END |
 		CIFS_SEARCH_RETURN_RESUME);
 	pSMB->InformationLevel = cpu_to_le16(psrch_inf->info_level);
@@ -3611,7 +3939,7 @@ int CIFSFindNext(const int xid, struct cifsTconInfo *tcon,
 	pSMB->SubCommand = cpu_to_le16(TRANS2_FIND_NEXT);
 	pSMB->SearchHandle = searchHandle;      /* always kept as le */
 	pSMB->SearchCount =
-		cpu_to_le16(CIFSMaxBufSize / sizeof(FILE_UNIX_INFO));
+		cpu_to_le16(cifs_search_count(tcon, psrch_inf->info_level));
 	pSMB->InformationLevel = cpu_to_le16(psrch_inf->info_level);
 	pSMB->ResumeKey = psrch_inf->resume_key;
 	pSMB->SearchFlags =
@@ -3909,8 +4237,14 @@ parse_DFS_referrals(TRANSACTION2_GET_DFS_REFER_RSP *pSMBr,
 		} else
 			node->path_consumed = le16_to_cpu(pSMBr->PathConsumed);
 
+		if ((char *)(ref + 1) > data_end) {
+			cERROR(1, ("DFS referral %d beyond end of response", i));
+			rc = -EINVAL;
+			goto parse_DFS_referrals_exit;
+		}
 		node->server_type = le16_to_cpu(ref->ServerType);
 		node->ref_flag = le16_to_cpu(ref->ReferralEntryFlags);
+		node->ttl = le32_to_cpu(ref->TimeToLive);
 
 		/* copy DfsPath */
 		temp = (char *)ref + le16_to_cpu(ref->DfsPathOffset);
@@ -3927,8 +4261,14 @@ parse_DFS_referrals(TRANSACTION2_GET_DFS_REFER_RSP *pSMBr,
 		max_len = data_end - temp;
 		node->node_name = cifs_strndup_from_ucs(temp, max_len,
 						      is_unicode, nls_codepage);
-		if (!node->node_name)
+		if (!node->node_name) {
 			rc = -ENOMEM;
+			goto parse_DFS_referrals_exit;
+		}
+
+		/* string offsets are relative to each entry, so step by Size */
+		ref = (struct dfs_referral_level_3 *)((char *)ref +
+						le16_to_cpu(ref->Size));
 	}
 
 parse_DFS_referrals_exit:
@@ -5270,24 +5610,31 @@ int CIFSSMBNotify(const int xid, struct cifsTconInfo *tcon,
 	return rc;
 }
 #ifdef CONFIG_CIFS_XATTR
-ssize_t
-CIFSSMBQAllEAs(const int xid, struct cifsTconInfo *tcon,
-		 const unsigned char *searchName,
-		 char *EAData, size_t buf_size,
-		 const struct nls_table *nls_codepage, int remap)
+/*
+ * Query the EAs of a file: all of them, or, if ea_name is set, just that
+ * one (SMB_INFO_QUERY_EAS_FROM_LIST). A copy of the FEA list from the
+ * response is returned in *plist. The list is known to lie within the
+ * response, but the entries in it still have to be checked by the caller
+ * (see cifs_fealist_names and cifs_fealist_value).
+ */
+static int
+cifs_query_eas(const int xid, struct cifsTconInfo *tcon,
+	       const unsigned char *searchName, const char *ea_name,
+	       struct fealist **plist, const struct nls_table *nls_codepage,
+	       int remap)
 {
 		/* BB assumes one setup word */
 	TRANSACTION2_QPI_REQ *pSMB = NULL;
 	TRANSACTION2_QPI_RSP *pSMBr = NULL;
 	int rc = 0;
 	int bytes_returned;
-	int name_len;
-	struct fea *temp_fea;
-	char *temp_ptr;
-	__u16 params, byte_count;
+	int name_len, ea_name_len = 0;
+	__u16 params, param_offset, byte_count, count = 0;
 
-	cFYI(1, ("In Query All EAs path %s", searchName));
-QAllEAsRetry:
+	cFYI(1, ("In Query EAs path %s ea %s", searchName,
+		 ea_name ? ea_name : "(all)"));
+	*plist = NULL;
+QEAsRetry:
 	rc = smb_init(SMB_COM_TRANSACTION2, 15, tcon, (void **) &pSMB,
 		      (void **) &pSMBr);
 	if (rc)
@@ -5306,26 +5653,46 @@ QAllEAsRetry:
 	}
 
 	params = 2 /* level */ + 4 /* reserved */ + name_len /* includes NUL */;
-	pSMB->TotalDataCount = 0;
+	param_offset = offsetof(struct smb_com_transaction2_qpi_req,
+				InformationLevel) - 4;
 	pSMB->MaxParameterCount = cpu_to_le16(2);
-	/* BB find exact max SMB PDU from sess structure BB */
-	pSMB->MaxDataCount = cpu_to_le16(4000);
+	pSMB->MaxDataCount = cpu_to_le16((tcon->ses->server->maxBuf -
+					  MAX_CIFS_HDR_SIZE) & 0xFFFFFF00);
 	pSMB->MaxSetupCount = 0;
 	pSMB->Reserved = 0;
 	pSMB->Flags = 0;
 	pSMB->Timeout = 0;
 	pSMB->Reserved2 = 0;
-	pSMB->ParameterOffset = cpu_to_le16(offsetof(
-	struct smb_com_transaction2_qpi_req, InformationLevel) - 4);
-	pSMB->DataCount = 0;
-	pSMB->DataOffset = 0;
+	pSMB->ParameterOffset = cpu_to_le16(param_offset);
 	pSMB->SetupCount = 1;
 	pSMB->Reserved3 = 0;
 	pSMB->SubCommand = cpu_to_le16(TRANS2_QUERY_PATH_INFORMATION);
 	byte_count = params + 1 /* pad */ ;
+
+	if (ea_name) {
+		/* a GEA list with the one name we want */
+		char *gea = (char *)&pSMB->hdr.Protocol + param_offset +
+			    params;
+
+		ea_name_len = strnlen(ea_name, 255);
+		count = 4 /* list len */ + 1 /* name len */ + ea_name_len + 1;
+		put_unaligned_le32(count, gea);
+		gea[4] = (__u8)ea_name_len;
+		/* EA names are always ASCII */
+		memcpy(gea + 5, ea_name, ea_name_len);
+		gea[5 + ea_name_len] = 0;
+		pSMB->DataOffset = cpu_to_le16(param_offset + params);
+		pSMB->InformationLevel =
+			cpu_to_le16(SMB_INFO_QUERY_EAS_FROM_LIST);
+	} else {
+		pSMB->DataOffset = 0;
+		pSMB->InformationLevel = cpu_to_le16(SMB_INFO_QUERY_ALL_EAS);
+	}
+	pSMB->DataCount = cpu_to_le16(count);
+	pSMB->TotalDataCount = pSMB->DataCount;
+	byte_count += count;
 	pSMB->TotalParameterCount = cpu_to_le16(params);
 	pSMB->ParameterCount = pSMB->TotalParameterCount;
-	pSMB->InformationLevel = cpu_to_le16(SMB_INFO_QUERY_ALL_EAS);
 	pSMB->Reserved4 = 0;
 	pSMB->hdr.smb_buf_length += byte_count;
 	pSMB->ByteCount = cpu_to_le16(byte_count);
@@ -5333,240 +5700,188 @@ QAllEAsRetry:
 	rc = SendReceive(xid, tcon->ses, (struct smb_hdr *) pSMB,
 			 (struct smb_hdr *) pSMBr, &bytes_returned, 0);
 	if (rc) {
-		cFYI(1, ("Send error in QueryAllEAs = %d", rc));
+		cFYI(1, ("Send error in Query EAs = %d", rc));
 	} else {		/* decode response */
 		rc = validate_t2((struct smb_t2_rsp *)pSMBr);
 
-		/* BB also check enough total bytes returned */
-		/* BB we need to improve the validity checking
-		of these trans2 responses */
 		if (rc || (pSMBr->ByteCount < 4))
 			rc = -EIO;	/* bad smb */
-	   /* else if (pFindData){
-			memcpy((char *) pFindData,
-			       (char *) &pSMBr->hdr.Protocol +
-			       data_offset, kl);
-		}*/ else {
-			/* check that length of list is not more than bcc */
-			/* check that each entry does not go beyond length
-			   of list */
-			/* check that each element of each entry does not
-			   go beyond end of list */
+		else {
 			__u16 data_offset = le16_to_cpu(pSMBr->t2.DataOffset);
+			__u16 data_count = le16_to_cpu(pSMBr->t2.DataCount);
 			struct fealist *ea_response_data;
-			rc = 0;
-			/* validate_trans2_offsets() */
-			/* BB check if start of smb + data_offset > &bcc+ bcc */
+			__u32 list_len;
+
 			ea_response_data = (struct fealist *)
 				(((char *) &pSMBr->hdr.Protocol) +
 				data_offset);
-			name_len = le32_to_cpu(ea_response_data->list_len);
-			cFYI(1, ("ea length %d", name_len));
-			if (name_len <= 8) {
-			/* returned EA size zeroed at top of function */
-				cFYI(1, ("empty EA list returned from server"));
-			} else {
-				/* account for ea list len */
-				name_len -= 4;
-				temp_fea = ea_response_data->list;
-				temp_ptr = (char *)temp_fea;
-				while (name_len > 0) {
-					__u16 value_len;
-					name_len -= 4;
-					temp_ptr += 4;
-					rc += temp_fea->name_len;
-				/* account for prefix user. and trailing null */
-					rc = rc + 5 + 1;
-					if (rc < (int)buf_size) {
-						memcpy(EAData, "user.", 5);
-						EAData += 5;
-						memcpy(EAData, temp_ptr,
-						       temp_fea->name_len);
-						EAData += temp_fea->name_len;
-						/* null terminate name */
-						*EAData = 0;
-						EAData = EAData + 1;
-					} else if (buf_size == 0) {
-						/* skip copy - calc size only */
-					} else {
-						/* stop before overrun buffer */
-						rc = -ERANGE;
-						break;
-					}
-					name_len -= temp_fea->name_len;
-					temp_ptr += temp_fea->name_len;
-					/* account for trailing null */
-					name_len--;
-					temp_ptr++;
-					value_len =
-					      le16_to_cpu(temp_fea->value_len);
-					name_len -= value_len;
-					temp_ptr += value_len;
-					/* BB check that temp_ptr is still
-					      within the SMB BB*/
-
-					/* no trailing null to account for
-					   in value len */
-					/* go on to next EA */
-					temp_fea = (struct fea *)temp_ptr;
-				}
+			if (data_count < 4) {
+				rc = -EIO;
+				goto QEAsOut;
 			}
+			/* the list can not be longer than the data returned */
+			list_len = le32_to_cpu(ea_response_data->list_len);
+			cFYI(1, ("ea length %d", list_len));
+			if (list_len > data_count)
+				list_len = data_count;
+			else if (list_len < 4)
+				list_len = 4;
+
+			*plist = kmalloc(list_len, GFP_KERNEL);
+			if (*plist == NULL) {
+				rc = -ENOMEM;
+				goto QEAsOut;
+			}
+			memcpy(*plist, ea_response_data, list_len);
+			(*plist)->list_len = cpu_to_le32(list_len);
 		}
 	}
+QEAsOut:
 	cifs_buf_release(pSMB);
 	if (rc == -EAGAIN)
-		goto QAllEAsRetry;
+		goto QEAsRetry;
 
-	return (ssize_t)rc;
+	return rc;
 }
 
-ssize_t CIFSSMBQueryEA(const int xid, struct cifsTconInfo *tcon,
-		const unsigned char *searchName, const unsigned char *ea_name,
-		unsigned char *ea_value, size_t buf_size,
-		const struct nls_table *nls_codepage, int remap)
+/*
+ * Walk an FEA list returned by cifs_query_eas, returning the next entry
+ * (or the first, if fea is NULL) or NULL at the end of the list or if the
+ * entry would overrun it.
+ */
+static struct fea *
+cifs_fealist_next(const struct fealist *list, struct fea *fea)
 {
-	TRANSACTION2_QPI_REQ *pSMB = NULL;
-	TRANSACTION2_QPI_RSP *pSMBr = NULL;
-	int rc = 0;
-	int bytes_returned;
-	int name_len;
-	struct fea *temp_fea;
-	char *temp_ptr;
-	__u16 params, byte_count;
+	char *end = (char *)list + le32_to_cpu(list->list_len);
+	char *p;
 
-	cFYI(1, ("In Query EA path %s", searchName));
-QEARetry:
-	rc = smb_init(SMB_COM_TRANSACTION2, 15, tcon, (void **) &pSMB,
-		      (void **) &pSMBr);
-	if (rc)
-		return rc;
+	if (fea == NULL)
+		p = (char *)list->list;
+	else
+		p = fea->name + fea->name_len + 1 +
+		    le16_to_cpu(fea->value_len);
+
+	/* entry header, name plus trailing null and value must all fit */
+	if (p + 4 > end)
+		return NULL;
+	fea = (struct fea *)p;
+	if (fea->name + fea->name_len + 1 + le16_to_cpu(fea->value_len) > end)
+		return NULL;
+	return fea;
+}
 
-	if (pSMB->hdr.Flags2 & SMBFLG2_UNICODE) {
-		name_len =
-		    cifsConvertToUCS((__le16 *) pSMB->FileName, searchName,
-				     PATH_MAX, nls_codepage, remap);
-		name_len++;	/* trailing null */
-		name_len *= 2;
-	} else {	/* BB improve the check for buffer overruns BB */
-		name_len = strnlen(searchName, PATH_MAX);
-		name_len++;	/* trailing null */
-		strncpy(pSMB->FileName, searchName, name_len);
+/*
+ * Return the names in an FEA list as "user." xattr names in EAData, or just
+ * the size needed if buf_size is 0
+ */
+ssize_t
+cifs_fealist_names(const struct fealist *list, char *EAData, size_t buf_size)
+{
+	struct fea *fea = NULL;
+	ssize_t rc = 0;
+
+	while ((fea = cifs_fealist_next(list, fea)) != NULL) {
+		/* account for prefix user. and trailing null */
+		size_t len = 5 + fea->name_len + 1;
+
+		if (buf_size == 0) {
+			/* skip copy - calc size only */
+		} else if (rc + len > buf_size) {
+			/* stop before overrun buffer */
+			return -ERANGE;
+		} else {
+			memcpy(EAData + rc, "user.", 5);
+			memcpy(EAData + rc + 5, fea->name, fea->name_len);
+			/* null terminate name */
+			EAData[rc + len - 1] = 0;
+		}
+		rc += len;
 	}
+	return rc;
+}
 
-	params = 2 /* level */ + 4 /* reserved */ + name_len /* includes NUL */;
-	pSMB->TotalDataCount = 0;
-	pSMB->MaxParameterCount = cpu_to_le16(2);
-	/* BB find exact max SMB PDU from sess structure BB */
-	pSMB->MaxDataCount = cpu_to_le16(4000);
-	pSMB->MaxSetupCount = 0;
-	pSMB->Reserved = 0;
-	pSMB->Flags = 0;
-	pSMB->Timeout = 0;
-	pSMB->Reserved2 = 0;
-	pSMB->ParameterOffset = cpu_to_le16(offsetof(
-		struct smb_com_transaction2_qpi_req, InformationLevel) - 4);
-	pSMB->DataCount = 0;
-	pSMB->DataOffset = 0;
-	pSMB->SetupCount = 1;
-	pSMB->Reserved3 = 0;
-	pSMB->SubCommand = cpu_to_le16(TRANS2_QUERY_PATH_INFORMATION);
-	byte_count = params + 1 /* pad */ ;
-	pSMB->TotalParameterCount = cpu_to_le16(params);
-	pSMB->ParameterCount = pSMB->TotalParameterCount;
-	pSMB->InformationLevel = cpu_to_le16(SMB_INFO_QUERY_ALL_EAS);
-	pSMB->Reserved4 = 0;
-	pSMB->hdr.smb_buf_length += byte_count;
-	pSMB->ByteCount = cpu_to_le16(byte_count);
-
-	rc = SendReceive(xid, tcon->ses, (struct smb_hdr *) pSMB,
-			 (struct smb_hdr *) pSMBr, &bytes_returned, 0);
-	if (rc) {
-		cFYI(1, ("Send error in Query EA = %d", rc));
-	} else {		/* decode response */
-		rc = validate_t2((struct smb_t2_rsp *)pSMBr);
-
-		/* BB also check enough total bytes returned */
-		/* BB we need to improve the validity checking
-		of these trans2 responses */
-		if (rc || (pSMBr->ByteCount < 4))
-			rc = -EIO;	/* bad smb */
-	   /* else if (pFindData){
-			memcpy((char *) pFindData,
-			       (char *) &pSMBr->hdr.Protocol +
-			       data_offset, kl);
-		}*/ else {
-			/* check that length of list is not more than bcc */
-			/* check that each entry does not go beyond length
-			   of list */
-			/* check that each element of each entry does not
-			   go beyond end of list */
-			__u16 data_offset = le16_to_cpu(pSMBr->t2.DataOffset);
-			struct fealist *ea_response_data;
-			rc = -ENODATA;
-			/* validate_trans2_offsets() */
-			/* BB check if start of smb + data_offset > &bcc+ bcc*/
-			ea_response_data = (struct fealist *)
-				(((char *) &pSMBr->hdr.Protocol) +
-				data_offset);
-			name_len = le32_to_cpu(ea_response_data->list_len);
-			cFYI(1, ("ea length %d", name_len));
-			if (name_len <= 8) {
-			/* returned EA size zeroed at top of function */
-				cFYI(1, ("empty EA list returned from server"));
-			} else {
-				/* account for ea list len */
-				name_len -= 4;
-				temp_fea = ea_response_data->list;
-				temp_ptr = (char *)temp_fea;
-				/* loop through checking if we have a matching
-				name and then return the associated value */
-				while (name_len > 0) {
-					__u16 value_len;
-					name_len -= 4;
-					temp_ptr += 4;
-					value_len =
-					      le16_to_cpu(temp_fea->value_len);
-				/* BB validate that value_len falls within SMB,
-				even though maximum for name_len is 255 */
-					if (memcmp(temp_fea->name, ea_name,
-						  temp_fea->name_len) == 0) {
-						/* found a match */
-						rc = value_len;
-				/* account for prefix user. and trailing null */
-						if (rc <= (int)buf_size) {
-							memcpy(ea_value,
-								temp_fea->name+temp_fea->name_len+1,
-								rc);
-							/* ea values, unlike ea
-							   names, are not null
-							   terminated */
-						} else if (buf_size == 0) {
-						/* skip copy - calc size only */
-						} else {
-						/* stop before overrun buffer */
-							rc = -ERANGE;
-						}
-						break;
-					}
-					name_len -= temp_fea->name_len;
-					temp_ptr += temp_fea->name_len;
-					/* account for trailing null */
-					name_len--;
-					temp_ptr++;
-					name_len -= value_len;
-					temp_ptr += value_len;
-					/* No trailing null to account for in
-					   value_len.  Go on to next EA */
-					temp_fea = (struct fea *)temp_ptr;
-				}
-			}
+/*
+ * Look up an EA value in an FEA list, or just return its size if buf_size is
+ * 0. Windows stores EA names in upper case, so they compare caselessly.
+ */
+ssize_t
+cifs_fealist_value(const struct fealist *list, const char *ea_name,
+		   void *ea_value, size_t buf_size)
+{
+	size_t ea_name_len = strnlen(ea_name, 255);
+	struct fea *fea = NULL;
+	ssize_t rc;
+
+	while ((fea = cifs_fealist_next(list, fea)) != NULL) {
+		if (fea->name_len != ea_name_len ||
+		    strnicmp(fea->name, ea_name, ea_name_len))
+			continue;
+		/* an EA with no value does not exist (queried by name) */
+		rc = le16_to_cpu(fea->value_len);
+		if (rc == 0)
+			return -ENODATA;
+		if (buf_size == 0) {
+			/* skip copy - calc size only */
+		} else if ((size_t)rc > buf_size) {
+			/* stop before overrun buffer */
+			return -ERANGE;
+		} else {
+			/* ea values, unlike ea names, are not null
+			   terminated */
+			memcpy(ea_value, fea->name + fea->name_len + 1, rc);
 		}
+		return rc;
 	}
-	cifs_buf_release(pSMB);
-	if (rc == -EAGAIN)
-		goto QEARetry;
+	return -ENODATA;
+}
 
-	return (ssize_t)rc;
+int
+CIFSSMBQAllEAsList(const int xid, struct cifsTconInfo *tcon,
+		   const unsigned char *searchName, struct fealist **plist,
+		   const struct nls_table *nls_codepage, int remap)
+{
+	return cifs_query_eas(xid, tcon, searchName, NULL, plist,
+			      nls_codepage, remap);
+}
+
+ssize_t
+CIFSSMBQAllEAs(const int xid, struct cifsTconInfo *tcon,
+		 const unsigned char *searchName,
+		 char *EAData, size_t buf_size,
+		 const struct nls_table *nls_codepage, int remap)
+{
+	struct fealist *list;
+	ssize_t rc;
+
+	rc = cifs_query_eas(xid, tcon, searchName, NULL, &list,
+			    nls_codepage, remap);
+	if (rc)
+		return rc;
+	rc = cifs_fealist_names(list, EAData, buf_size);
+	kfree(list);
+	return rc;
+}
+
+ssize_t CIFSSMBQueryEA(const int xid, struct cifsTconInfo *tcon,
+		const unsigned char *searchName, const unsigned char *ea_name,
+		unsigned char *ea_value, size_t buf_size,
+		const struct nls_table *nls_codepage, int remap)
+{
+	struct fealist *list;
+	ssize_t rc;
+
+	/* ask for just this EA, falling back to all of them for servers
+	   which do not support querying EAs by name */
+	rc = cifs_query_eas(xid, tcon, searchName, ea_name, &list,
+			    nls_codepage, remap);
+	if (rc == -EOPNOTSUPP || rc == -EINVAL)
+		rc = cifs_query_eas(xid, tcon, searchName, NULL, &list,
+				    nls_codepage, remap);
+	if (rc)
+		return rc;
+	rc = cifs_fealist_value(list, ea_name, ea_value, buf_size);
+	kfree(list);
+	return rc;
 }
 
 int
@@ -47,10 +47,18 @@
 #include "nterr.h"
 #include "rfc1002pdu.h"
 #include "cn_cifs.h"
+#include "dfs_cache.h"
+#include "dns_resolve.h"
+#include "cifs_trace.h"
 
 #define CIFS_PORT 445
 #define RFC1001_PORT 139
 
+/* how long to wait for each address to answer before trying the next */
+#define CIFS_CONNECT_TIMEOUT	(20 * HZ)
+/* how many of the addresses of a server name to try */
+#define CIFS_MAX_SERVER_ADDRS	8
+
 extern void SMBNTencrypt(unsigned char *passwd, unsigned char *c8,
 			 unsigned char *p24);
 
@@ -96,15 +104,82 @@ struct smb_vol {
 	bool noblocksnd:1;
 	bool noautotune:1;
 	bool nostrictsync:1; /* do not force expensive SMBflush on every sync */
+	bool append_cache:1; /* keep cached data below old EOF on growth */
 	unsigned int rsize;
 	unsigned int wsize;
+	unsigned int dirty_ratio;
 	unsigned int sockopt;
 	unsigned short int port;
+	int cifsd_node;
 	char *prepath;
 };
 
 static int ipv4_connect(struct TCP_Server_Info *server);
 static int ipv6_connect(struct TCP_Server_Info *server);
+static int cifs_connect_server(struct TCP_Server_Info *server);
+
+/* restrict a cifsd thread to the cpus of a NUMA node */
+static void
+cifs_set_cifsd_node(struct task_struct *tsk, int node)
+{
+	if (node < 0)
+		return;
+	if (node >= nr_node_ids || !node_online(node)) {
+		cERROR(1, ("cifsdnode %d is not an online node", node));
+		return;
+	}
+	set_cpus_allowed_ptr(tsk, cpumask_of_node(node));
+}
+
+/*
+ * With cifsdnode=auto, note which node the network stack processes the
+ * socket's packets on (that of the cpu the NIC interrupts), so that cifsd
+ * can run there and receive into memory local to it.
+ */
+static void
+cifs_data_ready(struct sock *sk, int bytes)
+{
+	struct TCP_Server_Info *server;
+	void (*data_ready)(struct sock *, int) = NULL;
+
+	read_lock(&sk->sk_callback_lock);
+	server = sk->sk_user_data;
+	if (server) {
+		server->rx_node = numa_node_id();
+		data_ready = server->sk_data_ready;
+	}
+	read_unlock(&sk->sk_callback_lock);
+	if (data_ready)
+		data_ready(sk, bytes);
+}
+
+static void
+cifs_set_sock_callbacks(struct TCP_Server_Info *server, struct socket *sock)
+{
+	struct sock *sk = sock->sk;
+
+	if (server->cifsd_node != CIFSD_NODE_AUTO)
+		return;
+	write_lock_bh(&sk->sk_callback_lock);
+	sk->sk_user_data = server;
+	server->sk_data_ready = sk->sk_data_ready;
+	sk->sk_data_ready = cifs_data_ready;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void
+cifs_restore_sock_callbacks(struct TCP_Server_Info *server,
+			    struct socket *sock)
+{
+	struct sock *sk = sock->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	if (sk->sk_user_data == server) {
+		sk->sk_data_ready = server->sk_data_ready;
+		sk->sk_user_data = NULL;
+	}
+	write_unlock_bh(&sk->sk_callback_lock);
+}
 
 /*
  * cifs tcp session reconnection
@@ -122,6 +197,7 @@ cifs_reconnect(struct TCP_Server_Info *server)
 	struct cifsSesInfo *ses;
 	struct cifsTconInfo *tcon;
 	struct mid_q_entry *mid_entry;
+	bool target_down = false;
 
 	spin_lock(&GlobalMid_Lock);
 	if (server->tcpStatus == CifsExiting) {
@@ -133,6 +209,9 @@ cifs_reconnect(struct TCP_Server_Info *server)
 		server->tcpStatus = CifsNeedReconnect;
 	spin_unlock(&GlobalMid_Lock);
 	server->maxBuf = 0;
+#ifdef CONFIG_CIFS_STATS2
+	server->reconnect_start = ktime_get();
+#endif
 
 	cFYI(1, ("Reconnecting tcp session"));
 
@@ -158,6 +237,7 @@ cifs_reconnect(struct TCP_Server_Info *server)
 		cFYI(1, ("Post shutdown state: 0x%x Flags: 0x%lx",
 			server->ssocket->state,
 			server->ssocket->flags));
+		cifs_restore_sock_callbacks(server, server->ssocket);
 		sock_release(server->ssocket);
 		server->ssocket = NULL;
 	}
@@ -181,15 +261,22 @@ cifs_reconnect(struct TCP_Server_Info *server)
 	while ((server->tcpStatus != CifsExiting) &&
 	       (server->tcpStatus != CifsGood)) {
 		try_to_freeze();
-		if (server->addr.sockAddr6.sin6_family == AF_INET6)
-			rc = ipv6_connect(server);
-		else
-			rc = ipv4_connect(server);
+		rc = cifs_connect_server(server);
+		trace_cifs_reconnect(server, rc);
 		if (rc) {
 			cFYI(1, ("reconnect error %d", rc));
+			/* point new DFS mounts elsewhere while it is down */
+			if (!target_down) {
+				dfs_cache_target_down(server->hostname);
+				target_down = true;
+			}
 			msleep(3000);
 		} else {
 			atomic_inc(&tcpSesReconnectCount);
+#ifdef CONFIG_CIFS_STATS2
+			cifs_hist_add_usecs(&server->reconnect_time,
+					    server->reconnect_start);
+#endif
 			spin_lock(&GlobalMid_Lock);
 			if (server->tcpStatus != CifsExiting)
 				server->tcpStatus = CifsGood;
@@ -199,6 +286,10 @@ cifs_reconnect(struct TCP_Server_Info *server)
 			wake_up(&server->response_q);
 		}
 	}
+
+	/* bring sessions, tcons and open files back in the background */
+	if (server->tcpStatus == CifsGood)
+		slow_work_enqueue(&server->reconnect_work);
 	return rc;
 }
 
@@ -336,6 +427,13 @@ cifs_demultiplex_thread(struct TCP_Server_Info *server)
 	bool isLargeBuf = false;
 	bool isMultiRsp;
 	int reconnect;
+	int cifsd_node = -1;
+	__u8 rsp_cmd = 0;
+	__u16 rsp_mid = 0, rsp_tid = 0;
+	s64 rsp_usecs = 0;
+#ifdef CONFIG_CIFS_STATS2
+	unsigned int rsp_req_bytes = 0;
+#endif
 
 	current->flags |= PF_MEMALLOC;
 	cFYI(1, ("Demultiplex PID: %d", task_pid_nr(current)));
@@ -349,6 +447,13 @@ cifs_demultiplex_thread(struct TCP_Server_Info *server)
 	while (server->tcpStatus != CifsExiting) {
 		if (try_to_freeze())
 			continue;
+		/* follow the node the socket's packets arrive on */
+		if (server->cifsd_node == CIFSD_NODE_AUTO &&
+		    server->rx_node != cifsd_node && server->rx_node >= 0) {
+			cifsd_node = server->rx_node;
+			cFYI(1, ("cifsd moving to node %d", cifsd_node));
+			cifs_set_cifsd_node(current, cifsd_node);
+		}
 		if (bigbuf == NULL) {
 			bigbuf = cifs_buf_get();
 			if (!bigbuf) {
@@ -606,8 +711,19 @@ incomplete_rcv:
 multi_t2_fnd:
 				task_to_wake = mid_entry->tsk;
 				mid_entry->midState = MID_RESPONSE_RECEIVED;
+				/* the buffers may be freed once we unlock */
+				rsp_cmd = mid_entry->command;
+				rsp_mid = mid_entry->mid;
+				rsp_tid = smb_buffer->Tid;
+				rsp_usecs = ktime_us_delta(ktime_get(),
+						mid_entry->when_start);
 #ifdef CONFIG_CIFS_STATS2
 				mid_entry->when_received = jiffies;
+				rsp_req_bytes = mid_entry->req_bytes;
+				/* the tcon may be gone once the waiter runs */
+				if (mid_entry->tcon_latency)
+					cifs_hist_add(mid_entry->tcon_latency,
+						rsp_usecs > 0 ? rsp_usecs : 0);
 #endif
 				/* so we do not time out requests to  server
 				which is still responding (since server could
@@ -618,6 +734,12 @@ multi_t2_fnd:
 		}
 		spin_unlock(&GlobalMid_Lock);
 		if (task_to_wake) {
+			trace_cifs_receive(server, rsp_tid, rsp_mid, rsp_cmd,
+					   length, rsp_usecs);
+#ifdef CONFIG_CIFS_STATS2
+			cifs_hist_record_rsp(server, rsp_cmd, rsp_usecs,
+					     rsp_req_bytes, length);
+#endif
 			/* Was previous buf put in mpx struct for multi-rsp? */
 			if (!isMultiRsp) {
 				/* smb buffer will be freed by user thread */
@@ -670,6 +792,7 @@ multi_t2_fnd:
 	msleep(125);
 
 	if (server->ssocket) {
+		cifs_restore_sock_callbacks(server, csocket);
 		sock_release(csocket);
 		server->ssocket = NULL;
 	}
@@ -745,6 +868,17 @@ multi_t2_fnd:
 	}
 	read_unlock(&cifs_tcp_ses_lock);
 
+	/* the reconnect job must be done with the server before we free it */
+	slow_work_cancel(&server->reconnect_work);
+
+	/*
+	 * So must cifsoplockd. No breaks can be queued, they hold references
+	 * to our mounts, but the last of those may have been dropped by
+	 * cifsoplockd itself, which got us here, so it is stopped from this
+	 * thread rather than from cifs_put_tcp_session.
+	 */
+	kthread_stop(server->oplock_tsk);
+
 	kfree(server->hostname);
 	task_to_wake = xchg(&server->tsk, NULL);
 	kfree(server);
@@ -807,6 +941,7 @@ cifs_parse_mount_options(char *options, const char *devname,
 	short int override_gid = -1;
 	bool uid_specified = false;
 	bool gid_specified = false;
+	long node;
 
 	separator[0] = ',';
 	separator[1] = 0;
@@ -839,6 +974,9 @@ cifs_parse_mount_options(char *options, const char *devname,
 	vol->posix_paths = 1;
 	/* default to using server inode numbers where available */
 	vol->server_ino = 1;
+	vol->cifsd_node = CIFSD_NODE_ANY;
+	/* no limit beyond the global one on this mount's dirty pages */
+	vol->dirty_ratio = 100;
 
 	if (!options)
 		return 1;
@@ -1141,6 +1279,11 @@ cifs_parse_mount_options(char *options, const char *devname,
 				vol->wsize =
 					simple_strtoul(value, &value, 0);
 			}
+		} else if (strnicmp(data, "dirtyratio", 10) == 0) {
+			if (value && *value) {
+				vol->dirty_ratio =
+					simple_strtoul(value, &value, 0);
+			}
 		} else if (strnicmp(data, "sockopt", 5) == 0) {
 			if (value && *value) {
 				vol->sockopt =
@@ -1208,6 +1351,23 @@ cifs_parse_mount_options(char *options, const char *devname,
 			/* ignore */
 		} else if (strnicmp(data, "noblocksend", 11) == 0) {
 			vol->noblocksnd = 1;
+		} else if (strnicmp(data, "cifsdnode", 9) == 0) {
+			if (!value || !*value) {
+				printk(KERN_WARNING "CIFS: cifsdnode needs a "
+					"node number or auto\n");
+				return 1;
+			}
+			if (strnicmp(value, "auto", 5) == 0) {
+				vol->cifsd_node = CIFSD_NODE_AUTO;
+			} else if (strict_strtol(value, 0, &node) ||
+				   node < 0 || node >= nr_node_ids ||
+				   !node_online(node)) {
+				printk(KERN_WARNING "CIFS: cifsdnode %s is not "
+					"an online node\n", value);
+				return 1;
+			} else {
+				vol->cifsd_node = node;
+			}
 		} else if (strnicmp(data, "noautotune", 10) == 0) {
 			vol->noautotune = 1;
 		} else if ((strnicmp(data, "suid", 4) == 0) ||
@@ -1295,6 +1455,10 @@ cifs_parse_mount_options(char *options, const char *devname,
 			vol->nostrictsync = 1;
 		} else if (strnicmp(data, "strictsync", 10) == 0) {
 			vol->nostrictsync = 0;
+		} else if (strnicmp(data, "noappendcache", 13) == 0) {
+			vol->append_cache = 0;
+		} else if (strnicmp(data, "appendcache", 11) == 0) {
+			vol->append_cache = 1;
 		} else if (strnicmp(data, "serverino", 7) == 0) {
 			vol->server_ino = 1;
 		} else if (strnicmp(data, "noserverino", 9) == 0) {
@@ -1514,6 +1678,8 @@ cifs_get_tcp_session(struct smb_vol *volume_info)
 
 	tcp_ses->noblocksnd = volume_info->noblocksnd;
 	tcp_ses->noautotune = volume_info->noautotune;
+	tcp_ses->cifsd_node = volume_info->cifsd_node;
+	tcp_ses->rx_node = -1;
 	atomic_set(&tcp_ses->inFlight, 0);
 	init_waitqueue_head(&tcp_ses->response_q);
 	init_waitqueue_head(&tcp_ses->request_q);
@@ -1526,6 +1692,10 @@ cifs_get_tcp_session(struct smb_vol *volume_info)
 	tcp_ses->sequence_number = 0;
 	INIT_LIST_HEAD(&tcp_ses->tcp_ses_list);
 	INIT_LIST_HEAD(&tcp_ses->smb_ses_list);
+	vslow_work_init(&tcp_ses->reconnect_work, &cifs_reconnect_ops);
+	spin_lock_init(&tcp_ses->oplock_break_lock);
+	INIT_LIST_HEAD(&tcp_ses->oplock_break_q);
+	atomic_set(&tcp_ses->oplock_breaks_pending, 0);
 
 	/*
 	 * at this point we are the only ones with the pointer
@@ -1542,31 +1712,42 @@ cifs_get_tcp_session(struct smb_vol *volume_info)
 		sin_server6->sin6_port = htons(volume_info->port);
 		memcpy(&tcp_ses->addr.sockAddr6, sin_server6,
 			sizeof(struct sockaddr_in6));
-		rc = ipv6_connect(tcp_ses);
 	} else {
 		sin_server->sin_port = htons(volume_info->port);
 		memcpy(&tcp_ses->addr.sockAddr, sin_server,
 			sizeof(struct sockaddr_in));
-		rc = ipv4_connect(tcp_ses);
 	}
+	rc = cifs_connect_server(tcp_ses);
 	if (rc < 0) {
 		cERROR(1, ("Error connecting to socket. Aborting operation"));
 		goto out_err;
 	}
 
+	/* started first, cifsd may hand it a break as soon as it runs */
+	tcp_ses->oplock_tsk = kthread_run(cifs_oplock_break_thread, tcp_ses,
+					  "cifsoplockd");
+	if (IS_ERR(tcp_ses->oplock_tsk)) {
+		rc = PTR_ERR(tcp_ses->oplock_tsk);
+		cERROR(1, ("error %d create cifsoplockd thread", rc));
+		goto out_err;
+	}
+
 	/*
 	 * since we're in a cifs function already, we know that
 	 * this will succeed. No need for try_module_get().
 	 */
 	__module_get(THIS_MODULE);
-	tcp_ses->tsk = kthread_run((void *)(void *)cifs_demultiplex_thread,
+	tcp_ses->tsk = kthread_create((void *)(void *)cifs_demultiplex_thread,
 				  tcp_ses, "cifsd");
 	if (IS_ERR(tcp_ses->tsk)) {
 		rc = PTR_ERR(tcp_ses->tsk);
 		cERROR(1, ("error %d create cifsd thread", rc));
 		module_put(THIS_MODULE);
+		kthread_stop(tcp_ses->oplock_tsk);
 		goto out_err;
 	}
+	cifs_set_cifsd_node(tcp_ses->tsk, tcp_ses->cifsd_node);
+	wake_up_process(tcp_ses->tsk);
 
 	/* thread spawned, put it on the list */
 	write_lock(&cifs_tcp_ses_lock);
@@ -1579,8 +1760,11 @@ out_err:
 	if (tcp_ses) {
 		if (!IS_ERR(tcp_ses->hostname))
 			kfree(tcp_ses->hostname);
-		if (tcp_ses->ssocket)
+		if (tcp_ses->ssocket) {
+			cifs_restore_sock_callbacks(tcp_ses,
+						    tcp_ses->ssocket);
 			sock_release(tcp_ses->ssocket);
+		}
 		kfree(tcp_ses);
 	}
 	return ERR_PTR(rc);
@@ -1652,7 +1836,7 @@ cifs_find_tcon(struct cifsSesInfo *ses, const char *unc)
 	return NULL;
 }
 
-static void
+void
 cifs_put_tcon(struct cifsTconInfo *tcon)
 {
 	int xid;
@@ -1675,6 +1859,74 @@ cifs_put_tcon(struct cifsTconInfo *tcon)
 	cifs_put_smb_ses(ses);
 }
 
+/*
+ * Once the socket to a server is back, reestablish its smb sessions and
+ * tree connections right away and reopen their files in bulk, rather than
+ * leaving each of them to be redone by whichever request next needs it.
+ */
+static void
+cifs_reconnect_work(struct slow_work *work)
+{
+	struct TCP_Server_Info *server = container_of(work,
+					struct TCP_Server_Info, reconnect_work);
+	struct cifsSesInfo *ses;
+	struct cifsTconInfo *tcon;
+	struct cifsTconInfo **tcons;
+	unsigned int i, num = 0, max_num = 0;
+	int rc;
+
+	read_lock(&cifs_tcp_ses_lock);
+	list_for_each_entry(ses, &server->smb_ses_list, smb_ses_list)
+		list_for_each_entry(tcon, &ses->tcon_list, tcon_list)
+			max_num++;
+	read_unlock(&cifs_tcp_ses_lock);
+
+	if (max_num == 0)
+		return;
+
+	tcons = kcalloc(max_num, sizeof(struct cifsTconInfo *), GFP_KERNEL);
+	if (tcons == NULL)
+		return;
+
+	/* pin the tcons (and so their sessions) while we work on them */
+	write_lock(&cifs_tcp_ses_lock);
+	list_for_each_entry(ses, &server->smb_ses_list, smb_ses_list) {
+		list_for_each_entry(tcon, &ses->tcon_list, tcon_list) {
+			if (num == max_num)
+				break;
+			if (tcon->tidStatus == CifsExiting)
+				continue;
+			++tcon->tc_count;
+			tcons[num++] = tcon;
+		}
+	}
+	write_unlock(&cifs_tcp_ses_lock);
+
+	for (i = 0; i < num; i++) {
+		tcon = tcons[i];
+		/* do not sit out another reconnect here, callers will */
+		if (server->tcpStatus == CifsGood) {
+			rc = cifs_reconnect_tcon(tcon,
+						 SMB_COM_TREE_CONNECT_ANDX);
+			cFYI(1, ("reconnect of tcon %s rc %d",
+				 tcon->treeName, rc));
+			if (rc == 0)
+				cifs_reopen_tcon_files(tcon);
+		}
+		cifs_put_tcon(tcon);
+	}
+	kfree(tcons);
+#ifdef CONFIG_CIFS_STATS2
+	if (server->tcpStatus == CifsGood)
+		cifs_hist_add_usecs(&server->recover_time,
+				    server->reconnect_start);
+#endif
+}
+
+const struct slow_work_ops cifs_reconnect_ops = {
+	.execute	= cifs_reconnect_work,
+};
+
 int
 get_dfs_path(int xid, struct cifsSesInfo *pSesInfo, const char *old_path,
 	     const struct nls_table *nls_codepage, unsigned int *pnum_referrals,
@@ -1686,6 +1938,9 @@ get_dfs_path(int xid, struct cifsSesInfo *pSesInfo, const char *old_path,
 	*pnum_referrals = 0;
 	*preferrals = NULL;
 
+	if (dfs_cache_find(old_path, preferrals, pnum_referrals) == 0)
+		return 0;
+
 	if (pSesInfo->ipc_tid == 0) {
 		temp_unc = kmalloc(2 /* for slashes */ +
 			strnlen(pSesInfo->serverName,
@@ -1706,8 +1961,8 @@ get_dfs_path(int xid, struct cifsSesInfo *pSesInfo, const char *old_path,
 	if (rc == 0)
 		rc = CIFSGetDFSRefer(xid, pSesInfo, old_path, preferrals,
 				     pnum_referrals, nls_codepage, remap);
-	/* BB map targetUNCs to dfs_info3 structures, here or
-		in CIFSGetDFSRefer BB */
+	if (rc == 0)
+		dfs_cache_update(old_path, *preferrals, *pnum_referrals);
 
 	return rc;
 }
@@ -1780,6 +2035,7 @@ ipv4_connect(struct TCP_Server_Info *server)
 		cFYI(1, ("Socket created"));
 		server->ssocket = socket;
 		socket->sk->sk_allocation = GFP_NOFS;
+		socket->sk->sk_sndtimeo = CIFS_CONNECT_TIMEOUT;
 		cifs_reclassify_socket4(socket);
 	}
 
@@ -1836,6 +2092,7 @@ ipv4_connect(struct TCP_Server_Info *server)
 	 */
 	socket->sk->sk_rcvtimeo = 7 * HZ;
 	socket->sk->sk_sndtimeo = 5 * HZ;
+	cifs_set_sock_callbacks(server, socket);
 
 	/* make the bufsizes depend on wsize/rsize and max requests */
 	if (server->noautotune) {
@@ -1933,6 +2190,7 @@ ipv6_connect(struct TCP_Server_Info *server)
 		cFYI(1, ("ipv6 Socket created"));
 		server->ssocket = socket;
 		socket->sk->sk_allocation = GFP_NOFS;
+		socket->sk->sk_sndtimeo = CIFS_CONNECT_TIMEOUT;
 		cifs_reclassify_socket6(socket);
 	}
 
@@ -1987,11 +2245,92 @@ ipv6_connect(struct TCP_Server_Info *server)
 	 */
 	socket->sk->sk_rcvtimeo = 7 * HZ;
 	socket->sk->sk_sndtimeo = 5 * HZ;
+	cifs_set_sock_callbacks(server, socket);
 	server->ssocket = socket;
 
 	return rc;
 }
 
+static int
+cifs_connect_addr(struct TCP_Server_Info *server)
+{
+	if (server->addr.sockAddr6.sin6_family == AF_INET6)
+		return ipv6_connect(server);
+	return ipv4_connect(server);
+}
+
+/*
+ * Connect to the server at the address we last reached it on and, if that
+ * fails, at the other addresses its host name resolves to. Host names are
+ * resolved through the DNS cache, so reconnects do not wait on an upcall.
+ * The address that answers is kept for next time.
+ */
+static int
+cifs_connect_server(struct TCP_Server_Info *server)
+{
+	struct sockaddr_storage *addrs;
+	struct sockaddr_in6 orig_addr;
+	struct sockaddr_storage tmp;
+	__be16 port;
+	int rc, i, num;
+
+	rc = cifs_connect_addr(server);
+	if (rc >= 0 || server->hostname == NULL ||
+	    cifs_convert_address(server->hostname, &tmp))
+		return rc;
+
+	addrs = kcalloc(CIFS_MAX_SERVER_ADDRS, sizeof(struct sockaddr_storage),
+			GFP_KERNEL);
+	if (addrs == NULL)
+		return rc;
+	num = dns_resolve_server_name_to_addrs(server->hostname, addrs,
+					       CIFS_MAX_SERVER_ADDRS);
+
+	memcpy(&orig_addr, &server->addr.sockAddr6, sizeof(orig_addr));
+	if (orig_addr.sin6_family == AF_INET6)
+		port = orig_addr.sin6_port;
+	else
+		port = server->addr.sockAddr.sin_port;
+
+	for (i = 0; i < num; i++) {
+		struct sockaddr_in *a4 = (struct sockaddr_in *)&addrs[i];
+		struct sockaddr_in6 *a6 = (struct sockaddr_in6 *)&addrs[i];
+
+		if (a6->sin6_family == AF_INET6) {
+			if (orig_addr.sin6_family == AF_INET6 &&
+			    ipv6_addr_equal(&a6->sin6_addr,
+					    &orig_addr.sin6_addr))
+				continue;
+			a6->sin6_port = port;
+		} else {
+			if (orig_addr.sin6_family == AF_INET &&
+			    a4->sin_addr.s_addr ==
+			    ((struct sockaddr_in *)&orig_addr)->sin_addr.s_addr)
+				continue;
+			a4->sin_port = port;
+		}
+
+		write_lock(&cifs_tcp_ses_lock);
+		memcpy(&server->addr.sockAddr6, a6, sizeof(struct sockaddr_in6));
+		write_unlock(&cifs_tcp_ses_lock);
+
+		rc = cifs_connect_addr(server);
+		if (rc >= 0) {
+			cFYI(1, ("%s: connected to alternate address %d of %s",
+				 __func__, i, server->hostname));
+			goto out;
+		}
+	}
+
+	/* none answered, start from the original address next time */
+	write_lock(&cifs_tcp_ses_lock);
+	memcpy(&server->addr.sockAddr6, &orig_addr, sizeof(orig_addr));
+	write_unlock(&cifs_tcp_ses_lock);
+out:
+	kfree(addrs);
+	return rc;
+}
+
 void reset_cifs_unix_caps(int xid, struct cifsTconInfo *tcon,
 			  struct super_block *sb, struct smb_vol *vol_info)
 {
@@ -2160,6 +2499,13 @@ static void setup_cifs_sb(struct smb_vol *pvolume_info,
 		/* Windows ME may prefer this */
 		cFYI(1, ("readsize set to minimum: 2048"));
 	}
+
+	if (pvolume_info->dirty_ratio == 0 || pvolume_info->dirty_ratio > 100) {
+		cERROR(1, ("dirtyratio %u out of range, using 100",
+			   pvolume_info->dirty_ratio));
+		cifs_sb->dirty_ratio = 100;
+	} else
+		cifs_sb->dirty_ratio = pvolume_info->dirty_ratio;
 	/* calculate prepath */
 	cifs_sb->prepath = pvolume_info->prepath;
 	if (cifs_sb->prepath) {
@@ -2195,6 +2541,8 @@ static void setup_cifs_sb(struct smb_vol *pvolume_info,
 		cifs_sb->mnt_cifs_flags |= CIFS_MOUNT_NO_BRL;
 	if (pvolume_info->nostrictsync)
 		cifs_sb->mnt_cifs_flags |= CIFS_MOUNT_NOSSYNC;
+	if (pvolume_info->append_cache)
+		cifs_sb->mnt_cifs_flags |= CIFS_MOUNT_APPEND_CACHE;
 	if (pvolume_info->mand_lock)
 		cifs_sb->mnt_cifs_flags |= CIFS_MOUNT_NOPOSIXBRL;
 	if (pvolume_info->cifs_acl)
@@ -2283,6 +2631,105 @@ build_unc_path_to_root(const struct smb_vol *volume_info,
 }
 #endif
 
+/*
+ * Requests made during mount whose results the mount does not need to go
+ * on are sent from slow_work threads, so that they are on the wire at the
+ * same time as the ones the mounting thread waits for.
+ */
+struct cifs_mount_async {
+	struct slow_work work;
+	bool ran;		/* fn has been called */
+	void (*fn)(int xid, struct cifs_mount_async *async);
+	struct cifsTconInfo *tcon;
+	char *path;		/* for a referral prefetch */
+	struct nls_table *nls;
+	int remap;
+};
+
+static void
+cifs_mount_async_run(struct cifs_mount_async *async)
+{
+	int xid;
+
+	xid = GetXid();
+	async->fn(xid, async);
+	_FreeXid(xid);
+	async->ran = true;
+}
+
+static void
+cifs_mount_async_work(struct slow_work *work)
+{
+	cifs_mount_async_run(container_of(work, struct cifs_mount_async,
+					  work));
+}
+
+static const struct slow_work_ops cifs_mount_async_ops = {
+	.execute	= cifs_mount_async_work,
+};
+
+static void
+cifs_mount_async_start(struct cifs_mount_async *async,
+		       void (*fn)(int xid, struct cifs_mount_async *async))
+{
+	async->fn = fn;
+	async->ran = false;
+	slow_work_init(&async->work, &cifs_mount_async_ops);
+	if (slow_work_enqueue(&async->work))
+		cifs_mount_async_run(async);	/* do it ourselves */
+}
+
+static void
+cifs_mount_async_wait(struct cifs_mount_async *async)
+{
+	if (async->fn) {
+		/* waits if it is running, takes it off the queue if not yet */
+		slow_work_cancel(&async->work);
+		if (!async->ran)
+			cifs_mount_async_run(async);
+		async->fn = NULL;
+	}
+}
+
+static void
+cifs_mount_qfs_device(int xid, struct cifs_mount_async *async)
+{
+	CIFSSMBQFSDeviceInfo(xid, async->tcon);
+}
+
+static void
+cifs_mount_qfs_attribute(int xid, struct cifs_mount_async *async)
+{
+	CIFSSMBQFSAttributeInfo(xid, async->tcon);
+}
+
+#ifdef CONFIG_CIFS_DFS_UPCALL
+/*
+ * Ask for the referral that the prefix path check will need if the path
+ * turns out to be below a DFS link, so that it is in the DFS cache by
+ * the time the check fails.
+ */
+static void
+cifs_mount_prefetch_referral(int xid, struct cifs_mount_async *async)
+{
+	struct dfs_info3_param *referrals = NULL;
+	unsigned int num_referrals = 0;
+
+	if (!get_dfs_path(xid, async->tcon->ses, async->path, async->nls,
+			  &num_referrals, &referrals, async->remap))
+		free_dfs_info_array(referrals, num_referrals);
+}
+#endif
+
+static void
+cifs_mount_phase(struct TCP_Server_Info *server, int phase, ktime_t *start)
+{
+#ifdef CONFIG_CIFS_STATS2
+	cifs_hist_add_usecs(&server->mount_time[phase], *start);
+	*start = ktime_get();
+#endif
+}
+
 int
 cifs_mount(struct super_block *sb, struct cifs_sb_info *cifs_sb,
 		char *mount_data_global, const char *devname)
@@ -2295,17 +2742,23 @@ cifs_mount(struct super_block *sb, struct cifs_sb_info *cifs_sb,
 	struct TCP_Server_Info *srvTcp;
 	char   *full_path;
 	char *mount_data = mount_data_global;
+	struct cifs_mount_async qfs_device, qfs_attribute;
+	ktime_t mount_start, phase_start;
 #ifdef CONFIG_CIFS_DFS_UPCALL
+	struct cifs_mount_async referral;
 	struct dfs_info3_param *referrals = NULL;
 	unsigned int num_referrals = 0;
 	int referral_walks_count = 0;
 try_mount_again:
+	referral.fn = NULL;
 #endif
 	rc = 0;
 	tcon = NULL;
 	pSesInfo = NULL;
 	srvTcp = NULL;
 	full_path = NULL;
+	qfs_device.fn = qfs_attribute.fn = NULL;
+	mount_start = phase_start = ktime_get();
 
 	xid = GetXid();
 
@@ -2355,6 +2808,7 @@ try_mount_again:
 		rc = PTR_ERR(srvTcp);
 		goto out;
 	}
+	cifs_mount_phase(srvTcp, CIFS_MOUNT_CONNECT, &phase_start);
 
 	pSesInfo = cifs_find_smb_ses(srvTcp, volume_info->username);
 	if (pSesInfo) {
@@ -2425,6 +2879,7 @@ try_mount_again:
 
 	/* search for existing tcon to this server share */
 	if (!rc) {
+		cifs_mount_phase(srvTcp, CIFS_MOUNT_SESSION, &phase_start);
 		setup_cifs_sb(volume_info, cifs_sb);
 
 		tcon = cifs_find_tcon(pSesInfo, volume_info->UNC);
@@ -2500,11 +2955,18 @@ try_mount_again:
 		goto remote_path_check;
 
 	cifs_sb->tcon = tcon;
+	cifs_mount_phase(srvTcp, CIFS_MOUNT_TCON, &phase_start);
 
-	/* do not care if following two calls succeed - informational */
+	/*
+	 * do not care if following two calls succeed - informational, so
+	 * send them alongside the rest of the mount and wait for them at
+	 * the end
+	 */
 	if (!tcon->ipc) {
-		CIFSSMBQFSDeviceInfo(xid, tcon);
-		CIFSSMBQFSAttributeInfo(xid, tcon);
+		qfs_device.tcon = qfs_attribute.tcon = tcon;
+		cifs_mount_async_start(&qfs_device, cifs_mount_qfs_device);
+		cifs_mount_async_start(&qfs_attribute,
+				       cifs_mount_qfs_attribute);
 	}
 
 	/* tell server which Unix caps we support */
@@ -2529,6 +2991,7 @@ try_mount_again:
 	if (!(tcon->ses->capabilities & CAP_LARGE_READ_X))
 		cifs_sb->rsize = min(cifs_sb->rsize,
 			       (tcon->ses->server->maxBuf - MAX_CIFS_HDR_SIZE));
+	cifs_mount_phase(srvTcp, CIFS_MOUNT_FSINFO, &phase_start);
 
 remote_path_check:
 	/* check if a whole path (including prepath) is not remote */
@@ -2539,7 +3002,30 @@ remote_path_check:
 			rc = -ENOMEM;
 			goto mount_fail_check;
 		}
+#ifdef CONFIG_CIFS_DFS_UPCALL
+		/* in a DFS share the path may be below a link */
+		if (tcon->Flags & SMB_SHARE_IS_IN_DFS) {
+			referral.path = build_unc_path_to_root(volume_info,
+							       cifs_sb);
+			if (!IS_ERR(referral.path)) {
+				referral.tcon = tcon;
+				referral.nls = cifs_sb->local_nls;
+				referral.remap = cifs_sb->mnt_cifs_flags &
+						 CIFS_MOUNT_MAP_SPECIAL_CHR;
+				/* skip the leading path separator */
+				referral.path++;
+				cifs_mount_async_start(&referral,
+					cifs_mount_prefetch_referral);
+			}
+		}
+#endif
 		rc = is_path_accessible(xid, tcon, cifs_sb, full_path);
+#ifdef CONFIG_CIFS_DFS_UPCALL
+		if (referral.fn) {
+			cifs_mount_async_wait(&referral);
+			kfree(referral.path - 1);
+		}
+#endif
 		if (rc != -EREMOTE) {
 			kfree(full_path);
 			goto mount_fail_check;
@@ -2549,6 +3035,8 @@ remote_path_check:
 
 	/* get referral if needed */
 	if (rc == -EREMOTE) {
+		cifs_mount_async_wait(&qfs_device);
+		cifs_mount_async_wait(&qfs_attribute);
 #ifdef CONFIG_CIFS_DFS_UPCALL
 		if (referral_walks_count > MAX_NESTED_LINKS) {
 			/*
@@ -2610,6 +3098,13 @@ remote_path_check:
 	}
 
 mount_fail_check:
+	cifs_mount_async_wait(&qfs_device);
+	cifs_mount_async_wait(&qfs_attribute);
+	if (tcon) {
+		cifs_mount_phase(srvTcp, CIFS_MOUNT_PATH, &phase_start);
+		cifs_mount_phase(srvTcp, CIFS_MOUNT_TOTAL, &mount_start);
+	}
+
 	/* on error free sesinfo and tcon struct if needed */
 	if (rc) {
 		if (mount_data != mount_data_global)
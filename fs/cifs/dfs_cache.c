@@ -0,0 +1,351 @@
+/*
+ *  fs/cifs/dfs_cache.c
+ *
+ *   Contains the cache of DFS referrals, so that mounts and automounts of
+ *   paths in a DFS namespace do not each have to ask a domain controller
+ *   or DFS root for a referral the server already told us how long to keep.
+ *
+ *   Referrals are cached for the TimeToLive the server gave them, keyed by
+ *   the part of the request path the server consumed. A cached link
+ *   referral also answers requests for paths below the link, since the
+ *   rest of such a path is resolved on the link target. Each entry
+ *   remembers which of its targets last worked, and hands that one out
+ *   first, so that once a target is known to be down new mounts fail over
+ *   to an alternate without another referral request.
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published
+ *   by the Free Software Foundation; either version 2.1 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See
+ *   the GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <linux/slab.h>
+#include <linux/ctype.h>
+#include <linux/hash.h>
+#include <linux/kref.h>
+#include <linux/dcache.h>
+#include "cifspdu.h"
+#include "cifsglob.h"
+#include "cifsproto.h"
+#include "cifs_debug.h"
+#include "dfs_cache.h"
+
+#define DFS_CACHE_HASH_BITS	8
+#define DFS_CACHE_MAX_ENTRIES	4096
+#define DFS_CACHE_MAX_TTL	(24 * 60 * 60)	/* seconds */
+
+struct dfs_cache_entry {
+	struct hlist_node hlist;
+	struct list_head lru;
+	struct kref refcount;
+	char *path;		/* path prefix the referral was given for */
+	unsigned int path_len;
+	unsigned long expires;
+	bool is_link;		/* targets are storage, not DFS roots */
+	unsigned int tgt_hint;	/* target to try first */
+	unsigned int num_refs;
+	struct dfs_info3_param *refs;
+};
+
+static DEFINE_SPINLOCK(dfs_cache_lock);
+static struct hlist_head dfs_cache_hash[1 << DFS_CACHE_HASH_BITS];
+static LIST_HEAD(dfs_cache_lru);
+static unsigned int dfs_cache_count;
+
+/* DFS paths are case insensitive */
+static unsigned int
+dfs_cache_hash_path(const char *path, unsigned int len)
+{
+	unsigned long hash = init_name_hash();
+
+	while (len--)
+		hash = partial_name_hash(tolower(*path++), hash);
+	return hash_long(end_name_hash(hash), DFS_CACHE_HASH_BITS);
+}
+
+static void
+dfs_cache_entry_release(struct kref *kref)
+{
+	struct dfs_cache_entry *ce = container_of(kref, struct dfs_cache_entry,
+						  refcount);
+
+	free_dfs_info_array(ce->refs, ce->num_refs);
+	kfree(ce->path);
+	kfree(ce);
+}
+
+/* must be called with dfs_cache_lock held */
+static void
+dfs_cache_remove_locked(struct dfs_cache_entry *ce)
+{
+	hlist_del(&ce->hlist);
+	list_del(&ce->lru);
+	dfs_cache_count--;
+	kref_put(&ce->refcount, dfs_cache_entry_release);
+}
+
+static struct dfs_cache_entry *
+dfs_cache_lookup_locked(const char *path, unsigned int len)
+{
+	struct dfs_cache_entry *ce;
+	struct hlist_node *node;
+	struct hlist_head *head;
+
+	head = &dfs_cache_hash[dfs_cache_hash_path(path, len)];
+	hlist_for_each_entry(ce, node, head, hlist) {
+		if (ce->path_len == len && strnicmp(ce->path, path, len) == 0)
+			return ce;
+	}
+	return NULL;
+}
+
+/*
+ * Find the entry covering a path: either one for the path itself, or one
+ * for a link the path lies below. Expired entries found on the way are
+ * dropped. Must be called with dfs_cache_lock held.
+ */
+static struct dfs_cache_entry *
+dfs_cache_find_locked(const char *path)
+{
+	struct dfs_cache_entry *ce;
+	unsigned int full_len = strlen(path);
+	unsigned int len = full_len;
+
+	while (len > 1) {
+		ce = dfs_cache_lookup_locked(path, len);
+		if (ce && time_after_eq(jiffies, ce->expires)) {
+			cFYI(1, ("DFS cache: %s expired", ce->path));
+			dfs_cache_remove_locked(ce);
+			ce = NULL;
+		}
+		if (ce) {
+			if (len == full_len || ce->is_link) {
+				list_move(&ce->lru, &dfs_cache_lru);
+				return ce;
+			}
+			/* below a root, the server has to resolve the rest */
+			return NULL;
+		}
+		/* strip the last component */
+		while (--len > 0 && path[len] != '\\')
+			;
+	}
+	return NULL;
+}
+
+/* copy a referral array, rotated so that refs[first] comes first */
+static struct dfs_info3_param *
+dfs_cache_dup_refs(const struct dfs_info3_param *refs, unsigned int num_refs,
+		   unsigned int first)
+{
+	struct dfs_info3_param *copy;
+	unsigned int i;
+
+	copy = kcalloc(num_refs, sizeof(struct dfs_info3_param), GFP_KERNEL);
+	if (copy == NULL)
+		return NULL;
+
+	for (i = 0; i < num_refs; i++) {
+		const struct dfs_info3_param *src;
+
+		src = &refs[(first + i) % num_refs];
+		copy[i] = *src;
+		copy[i].path_name = kstrdup(src->path_name, GFP_KERNEL);
+		copy[i].node_name = kstrdup(src->node_name, GFP_KERNEL);
+		if (!copy[i].path_name || !copy[i].node_name) {
+			free_dfs_info_array(copy, i + 1);
+			return NULL;
+		}
+	}
+	return copy;
+}
+
+/**
+ * dfs_cache_find	-	look up a cached referral for a path
+ * @path:	path in the form \server\share[\path]
+ * @refs:	where to return a copy of the referral targets
+ * @num_refs:	where to return the number of targets
+ *
+ * The target that last worked is returned first. Returns 0 on a hit,
+ * -ENOENT on a miss. Caller frees @refs with free_dfs_info_array.
+ */
+int
+dfs_cache_find(const char *path, struct dfs_info3_param **refs,
+	       unsigned int *num_refs)
+{
+	struct dfs_cache_entry *ce;
+	unsigned int hint;
+
+	spin_lock(&dfs_cache_lock);
+	ce = dfs_cache_find_locked(path);
+	if (ce == NULL) {
+		spin_unlock(&dfs_cache_lock);
+		return -ENOENT;
+	}
+	kref_get(&ce->refcount);
+	hint = ce->tgt_hint;
+	spin_unlock(&dfs_cache_lock);
+
+	cFYI(1, ("DFS cache: %s found under %s, target hint %u", path,
+		 ce->path, hint));
+	*refs = dfs_cache_dup_refs(ce->refs, ce->num_refs, hint);
+	*num_refs = *refs ? ce->num_refs : 0;
+	kref_put(&ce->refcount, dfs_cache_entry_release);
+	return *refs ? 0 : -ENOMEM;
+}
+
+/**
+ * dfs_cache_update	-	cache a referral returned by the server
+ * @path:	path the referral was requested for
+ * @refs:	referral targets as returned by CIFSGetDFSRefer
+ * @num_refs:	number of targets
+ */
+void
+dfs_cache_update(const char *path, const struct dfs_info3_param *refs,
+		 unsigned int num_refs)
+{
+	struct dfs_cache_entry *ce, *old;
+	unsigned int i, len, ttl;
+
+	if (num_refs == 0 || (refs[0].ref_flag & DFS_NAME_LIST_REF))
+		return;
+
+	/* the server consumed a whole number of leading path components */
+	len = refs[0].path_consumed;
+	if (len <= 1 || len > strlen(path) ||
+	    (path[len] != '\0' && path[len] != '\\')) {
+		cFYI(1, ("DFS cache: not caching %s, %u bytes consumed",
+			 path, len));
+		return;
+	}
+
+	ttl = DFS_CACHE_MAX_TTL;
+	for (i = 0; i < num_refs; i++)
+		ttl = min_t(unsigned int, ttl, refs[i].ttl);
+	if (ttl == 0)
+		return;
+
+	ce = kzalloc(sizeof(struct dfs_cache_entry), GFP_KERNEL);
+	if (ce == NULL)
+		return;
+	ce->path = kstrndup(path, len, GFP_KERNEL);
+	ce->refs = dfs_cache_dup_refs(refs, num_refs, 0);
+	if (!ce->path || !ce->refs) {
+		kfree(ce->path);
+		kfree(ce);
+		return;
+	}
+	kref_init(&ce->refcount);
+	ce->path_len = len;
+	ce->num_refs = num_refs;
+	ce->expires = jiffies + ttl * HZ;
+	ce->is_link = refs[0].server_type == DFS_TYPE_LINK &&
+		      !(refs[0].flags & DFSREF_REFERRAL_SERVER);
+
+	cFYI(1, ("DFS cache: caching %s, %u targets for %us", ce->path,
+		 num_refs, ttl));
+
+	spin_lock(&dfs_cache_lock);
+	old = dfs_cache_lookup_locked(ce->path, len);
+	if (old)
+		dfs_cache_remove_locked(old);
+	hlist_add_head(&ce->hlist,
+		       &dfs_cache_hash[dfs_cache_hash_path(ce->path, len)]);
+	list_add(&ce->lru, &dfs_cache_lru);
+	if (++dfs_cache_count > DFS_CACHE_MAX_ENTRIES)
+		dfs_cache_remove_locked(list_entry(dfs_cache_lru.prev,
+					struct dfs_cache_entry, lru));
+	spin_unlock(&dfs_cache_lock);
+}
+
+/**
+ * dfs_cache_set_target	-	remember the target a path was reached on
+ * @path:	path the referral was looked up for
+ * @node_name:	the target that worked
+ */
+void
+dfs_cache_set_target(const char *path, const char *node_name)
+{
+	struct dfs_cache_entry *ce;
+	unsigned int i;
+
+	spin_lock(&dfs_cache_lock);
+	ce = dfs_cache_find_locked(path);
+	if (ce) {
+		for (i = 0; i < ce->num_refs; i++) {
+			if (strcasecmp(ce->refs[i].node_name, node_name) == 0) {
+				ce->tgt_hint = i;
+				break;
+			}
+		}
+	}
+	spin_unlock(&dfs_cache_lock);
+}
+
+/* is a target UNC (\server\share...) on the given host */
+static bool
+dfs_node_on_host(const char *node_name, const char *hostname)
+{
+	size_t len = strlen(hostname);
+
+	while (*node_name == '\\')
+		node_name++;
+	return strnicmp(node_name, hostname, len) == 0 &&
+	       (node_name[len] == '\\' || node_name[len] == '\0');
+}
+
+/**
+ * dfs_cache_target_down	-	fail over away from a host
+ * @hostname:	host that we lost the connection to
+ *
+ * Called when reconnecting to a server fails. Every cached referral whose
+ * preferred target is on that host is switched to its next target on
+ * another host, so that new mounts of those paths go straight there.
+ */
+void
+dfs_cache_target_down(const char *hostname)
+{
+	struct dfs_cache_entry *ce;
+	unsigned int i, n;
+
+	if (hostname == NULL)
+		return;
+
+	spin_lock(&dfs_cache_lock);
+	list_for_each_entry(ce, &dfs_cache_lru, lru) {
+		if (ce->num_refs < 2 ||
+		    !dfs_node_on_host(ce->refs[ce->tgt_hint].node_name,
+				      hostname))
+			continue;
+		for (i = 1; i < ce->num_refs; i++) {
+			n = (ce->tgt_hint + i) % ce->num_refs;
+			if (!dfs_node_on_host(ce->refs[n].node_name,
+					      hostname)) {
+				cFYI(1, ("DFS cache: %s fails over to %s",
+					 ce->path, ce->refs[n].node_name));
+				ce->tgt_hint = n;
+				break;
+			}
+		}
+	}
+	spin_unlock(&dfs_cache_lock);
+}
+
+void
+dfs_cache_flush(void)
+{
+	spin_lock(&dfs_cache_lock);
+	while (!list_empty(&dfs_cache_lru))
+		dfs_cache_remove_locked(list_entry(dfs_cache_lru.next,
+					struct dfs_cache_entry, lru));
+	spin_unlock(&dfs_cache_lock);
+}
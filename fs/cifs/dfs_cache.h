@@ -0,0 +1,52 @@
+/*
+ *   fs/cifs/dfs_cache.h -- DFS referral cache
+ *
+ *   This library is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU Lesser General Public License as published
+ *   by the Free Software Foundation; either version 2.1 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This library is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See
+ *   the GNU Lesser General Public License for more details.
+ *
+ *   You should have received a copy of the GNU Lesser General Public License
+ *   along with this library; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _DFS_CACHE_H
+#define _DFS_CACHE_H
+
+#ifdef __KERNEL__
+struct dfs_info3_param;
+
+#ifdef CONFIG_CIFS_DFS_UPCALL
+extern int dfs_cache_find(const char *path, struct dfs_info3_param **refs,
+			  unsigned int *num_refs);
+extern void dfs_cache_update(const char *path,
+			     const struct dfs_info3_param *refs,
+			     unsigned int num_refs);
+extern void dfs_cache_set_target(const char *path, const char *node_name);
+extern void dfs_cache_target_down(const char *hostname);
+extern void dfs_cache_flush(void);
+#else
+static inline int dfs_cache_find(const char *path,
+				 struct dfs_info3_param **refs,
+				 unsigned int *num_refs)
+{
+	return -ENOENT;
+}
+static inline void dfs_cache_update(const char *path,
+				    const struct dfs_info3_param *refs,
+				    unsigned int num_refs)
+{
+}
+static inline void dfs_cache_target_down(const char *hostname)
+{
+}
+#endif /* CONFIG_CIFS_DFS_UPCALL */
+#endif /* KERNEL */
+
+#endif /* _DFS_CACHE_H */
@@ -23,6 +23,7 @@
  *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
  */
 
+#include <linux/time.h>
 #include <keys/user-type.h>
 #include "dns_resolve.h"
 #include "cifsglob.h"
@@ -42,30 +43,63 @@ is_ip(char *name)
 	return cifs_convert_address(name, &ss);
 }
 
+/*
+ * The upcall answers with one or more addresses separated by commas,
+ * spaces or newlines, optionally followed by "ttl=<seconds>" for how long
+ * they may be cached. The payload is kept as a comma separated list.
+ */
 static int
 dns_resolver_instantiate(struct key *key, const void *data,
 		size_t datalen)
 {
-	int rc = 0;
-	char *ip;
+	char *buf, *tkn, *p, *ip;
+	unsigned long ttl = DNS_RESOLVER_DEFAULT_TTL;
+	int len = 0;
+
+	buf = kmalloc(datalen + 1, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	memcpy(buf, data, datalen);
+	buf[datalen] = '\0';
 
 	ip = kmalloc(datalen + 1, GFP_KERNEL);
-	if (!ip)
+	if (!ip) {
+		kfree(buf);
 		return -ENOMEM;
+	}
 
-	memcpy(ip, data, datalen);
-	ip[datalen] = '\0';
+	p = buf;
+	while ((tkn = strsep(&p, ", \n")) != NULL) {
+		if (*tkn == '\0')
+			continue;
+		if (strncmp(tkn, "ttl=", 4) == 0) {
+			ttl = simple_strtoul(tkn + 4, NULL, 10);
+			continue;
+		}
+		/* make sure this looks like an address */
+		if (!is_ip(tkn)) {
+			cFYI(1, ("%s: not an address: %s", __func__, tkn));
+			continue;
+		}
+		if (len)
+			ip[len++] = ',';
+		strcpy(ip + len, tkn);
+		len += strlen(tkn);
+	}
+	kfree(buf);
 
-	/* make sure this looks like an address */
-	if (!is_ip(ip)) {
+	if (len == 0) {
 		kfree(ip);
 		return -EINVAL;
 	}
 
-	key->type_data.x[0] = datalen;
+	/* the key garbage collector reaps it once it has expired */
+	if (ttl)
+		key->expiry = current_kernel_time().tv_sec + ttl;
+	key->type_data.x[0] = len;
 	key->payload.data = ip;
 
-	return rc;
+	return 0;
 }
 
 static void
@@ -83,6 +117,129 @@ struct key_type key_type_dns_resolver = {
 	.match       = user_match,
 };
 
+/*
+ * request_key only finds a key in the keyrings of the calling process,
+ * so keep our own references to the resolved names to share them between
+ * mounts, automounts and the reconnect path. Entries go away with the
+ * expiry of their key.
+ */
+struct dns_cache_entry {
+	struct list_head list;
+	struct key *key;
+	char name[1];
+};
+
+static LIST_HEAD(dns_cache);
+static DEFINE_SPINLOCK(dns_cache_lock);
+static unsigned int dns_cache_count;
+
+static void
+dns_cache_free(struct dns_cache_entry *dce)
+{
+	key_put(dce->key);
+	kfree(dce);
+}
+
+static struct key *
+dns_cache_lookup(const char *name)
+{
+	struct dns_cache_entry *dce;
+	struct key *key = NULL;
+
+	spin_lock(&dns_cache_lock);
+	list_for_each_entry(dce, &dns_cache, list) {
+		if (strcasecmp(dce->name, name))
+			continue;
+		if (key_validate(dce->key) < 0) {
+			/* expired or revoked, resolve again */
+			list_del(&dce->list);
+			dns_cache_count--;
+			spin_unlock(&dns_cache_lock);
+			dns_cache_free(dce);
+			return NULL;
+		}
+		list_move(&dce->list, &dns_cache);
+		key = key_get(dce->key);
+		break;
+	}
+	spin_unlock(&dns_cache_lock);
+	return key;
+}
+
+static void
+dns_cache_add(const char *name, struct key *key)
+{
+	struct dns_cache_entry *dce, *tmp, *old = NULL;
+
+	dce = kmalloc(sizeof(struct dns_cache_entry) + strlen(name),
+		      GFP_KERNEL);
+	if (!dce)
+		return;
+	strcpy(dce->name, name);
+	dce->key = key_get(key);
+
+	spin_lock(&dns_cache_lock);
+	list_for_each_entry(tmp, &dns_cache, list) {
+		if (strcasecmp(tmp->name, name) == 0) {
+			old = tmp;
+			break;
+		}
+	}
+	if (old == NULL && ++dns_cache_count > DNS_CACHE_MAX_ENTRIES)
+		old = list_entry(dns_cache.prev, struct dns_cache_entry, list);
+	if (old)
+		list_del(&old->list);
+	list_add(&dce->list, &dns_cache);
+	spin_unlock(&dns_cache_lock);
+
+	if (old)
+		dns_cache_free(old);
+}
+
+void
+dns_resolver_cache_flush(void)
+{
+	struct dns_cache_entry *dce;
+
+	spin_lock(&dns_cache_lock);
+	while (!list_empty(&dns_cache)) {
+		dce = list_entry(dns_cache.next, struct dns_cache_entry, list);
+		list_del(&dce->list);
+		spin_unlock(&dns_cache_lock);
+		dns_cache_free(dce);
+		spin_lock(&dns_cache_lock);
+	}
+	dns_cache_count = 0;
+	spin_unlock(&dns_cache_lock);
+}
+
+/*
+ * Resolve a host name to its comma separated list of addresses, from the
+ * cache if possible. Returns a key the caller must put.
+ */
+static struct key *
+dns_resolve_host(const char *name)
+{
+	struct key *rkey;
+
+	rkey = dns_cache_lookup(name);
+	if (rkey) {
+		cFYI(1, ("%s: %s cached as %s", __func__, name,
+			 (char *)rkey->payload.data));
+		return rkey;
+	}
+
+	rkey = request_key(&key_type_dns_resolver, name, "");
+	if (IS_ERR(rkey)) {
+		cERROR(1, ("%s: unable to resolve: %s", __func__, name));
+		return rkey;
+	}
+	cFYI(1, ("%s: resolved: %s to %s", __func__, name,
+		 (char *)rkey->payload.data));
+	dns_cache_add(name, rkey);
+	return rkey;
+}
+
 /* Resolves server name to ip address.
  * input:
  * 	unc - server UNC
@@ -94,9 +251,9 @@ int
 dns_resolve_server_name_to_ip(const char *unc, char **ip_addr)
 {
 	int rc = -EAGAIN;
-	struct key *rkey = ERR_PTR(-EAGAIN);
+	struct key *rkey;
 	char *name;
-	char *data = NULL;
+	const char *data;
 	int len;
 
 	if (!ip_addr || !unc)
@@ -128,40 +285,59 @@ dns_resolve_server_name_to_ip(const char *unc, char **ip_addr)
 	if (is_ip(name)) {
 		cFYI(1, ("%s: it is IP, skipping dns upcall: %s",
 					__func__, name));
-		data = name;
-		goto skip_upcall;
+		*ip_addr = name;
+		return 0;
 	}
 
-	rkey = request_key(&key_type_dns_resolver, name, "");
-	if (!IS_ERR(rkey)) {
-		len = rkey->type_data.x[0];
-		data = rkey->payload.data;
-	} else {
-		cERROR(1, ("%s: unable to resolve: %s", __func__, name));
+	rkey = dns_resolve_host(name);
+	if (IS_ERR(rkey)) {
+		rc = PTR_ERR(rkey);
 		goto out;
 	}
 
-skip_upcall:
-	if (data) {
-		*ip_addr = kmalloc(len + 1, GFP_KERNEL);
-		if (*ip_addr) {
-			memcpy(*ip_addr, data, len + 1);
-			if (!IS_ERR(rkey))
-				cFYI(1, ("%s: resolved: %s to %s", __func__,
-							name,
-							*ip_addr
-					));
-			rc = 0;
-		} else {
-			rc = -ENOMEM;
-		}
-		if (!IS_ERR(rkey))
-			key_put(rkey);
-	}
+	/* the first address is the preferred one */
+	data = rkey->payload.data;
+	len = strcspn(data, ",");
+	*ip_addr = kstrndup(data, len, GFP_KERNEL);
+	rc = *ip_addr ? 0 : -ENOMEM;
+	key_put(rkey);
 
 out:
 	kfree(name);
 	return rc;
 }
 
+/**
+ * dns_resolve_server_name_to_addrs	-	resolve a host to all its addresses
+ * @hostname:	name of the server
+ * @addrs:	array to return the addresses in (ports are left zero)
+ * @max_addrs:	size of @addrs
+ *
+ * Returns the number of addresses found, or a negative error.
+ */
+int
+dns_resolve_server_name_to_addrs(const char *hostname,
+				 struct sockaddr_storage *addrs, int max_addrs)
+{
+	struct key *rkey;
+	char *list, *p, *tkn;
+	int num = 0;
 
+	rkey = dns_resolve_host(hostname);
+	if (IS_ERR(rkey))
+		return PTR_ERR(rkey);
+
+	list = kstrdup(rkey->payload.data, GFP_KERNEL);
+	key_put(rkey);
+	if (!list)
+		return -ENOMEM;
+
+	p = list;
+	while ((tkn = strsep(&p, ",")) != NULL && num < max_addrs) {
+		memset(&addrs[num], 0, sizeof(struct sockaddr_storage));
+		if (cifs_convert_address(tkn, &addrs[num]))
+			num++;
+	}
+	kfree(list);
+	return num;
+}
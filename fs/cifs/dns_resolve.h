@@ -24,9 +24,26 @@
 #define _DNS_RESOLVE_H
 
 #ifdef __KERNEL__
+#include <linux/socket.h>
 #include <linux/key-type.h>
+
+#define DNS_RESOLVER_DEFAULT_TTL	600	/* seconds */
+#define DNS_CACHE_MAX_ENTRIES		64
+
 extern struct key_type key_type_dns_resolver;
 extern int dns_resolve_server_name_to_ip(const char *unc, char **ip_addr);
+#ifdef CONFIG_CIFS_DFS_UPCALL
+extern int dns_resolve_server_name_to_addrs(const char *hostname,
+				struct sockaddr_storage *addrs, int max_addrs);
+extern void dns_resolver_cache_flush(void);
+#else
+static inline int
+dns_resolve_server_name_to_addrs(const char *hostname,
+				 struct sockaddr_storage *addrs, int max_addrs)
+{
+	return -EOPNOTSUPP;
+}
+#endif /* CONFIG_CIFS_DFS_UPCALL */
 #endif /* KERNEL */
 
 #endif /* _DNS_RESOLVE_H */
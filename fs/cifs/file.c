@@ -31,6 +31,7 @@
 #include <linux/task_io_accounting_ops.h>
 #include <linux/delay.h>
 #include <linux/mount.h>
+#include <linux/kthread.h>
 #include <asm/div64.h>
 #include "cifsfs.h"
 #include "cifspdu.h"
@@ -39,6 +40,7 @@
 #include "cifs_unicode.h"
 #include "cifs_debug.h"
 #include "cifs_fs_sb.h"
+#include "cifs_trace.h"
 
 static inline int cifs_convert_flags(unsigned int flags)
 {
@@ -225,7 +227,9 @@ static inline int cifs_open_inode_helper(struct inode *inode, struct file *file,
 		}
 		cFYI(1, ("invalidating remote inode since open detected it "
 			 "changed"));
-		invalidate_remote_inode(file->f_path.dentry->d_inode);
+		cifs_invalidate_changed(file->f_path.dentry->d_inode,
+			file->f_path.dentry->d_inode->i_size,
+			(loff_t)le64_to_cpu(buf->EndOfFile));
 	}
 
 client_can_cache:
@@ -425,35 +429,185 @@ out:
 	return rc;
 }
 
+/* the two lock types we store, each must go out in its own LOCKING_ANDX */
+static const __u8 cifs_lock_types[] = {
+	LOCKING_ANDX_LARGE_FILES,
+	LOCKING_ANDX_SHARED_LOCK | LOCKING_ANDX_LARGE_FILES
+};
+
+/* how many ranges fit in one LOCKING_ANDX given the negotiated buffer */
+static unsigned int cifs_max_lock_ranges(struct cifsTconInfo *tcon)
+{
+	unsigned int max_buf = tcon->ses->server->maxBuf;
+
+	if (max_buf <= sizeof(LOCK_REQ))
+		return 1;
+	/* ByteCount is only 16 bits */
+	return min_t(unsigned int,
+		     (max_buf - sizeof(LOCK_REQ)) / sizeof(LOCKING_ANDX_RANGE) + 1,
+		     USHORT_MAX / sizeof(LOCKING_ANDX_RANGE));
+}
+
+static void cifs_fill_lock_range(LOCKING_ANDX_RANGE *range,
+				 struct cifsLockInfo *li)
+{
+	range->Pid = cpu_to_le16((__u16)li->pid);
+	range->Pad = 0;
+	range->LengthLow = cpu_to_le32((u32)li->length);
+	range->LengthHigh = cpu_to_le32((u32)(li->length >> 32));
+	range->OffsetLow = cpu_to_le32((u32)li->offset);
+	range->OffsetHigh = cpu_to_le32((u32)(li->offset >> 32));
+}
+
+/*
+ * Relock a batch of ranges of one type. The server drops every lock of a
+ * LOCKING_ANDX if any one of them fails, so on error retry the ranges one
+ * at a time to get back as many of them as we can.
+ */
+static int cifs_relock_ranges(int xid, struct cifsTconInfo *tcon,
+			      __u16 netfid, __u8 type,
+			      LOCKING_ANDX_RANGE *buf, unsigned int num)
+{
+	int rc, stored_rc;
+	unsigned int i;
+
+	rc = CIFSSMBLockv(xid, tcon, netfid, type, 0, num, buf);
+	if (rc == 0 || rc == -EAGAIN || num == 1)
+		return rc;
+
+	rc = 0;
+	for (i = 0; i < num; i++) {
+		stored_rc = CIFSSMBLockv(xid, tcon, netfid, type, 0, 1,
+					 &buf[i]);
+		if (stored_rc) {
+			cERROR(1, ("could not reacquire lock %d of %d rc %d",
+				   i, num, stored_rc));
+			rc = stored_rc;
+		}
+	}
+	return rc;
+}
+
 /* Try to reacquire byte range locks that were released when session */
-/* to server was lost */
-static int cifs_relock_file(struct cifsFileInfo *cifsFile)
+/* to server was lost. Locks are replayed in as few requests as possible */
+static int cifs_relock_file(int xid, struct cifsTconInfo *tcon,
+			    struct cifsFileInfo *cifsFile)
 {
 	int rc = 0;
+	int stored_rc;
+	unsigned int i, num, max_num;
+	struct cifsLockInfo *li;
+	LOCKING_ANDX_RANGE *buf;
+
+	mutex_lock(&cifsFile->lock_mutex);
+	if (list_empty(&cifsFile->llist))
+		goto out;
 
-/* BB list all locks open on this file and relock */
+	max_num = cifs_max_lock_ranges(tcon);
+	buf = kcalloc(max_num, sizeof(LOCKING_ANDX_RANGE), GFP_KERNEL);
+	if (buf == NULL) {
+		rc = -ENOMEM;
+		goto out;
+	}
 
+	for (i = 0; i < ARRAY_SIZE(cifs_lock_types); i++) {
+		num = 0;
+		list_for_each_entry(li, &cifsFile->llist, llist) {
+			if (li->type != cifs_lock_types[i])
+				continue;
+			cifs_fill_lock_range(&buf[num++], li);
+			if (num < max_num)
+				continue;
+			stored_rc = cifs_relock_ranges(xid, tcon,
+					cifsFile->netfid, cifs_lock_types[i],
+					buf, num);
+			if (stored_rc)
+				rc = stored_rc;
+			num = 0;
+		}
+		if (num) {
+			stored_rc = cifs_relock_ranges(xid, tcon,
+					cifsFile->netfid, cifs_lock_types[i],
+					buf, num);
+			if (stored_rc)
+				rc = stored_rc;
+		}
+	}
+	kfree(buf);
+out:
+	mutex_unlock(&cifsFile->lock_mutex);
+	cFYI(1, ("relock file rc %d", rc));
 	return rc;
 }
 
-static int cifs_reopen_file(struct file *file, bool can_flush)
+/*
+ * Unlock every stored lock that lies entirely inside [start, start+length)
+ * and drop our records of them, batching the unlock ranges of each type
+ * into as few LOCKING_ANDX requests as the server buffer allows.
+ */
+static int cifs_unlock_range(int xid, struct cifsTconInfo *tcon,
+			     struct cifsFileInfo *fid, __u64 start,
+			     __u64 length)
+{
+	int rc = 0;
+	int stored_rc;
+	unsigned int i, num, max_num;
+	struct cifsLockInfo *li, *tmp;
+	LOCKING_ANDX_RANGE *buf;
+
+	max_num = cifs_max_lock_ranges(tcon);
+	buf = kcalloc(max_num, sizeof(LOCKING_ANDX_RANGE), GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	mutex_lock(&fid->lock_mutex);
+	for (i = 0; i < ARRAY_SIZE(cifs_lock_types); i++) {
+		num = 0;
+		list_for_each_entry_safe(li, tmp, &fid->llist, llist) {
+			if (li->type != cifs_lock_types[i])
+				continue;
+			if (start > li->offset ||
+			    (start + length) < (li->offset + li->length))
+				continue;
+			cifs_fill_lock_range(&buf[num++], li);
+			list_del(&li->llist);
+			kfree(li);
+			if (num < max_num)
+				continue;
+			stored_rc = CIFSSMBLockv(xid, tcon, fid->netfid,
+					cifs_lock_types[i], num, 0, buf);
+			if (stored_rc)
+				rc = stored_rc;
+			num = 0;
+		}
+		if (num) {
+			stored_rc = CIFSSMBLockv(xid, tcon, fid->netfid,
+					cifs_lock_types[i], num, 0, buf);
+			if (stored_rc)
+				rc = stored_rc;
+		}
+	}
+	mutex_unlock(&fid->lock_mutex);
+	kfree(buf);
+	return rc;
+}
+
+static int cifs_reopen_file(struct cifsFileInfo *pCifsFile, bool can_flush)
 {
 	int rc = -EACCES;
 	int xid;
 	__u32 oplock;
 	struct cifs_sb_info *cifs_sb;
 	struct cifsTconInfo *tcon;
-	struct cifsFileInfo *pCifsFile;
 	struct cifsInodeInfo *pCifsInode;
 	struct inode *inode;
+	struct file *file;
 	char *full_path = NULL;
 	int desiredAccess;
 	int disposition = FILE_OPEN;
 	__u16 netfid;
 
-	if (file->private_data)
-		pCifsFile = (struct cifsFileInfo *)file->private_data;
-	else
+	if (pCifsFile == NULL)
 		return -EBADF;
 
 	xid = GetXid();
@@ -465,6 +619,14 @@ static int cifs_reopen_file(struct file *file, bool can_flush)
 		return rc;
 	}
 
+	/* cifs_close waits on fh_mutex once closePend is set, so pfile is
+	   safe to use while we hold it unless a close already began */
+	if (pCifsFile->closePend) {
+		rc = -EBADF;
+		goto reopen_error_exit;
+	}
+	file = pCifsFile->pfile;
+
 	if (file->f_path.dentry == NULL) {
 		cERROR(1, ("no valid name if dentry freed"));
 		dump_stack();
@@ -568,7 +730,7 @@ reopen_success:
 				pCifsInode->clientCanCacheAll = true;
 				pCifsInode->clientCanCacheRead = true;
 				cFYI(1, ("Exclusive Oplock granted on inode %p",
-					 file->f_path.dentry->d_inode));
+					 inode));
 			} else if ((oplock & 0xF) == OPLOCK_READ) {
 				pCifsInode->clientCanCacheRead = true;
 				pCifsInode->clientCanCacheAll = false;
@@ -576,7 +738,7 @@ reopen_success:
 				pCifsInode->clientCanCacheRead = false;
 				pCifsInode->clientCanCacheAll = false;
 			}
-			cifs_relock_file(pCifsFile);
+			cifs_relock_file(xid, tcon, pCifsFile);
 		}
 	}
 	kfree(full_path);
@@ -584,6 +746,115 @@ reopen_success:
 	return rc;
 }
 
+/* the handles of one tree connection being reopened after a reconnect */
+struct cifs_reopen_batch {
+	spinlock_t		lock;
+	struct list_head	files;	/* cifsFileInfos not yet picked up */
+};
+
+/* a slow_work item helping with a cifs_reopen_batch */
+struct cifs_reopen_work {
+	struct slow_work		work;
+	struct cifs_reopen_batch	*batch;
+};
+
+static void cifs_reopen_batch_run(struct cifs_reopen_batch *batch)
+{
+	struct cifsFileInfo *cfile;
+	struct vfsmount *mnt;
+
+	spin_lock(&batch->lock);
+	while (!list_empty(&batch->files)) {
+		cfile = list_first_entry(&batch->files, struct cifsFileInfo,
+					 rlist);
+		list_del_init(&cfile->rlist);
+		spin_unlock(&batch->lock);
+
+		/* not safe to flush here, we may hold up a writepage */
+		cifs_reopen_file(cfile, false);
+		mnt = cfile->mnt;
+		cifsFileInfo_put(cfile);
+		mntput(mnt);
+
+		spin_lock(&batch->lock);
+	}
+	spin_unlock(&batch->lock);
+}
+
+static void
+cifs_reopen_work(struct slow_work *work)
+{
+	struct cifs_reopen_work *rwork = container_of(work,
+					struct cifs_reopen_work, work);
+
+	cifs_reopen_batch_run(rwork->batch);
+}
+
+static const struct slow_work_ops cifs_reopen_ops = {
+	.execute	= cifs_reopen_work,
+};
+
+/*
+ * Reopen every handle on the tree connection that was invalidated by a
+ * reconnect, together with its byte range locks, instead of waiting for
+ * each one to be reopened by its next user. Some slow_work items help the
+ * caller with the list so that many of the opens are on the wire at once,
+ * and a caller blocked on one handle can go on as soon as that one is back.
+ * Returns once all of them have been attempted.
+ */
+void cifs_reopen_tcon_files(struct cifsTconInfo *tcon)
+{
+	struct cifs_reopen_batch batch;
+	struct cifs_reopen_work *rwork;
+	struct cifsFileInfo *cfile;
+	unsigned int count = 0;
+	unsigned int nwork, i;
+
+	spin_lock_init(&batch.lock);
+	INIT_LIST_HEAD(&batch.files);
+
+	read_lock(&GlobalSMBSeslock);
+	list_for_each_entry(cfile, &tcon->openFileList, tlist) {
+		if (!cfile->invalidHandle || cfile->closePend)
+			continue;
+		if (!S_ISREG(cfile->pInode->i_mode))
+			continue;
+		mntget(cfile->mnt);
+		cifsFileInfo_get(cfile);
+		list_add_tail(&cfile->rlist, &batch.files);
+		count++;
+	}
+	read_unlock(&GlobalSMBSeslock);
+
+	if (count == 0)
+		return;
+
+	/* the caller does its share too, so queue one less */
+	nwork = min_t(unsigned int, count, CIFS_MAX_REOPEN_THREADS);
+	nwork = min_t(unsigned int, nwork, cifs_max_pending / 2);
+	nwork = nwork ? nwork - 1 : 0;
+	rwork = NULL;
+	if (nwork)
+		rwork = kcalloc(nwork, sizeof(*rwork), GFP_KERNEL);
+	if (rwork == NULL)
+		nwork = 0;
+	cFYI(1, ("reopening %u files on tcon %p with %u helpers",
+		 count, tcon, nwork));
+
+	for (i = 0; i < nwork; i++) {
+		rwork[i].batch = &batch;
+		slow_work_init(&rwork[i].work, &cifs_reopen_ops);
+		slow_work_enqueue(&rwork[i].work);
+	}
+
+	cifs_reopen_batch_run(&batch);
+
+	/* the list is empty now, so waiting here is short */
+	for (i = 0; i < nwork; i++)
+		slow_work_cancel(&rwork[i].work);
+	kfree(rwork);
+}
+
 int cifs_close(struct inode *inode, struct file *file)
 {
 	int rc = 0;
@@ -601,6 +872,11 @@ int cifs_close(struct inode *inode, struct file *file)
 		struct cifsLockInfo *li, *tmp;
 		write_lock(&GlobalSMBSeslock);
 		pSMBFile->closePend = true;
+		write_unlock(&GlobalSMBSeslock);
+		/* let a bulk reopen that is using this file finish with it */
+		mutex_lock(&pSMBFile->fh_mutex);
+		mutex_unlock(&pSMBFile->fh_mutex);
+		write_lock(&GlobalSMBSeslock);
 		if (pTcon) {
 			/* no sense reconnecting to close a file that is
 			   already closed */
@@ -683,6 +959,7 @@ int cifs_closedir(struct inode *inode, struct file *file)
 		pTcon = cifs_sb->tcon;
 
 		cFYI(1, ("Freeing private data in close dir"));
+		cifs_readdir_ahead_discard(pCFileStruct);
 		write_lock(&GlobalSMBSeslock);
 		if (!pCFileStruct->srch_inf.endOfSearch &&
 		    !pCFileStruct->invalidHandle) {
@@ -721,6 +998,7 @@ static int store_file_lock(struct cifsFileInfo *fid, __u64 len,
 		return -ENOMEM;
 	li->offset = offset;
 	li->length = len;
+	li->pid = current->tgid;
 	li->type = lockType;
 	mutex_lock(&fid->lock_mutex);
 	list_add(&li->llist, &fid->llist);
@@ -881,27 +1159,8 @@ int cifs_lock(struct file *file, int cmd, struct file_lock *pfLock)
 		} else if (numUnlock) {
 			/* For each stored lock that this unlock overlaps
 			   completely, unlock it. */
-			int stored_rc = 0;
-			struct cifsLockInfo *li, *tmp;
-
-			rc = 0;
-			mutex_lock(&fid->lock_mutex);
-			list_for_each_entry_safe(li, tmp, &fid->llist, llist) {
-				if (pfLock->fl_start <= li->offset &&
-						(pfLock->fl_start + length) >=
-						(li->offset + li->length)) {
-					stored_rc = CIFSSMBLock(xid, tcon,
-							netfid,
-							li->length, li->offset,
-							1, 0, li->type, false);
-					if (stored_rc)
-						rc = stored_rc;
-
-					list_del(&li->llist);
-					kfree(li);
-				}
-			}
-			mutex_unlock(&fid->lock_mutex);
+			rc = cifs_unlock_range(xid, tcon, fid,
+					       pfLock->fl_start, length);
 		}
 	}
 
@@ -1000,7 +1259,7 @@ ssize_t cifs_user_write(struct file *file, const char __user *write_data,
 				   filemap_fdatawait from here so tell
 				   reopen_file not to flush data to server
 				   now */
-				rc = cifs_reopen_file(file, false);
+				rc = cifs_reopen_file(open_file, false);
 				if (rc != 0)
 					break;
 			}
@@ -1099,7 +1358,7 @@ static ssize_t cifs_write(struct file *file, const char *write_data,
 				   filemap_fdatawait from here so tell
 				   reopen_file not to flush data to
 				   server now */
-				rc = cifs_reopen_file(file, false);
+				rc = cifs_reopen_file(open_file, false);
 				if (rc != 0)
 					break;
 			}
@@ -1164,7 +1423,6 @@ static ssize_t cifs_write(struct file *file, const char *write_data,
 	return total_written;
 }
 
-#ifdef CONFIG_CIFS_EXPERIMENTAL
 struct cifsFileInfo *find_readable_file(struct cifsInodeInfo *cifs_inode)
 {
 	struct cifsFileInfo *open_file = NULL;
@@ -1193,7 +1451,6 @@ struct cifsFileInfo *find_readable_file(struct cifsInodeInfo *cifs_inode)
 	read_unlock(&GlobalSMBSeslock);
 	return NULL;
 }
-#endif
 
 struct cifsFileInfo *find_writable_file(struct cifsInodeInfo *cifs_inode)
 {
@@ -1231,7 +1488,7 @@ refind_writable:
 
 			read_unlock(&GlobalSMBSeslock);
 			/* Had to unlock since following call can block */
-			rc = cifs_reopen_file(open_file->pfile, false);
+			rc = cifs_reopen_file(open_file, false);
 			if (!rc) {
 				if (!open_file->closePend)
 					return open_file;
@@ -1334,6 +1591,99 @@ static int cifs_partialpagewrite(struct page *page, unsigned from, unsigned to)
 	return rc;
 }
 
+/*
+ * A page that is not up to date can still cache data written to it, as
+ * one contiguous range of bytes recorded in page_private, so that a
+ * partial page write does not first have to read the rest of the page
+ * from the server. Only that range is then written back. The range is
+ * stored as its first byte and its last byte in the two halves of the
+ * private word, and is only changed with the page locked.
+ */
+#define CIFS_PAGE_RANGE_SHIFT	(BITS_PER_LONG / 2)
+
+static void
+cifs_page_get_range(struct page *page, unsigned *from, unsigned *to)
+{
+	unsigned long priv = page_private(page);
+
+	*from = priv & ((1UL << CIFS_PAGE_RANGE_SHIFT) - 1);
+	*to = (priv >> CIFS_PAGE_RANGE_SHIFT) + 1;
+}
+
+static void
+cifs_page_set_range(struct page *page, unsigned from, unsigned to)
+{
+	BUILD_BUG_ON(PAGE_CACHE_SHIFT > CIFS_PAGE_RANGE_SHIFT);
+	set_page_private(page,
+		((unsigned long)(to - 1) << CIFS_PAGE_RANGE_SHIFT) | from);
+	SetPagePrivate(page);
+}
+
+static void
+cifs_page_clear_range(struct page *page)
+{
+	set_page_private(page, 0);
+	ClearPagePrivate(page);
+}
+
+/*
+ * Add the bytes [from, from + len) just written to the range cached in a
+ * page that is not up to date. Returns false if they do not join up with
+ * the range already there. A range covering the whole page makes it up to
+ * date.
+ */
+static bool
+cifs_page_add_range(struct page *page, unsigned from, unsigned len)
+{
+	unsigned to = from + len;
+	unsigned start, end;
+
+	if (PagePrivate(page)) {
+		cifs_page_get_range(page, &start, &end);
+		if (from > end || to < start)
+			return false;
+		from = min(from, start);
+		to = max(to, end);
+	}
+
+	if (from == 0 && to == PAGE_CACHE_SIZE) {
+		cifs_page_clear_range(page);
+		SetPageUptodate(page);
+	} else
+		cifs_page_set_range(page, from, to);
+	return true;
+}
+
+/*
+ * Write back the range cached in a locked page, e.g. before the page is
+ * read from the server over it. The page stays locked.
+ */
+static int
+cifs_page_flush_range(struct page *page)
+{
+	unsigned from, to;
+	int rc = 0;
+
+	if (!PagePrivate(page))
+		return 0;
+
+	wait_on_page_writeback(page);
+	cifs_page_get_range(page, &from, &to);
+	if (clear_page_dirty_for_io(page)) {
+		set_page_writeback(page);
+		rc = cifs_partialpagewrite(page, from, to);
+		end_page_writeback(page);
+		if (rc) {
+			SetPageError(page);
+			mapping_set_error(page->mapping, rc);
+		}
+	}
+	cifs_page_clear_range(page);
+	return rc;
+}
+
+static int cifs_writepage(struct page *page, struct writeback_control *wbc);
+
 static int cifs_writepages(struct address_space *mapping,
 			   struct writeback_control *wbc)
 {
@@ -1447,6 +1797,12 @@ retry:
 				break;
 			}
 
+			/* a page caching part of its data is written alone */
+			if (first >= 0 && PagePrivate(page)) {
+				unlock_page(page);
+				break;
+			}
+
 			if (wbc->sync_mode != WB_SYNC_NONE)
 				wait_on_page_writeback(page);
 
@@ -1456,6 +1812,12 @@ retry:
 				break;
 			}
 
+			if (PagePrivate(page)) {
+				rc = cifs_writepage(page, wbc);
+				wbc->nr_to_write--;
+				break;
+			}
+
 			/*
 			 * This actually clears the dirty bit in the radix tree.
 			 * See cifs_writepage() for more commentary.
@@ -1509,6 +1871,8 @@ retry:
 						   long_op);
 				cifsFileInfo_put(open_file);
 				cifs_update_eof(cifsi, offset, bytes_written);
+				trace_cifs_writepages(mapping->host, offset,
+						      n_iov, bytes_written, rc);
 
 				if (rc || bytes_written < bytes_to_write) {
 					cERROR(1, ("Write2 ret %d, wrote %d",
@@ -1586,8 +1950,18 @@ static int cifs_writepage(struct page *page, struct writeback_control *wbc)
 	 * to fail to update with the state of the page correctly.
 	 */
 	set_page_writeback(page);
-	rc = cifs_partialpagewrite(page, 0, PAGE_CACHE_SIZE);
-	SetPageUptodate(page); /* BB add check for error and Clearuptodate? */
+	if (PagePrivate(page)) {
+		unsigned from, to;
+
+		/* only part of the page holds data, see cifs_write_begin */
+		cifs_page_get_range(page, &from, &to);
+		rc = cifs_partialpagewrite(page, from, to);
+		cifs_page_clear_range(page);
+	} else {
+		rc = cifs_partialpagewrite(page, 0, PAGE_CACHE_SIZE);
+		/* BB add check for error and Clearuptodate? */
+		SetPageUptodate(page);
+	}
 	unlock_page(page);
 	end_page_writeback(page);
 	page_cache_release(page);
@@ -1613,23 +1987,22 @@ static int cifs_write_end(struct file *file, struct address_space *mapping,
 		SetPageUptodate(page);
 
 	if (!PageUptodate(page)) {
-		char *page_data;
 		unsigned offset = pos & (PAGE_CACHE_SIZE - 1);
-		int xid;
-
-		xid = GetXid();
-		/* this is probably better than directly calling
-		   partialpage_write since in this function the file handle is
-		   known which we might as well	leverage */
-		/* BB check if anything else missing out of ppw
-		   such as updating last write time */
-		page_data = kmap(page);
-		rc = cifs_write(file, page_data + offset, copied, &pos);
-		/* if (rc < 0) should we set writebehind rc? */
-		kunmap(page);
 
-		FreeXid(xid);
+		/*
+		 * cache just the bytes written, to be written back on their
+		 * own. If a short copy left them apart from those the page
+		 * already holds, have the caller retry the write.
+		 */
+		if (copied && cifs_page_add_range(page, offset, copied)) {
+			rc = copied;
+			pos += copied;
+			set_page_dirty(page);
+		} else
+			rc = 0;
 	} else {
+		if (PagePrivate(page))
+			cifs_page_clear_range(page);
 		rc = copied;
 		pos += copied;
 		set_page_dirty(page);
@@ -1774,7 +2147,7 @@ ssize_t cifs_user_read(struct file *file, char __user *read_data,
 			int buf_type = CIFS_NO_BUFFER;
 			if ((open_file->invalidHandle) &&
 			    (!open_file->closePend)) {
-				rc = cifs_reopen_file(file, true);
+				rc = cifs_reopen_file(open_file, true);
 				if (rc != 0)
 					break;
 			}
@@ -1860,7 +2233,7 @@ static ssize_t cifs_read(struct file *file, char *read_data, size_t read_size,
 		while (rc == -EAGAIN) {
 			if ((open_file->invalidHandle) &&
 			    (!open_file->closePend)) {
-				rc = cifs_reopen_file(file, true);
+				rc = cifs_reopen_file(open_file, true);
 				if (rc != 0)
 					break;
 			}
@@ -2018,7 +2391,7 @@ static int cifs_readpages(struct file *file, struct address_space *mapping,
 		while (rc == -EAGAIN) {
 			if ((open_file->invalidHandle) &&
 			    (!open_file->closePend)) {
-				rc = cifs_reopen_file(file, true);
+				rc = cifs_reopen_file(open_file, true);
 				if (rc != 0)
 					break;
 			}
@@ -2028,6 +2401,8 @@ static int cifs_readpages(struct file *file, struct address_space *mapping,
 					 read_size, offset,
 					 &bytes_read, &smb_read_data,
 					 &buf_type);
+			trace_cifs_readpages(mapping->host, offset,
+					     contig_pages, bytes_read, rc);
 			/* BB more RC checks ? */
 			if (rc == -EAGAIN) {
 				if (smb_read_data) {
@@ -2145,6 +2520,9 @@ static int cifs_readpage(struct file *file, struct page *page)
 	cFYI(1, ("readpage %p at offset %d 0x%x\n",
 		 page, (int)offset, (int)offset));
 
+	/* do not read over data cached by a partial page write */
+	cifs_page_flush_range(page);
+
 	rc = cifs_readpage_worker(file, page, &offset);
 
 	unlock_page(page);
@@ -2226,8 +2604,8 @@ static int cifs_write_begin(struct file *file, struct address_space *mapping,
 
 	/*
 	 * If we write a full page it will be up to date, no need to read from
-	 * the server. If the write is short, we'll end up doing a sync write
-	 * instead.
+	 * the server. If the write is short, cifs_write_end will cache just
+	 * the bytes copied.
 	 */
 	if (len == PAGE_CACHE_SIZE)
 		goto out;
@@ -2238,7 +2616,7 @@ static int cifs_write_begin(struct file *file, struct address_space *mapping,
 	 * is, when the page lies beyond the EOF, or straddles the EOF
 	 * and the write will cover all of the existing data.
 	 */
-	if (CIFS_I(mapping->host)->clientCanCacheRead) {
+	if (CIFS_I(mapping->host)->clientCanCacheRead && !PagePrivate(page)) {
 		i_size = i_size_read(mapping->host);
 		if (page_start >= i_size ||
 		    (offset == 0 && (pos + len) >= i_size)) {
@@ -2256,45 +2634,100 @@ static int cifs_write_begin(struct file *file, struct address_space *mapping,
 		}
 	}
 
-	if ((file->f_flags & O_ACCMODE) != O_WRONLY) {
+	if (CIFS_I(mapping->host)->clientCanCacheRead && !PagePrivate(page) &&
+	    (file->f_flags & O_ACCMODE) != O_WRONLY) {
 		/*
-		 * might as well read a page, it is fast enough. If we get
+		 * with a read oplock the page can be kept for later reads,
+		 * so might as well read it, it is fast enough. If we get
 		 * an error, we don't need to return it. cifs_write_end will
-		 * do a sync write instead since PG_uptodate isn't set.
+		 * cache just the bytes written since PG_uptodate isn't set.
 		 */
 		cifs_readpage_worker(file, page, &page_start);
-	} else {
-		/* we could try using another file handle if there is one -
-		   but how would we lock it to prevent close of that handle
-		   racing with this read? In any case
-		   this will be written out by write_end so is fine */
+	} else if (PagePrivate(page)) {
+		/*
+		 * Otherwise do not read the page just to write part of it,
+		 * cifs_write_end caches only the bytes written. The page can
+		 * hold one range of them, so if this write will not join up
+		 * with the range already there, write that back first.
+		 */
+		unsigned start, end;
+
+		cifs_page_get_range(page, &start, &end);
+		if (offset > end || offset + len < start)
+			cifs_page_flush_range(page);
 	}
 out:
 	*pagep = page;
 	return rc;
 }
 
-static void
-cifs_oplock_break(struct slow_work *work)
+/*
+ * Write out up to one chunk of the dirty pages of a file whose oplock is
+ * being broken, so that breaks of other files on the server are not held
+ * up behind a large flush. Returns true once nothing is left to write.
+ */
+static bool
+cifs_oplock_break_flush(struct cifsFileInfo *cfile)
+{
+	struct inode *inode = cfile->pInode;
+	struct writeback_control wbc = {
+		.sync_mode = WB_SYNC_NONE,
+		.nr_to_write = CIFS_OPLOCK_BREAK_CHUNK,
+		.range_start = 0,
+		.range_end = LLONG_MAX,
+	};
+	int rc;
+
+	rc = cifs_writepages(inode->i_mapping, &wbc);
+	if (rc) {
+		CIFS_I(inode)->write_behind_rc = rc;
+		return true;
+	}
+	return wbc.nr_to_write > 0;
+}
+
+/* returns false if the break needs another turn */
+static bool
+cifs_oplock_break(struct cifsFileInfo *cfile)
 {
-	struct cifsFileInfo *cfile = container_of(work, struct cifsFileInfo,
-						  oplock_break);
 	struct inode *inode = cfile->pInode;
 	struct cifsInodeInfo *cinode = CIFS_I(inode);
 	struct cifs_sb_info *cifs_sb = CIFS_SB(cfile->mnt->mnt_sb);
 	int rc, waitrc = 0;
 
 	if (inode && S_ISREG(inode->i_mode)) {
+		if (!cfile->oplock_break_flushing) {
 #ifdef CONFIG_CIFS_EXPERIMENTAL
-		if (cinode->clientCanCacheAll == 0)
-			break_lease(inode, FMODE_READ);
-		else if (cinode->clientCanCacheRead == 0)
-			break_lease(inode, FMODE_WRITE);
+			if (cinode->clientCanCacheAll == 0)
+				break_lease(inode, FMODE_READ);
+			else if (cinode->clientCanCacheRead == 0)
+				break_lease(inode, FMODE_WRITE);
 #endif
+			cfile->oplock_break_flushing = true;
+		}
+		if (!cifs_oplock_break_flush(cfile))
+			return false;
+		cfile->oplock_break_flushing = false;
+
+		/* pick up whatever the chunks skipped */
 		rc = filemap_fdatawrite(inode->i_mapping);
 		if (cinode->clientCanCacheRead == 0) {
 			waitrc = filemap_fdatawait(inode->i_mapping);
-			invalidate_remote_inode(inode);
+			/*
+			 * Nothing has changed yet. With appendcache keep the
+			 * pages and have the next revalidate drop what the
+			 * other client's changes made stale.
+			 */
+			if (cifs_sb->mnt_cifs_flags & CIFS_MOUNT_APPEND_CACHE) {
+				cinode->time = 0;
+				trace_cifs_revalidate(inode, i_size_read(inode),
+						      CIFS_REVAL_DEFERRED);
+			} else {
+				invalidate_remote_inode(inode);
+				trace_cifs_revalidate(inode, i_size_read(inode),
+						      CIFS_REVAL_INVALIDATE);
+			}
+			cifs_ea_cache_invalidate(inode);
 		}
 		if (!rc)
 			rc = waitrc;
@@ -2313,33 +2746,132 @@ cifs_oplock_break(struct slow_work *work)
 		rc = CIFSSMBLock(0, cifs_sb->tcon, cfile->netfid, 0, 0, 0, 0,
 				 LOCKING_ANDX_OPLOCK_RELEASE, false);
 		cFYI(1, ("Oplock release rc = %d", rc));
+		trace_cifs_oplock_break(cifs_sb->tcon, cfile->netfid, 0, true,
+					rc);
+#ifdef CONFIG_CIFS_STATS2
+		cifs_hist_add_usecs(&cifs_sb->tcon->ses->server->
+					oplock_break_time,
+				    cfile->oplock_break_start);
+#endif
 	}
+	return true;
 }
 
-static int
-cifs_oplock_break_get(struct slow_work *work)
+/**
+ * cifs_queue_oplock_break	-	hand an oplock break to cifsoplockd
+ * @cfile:	file the server broke the oplock of
+ *
+ * Called from the demultiplex thread with spinlocks held. Returns false
+ * if the break was already queued.
+ */
+bool
+cifs_queue_oplock_break(struct cifsFileInfo *cfile)
 {
-	struct cifsFileInfo *cfile = container_of(work, struct cifsFileInfo,
-						  oplock_break);
-	mntget(cfile->mnt);
-	cifsFileInfo_get(cfile);
-	return 0;
+	struct TCP_Server_Info *server = CIFS_SB(cfile->mnt->mnt_sb)->tcon->
+						ses->server;
+	bool queued = false;
+
+	spin_lock(&server->oplock_break_lock);
+	if (list_empty(&cfile->oplock_break_list)) {
+		mntget(cfile->mnt);
+		cifsFileInfo_get(cfile);
+		list_add_tail(&cfile->oplock_break_list,
+			      &server->oplock_break_q);
+		atomic_inc(&server->oplock_breaks_pending);
+		queued = true;
+	}
+	spin_unlock(&server->oplock_break_lock);
+	if (queued)
+		wake_up_process(server->oplock_tsk);
+	return queued;
 }
 
 static void
-cifs_oplock_break_put(struct slow_work *work)
+cifs_oplock_break_done(struct TCP_Server_Info *server,
+		       struct cifsFileInfo *cfile)
 {
-	struct cifsFileInfo *cfile = container_of(work, struct cifsFileInfo,
-						  oplock_break);
-	mntput(cfile->mnt);
+	struct vfsmount *mnt = cfile->mnt;
+
+	/* let requests held back for the break go */
+	if (atomic_dec_and_test(&server->oplock_breaks_pending))
+		wake_up_all(&server->request_q);
+	/* may be the last references to the mount, and so to the server */
 	cifsFileInfo_put(cfile);
+	mntput(mnt);
 }
 
-const struct slow_work_ops cifs_oplock_break_ops = {
-	.get_ref	= cifs_oplock_break_get,
-	.put_ref	= cifs_oplock_break_put,
-	.execute	= cifs_oplock_break,
-};
+/*
+ * cifsoplockd: one per server, so that oplock breaks do not wait behind
+ * other work. Breaks are handled in turn, a chunk of writeback at a time.
+ */
+int
+cifs_oplock_break_thread(void *data)
+{
+	struct TCP_Server_Info *server = data;
+	struct cifsFileInfo *cfile;
+
+	while (!kthread_should_stop()) {
+		spin_lock(&server->oplock_break_lock);
+		if (list_empty(&server->oplock_break_q)) {
+			set_current_state(TASK_INTERRUPTIBLE);
+			spin_unlock(&server->oplock_break_lock);
+			if (!kthread_should_stop())
+				schedule();
+			__set_current_state(TASK_RUNNING);
+			continue;
+		}
+		cfile = list_first_entry(&server->oplock_break_q,
+					 struct cifsFileInfo, oplock_break_list);
+		list_del_init(&cfile->oplock_break_list);
+		spin_unlock(&server->oplock_break_lock);
+
+#ifdef CONFIG_CIFS_STATS2
+		if (!cfile->oplock_break_flushing)
+			cifs_hist_add_usecs(&server->oplock_break_wait,
+					    cfile->oplock_break_start);
+#endif
+		if (cifs_oplock_break(cfile)) {
+			cifs_oplock_break_done(server, cfile);
+			continue;
+		}
+
+		/* more to write, go to the back of the queue */
+		spin_lock(&server->oplock_break_lock);
+		if (list_empty(&cfile->oplock_break_list)) {
+			list_add_tail(&cfile->oplock_break_list,
+				      &server->oplock_break_q);
+			cfile = NULL;
+		}
+		spin_unlock(&server->oplock_break_lock);
+		/* broken again meanwhile and queued with its own refs */
+		if (cfile) {
+			cfile->oplock_break_flushing = false;
+			cifs_oplock_break_done(server, cfile);
+		}
+		cond_resched();
+	}
+	return 0;
+}
+
+static int cifs_release_page(struct page *page, gfp_t gfp)
+{
+	/* a page caching a written range is dirty, do not let it go */
+	return !PagePrivate(page);
+}
+
+static void cifs_invalidate_page(struct page *page, unsigned long offset)
+{
+	unsigned start, end;
+
+	if (!PagePrivate(page))
+		return;
+
+	cifs_page_get_range(page, &start, &end);
+	if (start >= offset)
+		cifs_page_clear_range(page);
+	else if (end > offset)
+		cifs_page_set_range(page, start, offset);
+}
 
 const struct address_space_operations cifs_addr_ops = {
 	.readpage = cifs_readpage,
@@ -2349,6 +2881,8 @@ const struct address_space_operations cifs_addr_ops = {
 	.write_begin = cifs_write_begin,
 	.write_end = cifs_write_end,
 	.set_page_dirty = __set_page_dirty_nobuffers,
+	.releasepage = cifs_release_page,
+	.invalidatepage = cifs_invalidate_page,
 	/* .sync_page = cifs_sync_page, */
 	/* .direct_IO = */
 };
@@ -2365,6 +2899,8 @@ const struct address_space_operations cifs_addr_ops_smallbuf = {
 	.write_begin = cifs_write_begin,
 	.write_end = cifs_write_end,
 	.set_page_dirty = __set_page_dirty_nobuffers,
+	.releasepage = cifs_release_page,
+	.invalidatepage = cifs_invalidate_page,
 	/* .sync_page = cifs_sync_page, */
 	/* .direct_IO = */
 };
@@ -21,6 +21,7 @@
 #include <linux/fs.h>
 #include <linux/stat.h>
 #include <linux/pagemap.h>
+#include <linux/falloc.h>
 #include <asm/div64.h>
 #include "cifsfs.h"
 #include "cifspdu.h"
@@ -28,6 +29,7 @@
 #include "cifsproto.h"
 #include "cifs_debug.h"
 #include "cifs_fs_sb.h"
+#include "cifs_trace.h"
 
 
 static void cifs_set_ops(struct inode *inode, const bool is_dfs_referral)
@@ -440,6 +442,7 @@ int cifs_get_inode_info(struct inode **pinode,
 	struct cifs_sb_info *cifs_sb = CIFS_SB(sb);
 	char *buf = NULL;
 	bool adjustTZ = false;
+	__u64 index_number = 0;
 	struct cifs_fattr fattr;
 
 	pTcon = cifs_sb->tcon;
@@ -473,6 +476,9 @@ int cifs_get_inode_info(struct inode **pinode,
 					cifs_sb->mnt_cifs_flags &
 					  CIFS_MOUNT_MAP_SPECIAL_CHR);
 			adjustTZ = true;
+		} else if (!rc) {
+			/* zero unless the server returned it with the rest */
+			index_number = le64_to_cpu(pfindData->IndexNumber);
 		}
 	}
 
@@ -502,23 +508,29 @@ int cifs_get_inode_info(struct inode **pinode,
 	 * There may be higher info levels that work but are there Windows
 	 * server or network appliances for which IndexNumber field is not
 	 * guaranteed unique?
+	 *
+	 * When the passthrough all info level was used to query the path,
+	 * the IndexNumber came back with the attributes and no second
+	 * request is needed.
 	 */
 	if (*pinode == NULL) {
 		if (cifs_sb->mnt_cifs_flags & CIFS_MOUNT_SERVER_INUM) {
 			int rc1 = 0;
 
-			rc1 = CIFSGetSrvInodeNumber(xid, pTcon,
+			fattr.cf_uniqueid = index_number;
+			if (!fattr.cf_uniqueid)
+				rc1 = CIFSGetSrvInodeNumber(xid, pTcon,
 					full_path, &fattr.cf_uniqueid,
 					cifs_sb->local_nls,
 					cifs_sb->mnt_cifs_flags &
 						CIFS_MOUNT_MAP_SPECIAL_CHR);
 			if (rc1 || !fattr.cf_uniqueid) {
 				cFYI(1, ("GetSrvInodeNum rc %d", rc1));
-				fattr.cf_uniqueid = iunique(sb, ROOT_I);
+				fattr.cf_uniqueid = cifs_new_uniqueid(sb);
 				cifs_autodisable_serverino(cifs_sb);
 			}
 		} else {
-			fattr.cf_uniqueid = iunique(sb, ROOT_I);
+			fattr.cf_uniqueid = cifs_new_uniqueid(sb);
 		}
 	} else {
 		fattr.cf_uniqueid = CIFS_I(*pinode)->uniqueid;
@@ -602,6 +614,29 @@ char *cifs_build_path_to_root(struct cifs_sb_info *cifs_sb)
 	return full_path;
 }
 
+/*
+ * Pick an inode number for a file the server gave us none for. While no
+ * inode numbered by the server can be in the inode hash for this mount, a
+ * per mount counter is enough to keep numbers unique, which saves the
+ * hash scan under a global lock done by iunique(). Once server numbers
+ * may have been used, or the counter runs into the upper half of the
+ * ino_t range, fall back to iunique() for good.
+ */
+u64
+cifs_new_uniqueid(struct super_block *sb)
+{
+	struct cifs_sb_info *cifs_sb = CIFS_SB(sb);
+	unsigned long ino;
+
+	if (cifs_sb->local_ino) {
+		ino = atomic_long_inc_return(&cifs_sb->next_ino);
+		if (ino > ROOT_I && ino <= LONG_MAX)
+			return ino;
+		cifs_sb->local_ino = false;
+	}
+	return iunique(sb, ROOT_I);
+}
+
 static int
 cifs_find_inode(struct inode *inode, void *opaque)
 {
@@ -619,6 +654,7 @@ cifs_init_inode(struct inode *inode, void *opaque)
 	struct cifs_fattr *fattr = (struct cifs_fattr *) opaque;
 
 	CIFS_I(inode)->uniqueid = fattr->cf_uniqueid;
+	inode->i_data.backing_dev_info = &CIFS_SB(inode->i_sb)->bdi;
 	return 0;
 }
 
@@ -1388,6 +1424,30 @@ cifs_rename_exit:
 	return rc;
 }
 
+/*
+ * The file changed on the server, so drop cached pages that may be stale.
+ * With the appendcache mount option a file that only grew is taken to
+ * have been appended to: the pages below the page holding the old EOF
+ * are still good and are kept, so that a reader tailing a growing log
+ * does not read the whole file again.
+ */
+void
+cifs_invalidate_changed(struct inode *inode, loff_t old_size,
+			loff_t new_size)
+{
+	if ((CIFS_SB(inode->i_sb)->mnt_cifs_flags & CIFS_MOUNT_APPEND_CACHE) &&
+	    old_size > 0 && new_size > old_size) {
+		cFYI(1, ("keeping cached data below old eof %lld",
+			 (long long)old_size));
+		invalidate_mapping_pages(inode->i_mapping,
+					 old_size >> PAGE_CACHE_SHIFT, -1);
+		trace_cifs_revalidate(inode, old_size, CIFS_REVAL_APPENDED);
+		return;
+	}
+	invalidate_remote_inode(inode);
+	trace_cifs_revalidate(inode, old_size, CIFS_REVAL_INVALIDATE);
+}
+
 int cifs_revalidate(struct dentry *direntry)
 {
 	int xid;
@@ -1473,6 +1533,8 @@ int cifs_revalidate(struct dentry *direntry)
 	if (timespec_equal(&local_mtime, &direntry->d_inode->i_mtime) &&
 	    (local_size == direntry->d_inode->i_size)) {
 		cFYI(1, ("cifs_revalidate - inode unchanged"));
+		trace_cifs_revalidate(direntry->d_inode, local_size,
+				      CIFS_REVAL_UNCHANGED);
 	} else {
 		/* file may have changed on server */
 		if (cifsInode->clientCanCacheRead) {
@@ -1507,12 +1569,17 @@ int cifs_revalidate(struct dentry *direntry)
 				if (wbrc)
 					CIFS_I(direntry->d_inode)->write_behind_rc = wbrc;
 			}
-			/* may eventually have to do this for open files too */
-			if (list_empty(&(cifsInode->openFileList))) {
+			/* may eventually have to do this for open files too,
+			   appendcache already does since an oplock break
+			   leaves the pages to be checked here */
+			if (list_empty(&(cifsInode->openFileList)) ||
+			    (cifs_sb->mnt_cifs_flags &
+			     CIFS_MOUNT_APPEND_CACHE)) {
 				/* changed on server - flush read ahead pages */
 				cFYI(1, ("Invalidating read ahead data on "
 					 "closed file"));
-				invalidate_remote_inode(direntry->d_inode);
+				cifs_invalidate_changed(direntry->d_inode,
+					local_size, direntry->d_inode->i_size);
 			}
 		}
 	}
@@ -1926,6 +1993,168 @@ cifs_setattr(struct dentry *direntry, struct iattr *attrs)
 	/* BB: add cifs_setattr_legacy for really old servers */
 }
 
+/*
+ * Preallocate by raising the allocation size of the file on the server,
+ * and unless FALLOC_FL_KEEP_SIZE is set also extend the end of file.  The
+ * allocation size covers the file from offset zero, so it is never lowered
+ * here (that would truncate the file on some servers).
+ */
+long cifs_fallocate(struct inode *inode, int mode, loff_t offset, loff_t len)
+{
+	int xid;
+	int rc;
+	loff_t end = offset + len;
+	struct cifsInodeInfo *cifsInode = CIFS_I(inode);
+	struct cifsTconInfo *pTcon = CIFS_SB(inode->i_sb)->tcon;
+	struct cifsFileInfo *open_file;
+
+	if (mode & ~FALLOC_FL_KEEP_SIZE)
+		return -EOPNOTSUPP;
+
+	/* fallocate requires a file open for write, so we should find it */
+	open_file = find_writable_file(cifsInode);
+	if (open_file == NULL)
+		return -EBADF;
+
+	xid = GetXid();
+	mutex_lock(&inode->i_mutex);
+
+	if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+		rc = inode_newsize_ok(inode, end);
+		if (rc)
+			goto fallocate_exit;
+	}
+
+	/* write out cached data so the server end of file is current */
+	rc = filemap_write_and_wait(inode->i_mapping);
+	if (rc)
+		goto fallocate_exit;
+
+	if ((end > ((loff_t)inode->i_blocks << 9)) &&
+	    (end > cifsInode->server_eof) && (end > i_size_read(inode))) {
+		rc = CIFSSMBSetFileSize(xid, pTcon, end, open_file->netfid,
+					open_file->pid, true);
+		cFYI(1, ("SetAllocationSize to %lld rc = %d", end, rc));
+		if (rc)
+			goto fallocate_exit;
+		spin_lock(&inode->i_lock);
+		inode->i_blocks = (512 - 1 + end) >> 9;
+		spin_unlock(&inode->i_lock);
+	}
+
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && (end > i_size_read(inode))) {
+		rc = CIFSSMBSetFileSize(xid, pTcon, end, open_file->netfid,
+					open_file->pid, false);
+		cFYI(1, ("SetFSize for fallocate rc = %d", rc));
+		if (rc == 0) {
+			cifsInode->server_eof = end;
+			rc = cifs_vmtruncate(inode, end);
+		}
+	}
+
+fallocate_exit:
+	mutex_unlock(&inode->i_mutex);
+	cifsFileInfo_put(open_file);
+	FreeXid(xid);
+	return rc;
+}
+
+/* max allocated ranges returned by one FSCTL_QUERY_ALLOCATED_RANGES */
+#define CIFS_FIEMAP_MAX_RANGES 64
+
+/*
+ * Report the allocated ranges of a (possibly sparse) file.  The server
+ * does not tell us where the data lives on disk, so all extents are
+ * flagged FIEMAP_EXTENT_UNKNOWN.  If the server can not query allocated
+ * ranges the whole file is reported as one extent.
+ */
+int cifs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+		u64 start, u64 len)
+{
+	int xid;
+	int rc;
+	unsigned int i, count;
+	u64 end, window, range_start, range_len;
+	u64 orig_start = start;
+	u32 flags;
+	struct cifsTconInfo *pTcon = CIFS_SB(inode->i_sb)->tcon;
+	struct cifsFileInfo *open_file;
+	struct file_allocated_range_buffer *ranges;
+
+	rc = fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC);
+	if (rc)
+		return rc;
+
+	end = i_size_read(inode);
+	if (start >= end)
+		return 0;
+	if (len < end - start)
+		end = start + len;
+
+	open_file = find_readable_file(CIFS_I(inode));
+	if (open_file == NULL) {
+		rc = -EBADF;
+		goto fiemap_whole_file;
+	}
+
+	ranges = kmalloc(CIFS_FIEMAP_MAX_RANGES * sizeof(*ranges), GFP_KERNEL);
+	if (ranges == NULL) {
+		cifsFileInfo_put(open_file);
+		return -ENOMEM;
+	}
+
+	xid = GetXid();
+	window = end - start;
+	while (start < end) {
+		count = CIFS_FIEMAP_MAX_RANGES;
+		rc = CIFSSMBQueryAllocRanges(xid, pTcon, open_file->netfid,
+					     start, min(window, end - start),
+					     ranges, &count);
+		if (rc == -EOVERFLOW && window > PAGE_CACHE_SIZE) {
+			/* too many ranges to fit in our buffer, ask for less */
+			window >>= 1;
+			continue;
+		} else if (rc)
+			break;
+
+		for (i = 0; i < count; i++) {
+			range_start = le64_to_cpu(ranges[i].FileOffset);
+			range_len = le64_to_cpu(ranges[i].Length);
+			if (range_start + range_len > end)
+				range_len = end - range_start;
+			flags = FIEMAP_EXTENT_UNKNOWN;
+			if (range_start + range_len >= i_size_read(inode))
+				flags |= FIEMAP_EXTENT_LAST;
+			rc = fiemap_fill_next_extent(fieinfo, range_start, 0,
+						     range_len, flags);
+			if (rc)
+				break;
+		}
+		if (rc)
+			break;
+		start += min(window, end - start);
+	}
+	/* fiemap_fill_next_extent returns 1 once the user buffer is full */
+	if (rc == 1)
+		rc = 0;
+
+	kfree(ranges);
+	cifsFileInfo_put(open_file);
+	FreeXid(xid);
+
+fiemap_whole_file:
+	if (rc && rc != -EFAULT && fieinfo->fi_extents_mapped == 0) {
+		cFYI(1, ("query allocated ranges failed %d", rc));
+		rc = fiemap_fill_next_extent(fieinfo, orig_start, 0,
+					     end - orig_start,
+					     FIEMAP_EXTENT_UNKNOWN |
+					     FIEMAP_EXTENT_LAST);
+		if (rc == 1)
+			rc = 0;
+	}
+	return rc;
+}
+
 #if 0
 void cifs_delete_inode(struct inode *inode)
 {
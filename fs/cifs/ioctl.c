@@ -22,6 +22,9 @@
  */
 
 #include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/pagemap.h>
+#include <asm/uaccess.h>
 #include "cifspdu.h"
 #include "cifsglob.h"
 #include "cifsproto.h"
@@ -29,6 +32,248 @@
 #include "cifsfs.h"
 
 #define CIFS_IOC_CHECKUMOUNT _IO(0xCF, 2)
+#define CIFS_IOC_COPYCHUNK_FILE _IOW(0xCF, 3, int)
+#define CIFS_IOC_PUNCH_HOLE _IOW(0xCF, 4, struct cifs_punch_hole)
+
+struct cifs_punch_hole {
+	__u64 offset;
+	__u64 length;
+};
+
+/* copy from *poff up to end through the page cache of both files */
+static int
+cifs_client_copy(struct file *src_file, struct file *dst_file, loff_t *poff,
+		 loff_t end)
+{
+	char *buf;
+	mm_segment_t old_fs;
+	ssize_t bytes_read, bytes_written;
+	loff_t rpos, wpos;
+	int rc = 0;
+
+	buf = (char *)__get_free_page(GFP_KERNEL);
+	if (buf == NULL)
+		return -ENOMEM;
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	while (*poff < end) {
+		if (fatal_signal_pending(current)) {
+			rc = -EINTR;
+			break;
+		}
+		rpos = wpos = *poff;
+		bytes_read = vfs_read(src_file, (char __user *)buf,
+				      min_t(loff_t, end - *poff, PAGE_SIZE),
+				      &rpos);
+		if (bytes_read <= 0) {
+			/* source shrank under us, copy what is there */
+			rc = bytes_read;
+			break;
+		}
+		bytes_written = vfs_write(dst_file, (char __user *)buf,
+					  bytes_read, &wpos);
+		if (bytes_written != bytes_read) {
+			rc = bytes_written < 0 ? bytes_written : -EIO;
+			break;
+		}
+		*poff += bytes_written;
+		cond_resched();
+	}
+	set_fs(old_fs);
+
+	free_page((unsigned long)buf);
+	return rc;
+}
+
+/* old style whole file server side copy via SMB_COM_COPY */
+static int
+cifs_copy_file(int xid, struct file *src_file, struct file *dst_file)
+{
+	struct cifs_sb_info *src_sb = CIFS_SB(src_file->f_path.dentry->d_sb);
+	struct cifs_sb_info *dst_sb = CIFS_SB(dst_file->f_path.dentry->d_sb);
+	char *from, *to;
+	int rc;
+
+	from = build_path_from_dentry(src_file->f_path.dentry);
+	to = build_path_from_dentry(dst_file->f_path.dentry);
+	if (from == NULL || to == NULL)
+		rc = -ENOMEM;
+	else
+		rc = CIFSSMBCopy(xid, src_sb->tcon, from, dst_sb->tcon->tid,
+				 to, COPY_MUST_BE_FILE, src_sb->local_nls,
+				 src_sb->mnt_cifs_flags &
+					CIFS_MOUNT_MAP_SPECIAL_CHR);
+	kfree(from);
+	kfree(to);
+	return rc;
+}
+
+/*
+ * Zero a range of the file on the server.  The file is made sparse first
+ * so that the server can release the space backing the range, but servers
+ * which do not support sparse files will still zero it.
+ */
+static int
+cifs_ioctl_punch_hole(int xid, struct file *filep, unsigned long arg)
+{
+	struct inode *inode = filep->f_path.dentry->d_inode;
+	struct cifsFileInfo *pSMBFile = filep->private_data;
+	struct cifsTconInfo *tcon = CIFS_SB(inode->i_sb)->tcon;
+	struct cifs_punch_hole hole;
+	int rc;
+
+	if (!(filep->f_mode & FMODE_WRITE) || pSMBFile == NULL)
+		return -EBADF;
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+	if (copy_from_user(&hole, (void __user *)arg, sizeof(hole)))
+		return -EFAULT;
+	/* both ends must be valid file offsets */
+	if (hole.offset > LLONG_MAX || hole.length > LLONG_MAX - hole.offset)
+		return -EINVAL;
+	if (hole.length == 0)
+		return 0;
+
+	/* keep writers out while the cached and server copies differ */
+	mutex_lock(&inode->i_mutex);
+	rc = filemap_write_and_wait_range(inode->i_mapping, hole.offset,
+					  hole.offset + hole.length - 1);
+	if (rc)
+		goto out_unlock;
+
+	rc = CIFSSMBSetSparse(xid, tcon, pSMBFile->netfid);
+	if (rc)
+		cFYI(1, ("could not make file sparse %d", rc));
+	rc = CIFSSMBZeroData(xid, tcon, pSMBFile->netfid, hole.offset,
+			     hole.length);
+	if (rc)
+		goto out_unlock;
+
+	invalidate_inode_pages2_range(inode->i_mapping,
+			hole.offset >> PAGE_CACHE_SHIFT,
+			(hole.offset + hole.length - 1) >> PAGE_CACHE_SHIFT);
+	CIFS_I(inode)->time = 0;	/* allocation size changed */
+out_unlock:
+	mutex_unlock(&inode->i_mutex);
+	return rc;
+}
+
+/*
+ * Replace the contents of dst_file with those of the file open as srcfd.
+ * When both files are on the same smb session the data is copied on the
+ * server with FSCTL_SRV_COPYCHUNK, a batch of chunks at a time so that the
+ * copy can be interrupted, or failing that with SMB_COM_COPY.  Otherwise,
+ * or if the server cannot do either, the data is copied through the client.
+ */
+static int
+cifs_ioctl_copychunk(int xid, struct file *dst_file, unsigned long srcfd)
+{
+	struct inode *dst_inode = dst_file->f_path.dentry->d_inode;
+	struct cifsFileInfo *dst_cfile = dst_file->private_data;
+	struct cifsTconInfo *dst_tcon = CIFS_SB(dst_inode->i_sb)->tcon;
+	struct file *src_file;
+	struct inode *src_inode;
+	struct cifsFileInfo *src_cfile;
+	struct cifsTconInfo *src_tcon;
+	char key[COPY_CHUNK_RES_KEY_SIZE];
+	loff_t size, off = 0;
+	__u32 len, written;
+	int rc;
+
+	if (!(dst_file->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (dst_file->f_flags & O_APPEND)
+		return -EINVAL;
+
+	src_file = fget(srcfd);
+	if (src_file == NULL)
+		return -EBADF;
+	src_inode = src_file->f_path.dentry->d_inode;
+	src_cfile = src_file->private_data;
+
+	if (!(src_file->f_mode & FMODE_READ) || !src_cfile || !dst_cfile) {
+		rc = -EBADF;
+		goto out_fput;
+	}
+	if (src_inode->i_sb->s_type != dst_inode->i_sb->s_type) {
+		rc = -EXDEV;
+		goto out_fput;
+	}
+	if (!S_ISREG(src_inode->i_mode) || !S_ISREG(dst_inode->i_mode) ||
+	    src_inode == dst_inode) {
+		rc = -EINVAL;
+		goto out_fput;
+	}
+	src_tcon = CIFS_SB(src_inode->i_sb)->tcon;
+
+	/* the server copies what it has, so get our dirty data to it first */
+	rc = filemap_write_and_wait(src_inode->i_mapping);
+	if (rc == 0)
+		rc = filemap_write_and_wait(dst_inode->i_mapping);
+	if (rc == 0)
+		rc = cifs_revalidate(src_file->f_path.dentry);
+	if (rc)
+		goto out_fput;
+
+	size = i_size_read(src_inode);
+	if (i_size_read(dst_inode) > size) {
+		rc = CIFSSMBSetFileSize(xid, dst_tcon, size, dst_cfile->netfid,
+					current->tgid, false);
+		if (rc)
+			goto out_fput;
+		spin_lock(&dst_inode->i_lock);
+		i_size_write(dst_inode, size);
+		spin_unlock(&dst_inode->i_lock);
+		truncate_inode_pages(dst_inode->i_mapping, size);
+	}
+
+	if (src_tcon->ses != dst_tcon->ses)
+		goto client_copy;
+
+	rc = CIFSSMBGetResumeKey(xid, src_tcon, src_cfile->netfid, key);
+	while (rc == 0 && off < size) {
+		if (fatal_signal_pending(current)) {
+			rc = -EINTR;
+			break;
+		}
+		len = min_t(loff_t, size - off, CIFS_COPYCHUNK_MAX_CHUNKS *
+						CIFS_COPYCHUNK_CHUNK_SIZE);
+		rc = CIFSSMBCopyChunk(xid, dst_tcon, dst_cfile->netfid, key,
+				      off, off, len, CIFS_COPYCHUNK_CHUNK_SIZE,
+				      &written);
+		if (rc == 0 && written == 0)
+			rc = -EIO;
+		off += written;
+		cFYI(1, ("copychunk copied %lld of %lld bytes", off, size));
+	}
+	if (rc == 0 || rc == -EINTR)
+		goto out_invalidate;
+	cFYI(1, ("server side copy failed with %d after %lld bytes", rc, off));
+
+	if (off == 0 && cifs_copy_file(xid, src_file, dst_file) == 0) {
+		off = size;
+		rc = 0;
+		goto out_invalidate;
+	}
+
+client_copy:
+	rc = cifs_client_copy(src_file, dst_file, &off, size);
+
+out_invalidate:
+	if (off) {
+		/* the server wrote behind our back, drop the stale pages */
+		invalidate_remote_inode(dst_inode);
+		spin_lock(&dst_inode->i_lock);
+		if (off > dst_inode->i_size)
+			i_size_write(dst_inode, off);
+		spin_unlock(&dst_inode->i_lock);
+		CIFS_I(dst_inode)->time = 0;	/* force revalidate */
+	}
+out_fput:
+	fput(src_file);
+	return rc;
+}
 
 long cifs_ioctl(struct file *filep, unsigned int command, unsigned long arg)
 {
@@ -72,6 +317,12 @@ long cifs_ioctl(struct file *filep, unsigned int command, unsigned long arg)
 				cFYI(1, ("uids do not match"));
 			}
 			break;
+		case CIFS_IOC_COPYCHUNK_FILE:
+			rc = cifs_ioctl_copychunk(xid, filep, arg);
+			break;
+		case CIFS_IOC_PUNCH_HOLE:
+			rc = cifs_ioctl_punch_hole(xid, filep, arg);
+			break;
 #ifdef CONFIG_CIFS_POSIX
 		case FS_IOC_GETFLAGS:
 			if (CIFS_UNIX_EXTATTR_CAP & caps) {
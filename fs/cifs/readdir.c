@@ -214,6 +214,8 @@ int get_symlink_reparse_path(char *full_path, struct cifs_sb_info *cifs_sb,
 }
  */
 
+static const struct slow_work_ops cifs_readdir_ahead_ops;
+
 static int initiate_cifs_search(const int xid, struct file *file)
 {
 	int rc = 0;
@@ -223,12 +225,14 @@ static int initiate_cifs_search(const int xid, struct file *file)
 	struct cifsTconInfo *pTcon;
 
 	if (file->private_data == NULL) {
-		file->private_data =
-			kzalloc(sizeof(struct cifsFileInfo), GFP_KERNEL);
+		cifsFile = kzalloc(sizeof(struct cifsFileInfo), GFP_KERNEL);
+		if (cifsFile == NULL)
+			return -ENOMEM;
+		cifsFile->pfile = file;
+		slow_work_init(&cifsFile->readdir_ahead,
+			       &cifs_readdir_ahead_ops);
+		file->private_data = cifsFile;
 	}
-
-	if (file->private_data == NULL)
-		return -ENOMEM;
 	cifsFile = file->private_data;
 	cifsFile->invalidHandle = true;
 	cifsFile->srch_inf.endOfSearch = false;
@@ -420,69 +424,195 @@ static int is_dir_changed(struct file *file)
 }
 
 static int cifs_save_resume_key(const char *current_entry,
-	struct cifsFileInfo *cifsFile)
+	struct cifs_search_info *srch_inf)
 {
 	int rc = 0;
 	unsigned int len = 0;
 	__u16 level;
 	char *filename;
 
-	if ((cifsFile == NULL) || (current_entry == NULL))
+	if ((srch_inf == NULL) || (current_entry == NULL))
 		return -EINVAL;
 
-	level = cifsFile->srch_inf.info_level;
+	level = srch_inf->info_level;
 
 	if (level == SMB_FIND_FILE_UNIX) {
 		FILE_UNIX_INFO *pFindData = (FILE_UNIX_INFO *)current_entry;
 
 		filename = &pFindData->FileName[0];
-		if (cifsFile->srch_inf.unicode) {
+		if (srch_inf->unicode) {
 			len = cifs_unicode_bytelen(filename);
 		} else {
 			/* BB should we make this strnlen of PATH_MAX? */
 			len = strnlen(filename, PATH_MAX);
 		}
-		cifsFile->srch_inf.resume_key = pFindData->ResumeKey;
+		srch_inf->resume_key = pFindData->ResumeKey;
 	} else if (level == SMB_FIND_FILE_DIRECTORY_INFO) {
 		FILE_DIRECTORY_INFO *pFindData =
 			(FILE_DIRECTORY_INFO *)current_entry;
 		filename = &pFindData->FileName[0];
 		len = le32_to_cpu(pFindData->FileNameLength);
-		cifsFile->srch_inf.resume_key = pFindData->FileIndex;
+		srch_inf->resume_key = pFindData->FileIndex;
 	} else if (level == SMB_FIND_FILE_FULL_DIRECTORY_INFO) {
 		FILE_FULL_DIRECTORY_INFO *pFindData =
 			(FILE_FULL_DIRECTORY_INFO *)current_entry;
 		filename = &pFindData->FileName[0];
 		len = le32_to_cpu(pFindData->FileNameLength);
-		cifsFile->srch_inf.resume_key = pFindData->FileIndex;
+		srch_inf->resume_key = pFindData->FileIndex;
 	} else if (level == SMB_FIND_FILE_ID_FULL_DIR_INFO) {
 		SEARCH_ID_FULL_DIR_INFO *pFindData =
 			(SEARCH_ID_FULL_DIR_INFO *)current_entry;
 		filename = &pFindData->FileName[0];
 		len = le32_to_cpu(pFindData->FileNameLength);
-		cifsFile->srch_inf.resume_key = pFindData->FileIndex;
+		srch_inf->resume_key = pFindData->FileIndex;
 	} else if (level == SMB_FIND_FILE_BOTH_DIRECTORY_INFO) {
 		FILE_BOTH_DIRECTORY_INFO *pFindData =
 			(FILE_BOTH_DIRECTORY_INFO *)current_entry;
 		filename = &pFindData->FileName[0];
 		len = le32_to_cpu(pFindData->FileNameLength);
-		cifsFile->srch_inf.resume_key = pFindData->FileIndex;
+		srch_inf->resume_key = pFindData->FileIndex;
 	} else if (level == SMB_FIND_FILE_INFO_STANDARD) {
 		FIND_FILE_STANDARD_INFO *pFindData =
 			(FIND_FILE_STANDARD_INFO *)current_entry;
 		filename = &pFindData->FileName[0];
 		/* one byte length, no name conversion */
 		len = (unsigned int)pFindData->FileNameLength;
-		cifsFile->srch_inf.resume_key = pFindData->ResumeKey;
+		srch_inf->resume_key = pFindData->ResumeKey;
 	} else {
 		cFYI(1, ("Unknown findfirst level %d", level));
 		return -EINVAL;
 	}
-	cifsFile->srch_inf.resume_name_len = len;
-	cifsFile->srch_inf.presume_name = filename;
+	srch_inf->resume_name_len = len;
+	srch_inf->presume_name = filename;
 	return rc;
 }
 
+/*
+ * Readdir-ahead: as soon as a search buffer is handed to filldir, send the
+ * FindNext for the buffer after it from a slow_work thread into srch_next,
+ * so that by the time the caller is through this buffer the next one has
+ * usually arrived and a large directory is not listed one round trip per
+ * buffer.
+ *
+ * CIFS_SRCH_NEXT_QUEUED is set while there is a read ahead whose result
+ * has not been taken, CIFS_SRCH_NEXT_PENDING while the slow_work thread
+ * still owns srch_next. Both are only set from readdir, which the VFS
+ * serializes per directory; closedir and a search restart wait for the
+ * read ahead before freeing the buffers it uses.
+ */
+#define CIFS_SRCH_NEXT_QUEUED	0
+#define CIFS_SRCH_NEXT_PENDING	1
+
+static void
+cifs_readdir_ahead(struct slow_work *work)
+{
+	struct cifsFileInfo *cfile = container_of(work, struct cifsFileInfo,
+						  readdir_ahead);
+	struct cifs_sb_info *cifs_sb;
+	int rc, xid;
+
+	cifs_sb = CIFS_SB(cfile->pfile->f_path.dentry->d_sb);
+	xid = GetXid();
+	rc = CIFSFindNext(xid, cifs_sb->tcon, cfile->netfid, &cfile->srch_next);
+	if (rc == 0 && cfile->srch_next.ntwrk_buf_start)
+		cifs_save_resume_key(cfile->srch_next.last_entry,
+				     &cfile->srch_next);
+	cfile->srch_next_rc = rc;
+	FreeXid(xid);
+}
+
+/* last access to the cifsFileInfo from the slow_work thread */
+static void
+cifs_readdir_ahead_put(struct slow_work *work)
+{
+	struct cifsFileInfo *cfile = container_of(work, struct cifsFileInfo,
+						  readdir_ahead);
+
+	clear_bit_unlock(CIFS_SRCH_NEXT_PENDING, &cfile->srch_next_flags);
+	smp_mb__after_clear_bit();
+	wake_up_bit(&cfile->srch_next_flags, CIFS_SRCH_NEXT_PENDING);
+}
+
+static const struct slow_work_ops cifs_readdir_ahead_ops = {
+	.put_ref	= cifs_readdir_ahead_put,
+	.execute	= cifs_readdir_ahead,
+};
+
+static void
+cifs_readdir_ahead_start(struct cifsFileInfo *cfile)
+{
+	struct cifs_search_info *next = &cfile->srch_next;
+
+	if (cfile->srch_inf.endOfSearch || cfile->invalidHandle ||
+	    cfile->srch_inf.last_entry == NULL)
+		return;
+	if (test_and_set_bit(CIFS_SRCH_NEXT_QUEUED, &cfile->srch_next_flags))
+		return;
+
+	/* resume after the last entry of the current buffer */
+	cifs_save_resume_key(cfile->srch_inf.last_entry, &cfile->srch_inf);
+	*next = cfile->srch_inf;
+	next->ntwrk_buf_start = NULL;
+	next->smallBuf = false;
+
+	set_bit(CIFS_SRCH_NEXT_PENDING, &cfile->srch_next_flags);
+	if (slow_work_enqueue(&cfile->readdir_ahead)) {
+		clear_bit(CIFS_SRCH_NEXT_PENDING, &cfile->srch_next_flags);
+		clear_bit(CIFS_SRCH_NEXT_QUEUED, &cfile->srch_next_flags);
+	}
+}
+
+static int
+cifs_readdir_ahead_wait_bit(void *word)
+{
+	schedule();
+	return 0;
+}
+
+/*
+ * Wait for a read ahead FindNext, if there is one, and if @use make its
+ * response the current search buffer. Returns true if the search moved
+ * on to the next buffer, false if the caller still has to send FindNext.
+ */
+static bool
+cifs_readdir_ahead_finish(struct cifsFileInfo *cfile, bool use)
+{
+	struct cifs_search_info *next = &cfile->srch_next;
+
+	if (!test_bit(CIFS_SRCH_NEXT_QUEUED, &cfile->srch_next_flags))
+		return false;
+	wait_on_bit(&cfile->srch_next_flags, CIFS_SRCH_NEXT_PENDING,
+		    cifs_readdir_ahead_wait_bit, TASK_UNINTERRUPTIBLE);
+	clear_bit(CIFS_SRCH_NEXT_QUEUED, &cfile->srch_next_flags);
+
+	if (!use || cfile->srch_next_rc) {
+		cifs_buf_release(next->ntwrk_buf_start);
+		next->ntwrk_buf_start = NULL;
+		return false;
+	}
+
+	if (next->ntwrk_buf_start == NULL) {
+		/* the server had already closed the search at its end */
+		cfile->srch_inf.endOfSearch = true;
+		return true;
+	}
+
+	if (cfile->srch_inf.smallBuf)
+		cifs_small_buf_release(cfile->srch_inf.ntwrk_buf_start);
+	else
+		cifs_buf_release(cfile->srch_inf.ntwrk_buf_start);
+	cfile->srch_inf = *next;
+	next->ntwrk_buf_start = NULL;
+	return true;
+}
+
+/* drop any read ahead FindNext before the search is closed or restarted */
+void
+cifs_readdir_ahead_discard(struct cifsFileInfo *cfile)
+{
+	cifs_readdir_ahead_finish(cfile, false);
+}
+
 /* find the corresponding entry in the search */
 /* Note that the SMB server returns search entries for . and .. which
    complicates logic here if we choose to parse for them and we do not
@@ -520,6 +650,7 @@ static int find_cifs_entry(const int xid, struct cifsTconInfo *pTcon,
 	   (index_to_find < first_entry_in_buffer)) {
 		/* close and restart search */
 		cFYI(1, ("search backing up - close and restart search"));
+		cifs_readdir_ahead_discard(cifsFile);
 		write_lock(&GlobalSMBSeslock);
 		if (!cifsFile->srch_inf.endOfSearch &&
 		    !cifsFile->invalidHandle) {
@@ -544,15 +675,21 @@ static int find_cifs_entry(const int xid, struct cifsTconInfo *pTcon,
 				 rc));
 			return rc;
 		}
-		cifs_save_resume_key(cifsFile->srch_inf.last_entry, cifsFile);
+		cifs_save_resume_key(cifsFile->srch_inf.last_entry,
+				     &cifsFile->srch_inf);
 	}
 
 	while ((index_to_find >= cifsFile->srch_inf.index_of_last_entry) &&
 	      (rc == 0) && !cifsFile->srch_inf.endOfSearch) {
+		if (cifs_readdir_ahead_finish(cifsFile, true)) {
+			cFYI(1, ("using read ahead findnext"));
+			continue;
+		}
 		cFYI(1, ("calling findnext2"));
 		rc = CIFSFindNext(xid, pTcon, cifsFile->netfid,
 				  &cifsFile->srch_inf);
-		cifs_save_resume_key(cifsFile->srch_inf.last_entry, cifsFile);
+		cifs_save_resume_key(cifsFile->srch_inf.last_entry,
+				     &cifsFile->srch_inf);
 		if (rc)
 			return -ENOENT;
 	}
@@ -584,6 +721,7 @@ static int find_cifs_entry(const int xid, struct cifsTconInfo *pTcon,
 		}
 		rc = 0;
 		*ppCurrentEntry = current_entry;
+		cifs_readdir_ahead_start(cifsFile);
 	} else {
 		cFYI(1, ("index not in buffer - could not findnext into it"));
 		return 0;
@@ -731,7 +869,7 @@ static int cifs_filldir(char *pfindEntry, struct file *file, filldir_t filldir,
 	if (inum && (cifs_sb->mnt_cifs_flags & CIFS_MOUNT_SERVER_INUM)) {
 		fattr.cf_uniqueid = inum;
 	} else {
-		fattr.cf_uniqueid = iunique(sb, ROOT_I);
+		fattr.cf_uniqueid = cifs_new_uniqueid(sb);
 		cifs_autodisable_serverino(cifs_sb);
 	}
 
@@ -865,7 +1003,8 @@ int cifs_readdir(struct file *file, void *direntry, filldir_t filldir)
 				cifsFile->srch_inf.index_of_last_entry) {
 				cFYI(1, ("last entry in buf at pos %lld %s",
 					file->f_pos, tmp_buf));
-				cifs_save_resume_key(current_entry, cifsFile);
+				cifs_save_resume_key(current_entry,
+						     &cifsFile->srch_inf);
 				break;
 			} else
 				current_entry =
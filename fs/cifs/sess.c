@@ -576,6 +576,7 @@ CIFS_SessSetup(unsigned int xid, struct cifsSesInfo *ses, int first_time,
 	__u16 action;
 	int bytes_remaining;
 	struct key *spnego_key = NULL;
+	bool spnego_retry;
 	__le32 phase = NtLmNegotiate; /* NTLMSSP, if needed, is multistage */
 
 	if (ses == NULL)
@@ -585,6 +586,7 @@ CIFS_SessSetup(unsigned int xid, struct cifsSesInfo *ses, int first_time,
 
 	cFYI(1, ("sess setup type %d", type));
 ssetup_ntlmssp_authenticate:
+	spnego_retry = false;
 	if (phase == NtLmChallenge)
 		phase = NtLmAuthenticate; /* if ntlmssp, now final phase */
 
@@ -928,8 +930,10 @@ ssetup_ntlmssp_authenticate:
 
 ssetup_exit:
 	if (spnego_key) {
-		key_revoke(spnego_key);
-		key_put(spnego_key);
+#ifdef CONFIG_CIFS_UPCALL
+		spnego_retry = cifs_put_spnego_key(ses->server, spnego_key, rc);
+		spnego_key = NULL;
+#endif
 	}
 	kfree(str_area);
 	if (resp_buf_type == CIFS_SMALL_BUFFER) {
@@ -942,5 +946,9 @@ ssetup_exit:
 	if ((phase == NtLmChallenge) && (rc == 0))
 		goto ssetup_ntlmssp_authenticate;
 
+	/* the server refused a cached blob, get a fresh one */
+	if (spnego_retry)
+		goto ssetup_ntlmssp_authenticate;
+
 	return rc;
 }
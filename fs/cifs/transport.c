@@ -28,10 +28,13 @@
 #include <asm/uaccess.h>
 #include <asm/processor.h>
 #include <linux/mempool.h>
+#include <linux/tcp.h>
+#include <net/sock.h>
 #include "cifspdu.h"
 #include "cifsglob.h"
 #include "cifsproto.h"
 #include "cifs_debug.h"
+#include "cifs_trace.h"
 
 extern mempool_t *cifs_mid_poolp;
 extern struct kmem_cache *cifs_oplock_cachep;
@@ -59,6 +62,10 @@ AllocMidQEntry(const struct smb_hdr *smb_buffer, struct TCP_Server_Info *server)
 		/* when mid allocated can be before when sent */
 		temp->when_alloc = jiffies;
 		temp->tsk = current;
+		temp->when_start = ktime_get();
+#ifdef CONFIG_CIFS_STATS2
+		temp->req_bytes = smb_buffer->smb_buf_length + 4;
+#endif
 	}
 
 	spin_lock(&GlobalMid_Lock);
@@ -66,6 +73,7 @@ AllocMidQEntry(const struct smb_hdr *smb_buffer, struct TCP_Server_Info *server)
 	atomic_inc(&midCount);
 	temp->midState = MID_REQUEST_ALLOCATED;
 	spin_unlock(&GlobalMid_Lock);
+	trace_cifs_mid_alloc(server, temp);
 	return temp;
 }
 
@@ -103,18 +111,100 @@ DeleteMidQEntry(struct mid_q_entry *midEntry)
 	mempool_free(midEntry, cifs_mid_poolp);
 }
 
+/*
+ * Requests queued behind the one being sent are sent with MSG_MORE, so that
+ * a burst of small requests from several threads leaves in full segments
+ * rather than one segment each. Whoever sends last without anyone queued
+ * behind it pushes out anything held back.
+ */
+void
+cifs_send_lock(struct TCP_Server_Info *server)
+{
+	atomic_inc(&server->send_waiters);
+	mutex_lock(&server->srv_mutex);
+	atomic_dec(&server->send_waiters);
+}
+
+void
+cifs_send_unlock(struct TCP_Server_Info *server)
+{
+	int val = 0;
+
+	if (server->send_corked && atomic_read(&server->send_waiters) == 0) {
+		server->send_corked = false;
+		/* uncorking pushes pending frames */
+		if (server->ssocket)
+			kernel_setsockopt(server->ssocket, SOL_TCP, TCP_CORK,
+					  (char *)&val, sizeof(val));
+	}
+	mutex_unlock(&server->srv_mutex);
+}
+
+/* smaller pieces are cheaper to copy than to reference */
+#define SMB_SENDPAGE_MIN	1024
+
+/*
+ * The data of a write is in page cache pages, which the socket can take
+ * references to rather than copying the data into its buffers. Not for
+ * signed requests though: the page can be written to again before it goes
+ * out, and the data on the wire would then no longer match the signature.
+ */
+static struct page *
+smb_kvec_page(const struct kvec *iov)
+{
+	unsigned long offset = offset_in_page(iov->iov_base);
+	struct page *page;
+
+	if (iov->iov_len < SMB_SENDPAGE_MIN ||
+	    offset + iov->iov_len > PAGE_SIZE ||
+	    !virt_addr_valid(iov->iov_base))
+		return NULL;
+	page = virt_to_page(iov->iov_base);
+	if (PageSlab(page) || PageCompound(page) || page->mapping == NULL)
+		return NULL;
+	return page;
+}
+
+/*
+ * Wait for the socket to have room for more data, which tcp signals
+ * through sk_write_space, or until the timeout.
+ */
+static void
+smb_wait_for_sndbuf(struct socket *ssocket, long timeout)
+{
+	struct sock *sk = ssocket->sk;
+	DEFINE_WAIT(wait);
+
+	/* we would not sleep at all, so back off instead */
+	if (signal_pending(current)) {
+		msleep(10);
+		return;
+	}
+
+	set_bit(SOCK_NOSPACE, &ssocket->flags);
+	prepare_to_wait(sk->sk_sleep, &wait, TASK_INTERRUPTIBLE);
+	if (!sk_stream_memory_free(sk))
+		schedule_timeout(timeout);
+	finish_wait(sk->sk_sleep, &wait);
+}
+
 static int
 smb_sendv(struct TCP_Server_Info *server, struct kvec *iov, int n_vec)
 {
 	int rc = 0;
-	int i = 0;
 	struct msghdr smb_msg;
 	struct smb_hdr *smb_buffer = iov[0].iov_base;
 	unsigned int len = iov[0].iov_len;
 	unsigned int total_len;
 	int first_vec = 0;
+	int last_vec;
+	int flags;
+	unsigned long deadline;
 	unsigned int smb_buf_length = smb_buffer->smb_buf_length;
 	struct socket *ssocket = server->ssocket;
+	struct page *page;
+	bool more;
+	bool zerocopy;
 
 	if (ssocket == NULL)
 		return -ENOTSOCK; /* BB eventually add reconnect code here */
@@ -124,9 +214,15 @@ smb_sendv(struct TCP_Server_Info *server, struct kvec *iov, int n_vec)
 	smb_msg.msg_control = NULL;
 	smb_msg.msg_controllen = 0;
 	if (server->noblocksnd)
-		smb_msg.msg_flags = MSG_DONTWAIT + MSG_NOSIGNAL;
+		flags = MSG_DONTWAIT + MSG_NOSIGNAL;
 	else
-		smb_msg.msg_flags = MSG_NOSIGNAL;
+		flags = MSG_NOSIGNAL;
+
+	/* hold back the tail of the request if another is queued behind us */
+	more = atomic_read(&server->send_waiters) > 0;
+	server->send_corked = more;
+
+	zerocopy = !(smb_buffer->Flags2 & SMBFLG2_SECURITY_SIGNATURE);
 
 	/* smb header is converted in header_assemble. bcc and rest of SMB word
 	   area, and byte area if necessary, is converted to littleendian in
@@ -135,54 +231,73 @@ smb_sendv(struct TCP_Server_Info *server, struct kvec *iov, int n_vec)
 
 
 	total_len = 0;
-	for (i = 0; i < n_vec; i++)
-		total_len += iov[i].iov_len;
+	for (last_vec = 0; last_vec < n_vec; last_vec++)
+		total_len += iov[last_vec].iov_len;
 
 	smb_buffer->smb_buf_length = cpu_to_be32(smb_buffer->smb_buf_length);
 	cFYI(1, ("Sending smb:  total_len %d", total_len));
 	dump_smb(smb_buffer, len);
 
-	i = 0;
+	/*
+	 * Runs of ordinary buffers go out with one sendmsg, page cache pages
+	 * of unsigned requests with sendpage. Every piece but the last is
+	 * sent with MSG_MORE.
+	 *
+	 * If we can not send we wait for room on the socket, for about 15
+	 * seconds overall. Similarly we wait for 15 seconds for a response
+	 * from the server in SendReceive[2] for most types of requests.
+	 * In most cases if we fail to send in that time we will kill the
+	 * socket and reconnect which may clear the network problem.
+	 */
+	deadline = jiffies + 15 * HZ;
 	while (total_len) {
-		rc = kernel_sendmsg(ssocket, &smb_msg, &iov[first_vec],
-				    n_vec - first_vec, total_len);
+		if (iov[first_vec].iov_len == 0) {
+			first_vec++;
+			continue;
+		}
+
+		page = zerocopy ? smb_kvec_page(&iov[first_vec]) : NULL;
+		if (page) {
+			last_vec = first_vec + 1;
+			smb_msg.msg_flags = flags;
+			if (more || iov[first_vec].iov_len < total_len)
+				smb_msg.msg_flags |= MSG_MORE;
+			rc = kernel_sendpage(ssocket, page,
+					     offset_in_page(iov[first_vec].iov_base),
+					     iov[first_vec].iov_len,
+					     smb_msg.msg_flags);
+		} else {
+			unsigned int run_len = 0;
+
+			for (last_vec = first_vec; last_vec < n_vec;
+			     last_vec++) {
+				if (last_vec > first_vec && zerocopy &&
+				    smb_kvec_page(&iov[last_vec]))
+					break;
+				run_len += iov[last_vec].iov_len;
+			}
+			smb_msg.msg_flags = flags;
+			if (more || run_len < total_len)
+				smb_msg.msg_flags |= MSG_MORE;
+			rc = kernel_sendmsg(ssocket, &smb_msg, &iov[first_vec],
+					    last_vec - first_vec, run_len);
+		}
+
 		if ((rc == -ENOSPC) || (rc == -EAGAIN)) {
-			i++;
-			/* if blocking send we try 3 times, since each can block
-			   for 5 seconds. For nonblocking  we have to try more
-			   but wait increasing amounts of time allowing time for
-			   socket to clear.  The overall time we wait in either
-			   case to send on the socket is about 15 seconds.
-			   Similarly we wait for 15 seconds for
-			   a response from the server in SendReceive[2]
-			   for the server to send a response back for
-			   most types of requests (except SMB Write
-			   past end of file which can be slow, and
-			   blocking lock operations). NFS waits slightly longer
-			   than CIFS, but this can make it take longer for
-			   nonresponsive servers to be detected and 15 seconds
-			   is more than enough time for modern networks to
-			   send a packet.  In most cases if we fail to send
-			   after the retries we will kill the socket and
-			   reconnect which may clear the network problem.
-			*/
-			if ((i >= 14) || (!server->noblocksnd && (i > 2))) {
+			if (time_after_eq(jiffies, deadline)) {
 				cERROR(1,
 				   ("sends on sock %p stuck for 15 seconds",
 				    ssocket));
 				rc = -EAGAIN;
 				break;
 			}
-			msleep(1 << i);
+			smb_wait_for_sndbuf(ssocket, deadline - jiffies);
 			continue;
 		}
 		if (rc < 0)
 			break;
 
-		if (rc == total_len) {
-			total_len = 0;
-			break;
-		} else if (rc > total_len) {
+		if (rc > total_len) {
 			cERROR(1, ("sent %d requested %d", rc, total_len));
 			break;
 		}
@@ -194,21 +309,18 @@ smb_sendv(struct TCP_Server_Info *server, struct kvec *iov, int n_vec)
 			continue;
 		}
 		total_len -= rc;
-		/* the line below resets i */
-		for (i = first_vec; i < n_vec; i++) {
-			if (iov[i].iov_len) {
-				if (rc > iov[i].iov_len) {
-					rc -= iov[i].iov_len;
-					iov[i].iov_len = 0;
-				} else {
-					iov[i].iov_base += rc;
-					iov[i].iov_len -= rc;
-					first_vec = i;
-					break;
-				}
+		/* consume what was sent from the iovecs */
+		while (rc > 0 && first_vec < n_vec) {
+			if (rc >= iov[first_vec].iov_len) {
+				rc -= iov[first_vec].iov_len;
+				iov[first_vec].iov_len = 0;
+				first_vec++;
+			} else {
+				iov[first_vec].iov_base += rc;
+				iov[first_vec].iov_len -= rc;
+				rc = 0;
 			}
 		}
-		i = 0; /* in case we get ENOSPC on the next send */
 	}
 
 	if ((total_len > 0) && (total_len != smb_buf_length + 4)) {
@@ -230,6 +342,7 @@ smb_sendv(struct TCP_Server_Info *server, struct kvec *iov, int n_vec)
 	   side effect of this call. */
 	smb_buffer->smb_buf_length = smb_buf_length;
 
+	trace_cifs_send(server, smb_buffer, smb_buf_length + 4, rc);
 	return rc;
 }
 
@@ -245,8 +358,25 @@ smb_send(struct TCP_Server_Info *server, struct smb_hdr *smb_buffer,
 	return smb_sendv(server, &iov, 1);
 }
 
+/*
+ * Requests made on behalf of pending oplock breaks may use every slot,
+ * others have to leave CIFS_OPLOCK_BREAK_SLOTS free for them.
+ */
+static int cifs_request_slots(struct TCP_Server_Info *server)
+{
+	if (atomic_read(&server->oplock_breaks_pending) &&
+	    current != server->oplock_tsk)
+		return max_t(int, cifs_max_pending - CIFS_OPLOCK_BREAK_SLOTS,
+			     1);
+	return cifs_max_pending;
+}
+
 static int wait_for_free_request(struct cifsSesInfo *ses, const int long_op)
 {
+#ifdef CONFIG_CIFS_STATS2
+	ktime_t start = ktime_get();
+#endif
+
 	if (long_op == CIFS_ASYNC_OP) {
 		/* oplock breaks must not be held up */
 		atomic_inc(&ses->server->inFlight);
@@ -256,17 +386,22 @@ static int wait_for_free_request(struct cifsSesInfo *ses, const int long_op)
 	spin_lock(&GlobalMid_Lock);
 	while (1) {
 		if (atomic_read(&ses->server->inFlight) >=
-				cifs_max_pending){
+				cifs_request_slots(ses->server)) {
+			ktime_t wait_start = ktime_get();
+
 			spin_unlock(&GlobalMid_Lock);
 #ifdef CONFIG_CIFS_STATS2
 			atomic_inc(&ses->server->num_waiters);
 #endif
 			wait_event(ses->server->request_q,
 				   atomic_read(&ses->server->inFlight)
-				     < cifs_max_pending);
+				     < cifs_request_slots(ses->server));
 #ifdef CONFIG_CIFS_STATS2
 			atomic_dec(&ses->server->num_waiters);
 #endif
+			trace_cifs_credit_wait(ses->server,
+				atomic_read(&ses->server->inFlight),
+				ktime_us_delta(ktime_get(), wait_start));
 			spin_lock(&GlobalMid_Lock);
 		} else {
 			if (ses->server->tcpStatus == CifsExiting) {
@@ -281,6 +416,9 @@ static int wait_for_free_request(struct cifsSesInfo *ses, const int long_op)
 			if (long_op != CIFS_BLOCKING_OP)
 				atomic_inc(&ses->server->inFlight);
 			spin_unlock(&GlobalMid_Lock);
+#ifdef CONFIG_CIFS_STATS2
+			cifs_hist_add_usecs(&ses->server->queue_wait, start);
+#endif
 			break;
 		}
 	}
@@ -309,6 +447,10 @@ static int allocate_mid(struct cifsSesInfo *ses, struct smb_hdr *in_buf,
 	*ppmidQ = AllocMidQEntry(in_buf, ses->server);
 	if (*ppmidQ == NULL)
 		return -ENOMEM;
+#ifdef CONFIG_CIFS_STATS2
+	(*ppmidQ)->tcon_latency = cifs_hist_tcon_slot(ses, in_buf->Tid,
+						      in_buf->Command);
+#endif
 	return 0;
 }
 
@@ -424,11 +566,11 @@ SendReceive2(const unsigned int xid, struct cifsSesInfo *ses,
 	   and avoid races inside tcp sendmsg code that could cause corruption
 	   of smb data */
 
-	mutex_lock(&ses->server->srv_mutex);
+	cifs_send_lock(ses->server);
 
 	rc = allocate_mid(ses, in_buf, &midQ);
 	if (rc) {
-		mutex_unlock(&ses->server->srv_mutex);
+		cifs_send_unlock(ses->server);
 		cifs_small_buf_release(in_buf);
 		/* Update # of requests on wire to server */
 		atomic_dec(&ses->server->inFlight);
@@ -437,7 +579,7 @@ SendReceive2(const unsigned int xid, struct cifsSesInfo *ses,
 	}
 	rc = cifs_sign_smb2(iov, n_vec, ses->server, &midQ->sequence_number);
 	if (rc) {
-		mutex_unlock(&ses->server->srv_mutex);
+		cifs_send_unlock(ses->server);
 		cifs_small_buf_release(in_buf);
 		goto out;
 	}
@@ -452,7 +594,7 @@ SendReceive2(const unsigned int xid, struct cifsSesInfo *ses,
 	midQ->when_sent = jiffies;
 #endif
 
-	mutex_unlock(&ses->server->srv_mutex);
+	cifs_send_unlock(ses->server);
 	cifs_small_buf_release(in_buf);
 
 	if (rc < 0)
@@ -619,11 +761,11 @@ SendReceive(const unsigned int xid, struct cifsSesInfo *ses,
 	   and avoid races inside tcp sendmsg code that could cause corruption
 	   of smb data */
 
-	mutex_lock(&ses->server->srv_mutex);
+	cifs_send_lock(ses->server);
 
 	rc = allocate_mid(ses, in_buf, &midQ);
 	if (rc) {
-		mutex_unlock(&ses->server->srv_mutex);
+		cifs_send_unlock(ses->server);
 		/* Update # of requests on wire to server */
 		atomic_dec(&ses->server->inFlight);
 		wake_up(&ses->server->request_q);
@@ -632,7 +774,7 @@ SendReceive(const unsigned int xid, struct cifsSesInfo *ses,
 
 	rc = cifs_sign_smb(in_buf, ses->server, &midQ->sequence_number);
 	if (rc) {
-		mutex_unlock(&ses->server->srv_mutex);
+		cifs_send_unlock(ses->server);
 		goto out;
 	}
 
@@ -645,7 +787,7 @@ SendReceive(const unsigned int xid, struct cifsSesInfo *ses,
 	atomic_dec(&ses->server->inSend);
 	midQ->when_sent = jiffies;
 #endif
-	mutex_unlock(&ses->server->srv_mutex);
+	cifs_send_unlock(ses->server);
 
 	if (rc < 0)
 		goto out;
@@ -775,14 +917,14 @@ send_nt_cancel(struct cifsTconInfo *tcon, struct smb_hdr *in_buf,
 
 	header_assemble(in_buf, SMB_COM_NT_CANCEL, tcon, 0);
 	in_buf->Mid = mid;
-	mutex_lock(&ses->server->srv_mutex);
+	cifs_send_lock(ses->server);
 	rc = cifs_sign_smb(in_buf, ses->server, &midQ->sequence_number);
 	if (rc) {
-		mutex_unlock(&ses->server->srv_mutex);
+		cifs_send_unlock(ses->server);
 		return rc;
 	}
 	rc = smb_send(ses->server, in_buf, in_buf->smb_buf_length);
-	mutex_unlock(&ses->server->srv_mutex);
+	cifs_send_unlock(ses->server);
 	return rc;
 }
 
@@ -854,18 +996,18 @@ SendReceiveBlockingLock(const unsigned int xid, struct cifsTconInfo *tcon,
 	   and avoid races inside tcp sendmsg code that could cause corruption
 	   of smb data */
 
-	mutex_lock(&ses->server->srv_mutex);
+	cifs_send_lock(ses->server);
 
 	rc = allocate_mid(ses, in_buf, &midQ);
 	if (rc) {
-		mutex_unlock(&ses->server->srv_mutex);
+		cifs_send_unlock(ses->server);
 		return rc;
 	}
 
 	rc = cifs_sign_smb(in_buf, ses->server, &midQ->sequence_number);
 	if (rc) {
 		DeleteMidQEntry(midQ);
-		mutex_unlock(&ses->server->srv_mutex);
+		cifs_send_unlock(ses->server);
 		return rc;
 	}
 
@@ -878,7 +1020,7 @@ SendReceiveBlockingLock(const unsigned int xid, struct cifsTconInfo *tcon,
 	atomic_dec(&ses->server->inSend);
 	midQ->when_sent = jiffies;
 #endif
-	mutex_unlock(&ses->server->srv_mutex);
+	cifs_send_unlock(ses->server);
 
 	if (rc < 0) {
 		DeleteMidQEntry(midQ);
@@ -38,6 +38,118 @@
 #define XATTR_SECURITY_PREFIX_LEN 9
 /* BB need to add server (Samba e.g) support for security and trusted prefix */
 
+/*
+ * The EAs of a file are cached in its inode as the FEA list returned by the
+ * server (an empty list if it has none), so that getxattr and listxattr do
+ * not have to query the server each time. The cache is used for as long as
+ * the oplock it was fetched under is held, and otherwise for as long as
+ * cached inode attributes are (see cifs_revalidate).
+ */
+#define CIFS_EA_CACHE_TIME HZ
+
+void cifs_ea_cache_invalidate(struct inode *inode)
+{
+	struct fealist *list;
+
+	spin_lock(&inode->i_lock);
+	list = CIFS_I(inode)->ea_list;
+	CIFS_I(inode)->ea_list = NULL;
+	spin_unlock(&inode->i_lock);
+	kfree(list);
+}
+
+#ifdef CONFIG_CIFS_XATTR
+/* must be called with i_lock held */
+static bool cifs_ea_cache_valid(struct cifsInodeInfo *cifsi)
+{
+	if (cifsi->ea_list == NULL)
+		return false;
+	if (cifsi->ea_oplock && cifsi->clientCanCacheRead)
+		return true;
+	return time_before(jiffies, cifsi->ea_time + CIFS_EA_CACHE_TIME);
+}
+
+/* fetch all EAs of a file into the cache */
+static int cifs_ea_cache_fill(int xid, struct cifs_sb_info *cifs_sb,
+			      struct inode *inode, const char *full_path)
+{
+	struct cifsInodeInfo *cifsi = CIFS_I(inode);
+	struct fealist *list, *old;
+	bool oplock = cifsi->clientCanCacheRead;
+	unsigned long time = jiffies;
+	int rc;
+
+	rc = CIFSSMBQAllEAsList(xid, cifs_sb->tcon, full_path, &list,
+				cifs_sb->local_nls,
+				cifs_sb->mnt_cifs_flags &
+					CIFS_MOUNT_MAP_SPECIAL_CHR);
+	if (rc)
+		return rc;
+
+	spin_lock(&inode->i_lock);
+	old = cifsi->ea_list;
+	cifsi->ea_list = list;
+	cifsi->ea_time = time;
+	cifsi->ea_oplock = oplock;
+	spin_unlock(&inode->i_lock);
+	kfree(old);
+	return 0;
+}
+
+/* look up an EA in the cache, -EAGAIN if the EAs are not cached */
+static ssize_t cifs_ea_cache_value(struct inode *inode, const char *ea_name,
+				   void *ea_value, size_t buf_size)
+{
+	ssize_t rc = -EAGAIN;
+
+	spin_lock(&inode->i_lock);
+	if (cifs_ea_cache_valid(CIFS_I(inode)))
+		rc = cifs_fealist_value(CIFS_I(inode)->ea_list, ea_name,
+					ea_value, buf_size);
+	spin_unlock(&inode->i_lock);
+	return rc;
+}
+
+static ssize_t cifs_ea_cache_names(struct inode *inode, char *data,
+				   size_t buf_size)
+{
+	ssize_t rc = -EAGAIN;
+
+	spin_lock(&inode->i_lock);
+	if (cifs_ea_cache_valid(CIFS_I(inode)))
+		rc = cifs_fealist_names(CIFS_I(inode)->ea_list, data,
+					buf_size);
+	spin_unlock(&inode->i_lock);
+	return rc;
+}
+
+static ssize_t cifs_get_ea(int xid, struct cifs_sb_info *cifs_sb,
+			   struct inode *inode, const char *full_path,
+			   const char *ea_name, void *ea_value,
+			   size_t buf_size)
+{
+	ssize_t rc;
+
+	rc = cifs_ea_cache_value(inode, ea_name, ea_value, buf_size);
+	if (rc != -EAGAIN)
+		return rc;
+
+	rc = cifs_ea_cache_fill(xid, cifs_sb, inode, full_path);
+	if (rc == 0) {
+		rc = cifs_ea_cache_value(inode, ea_name, ea_value, buf_size);
+		if (rc != -EAGAIN)
+			return rc;
+	} else if (rc != -EIO && rc != -EOVERFLOW)
+		return rc;
+
+	/* all of the EAs do not fit in one response, ask for just this one */
+	return CIFSSMBQueryEA(xid, cifs_sb->tcon, full_path, ea_name,
+			      ea_value, buf_size, cifs_sb->local_nls,
+			      cifs_sb->mnt_cifs_flags &
+				CIFS_MOUNT_MAP_SPECIAL_CHR);
+}
+#endif /* CONFIG_CIFS_XATTR */
+
 
 
 int cifs_removexattr(struct dentry *direntry, const char *ea_name)
@@ -86,6 +198,7 @@ int cifs_removexattr(struct dentry *direntry, const char *ea_name)
 		rc = CIFSSMBSetEA(xid, pTcon, full_path, ea_name, NULL,
 			(__u16)0, cifs_sb->local_nls,
 			cifs_sb->mnt_cifs_flags & CIFS_MOUNT_MAP_SPECIAL_CHR);
+		cifs_ea_cache_invalidate(direntry->d_inode);
 	}
 remove_ea_exit:
 	kfree(full_path);
@@ -148,6 +261,7 @@ int cifs_setxattr(struct dentry *direntry, const char *ea_name,
 		rc = CIFSSMBSetEA(xid, pTcon, full_path, ea_name, ea_value,
 			(__u16)value_size, cifs_sb->local_nls,
 			cifs_sb->mnt_cifs_flags & CIFS_MOUNT_MAP_SPECIAL_CHR);
+		cifs_ea_cache_invalidate(direntry->d_inode);
 	} else if (strncmp(ea_name, CIFS_XATTR_OS2_PREFIX, 4) == 0) {
 		if (cifs_sb->mnt_cifs_flags & CIFS_MOUNT_NO_XATTR)
 			goto set_ea_exit;
@@ -156,6 +270,7 @@ int cifs_setxattr(struct dentry *direntry, const char *ea_name,
 		rc = CIFSSMBSetEA(xid, pTcon, full_path, ea_name, ea_value,
 			(__u16)value_size, cifs_sb->local_nls,
 			cifs_sb->mnt_cifs_flags & CIFS_MOUNT_MAP_SPECIAL_CHR);
+		cifs_ea_cache_invalidate(direntry->d_inode);
 	} else {
 		int temp;
 		temp = strncmp(ea_name, POSIX_ACL_XATTR_ACCESS,
@@ -244,17 +359,15 @@ ssize_t cifs_getxattr(struct dentry *direntry, const char *ea_name,
 			/* revalidate/getattr then populate from inode */
 		} /* BB add else when above is implemented */
 		ea_name += 5; /* skip past user. prefix */
-		rc = CIFSSMBQueryEA(xid, pTcon, full_path, ea_name, ea_value,
-			buf_size, cifs_sb->local_nls,
-			cifs_sb->mnt_cifs_flags & CIFS_MOUNT_MAP_SPECIAL_CHR);
+		rc = cifs_get_ea(xid, cifs_sb, direntry->d_inode, full_path,
+				 ea_name, ea_value, buf_size);
 	} else if (strncmp(ea_name, CIFS_XATTR_OS2_PREFIX, 4) == 0) {
 		if (cifs_sb->mnt_cifs_flags & CIFS_MOUNT_NO_XATTR)
 			goto get_ea_exit;
 
 		ea_name += 4; /* skip past os2. prefix */
-		rc = CIFSSMBQueryEA(xid, pTcon, full_path, ea_name, ea_value,
-			buf_size, cifs_sb->local_nls,
-			cifs_sb->mnt_cifs_flags & CIFS_MOUNT_MAP_SPECIAL_CHR);
+		rc = cifs_get_ea(xid, cifs_sb, direntry->d_inode, full_path,
+				 ea_name, ea_value, buf_size);
 	} else if (strncmp(ea_name, POSIX_ACL_XATTR_ACCESS,
 			  strlen(POSIX_ACL_XATTR_ACCESS)) == 0) {
 #ifdef CONFIG_CIFS_POSIX
@@ -364,9 +477,18 @@ ssize_t cifs_listxattr(struct dentry *direntry, char *data, size_t buf_size)
 	/* if proc/fs/cifs/streamstoxattr is set then
 		search server for EAs or streams to
 		returns as xattrs */
-	rc = CIFSSMBQAllEAs(xid, pTcon, full_path, data, buf_size,
-				cifs_sb->local_nls,
-				cifs_sb->mnt_cifs_flags &
+	rc = cifs_ea_cache_names(direntry->d_inode, data, buf_size);
+	if (rc == -EAGAIN) {
+		rc = cifs_ea_cache_fill(xid, cifs_sb, direntry->d_inode,
+					full_path);
+		if (rc == 0)
+			rc = cifs_ea_cache_names(direntry->d_inode, data,
+						 buf_size);
+	}
+	if (rc == -EAGAIN)	/* invalidated again meanwhile */
+		rc = CIFSSMBQAllEAs(xid, pTcon, full_path, data, buf_size,
+				    cifs_sb->local_nls,
+				    cifs_sb->mnt_cifs_flags &
 					CIFS_MOUNT_MAP_SPECIAL_CHR);
 
 	kfree(full_path);
@@ -15,9 +15,12 @@
 #include <linux/mm.h>
 #include <linux/slab.h>
 #include <linux/pagemap.h>
+#include <linux/vmalloc.h>
+#include <linux/writeback.h>
 #include <linux/smp_lock.h>
 #include <linux/net.h>
 #include <linux/aio.h>
+#include <linux/err.h>
 
 #include <asm/uaccess.h>
 #include <asm/system.h>
@@ -111,6 +114,267 @@ smb_readpage(struct file *file, struct page *page)
 	return error;
 }
 
+/*
+ * readpages/writepages gather contiguous pages into runs of up to rsize or
+ * wsize bytes, map each run with vmap() and transfer it with a single read
+ * or write request. Several runs are kept outstanding on the server, so
+ * that sequential IO is not limited to one page per round trip.
+ */
+#define SMB_PAGEIO_MAXPAGES	16
+#define SMB_PAGEIO_INFLIGHT	8
+
+struct smb_pageio_run {
+	struct smb_request *req;
+	int result;		/* if req is NULL */
+	void *vaddr;
+	loff_t offset;
+	unsigned int count;
+	int npages;
+	struct page *pages[SMB_PAGEIO_MAXPAGES];
+};
+
+struct smb_pageio {
+	struct inode *inode;
+	int write;
+	int maxpages;
+	int inflight;
+	int head, nr;		/* outstanding runs */
+	int error;
+	struct smb_pageio_run runs[SMB_PAGEIO_INFLIGHT];
+};
+
+static struct smb_pageio *
+smb_pageio_alloc(struct inode *inode, int write)
+{
+	struct smb_sb_info *server = server_from_inode(inode);
+	struct smb_pageio *pio;
+	int size;
+
+	size = write ? smb_get_wsize(server) : smb_get_rsize(server);
+	if (size < PAGE_CACHE_SIZE)
+		return NULL;
+
+	pio = kzalloc(sizeof(*pio), GFP_NOFS);
+	if (!pio)
+		return NULL;
+	pio->inode = inode;
+	pio->write = write;
+	pio->maxpages = min_t(int, size >> PAGE_CACHE_SHIFT,
+			      SMB_PAGEIO_MAXPAGES);
+	/* leave room in the server's mux for other users of the mount */
+	pio->inflight = clamp_t(int, server->opt.maxmux / 2,
+				1, SMB_PAGEIO_INFLIGHT);
+	return pio;
+}
+
+static void
+smb_pageio_read_done(struct smb_pageio *pio, struct smb_pageio_run *run,
+		     int result)
+{
+	struct inode *inode = pio->inode;
+	int i;
+
+	if (result >= 0) {
+		if (result < run->count)
+			memset(run->vaddr + result, 0, run->count - result);
+		inode->i_atime = current_fs_time(inode->i_sb);
+	} else if (!pio->error)
+		pio->error = result;
+
+	for (i = 0; i < run->npages; i++) {
+		struct page *page = run->pages[i];
+
+		if (result >= 0) {
+			flush_dcache_page(page);
+			SetPageUptodate(page);
+		}
+		unlock_page(page);
+		page_cache_release(page);
+	}
+}
+
+static void
+smb_pageio_write_done(struct smb_pageio *pio, struct smb_pageio_run *run,
+		      int result)
+{
+	struct inode *inode = pio->inode;
+	int i;
+
+	if (result >= 0 && result < run->count) {
+		PARANOIA("short write, count=%d, result=%d\n",
+			 run->count, result);
+		result = -EIO;
+	}
+	if (result >= 0) {
+		inode->i_mtime = inode->i_atime = current_fs_time(inode->i_sb);
+		SMB_I(inode)->flags |= SMB_F_LOCALWRITE;
+		if (run->offset + run->count > inode->i_size)
+			inode->i_size = run->offset + run->count;
+	} else {
+		mapping_set_error(inode->i_mapping, result);
+		if (!pio->error)
+			pio->error = result;
+	}
+
+	for (i = 0; i < run->npages; i++) {
+		struct page *page = run->pages[i];
+
+		if (result < 0)
+			SetPageError(page);
+		end_page_writeback(page);
+		page_cache_release(page);
+	}
+}
+
+/*
+ * Wait for the oldest outstanding run and complete its pages.
+ */
+static void
+smb_pageio_complete(struct smb_pageio *pio)
+{
+	struct smb_pageio_run *run = &pio->runs[pio->head];
+	int result = run->result;
+
+	if (run->req) {
+		if (pio->write)
+			result = smb_proc_write_finish(pio->inode, run->req);
+		else
+			result = smb_proc_read_finish(pio->inode, run->req);
+	}
+	VERBOSE("ino=%ld, %s %d@%Ld, result=%d\n", pio->inode->i_ino,
+		pio->write ? "write" : "read", run->count, run->offset, result);
+
+	if (pio->write)
+		smb_pageio_write_done(pio, run, result);
+	else
+		smb_pageio_read_done(pio, run, result);
+	if (run->vaddr)
+		vunmap(run->vaddr);
+
+	pio->head = (pio->head + 1) % SMB_PAGEIO_INFLIGHT;
+	pio->nr--;
+}
+
+/*
+ * Send the run being built, waiting for the oldest one first if we already
+ * have as many outstanding as we allow.
+ */
+static void
+smb_pageio_submit(struct smb_pageio *pio)
+{
+	int idx = (pio->head + pio->nr) % SMB_PAGEIO_INFLIGHT;
+	struct smb_pageio_run *run = &pio->runs[idx];
+
+	if (!run->npages)
+		return;
+
+	run->req = NULL;
+	run->result = -ENOMEM;
+	run->vaddr = vmap(run->pages, run->npages, VM_MAP, PAGE_KERNEL);
+	if (run->vaddr) {
+		if (pio->write)
+			run->req = smb_proc_write_start(pio->inode,
+					run->offset, run->count, run->vaddr);
+		else
+			run->req = smb_proc_read_start(pio->inode,
+					run->offset, run->count, run->vaddr);
+		if (IS_ERR(run->req)) {
+			run->result = PTR_ERR(run->req);
+			run->req = NULL;
+		}
+	}
+	pio->nr++;
+
+	if (pio->nr >= pio->inflight)
+		smb_pageio_complete(pio);
+
+	idx = (pio->head + pio->nr) % SMB_PAGEIO_INFLIGHT;
+	pio->runs[idx].npages = 0;
+}
+
+/*
+ * Add 'count' bytes of a page to the current run. Only the last page of a
+ * run may be partial.
+ */
+static void
+smb_pageio_add(struct smb_pageio *pio, struct page *page, unsigned int count)
+{
+	int idx = (pio->head + pio->nr) % SMB_PAGEIO_INFLIGHT;
+	struct smb_pageio_run *run = &pio->runs[idx];
+
+	if (run->npages &&
+	    (run->npages == pio->maxpages ||
+	     run->count & (PAGE_CACHE_SIZE - 1) ||
+	     run->pages[run->npages - 1]->index + 1 != page->index)) {
+		smb_pageio_submit(pio);
+		idx = (pio->head + pio->nr) % SMB_PAGEIO_INFLIGHT;
+		run = &pio->runs[idx];
+	}
+
+	if (!run->npages) {
+		run->offset = (loff_t)page->index << PAGE_CACHE_SHIFT;
+		run->count = 0;
+	}
+	run->pages[run->npages++] = page;
+	run->count += count;
+}
+
+/*
+ * Send the last run and wait for everything to finish.
+ */
+static int
+smb_pageio_flush(struct smb_pageio *pio)
+{
+	smb_pageio_submit(pio);
+	while (pio->nr)
+		smb_pageio_complete(pio);
+	return pio->error;
+}
+
+static int
+smb_readpage_filler(void *data, struct page *page)
+{
+	return smb_readpage(data, page);
+}
+
+static int
+smb_readpages(struct file *file, struct address_space *mapping,
+	      struct list_head *pages, unsigned nr_pages)
+{
+	struct dentry *dentry = file->f_path.dentry;
+	struct inode *inode = mapping->host;
+	struct smb_pageio *pio;
+	int result;
+
+	VERBOSE("file %s/%s, nr_pages=%u\n", DENTRY_PATH(dentry), nr_pages);
+
+	pio = smb_pageio_alloc(inode, 0);
+	if (!pio)
+		return read_cache_pages(mapping, pages, smb_readpage_filler,
+					file);
+
+	result = smb_open(dentry, SMB_O_RDONLY);
+	if (result < 0)
+		goto out;
+
+	/* the list is in reverse order, lowest index last */
+	while (!list_empty(pages)) {
+		struct page *page = list_entry(pages->prev, struct page, lru);
+
+		list_del(&page->lru);
+		if (add_to_page_cache_lru(page, mapping, page->index,
+					  GFP_KERNEL)) {
+			page_cache_release(page);
+			continue;
+		}
+		smb_pageio_add(pio, page, PAGE_CACHE_SIZE);
+	}
+	result = smb_pageio_flush(pio);
+out:
+	kfree(pio);
+	return result;
+}
+
 /*
  * Write a page synchronously.
  * Offset is the data offset within the page.
@@ -202,6 +466,50 @@ do_it:
 	return err;
 }
 
+static int
+smb_writepages_fill(struct page *page, struct writeback_control *wbc,
+		    void *data)
+{
+	struct smb_pageio *pio = data;
+	struct inode *inode = pio->inode;
+	unsigned long end_index = inode->i_size >> PAGE_CACHE_SHIFT;
+	unsigned offset = PAGE_CACHE_SIZE;
+
+	/* same end of file handling as smb_writepage */
+	if (page->index >= end_index) {
+		offset = inode->i_size & (PAGE_CACHE_SIZE-1);
+		if (page->index >= end_index+1 || !offset) {
+			unlock_page(page);
+			return 0; /* truncated - don't care */
+		}
+	}
+
+	page_cache_get(page);
+	set_page_writeback(page);
+	unlock_page(page);
+	smb_pageio_add(pio, page, offset);
+	return 0;
+}
+
+static int
+smb_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	struct smb_pageio *pio;
+	int result, err;
+
+	pio = smb_pageio_alloc(mapping->host, 1);
+	if (!pio)
+		return generic_writepages(mapping, wbc);
+
+	result = write_cache_pages(mapping, wbc, smb_writepages_fill, pio);
+	err = smb_pageio_flush(pio);
+	if (!result)
+		result = err;
+
+	kfree(pio);
+	return result;
+}
+
 static int
 smb_updatepage(struct file *file, struct page *page, unsigned long offset,
 	       unsigned int count)
@@ -328,7 +636,9 @@ static int smb_write_end(struct file *file, struct address_space *mapping,
 
 const struct address_space_operations smb_file_aops = {
 	.readpage = smb_readpage,
+	.readpages = smb_readpages,
 	.writepage = smb_writepage,
+	.writepages = smb_writepages,
 	.write_begin = smb_write_begin,
 	.write_end = smb_write_end,
 };
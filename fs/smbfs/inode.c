@@ -472,10 +472,13 @@ smb_put_super(struct super_block *sb)
 
 	smb_lock_server(server);
 	server->state = CONN_INVALID;
-	smbiod_unregister_server(server);
-
 	smb_close_socket(server);
+	smb_unlock_server(server);
+
+	/* waits for the smbiod work, which takes the server lock */
+	smbiod_unregister_server(server);
 
+	smb_lock_server(server);
 	if (server->conn_pid)
 		kill_pid(server->conn_pid, SIGTERM, 1);
 
@@ -531,7 +534,6 @@ static int smb_fill_super(struct super_block *sb, void *raw_data, int silent)
 	server->sock_file = NULL;
 	init_waitqueue_head(&server->conn_wq);
 	init_MUTEX(&server->sem);
-	INIT_LIST_HEAD(&server->entry);
 	INIT_LIST_HEAD(&server->xmitq);
 	INIT_LIST_HEAD(&server->recvq);
 	server->conn_error = 0;
@@ -596,10 +598,7 @@ static int smb_fill_super(struct super_block *sb, void *raw_data, int silent)
 	else if (mnt->flags & SMB_MOUNT_DIRATTR)
 		printk("SMBFS: Using dir ff getattr\n");
 
-	if (smbiod_register_server(server) < 0) {
-		printk(KERN_ERR "smbfs: failed to start smbiod\n");
-		goto out_no_smbiod;
-	}
+	smbiod_register_server(server);
 
 	/*
 	 * Keep the super block locked while we get the root inode.
@@ -619,7 +618,6 @@ static int smb_fill_super(struct super_block *sb, void *raw_data, int silent)
 
 out_no_root:
 	iput(root_inode);
-out_no_smbiod:
 	smb_unload_nls(server);
 out_bad_option:
 	kfree(mem);
@@ -808,11 +806,16 @@ static int __init init_smb_fs(void)
 	err = smb_init_request_cache();
 	if (err)
 		goto out_request;
+	err = smbiod_init();
+	if (err)
+		goto out_smbiod;
 	err = register_filesystem(&smb_fs_type);
 	if (err)
 		goto out;
 	return 0;
 out:
+	smbiod_exit();
+out_smbiod:
 	smb_destroy_request_cache();
 out_request:
 	destroy_inodecache();
@@ -824,6 +827,7 @@ static void __exit exit_smb_fs(void)
 {
 	DEBUG1("unregistering ...\n");
 	unregister_filesystem(&smb_fs_type);
+	smbiod_exit();
 	smb_destroy_request_cache();
 	destroy_inodecache();
 }
@@ -817,14 +817,9 @@ err_unknown:
    the answer is <=0, the returned number is a valid unix errno. */
 
 static int
-smb_request_ok(struct smb_request *req, int command, int wct, int bcc)
+smb_request_check(struct smb_request *req, int result,
+		  int command, int wct, int bcc)
 {
-	int result;
-
-	req->rq_resp_wct = wct;
-	req->rq_resp_bcc = bcc;
-
-	result = smb_add_request(req);
 	if (result != 0) {
 		DEBUG1("smb_request failed\n");
 		goto out;
@@ -841,6 +836,33 @@ out:
 	return result;
 }
 
+static int
+smb_request_ok(struct smb_request *req, int command, int wct, int bcc)
+{
+	req->rq_resp_wct = wct;
+	req->rq_resp_bcc = bcc;
+
+	return smb_request_check(req, smb_add_request(req), command, wct, bcc);
+}
+
+/* smb_request_start/smb_request_finish: smb_request_ok split in two, so
+   that several requests can be outstanding on the server at once. */
+
+static int
+smb_request_start(struct smb_request *req, int wct, int bcc)
+{
+	req->rq_resp_wct = wct;
+	req->rq_resp_bcc = bcc;
+
+	return smb_queue_request(req);
+}
+
+static int
+smb_request_finish(struct smb_request *req, int command, int wct, int bcc)
+{
+	return smb_request_check(req, smb_wait_request(req), command, wct, bcc);
+}
+
 /*
  * This implements the NEWCONN ioctl. It installs the server pid,
  * sets server->state to CONN_VALID, and wakes up the waiting process.
@@ -900,8 +922,9 @@ smb_newconn(struct smb_sb_info *server, struct smb_conn_opt *opt)
 	sk = SOCKET_I(filp->f_path.dentry->d_inode)->sk;
 	sk->sk_user_data = server;
 
-	/* chain into the data_ready callback */
+	/* chain into the data_ready and write_space callbacks */
 	server->data_ready = xchg(&sk->sk_data_ready, smb_data_ready);
+	server->write_space = xchg(&sk->sk_write_space, smb_write_space);
 
 	/* check if we have an old smbmount that uses seconds for the 
 	   serverzone */
@@ -979,7 +1002,7 @@ smb_newconn(struct smb_sb_info *server, struct smb_conn_opt *opt)
 	}
 
 	smb_unlock_server(server);
-	smbiod_wake_up();
+	smbiod_wake_up(server);
 	if (server->opt.capabilities & SMB_CAP_UNIX)
 		smb_proc_query_cifsunix(server);
 
@@ -989,7 +1012,7 @@ smb_newconn(struct smb_sb_info *server, struct smb_conn_opt *opt)
 
 out:
 	smb_unlock_server(server);
-	smbiod_wake_up();
+	smbiod_wake_up(server);
 	return error;
 
 out_putf:
@@ -1320,19 +1343,11 @@ smb_proc_read_data(struct smb_request *req)
 	req->rq_rlen = smb_len(req->rq_header) + 4 - req->rq_bytes_recvd;
 }
 
-static int
-smb_proc_read(struct inode *inode, loff_t offset, int count, char *data)
+static void
+smb_setup_read(struct smb_request *req, struct inode *inode, loff_t offset,
+	       int count, char *data)
 {
-	struct smb_sb_info *server = server_from_inode(inode);
-	__u16 returned_count, data_len;
 	unsigned char *buf;
-	int result;
-	struct smb_request *req;
-	u8 rbuf[4];
-
-	result = -ENOMEM;
-	if (! (req = smb_alloc_request(server, 0)))
-		goto out;
 
 	smb_setup_header(req, SMBread, 5, 0);
 	buf = req->rq_header;
@@ -1344,44 +1359,64 @@ smb_proc_read(struct inode *inode, loff_t offset, int count, char *data)
 	req->rq_page = data;
 	req->rq_rsize = count;
 	req->rq_callback = smb_proc_read_data;
-	req->rq_buffer = rbuf;
-	req->rq_flags |= SMB_REQ_NORETRY | SMB_REQ_STATIC;
+	req->rq_flags |= SMB_REQ_NORETRY;
+}
 
-	result = smb_request_ok(req, SMBread, 5, -1);
-	if (result < 0)
-		goto out_free;
-	returned_count = WVAL(req->rq_header, smb_vwv0);
+static int
+smb_read_result(struct smb_request *req)
+{
+	__u16 returned_count, data_len;
 
-	data_len = WVAL(rbuf, 1);
+	returned_count = WVAL(req->rq_header, smb_vwv0);
+	data_len = WVAL(req->rq_buffer, 1);
 
 	if (returned_count != data_len) {
 		printk(KERN_NOTICE "smb_proc_read: returned != data_len\n");
 		printk(KERN_NOTICE "smb_proc_read: ret_c=%d, data_len=%d\n",
 		       returned_count, data_len);
 	}
-	result = data_len;
-
-out_free:
-	smb_rput(req);
-out:
-	VERBOSE("ino=%ld, fileid=%d, count=%d, result=%d\n",
-		inode->i_ino, SMB_I(inode)->fileid, count, result);
-	return result;
+	return data_len;
 }
 
 static int
-smb_proc_write(struct inode *inode, loff_t offset, int count, const char *data)
+smb_proc_read(struct inode *inode, loff_t offset, int count, char *data)
 {
 	struct smb_sb_info *server = server_from_inode(inode);
 	int result;
-	u16 fileid = SMB_I(inode)->fileid;
-	u8 buf[4];
 	struct smb_request *req;
+	u8 rbuf[4];
 
 	result = -ENOMEM;
 	if (! (req = smb_alloc_request(server, 0)))
 		goto out;
 
+	smb_setup_read(req, inode, offset, count, data);
+	req->rq_buffer = rbuf;
+	req->rq_flags |= SMB_REQ_STATIC;
+
+	result = smb_request_ok(req, SMBread, 5, -1);
+	if (result < 0)
+		goto out_free;
+	result = smb_read_result(req);
+
+out_free:
+	smb_rput(req);
+out:
+	VERBOSE("ino=%ld, fileid=%d, count=%d, result=%d\n",
+		inode->i_ino, SMB_I(inode)->fileid, count, result);
+	return result;
+}
+
+/*
+ * The three byte data block header goes in 'buf', which must stay valid
+ * until the request has been sent.
+ */
+static void
+smb_setup_write(struct smb_request *req, struct inode *inode, loff_t offset,
+		int count, const char *data, u8 *buf)
+{
+	u16 fileid = SMB_I(inode)->fileid;
+
 	VERBOSE("ino=%ld, fileid=%d, count=%d@%Ld\n",
 		inode->i_ino, fileid, count, offset);
 
@@ -1399,6 +1434,21 @@ smb_proc_write(struct inode *inode, loff_t offset, int count, const char *data)
 	req->rq_iov[2].iov_len = count;
 	req->rq_iovlen = 3;
 	req->rq_flags |= SMB_REQ_NORETRY;
+}
+
+static int
+smb_proc_write(struct inode *inode, loff_t offset, int count, const char *data)
+{
+	struct smb_sb_info *server = server_from_inode(inode);
+	int result;
+	u8 buf[4];
+	struct smb_request *req;
+
+	result = -ENOMEM;
+	if (! (req = smb_alloc_request(server, 0)))
+		goto out;
+
+	smb_setup_write(req, inode, offset, count, data, buf);
 
 	result = smb_request_ok(req, SMBwrite, 1, 0);
 	if (result >= 0)
@@ -1443,19 +1493,14 @@ smb_proc_readX_data(struct smb_request *req)
 	req->rq_rlen = smb_len(req->rq_header) + 4 - req->rq_bytes_recvd;
 }
 
-static int
-smb_proc_readX(struct inode *inode, loff_t offset, int count, char *data)
+static void
+smb_setup_readX(struct smb_request *req, struct inode *inode, loff_t offset,
+		int count, char *data)
 {
-	struct smb_sb_info *server = server_from_inode(inode);
 	unsigned char *buf;
-	int result;
-	struct smb_request *req;
+	/* only ever written to, so it can be shared by all requests */
 	static char pad[SMB_READX_MAX_PAD];
 
-	result = -ENOMEM;
-	if (! (req = smb_alloc_request(server, 0)))
-		goto out;
-
 	smb_setup_header(req, SMBreadX, 12, 0);
 	buf = req->rq_header;
 	WSET(buf, smb_vwv0, 0x00ff);
@@ -1475,6 +1520,20 @@ smb_proc_readX(struct inode *inode, loff_t offset, int count, char *data)
 	req->rq_buffer = pad;
 	req->rq_bufsize = SMB_READX_MAX_PAD;
 	req->rq_flags |= SMB_REQ_STATIC | SMB_REQ_NORETRY;
+}
+
+static int
+smb_proc_readX(struct inode *inode, loff_t offset, int count, char *data)
+{
+	struct smb_sb_info *server = server_from_inode(inode);
+	int result;
+	struct smb_request *req;
+
+	result = -ENOMEM;
+	if (! (req = smb_alloc_request(server, 0)))
+		goto out;
+
+	smb_setup_readX(req, inode, offset, count, data);
 
 	result = smb_request_ok(req, SMBreadX, 12, -1);
 	if (result < 0)
@@ -1489,23 +1548,17 @@ out:
 	return result;
 }
 
-static int
-smb_proc_writeX(struct inode *inode, loff_t offset, int count, const char *data)
+static void
+smb_setup_writeX(struct smb_request *req, struct inode *inode, loff_t offset,
+		 int count, const char *data)
 {
-	struct smb_sb_info *server = server_from_inode(inode);
-	int result;
-	u8 *p;
+	/* the pad byte is never looked at by the server */
 	static u8 pad[4];
-	struct smb_request *req;
-
-	result = -ENOMEM;
-	if (! (req = smb_alloc_request(server, 0)))
-		goto out;
 
 	VERBOSE("ino=%ld, fileid=%d, count=%d@%Ld\n",
 		inode->i_ino, SMB_I(inode)->fileid, count, offset);
 
-	p = smb_setup_header(req, SMBwriteX, 14, count + 1);
+	smb_setup_header(req, SMBwriteX, 14, count + 1);
 	WSET(req->rq_header, smb_vwv0, 0x00ff);
 	WSET(req->rq_header, smb_vwv1, 0);
 	WSET(req->rq_header, smb_vwv2, SMB_I(inode)->fileid);
@@ -1524,6 +1577,20 @@ smb_proc_writeX(struct inode *inode, loff_t offset, int count, const char *data)
 	req->rq_iov[2].iov_len = count;
 	req->rq_iovlen = 3;
 	req->rq_flags |= SMB_REQ_NORETRY;
+}
+
+static int
+smb_proc_writeX(struct inode *inode, loff_t offset, int count, const char *data)
+{
+	struct smb_sb_info *server = server_from_inode(inode);
+	int result;
+	struct smb_request *req;
+
+	result = -ENOMEM;
+	if (! (req = smb_alloc_request(server, 0)))
+		goto out;
+
+	smb_setup_writeX(req, inode, offset, count, data);
 
 	result = smb_request_ok(req, SMBwriteX, 6, 0);
  	if (result >= 0)
@@ -1534,6 +1601,109 @@ out:
 	return result;
 }
 
+/*
+ * Asynchronous variants of server->ops->read and server->ops->write, used by
+ * readpages and writepages to keep several requests outstanding. The data
+ * buffer must stay valid until the matching _finish call, which returns
+ * the byte count (or error) and drops the request.
+ *
+ * The core read/write requests need a small per request buffer for the
+ * data block header, since the caller's stack is gone by the time smbiod
+ * sends or receives them.
+ */
+struct smb_request *
+smb_proc_read_start(struct inode *inode, loff_t offset, int count, char *data)
+{
+	struct smb_sb_info *server = server_from_inode(inode);
+	int readX = server->ops->read == smb_proc_readX;
+	struct smb_request *req;
+	int result;
+
+	if (! (req = smb_alloc_request(server, readX ? 0 : 4)))
+		return ERR_PTR(-ENOMEM);
+
+	if (readX) {
+		smb_setup_readX(req, inode, offset, count, data);
+		result = smb_request_start(req, 12, -1);
+	} else {
+		smb_setup_read(req, inode, offset, count, data);
+		result = smb_request_start(req, 5, -1);
+	}
+	if (result < 0) {
+		smb_rput(req);
+		return ERR_PTR(result);
+	}
+	return req;
+}
+
+int
+smb_proc_read_finish(struct inode *inode, struct smb_request *req)
+{
+	struct smb_sb_info *server = server_from_inode(inode);
+	int result;
+
+	if (server->ops->read == smb_proc_readX) {
+		result = smb_request_finish(req, SMBreadX, 12, -1);
+		if (result >= 0)
+			result = WVAL(req->rq_header, smb_vwv5);
+	} else {
+		result = smb_request_finish(req, SMBread, 5, -1);
+		if (result >= 0)
+			result = smb_read_result(req);
+	}
+	smb_rput(req);
+
+	VERBOSE("ino=%ld, fileid=%d, result=%d\n",
+		inode->i_ino, SMB_I(inode)->fileid, result);
+	return result;
+}
+
+struct smb_request *
+smb_proc_write_start(struct inode *inode, loff_t offset, int count,
+		     const char *data)
+{
+	struct smb_sb_info *server = server_from_inode(inode);
+	int writeX = server->ops->write == smb_proc_writeX;
+	struct smb_request *req;
+	int result;
+
+	if (! (req = smb_alloc_request(server, writeX ? 0 : 4)))
+		return ERR_PTR(-ENOMEM);
+
+	if (writeX) {
+		smb_setup_writeX(req, inode, offset, count, data);
+		result = smb_request_start(req, 6, 0);
+	} else {
+		smb_setup_write(req, inode, offset, count, data,
+				req->rq_buffer);
+		result = smb_request_start(req, 1, 0);
+	}
+	if (result < 0) {
+		smb_rput(req);
+		return ERR_PTR(result);
+	}
+	return req;
+}
+
+int
+smb_proc_write_finish(struct inode *inode, struct smb_request *req)
+{
+	struct smb_sb_info *server = server_from_inode(inode);
+	int result;
+
+	if (server->ops->write == smb_proc_writeX) {
+		result = smb_request_finish(req, SMBwriteX, 6, 0);
+		if (result >= 0)
+			result = WVAL(req->rq_header, smb_vwv2);
+	} else {
+		result = smb_request_finish(req, SMBwrite, 1, 0);
+		if (result >= 0)
+			result = WVAL(req->rq_header, smb_vwv0);
+	}
+	smb_rput(req);
+	return result;
+}
+
 int
 smb_proc_create(struct dentry *dentry, __u16 attr, time_t ctime, __u16 *fileid)
 {
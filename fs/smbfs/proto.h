@@ -17,6 +17,10 @@ extern __u8 *smb_setup_header(struct smb_request *req, __u8 command, __u16 wct,
 extern int smb_open(struct dentry *dentry, int wish);
 extern int smb_close(struct inode *ino);
 extern int smb_close_fileid(struct dentry *dentry, __u16 fileid);
+extern struct smb_request *smb_proc_read_start(struct inode *inode, loff_t offset, int count, char *data);
+extern int smb_proc_read_finish(struct inode *inode, struct smb_request *req);
+extern struct smb_request *smb_proc_write_start(struct inode *inode, loff_t offset, int count, const char *data);
+extern int smb_proc_write_finish(struct inode *inode, struct smb_request *req);
 extern int smb_proc_create(struct dentry *dentry, __u16 attr, time_t ctime, __u16 *fileid);
 extern int smb_proc_mv(struct dentry *old_dentry, struct dentry *new_dentry);
 extern int smb_proc_mkdir(struct dentry *dentry);
@@ -47,6 +51,7 @@ extern struct dentry *smb_dget_fpos(struct dentry *dentry, struct dentry *parent
 extern int smb_fill_cache(struct file *filp, void *dirent, filldir_t filldir, struct smb_cache_control *ctrl, struct qstr *qname, struct smb_fattr *entry);
 /* sock.c */
 extern void smb_data_ready(struct sock *sk, int len);
+extern void smb_write_space(struct sock *sk);
 extern int smb_valid_socket(struct inode *inode);
 extern void smb_close_socket(struct smb_sb_info *server);
 extern int smb_recv_available(struct smb_sb_info *server);
@@ -69,16 +74,20 @@ extern const struct inode_operations smb_file_inode_operations;
 /* ioctl.c */
 extern int smb_ioctl(struct inode *inode, struct file *filp, unsigned int cmd, unsigned long arg);
 /* smbiod.c */
-extern void smbiod_wake_up(void);
-extern int smbiod_register_server(struct smb_sb_info *server);
+extern void smbiod_wake_up(struct smb_sb_info *server);
+extern void smbiod_register_server(struct smb_sb_info *server);
 extern void smbiod_unregister_server(struct smb_sb_info *server);
 extern void smbiod_flush(struct smb_sb_info *server);
 extern int smbiod_retry(struct smb_sb_info *server);
+extern int smbiod_init(void);
+extern void smbiod_exit(void);
 /* request.c */
 extern int smb_init_request_cache(void);
 extern void smb_destroy_request_cache(void);
 extern struct smb_request *smb_alloc_request(struct smb_sb_info *server, int bufsize);
 extern void smb_rput(struct smb_request *req);
+extern int smb_queue_request(struct smb_request *req);
+extern int smb_wait_request(struct smb_request *req);
 extern int smb_add_request(struct smb_request *req);
 extern int smb_request_send_server(struct smb_sb_info *server);
 extern int smb_request_recv(struct smb_sb_info *server);
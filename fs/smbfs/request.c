@@ -12,6 +12,7 @@
 #include <linux/slab.h>
 #include <linux/net.h>
 #include <linux/sched.h>
+#include <linux/mempool.h>
 
 #include <linux/smb_fs.h>
 #include <linux/smbno.h>
@@ -26,6 +27,32 @@
 
 /* cache for request structures */
 static struct kmem_cache *req_cachep;
+static mempool_t *req_poolp;
+
+/* requests kept in reserve, so that writeback can make progress */
+#define SMB_MIN_REQUESTS	8
+
+/*
+ * Request buffers come from size classed caches, each with a small reserve.
+ * Most requests either need a few bytes, a page (paths) or a full
+ * max_xmit packet (readdir, trans2 reassembly), so three classes are
+ * enough. max_xmit is never larger than SMB_MAX_PACKET_SIZE.
+ */
+struct smb_buf_class {
+	const char *name;
+	int size;
+	int reserve;
+	struct kmem_cache *cachep;
+	mempool_t *pool;
+};
+
+static struct smb_buf_class smb_buf_classes[] = {
+	{ "smb_buf_small",	128,			8 },
+	{ "smb_buf_page",	PAGE_SIZE,		4 },
+	{ "smb_buf_large",	SMB_MAX_PACKET_SIZE,	2 },
+};
+#define SMB_BUF_CLASSES	ARRAY_SIZE(smb_buf_classes)
+#define SMB_BUF_LARGE	(&smb_buf_classes[SMB_BUF_CLASSES - 1])
 
 static int smb_request_send_req(struct smb_request *req);
 
@@ -35,8 +62,24 @@ static int smb_request_send_req(struct smb_request *req);
 */
 
 
+static void smb_destroy_buf_classes(void)
+{
+	struct smb_buf_class *bc;
+
+	for (bc = smb_buf_classes; bc < smb_buf_classes + SMB_BUF_CLASSES; bc++) {
+		if (bc->pool)
+			mempool_destroy(bc->pool);
+		if (bc->cachep)
+			kmem_cache_destroy(bc->cachep);
+		bc->pool = NULL;
+		bc->cachep = NULL;
+	}
+}
+
 int smb_init_request_cache(void)
 {
+	struct smb_buf_class *bc;
+
 	req_cachep = kmem_cache_create("smb_request",
 				       sizeof(struct smb_request), 0,
 				       SMB_SLAB_DEBUG | SLAB_HWCACHE_ALIGN,
@@ -44,14 +87,46 @@ int smb_init_request_cache(void)
 	if (req_cachep == NULL)
 		return -ENOMEM;
 
+	req_poolp = mempool_create_slab_pool(SMB_MIN_REQUESTS, req_cachep);
+	if (req_poolp == NULL)
+		goto out_cache;
+
+	for (bc = smb_buf_classes; bc < smb_buf_classes + SMB_BUF_CLASSES; bc++) {
+		bc->cachep = kmem_cache_create(bc->name, bc->size, 0,
+					       SMB_SLAB_DEBUG, NULL);
+		if (bc->cachep == NULL)
+			goto out_bufs;
+		bc->pool = mempool_create_slab_pool(bc->reserve, bc->cachep);
+		if (bc->pool == NULL)
+			goto out_bufs;
+	}
 	return 0;
+
+out_bufs:
+	smb_destroy_buf_classes();
+	mempool_destroy(req_poolp);
+out_cache:
+	kmem_cache_destroy(req_cachep);
+	return -ENOMEM;
 }
 
 void smb_destroy_request_cache(void)
 {
+	smb_destroy_buf_classes();
+	mempool_destroy(req_poolp);
 	kmem_cache_destroy(req_cachep);
 }
 
+static struct smb_buf_class *smb_buf_class(int bufsize)
+{
+	struct smb_buf_class *bc;
+
+	for (bc = smb_buf_classes; bc < smb_buf_classes + SMB_BUF_CLASSES; bc++)
+		if (bufsize <= bc->size)
+			return bc;
+	return NULL;
+}
+
 /*
  * Allocate and initialise a request structure
  */
@@ -61,20 +136,30 @@ static struct smb_request *smb_do_alloc_request(struct smb_sb_info *server,
 	struct smb_request *req;
 	unsigned char *buf = NULL;
 
-	req = kmem_cache_zalloc(req_cachep, GFP_KERNEL);
+	mempool_t *pool = NULL;
+
+	req = mempool_alloc(req_poolp, GFP_NOFS);
 	VERBOSE("allocating request: %p\n", req);
 	if (!req)
 		goto out;
+	memset(req, 0, sizeof(*req));
 
 	if (bufsize > 0) {
-		buf = kmalloc(bufsize, GFP_NOFS);
+		struct smb_buf_class *bc = smb_buf_class(bufsize);
+
+		if (bc) {
+			pool = bc->pool;
+			buf = mempool_alloc(pool, GFP_NOFS);
+		} else
+			buf = kmalloc(bufsize, GFP_NOFS);
 		if (!buf) {
-			kmem_cache_free(req_cachep, req);
+			mempool_free(req, req_poolp);
 			return NULL;
 		}
 	}
 
 	req->rq_buffer = buf;
+	req->rq_bufpool = pool;
 	req->rq_bufsize = bufsize;
 	req->rq_server = server;
 	init_waitqueue_head(&req->rq_wait);
@@ -121,10 +206,15 @@ struct smb_request *smb_alloc_request(struct smb_sb_info *server, int bufsize)
 static void smb_free_request(struct smb_request *req)
 {
 	atomic_dec(&req->rq_server->nr_requests);
-	if (req->rq_buffer && !(req->rq_flags & SMB_REQ_STATIC))
-		kfree(req->rq_buffer);
-	kfree(req->rq_trans2buffer);
-	kmem_cache_free(req_cachep, req);
+	if (req->rq_buffer && !(req->rq_flags & SMB_REQ_STATIC)) {
+		if (req->rq_bufpool)
+			mempool_free(req->rq_buffer, req->rq_bufpool);
+		else
+			kfree(req->rq_buffer);
+	}
+	if (req->rq_trans2buffer)
+		mempool_free(req->rq_trans2buffer, SMB_BUF_LARGE->pool);
+	mempool_free(req, req_poolp);
 }
 
 /*
@@ -180,8 +270,6 @@ static int smb_setup_request(struct smb_request *req)
 	req->rq_err = 0;
 	req->rq_errno = 0;
 	req->rq_fragment = 0;
-	kfree(req->rq_trans2buffer);
-	req->rq_trans2buffer = NULL;
 
 	return 0;
 }
@@ -271,11 +359,12 @@ static int smb_setup_trans2request(struct smb_request *req)
 }
 
 /*
- * Add a request and tell smbiod to process it
+ * Queue a request and tell smbiod to process it, without waiting for the
+ * reply. Callers with several independent requests (readpages/writepages)
+ * queue them all first and then collect the replies with smb_wait_request.
  */
-int smb_add_request(struct smb_request *req)
+int smb_queue_request(struct smb_request *req)
 {
-	long timeleft;
 	struct smb_sb_info *server = req->rq_server;
 	int result = 0;
 
@@ -330,7 +419,17 @@ int smb_add_request(struct smb_request *req)
 
 	smb_unlock_server(server);
 
-	smbiod_wake_up();
+	smbiod_wake_up(server);
+	return 0;
+}
+
+/*
+ * Wait for the reply to a request queued by smb_queue_request
+ */
+int smb_wait_request(struct smb_request *req)
+{
+	long timeleft;
+	struct smb_sb_info *server = req->rq_server;
 
 	timeleft = wait_event_interruptible_timeout(req->rq_wait,
 				    req->rq_flags & SMB_REQ_RECEIVED, 30*HZ);
@@ -365,7 +464,7 @@ int smb_add_request(struct smb_request *req)
 		req->rq_err  = ERRtimeout;
 
 		/* Just in case it was "stuck" */
-		smbiod_wake_up();
+		smbiod_wake_up(server);
 	}
 	VERBOSE("woke up, rcls=%d\n", req->rq_rcls);
 
@@ -376,6 +475,19 @@ int smb_add_request(struct smb_request *req)
 	return req->rq_errno;
 }
 
+/*
+ * Add a request and wait for the reply
+ */
+int smb_add_request(struct smb_request *req)
+{
+	int result;
+
+	result = smb_queue_request(req);
+	if (result < 0)
+		return result;
+	return smb_wait_request(req);
+}
+
 /*
  * Send a request and place it on the recvq if successfully sent.
  * Must be called with the server lock held.
@@ -643,10 +755,23 @@ static int smb_recv_trans2(struct smb_sb_info *server, struct smb_request *req)
 		if (buf_len > SMB_MAX_PACKET_SIZE)
 			goto out_too_long;
 
+		/*
+		 * A reassembly buffer from an earlier try of this request is
+		 * reused. smbiod must not wait for the reserve to be refilled,
+		 * as that may need a reply only smbiod can receive.
+		 */
 		req->rq_trans2bufsize = buf_len;
-		req->rq_trans2buffer = kzalloc(buf_len, GFP_NOFS);
+		if (!req->rq_trans2buffer) {
+			req->rq_trans2buffer =
+				kmem_cache_alloc(SMB_BUF_LARGE->cachep, GFP_NOFS);
+			if (!req->rq_trans2buffer)
+				req->rq_trans2buffer =
+					mempool_alloc(SMB_BUF_LARGE->pool,
+						      GFP_NOWAIT);
+		}
 		if (!req->rq_trans2buffer)
 			goto out_no_mem;
+		memset(req->rq_trans2buffer, 0, buf_len);
 
 		req->rq_parm = req->rq_trans2buffer;
 		req->rq_data = req->rq_trans2buffer + parm_tot;
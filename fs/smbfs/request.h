@@ -1,4 +1,5 @@
 #include <linux/list.h>
+#include <linux/mempool.h>
 #include <linux/types.h>
 #include <linux/uio.h>
 #include <linux/wait.h>
@@ -19,6 +20,7 @@ struct smb_request {
 
 	int rq_bufsize;
 	unsigned char *rq_buffer;
+	mempool_t *rq_bufpool;	/* rq_buffer size class, NULL if kmalloc'ed */
 
 	/* FIXME: this is not good enough for merging IO requests. */
 	unsigned char *rq_page;
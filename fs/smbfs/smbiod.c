@@ -18,7 +18,7 @@
 #include <linux/dcache.h>
 #include <linux/module.h>
 #include <linux/net.h>
-#include <linux/kthread.h>
+#include <linux/workqueue.h>
 #include <net/ip.h>
 
 #include <linux/smb_fs.h>
@@ -32,92 +32,45 @@
 #include "request.h"
 #include "proto.h"
 
-enum smbiod_state {
-	SMBIOD_DEAD,
-	SMBIOD_STARTING,
-	SMBIOD_RUNNING,
-};
-
-static enum smbiod_state smbiod_state = SMBIOD_DEAD;
-static struct task_struct *smbiod_thread;
-static DECLARE_WAIT_QUEUE_HEAD(smbiod_wait);
-static LIST_HEAD(smb_servers);
-static DEFINE_SPINLOCK(servers_lock);
-
-#define SMBIOD_DATA_READY	(1<<0)
-static unsigned long smbiod_flags;
-
-static int smbiod(void *);
-static int smbiod_start(void);
+static void smbiod_work(struct work_struct *work);
 
 /*
- * called when there's work for us to do
+ * Each server has its own work item on this (per cpu) workqueue, so a slow
+ * or busy server only holds up its own requests and not those of every
+ * other smbfs mount.
  */
-void smbiod_wake_up(void)
-{
-	if (smbiod_state == SMBIOD_DEAD)
-		return;
-	set_bit(SMBIOD_DATA_READY, &smbiod_flags);
-	wake_up_interruptible(&smbiod_wait);
-}
+static struct workqueue_struct *smbiod_wq;
 
 /*
- * start smbiod if none is running
+ * called when there's work for us to do
  */
-static int smbiod_start(void)
+void smbiod_wake_up(struct smb_sb_info *server)
 {
-	struct task_struct *tsk;
-	int err = 0;
-
-	if (smbiod_state != SMBIOD_DEAD)
-		return 0;
-	smbiod_state = SMBIOD_STARTING;
-	__module_get(THIS_MODULE);
-	spin_unlock(&servers_lock);
-	tsk = kthread_run(smbiod, NULL, "smbiod");
-	if (IS_ERR(tsk)) {
-		err = PTR_ERR(tsk);
-		module_put(THIS_MODULE);
-	}
-
-	spin_lock(&servers_lock);
-	if (err < 0) {
-		smbiod_state = SMBIOD_DEAD;
-		smbiod_thread = NULL;
-	} else {
-		smbiod_state = SMBIOD_RUNNING;
-		smbiod_thread = tsk;
-	}
-	return err;
+	queue_work(smbiod_wq, &server->io_work);
 }
 
 /*
- * register a server & start smbiod if necessary
+ * register a server
  */
-int smbiod_register_server(struct smb_sb_info *server)
+void smbiod_register_server(struct smb_sb_info *server)
 {
-	int ret;
-	spin_lock(&servers_lock);
-	list_add(&server->entry, &smb_servers);
+	INIT_WORK(&server->io_work, smbiod_work);
 	VERBOSE("%p\n", server);
-	ret = smbiod_start();
-	spin_unlock(&servers_lock);
-	return ret;
 }
 
 /*
  * Unregister a server
- * Must be called with the server lock held.
+ * Must be called without the server lock held, after the socket has been
+ * closed so that no new work can be queued for the server.
  */
 void smbiod_unregister_server(struct smb_sb_info *server)
 {
-	spin_lock(&servers_lock);
-	list_del_init(&server->entry);
 	VERBOSE("%p\n", server);
-	spin_unlock(&servers_lock);
+	cancel_work_sync(&server->io_work);
 
-	smbiod_wake_up();
+	smb_lock_server(server);
 	smbiod_flush(server);
+	smb_unlock_server(server);
 }
 
 void smbiod_flush(struct smb_sb_info *server)
@@ -247,99 +200,71 @@ static void smbiod_handle_request(struct smb_sb_info *server)
 
 /*
  * Do some IO for one server.
+ * Returns true if there is more data to receive, so we want to run again
+ * after giving other servers a go.  Sending is restarted by smb_write_space
+ * once the socket has room again.
  */
-static void smbiod_doio(struct smb_sb_info *server)
+static bool smbiod_doio(struct smb_sb_info *server)
 {
 	int result;
 	int maxwork = 7;
 
 	if (server->state != CONN_VALID)
-		goto out;
+		return false;
 
 	do {
 		result = smb_request_recv(server);
 		if (result < 0) {
 			server->state = CONN_INVALID;
 			smbiod_retry(server);
-			goto out;	/* reconnecting is slow */
+			return false;	/* reconnecting is slow */
 		} else if (server->rstate == SMB_RECV_REQUEST)
 			smbiod_handle_request(server);
 	} while (result > 0 && maxwork-- > 0);
 
-	/*
-	 * If there is more to read then we want to be sure to wake up again.
-	 */
 	if (server->state != CONN_VALID)
-		goto out;
-	if (smb_recv_available(server) > 0)
-		set_bit(SMBIOD_DATA_READY, &smbiod_flags);
+		return false;
 
 	do {
 		result = smb_request_send_server(server);
 		if (result < 0) {
 			server->state = CONN_INVALID;
 			smbiod_retry(server);
-			goto out;	/* reconnecting is slow */
+			return false;	/* reconnecting is slow */
 		}
 	} while (result > 0);
 
-	/*
-	 * If the last request was not sent out we want to wake up again.
-	 */
-	if (!list_empty(&server->xmitq))
-		set_bit(SMBIOD_DATA_READY, &smbiod_flags);
-
-out:
-	return;
+	return smb_recv_available(server) > 0;
 }
 
 /*
- * smbiod kernel thread
+ * smbiod work, run whenever a server has data to receive or send
  */
-static int smbiod(void *unused)
+static void smbiod_work(struct work_struct *work)
 {
-	VERBOSE("SMB Kernel thread starting (%d) ...\n", current->pid);
-
-	for (;;) {
-		struct smb_sb_info *server;
-		struct list_head *pos, *n;
-
-		/* FIXME: Use poll? */
-		wait_event_interruptible(smbiod_wait,
-			 test_bit(SMBIOD_DATA_READY, &smbiod_flags));
-		if (signal_pending(current)) {
-			spin_lock(&servers_lock);
-			smbiod_state = SMBIOD_DEAD;
-			spin_unlock(&servers_lock);
-			break;
-		}
-
-		clear_bit(SMBIOD_DATA_READY, &smbiod_flags);
-
-		spin_lock(&servers_lock);
-		if (list_empty(&smb_servers)) {
-			smbiod_state = SMBIOD_DEAD;
-			spin_unlock(&servers_lock);
-			break;
-		}
+	struct smb_sb_info *server = container_of(work, struct smb_sb_info,
+						  io_work);
+	bool again;
 
-		list_for_each_safe(pos, n, &smb_servers) {
-			server = list_entry(pos, struct smb_sb_info, entry);
-			VERBOSE("checking server %p\n", server);
+	VERBOSE("checking server %p\n", server);
 
-			if (server->state == CONN_VALID) {
-				spin_unlock(&servers_lock);
+	smb_lock_server(server);
+	again = smbiod_doio(server);
+	smb_unlock_server(server);
 
-				smb_lock_server(server);
-				smbiod_doio(server);
-				smb_unlock_server(server);
+	if (again)
+		smbiod_wake_up(server);
+}
 
-				spin_lock(&servers_lock);
-			}
-		}
-		spin_unlock(&servers_lock);
-	}
+int smbiod_init(void)
+{
+	smbiod_wq = create_workqueue("smbiod");
+	if (!smbiod_wq)
+		return -ENOMEM;
+	return 0;
+}
 
-	VERBOSE("SMB Kernel thread exiting (%d) ...\n", current->pid);
-	module_put_and_exit(0);
+void smbiod_exit(void)
+{
+	destroy_workqueue(smbiod_wq);
 }
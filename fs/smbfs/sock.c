@@ -63,7 +63,22 @@ smb_data_ready(struct sock *sk, int len)
 
 	data_ready(sk, len);
 	VERBOSE("(%p, %d)\n", sk, len);
-	smbiod_wake_up();
+	smbiod_wake_up(server);
+}
+
+/*
+ * Called when there is room in the socket send buffer again.
+ */
+void
+smb_write_space(struct sock *sk)
+{
+	struct smb_sb_info *server = server_from_socket(sk->sk_socket);
+	void (*write_space)(struct sock *) = server->write_space;
+
+	write_space(sk);
+	/* no lock, if we miss a request smb_add_request wakes us */
+	if (!list_empty(&server->xmitq))
+		smbiod_wake_up(server);
 }
 
 int
@@ -99,6 +114,7 @@ smb_close_socket(struct smb_sb_info *server)
 
 		VERBOSE("closing socket %p\n", sock);
 		sock->sk->sk_data_ready = server->data_ready;
+		sock->sk->sk_write_space = server->write_space;
 		server->sock_file = NULL;
 		fput(file);
 	}
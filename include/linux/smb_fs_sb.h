@@ -10,6 +10,7 @@
 #define _SMB_FS_SB
 
 #include <linux/types.h>
+#include <linux/workqueue.h>
 #include <linux/smb.h>
 
 /*
@@ -34,8 +35,8 @@ enum smb_receive_state {
 #define SB_of(server) ((server)->super_block)
 
 struct smb_sb_info {
-	/* List of all smbfs superblocks */
-	struct list_head entry;
+	/* smbiod work doing the socket io for this server */
+	struct work_struct io_work;
 
         enum smb_conn_state state;
 	struct file * sock_file;
@@ -66,6 +67,8 @@ struct smb_sb_info {
 
         /* We use our own data_ready callback, but need the original one */
         void *data_ready;
+	/* ... and the same for write_space */
+	void *write_space;
 
 	/* nls pointers for codepage conversions */
 	struct nls_table *remote_nls;
@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Mount a cifs share from a private smbloop and run cifsbench on it.
+#
+#   cifs-bench.sh [-d delay_us] [-j jitter_us] [-o mount_opts] [-- cifsbench args]
+#
+# Needs root to mount. Builds the tools if they are not there yet.
+
+PORT=${PORT:-4450}
+MNT=${MNT:-/mnt/cifsbench}
+DELAY=0
+JITTER=0
+OPTS=
+
+while getopts d:j:o: opt; do
+	case $opt in
+	d) DELAY=$OPTARG ;;
+	j) JITTER=$OPTARG ;;
+	o) OPTS=,$OPTARG ;;
+	*) echo "usage: $0 [-d delay_us] [-j jitter_us] [-o mount_opts]" \
+		"[-- cifsbench args]" >&2
+	   exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+cd "$(dirname "$0")" || exit 1
+make -s smbloop cifsbench || exit 1
+
+./smbloop -p "$PORT" -d "$DELAY" -j "$JITTER" &
+SERVER=$!
+cleanup() {
+	umount "$MNT" 2>/dev/null
+	kill "$SERVER" 2>/dev/null
+	wait "$SERVER" 2>/dev/null
+}
+trap cleanup EXIT INT TERM
+sleep 1
+
+mkdir -p "$MNT"
+mount -t cifs //127.0.0.1/bench "$MNT" \
+	-o "ip=127.0.0.1,port=$PORT,user=bench,pass=bench$OPTS" || exit 1
+
+echo "delay ${DELAY}us jitter ${JITTER}us mount options:" \
+	"$(grep " $MNT " /proc/mounts | cut -d' ' -f4)"
+./cifsbench "$@" "$MNT"
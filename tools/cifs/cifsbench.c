@@ -0,0 +1,433 @@
+/*
+ * cifsbench.c - file workloads with per operation latency
+ *
+ * Runs a fixed set of workloads in a directory, normally on a cifs mount
+ * of smbloop, and prints for each the operation count, operations and
+ * megabytes per second, and the median, 99th percentile and worst
+ * operation latency:
+ *
+ *   seqwrite	write a file front to back, then fsync it
+ *   seqread	read it back after dropping it from the page cache
+ *   create	create, write and close many small files
+ *   stat	stat those files over and over
+ *   readdir	list a large directory
+ *   unlink	remove the small files
+ *
+ * Released under the GPL v2.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+typedef uint64_t u64;
+
+static const char *dir;
+static u64 file_size = 64 << 20;
+static size_t block_size = 64 << 10;
+static unsigned int nr_files = 1000;
+static unsigned int nr_dirents = 10000;
+static unsigned int rounds = 10;
+static size_t small_size = 4096;
+
+struct result {
+	u64 *lat;		/* nanoseconds per operation */
+	unsigned int ops;
+	unsigned int max_ops;
+	u64 bytes;
+	u64 start, end;
+};
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void die(const char *what, const char *path)
+{
+	fprintf(stderr, "cifsbench: %s %s: %s\n", what, path ? path : "",
+		strerror(errno));
+	exit(1);
+}
+
+static void result_init(struct result *res, unsigned int max_ops)
+{
+	res->lat = malloc(max_ops * sizeof(*res->lat));
+	if (res->lat == NULL)
+		die("malloc", NULL);
+	res->ops = 0;
+	res->max_ops = max_ops;
+	res->bytes = 0;
+	res->start = now_ns();
+	res->end = 0;
+}
+
+static void result_add(struct result *res, u64 start)
+{
+	if (res->ops < res->max_ops)
+		res->lat[res->ops++] = now_ns() - start;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double pct_ms(const struct result *res, double pct)
+{
+	unsigned int i = (unsigned int)(pct / 100 * (res->ops - 1) + 0.5);
+
+	return res->lat[i] / 1e6;
+}
+
+static void result_print(const char *name, struct result *res)
+{
+	double secs;
+
+	if (res->end == 0)
+		res->end = now_ns();
+	secs = (res->end - res->start) / 1e9;
+	if (res->ops == 0) {
+		printf("%-9s no operations\n", name);
+		return;
+	}
+	qsort(res->lat, res->ops, sizeof(*res->lat), cmp_u64);
+	printf("%-9s %8u ops %10.1f ops/s %8.1f MB/s  p50 %8.3f ms  "
+	       "p99 %8.3f ms  max %8.3f ms\n", name, res->ops,
+	       res->ops / secs, res->bytes / secs / (1 << 20),
+	       pct_ms(res, 50), pct_ms(res, 99), pct_ms(res, 100));
+	free(res->lat);
+	res->lat = NULL;
+}
+
+static char *path_of(const char *name)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%s", dir, name) < 0)
+		die("asprintf", NULL);
+	return path;
+}
+
+static void bench_seqwrite(void)
+{
+	char *path = path_of("cifsbench.seq");
+	struct result res;
+	char *buf = malloc(block_size);
+	u64 done, start;
+	ssize_t n;
+	int fd;
+
+	if (buf == NULL)
+		die("malloc", NULL);
+	memset(buf, 0x5a, block_size);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die("open", path);
+	result_init(&res, file_size / block_size + 2);
+	for (done = 0; done < file_size; done += n) {
+		start = now_ns();
+		n = write(fd, buf, block_size);
+		if (n <= 0)
+			die("write", path);
+		result_add(&res, start);
+		res.bytes += n;
+	}
+	/* the writeback is part of the cost */
+	start = now_ns();
+	if (fsync(fd))
+		die("fsync", path);
+	result_add(&res, start);
+	if (close(fd))
+		die("close", path);
+	result_print("seqwrite", &res);
+	free(buf);
+	free(path);
+}
+
+static void bench_seqread(void)
+{
+	char *path = path_of("cifsbench.seq");
+	struct result res;
+	char *buf = malloc(block_size);
+	u64 start;
+	ssize_t n;
+	int fd;
+
+	if (buf == NULL)
+		die("malloc", NULL);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		die("open", path);
+	/* make the reads go to the server, not the page cache */
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	result_init(&res, file_size / block_size + 1);
+	for (;;) {
+		start = now_ns();
+		n = read(fd, buf, block_size);
+		if (n < 0)
+			die("read", path);
+		if (n == 0)
+			break;
+		result_add(&res, start);
+		res.bytes += n;
+	}
+	close(fd);
+	result_print("seqread", &res);
+	unlink(path);
+	free(buf);
+	free(path);
+}
+
+static void small_name(char *name, size_t len, unsigned int i)
+{
+	snprintf(name, len, "cifsbench.small/f%06u", i);
+}
+
+static void bench_create(void)
+{
+	char *top = path_of("cifsbench.small");
+	char name[64], *path;
+	char *buf = calloc(1, small_size ? small_size : 1);
+	struct result res;
+	unsigned int i;
+	u64 start;
+	int fd;
+
+	if (buf == NULL)
+		die("malloc", NULL);
+	if (mkdir(top, 0755) && errno != EEXIST)
+		die("mkdir", top);
+	result_init(&res, nr_files);
+	for (i = 0; i < nr_files; i++) {
+		small_name(name, sizeof(name), i);
+		path = path_of(name);
+		start = now_ns();
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0)
+			die("create", path);
+		if (small_size &&
+		    write(fd, buf, small_size) != (ssize_t)small_size)
+			die("write", path);
+		if (close(fd))
+			die("close", path);
+		result_add(&res, start);
+		res.bytes += small_size;
+		free(path);
+	}
+	result_print("create", &res);
+	free(buf);
+	free(top);
+}
+
+static void bench_stat(void)
+{
+	char name[64], *path;
+	struct result res;
+	struct stat st;
+	unsigned int i, r;
+	u64 start;
+
+	result_init(&res, nr_files * rounds);
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < nr_files; i++) {
+			small_name(name, sizeof(name), i);
+			path = path_of(name);
+			start = now_ns();
+			if (stat(path, &st))
+				die("stat", path);
+			result_add(&res, start);
+			free(path);
+		}
+	}
+	result_print("stat", &res);
+}
+
+static void bench_unlink(void)
+{
+	char *top = path_of("cifsbench.small");
+	char name[64], *path;
+	struct result res;
+	unsigned int i;
+	u64 start;
+
+	result_init(&res, nr_files);
+	for (i = 0; i < nr_files; i++) {
+		small_name(name, sizeof(name), i);
+		path = path_of(name);
+		start = now_ns();
+		if (unlink(path))
+			die("unlink", path);
+		result_add(&res, start);
+		free(path);
+	}
+	result_print("unlink", &res);
+	rmdir(top);
+	free(top);
+}
+
+/*
+ * One operation is a whole listing. The directory is filled with empty
+ * files first, untimed, and left in place afterwards.
+ */
+static void bench_readdir(void)
+{
+	char *top = path_of("cifsbench.dir");
+	char name[64], *path;
+	struct result res;
+	struct dirent *de;
+	unsigned int i, r, n;
+	u64 start;
+	DIR *d;
+	int fd;
+
+	if (mkdir(top, 0755) && errno != EEXIST)
+		die("mkdir", top);
+	for (i = 0; i < nr_dirents; i++) {
+		snprintf(name, sizeof(name), "cifsbench.dir/entry-%08u", i);
+		path = path_of(name);
+		fd = open(path, O_WRONLY | O_CREAT, 0644);
+		if (fd < 0)
+			die("create", path);
+		close(fd);
+		free(path);
+	}
+
+	result_init(&res, rounds);
+	for (r = 0; r < rounds; r++) {
+		start = now_ns();
+		d = opendir(top);
+		if (d == NULL)
+			die("opendir", top);
+		n = 0;
+		while ((de = readdir(d)) != NULL)
+			n++;
+		closedir(d);
+		result_add(&res, start);
+		if (n < nr_dirents + 2) {
+			fprintf(stderr, "cifsbench: readdir saw %u of %u "
+				"entries\n", n, nr_dirents + 2);
+			exit(1);
+		}
+	}
+	result_print("readdir", &res);
+	free(top);
+}
+
+static const struct {
+	const char *name;
+	void (*fn)(void);
+} workloads[] = {
+	{ "seqwrite",	bench_seqwrite },
+	{ "seqread",	bench_seqread },
+	{ "create",	bench_create },
+	{ "stat",	bench_stat },
+	{ "readdir",	bench_readdir },
+	{ "unlink",	bench_unlink },
+};
+
+#define NR_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static u64 parse_size(const char *s)
+{
+	char *end;
+	u64 v = strtoull(s, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		v <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		v <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		v <<= 10;
+	}
+	return v;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: cifsbench [options] dir\n"
+		"  -s size     sequential file size (default 64M)\n"
+		"  -b size     sequential I/O size (default 64K)\n"
+		"  -n count    small files to create, stat and unlink "
+		"(default 1000)\n"
+		"  -f size     small file size (default 4K)\n"
+		"  -N count    entries in the readdir directory "
+		"(default 10000)\n"
+		"  -r rounds   stat and readdir passes (default 10)\n"
+		"  -w list     comma separated workloads (default all):\n"
+		"              seqwrite,seqread,create,stat,readdir,unlink\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char *list = NULL, *w;
+	int run[NR_WORKLOADS];
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:b:n:f:N:r:w:")) != -1) {
+		switch (opt) {
+		case 's':
+			file_size = parse_size(optarg);
+			break;
+		case 'b':
+			block_size = parse_size(optarg);
+			break;
+		case 'n':
+			nr_files = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			small_size = parse_size(optarg);
+			break;
+		case 'N':
+			nr_dirents = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rounds = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			list = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1 || block_size == 0 || rounds == 0)
+		usage();
+	dir = argv[optind];
+
+	for (i = 0; i < NR_WORKLOADS; i++)
+		run[i] = list == NULL;
+	for (w = list ? strtok(list, ",") : NULL; w; w = strtok(NULL, ",")) {
+		for (i = 0; i < NR_WORKLOADS; i++)
+			if (strcmp(w, workloads[i].name) == 0)
+				break;
+		if (i == NR_WORKLOADS)
+			usage();
+		run[i] = 1;
+	}
+
+	/* the order matters: each reads what the one before it wrote */
+	for (i = 0; i < NR_WORKLOADS; i++)
+		if (run[i])
+			workloads[i].fn();
+	return 0;
+}
@@ -0,0 +1,2005 @@
+/*
+ * smbloop.c - memory backed SMB server for benchmarking the cifs client
+ *
+ * Speaks just enough of the NT LM 0.12 dialect for fs/cifs to mount a
+ * share and run ordinary file workloads against it: negotiate, session
+ * setup, tree connect, NTCreateAndX, ReadAndX/WriteAndX, close, the
+ * trans2 find, query and set info calls, and the old style directory,
+ * delete and rename commands. The tree lives in memory and is shared by
+ * every connection and every share name. Any user and password are
+ * accepted. There is no signing, no unicode, no DFS and no CIFS unix
+ * extensions, and oplocks are granted but never broken.
+ *
+ * Requests are processed in the order they arrive on a connection. With
+ * -d (and -j) each response is held back for that many microseconds
+ * before it is sent, which models a server across a network while still
+ * letting the client keep as many requests in flight as it would against
+ * the real thing.
+ *
+ * Released under the GPL v2.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+/* SMB header layout, offsets from the 0xff 'SMB' signature */
+#define HDR_CMD		4
+#define HDR_STATUS	5
+#define HDR_FLAGS	9
+#define HDR_FLAGS2	10
+#define HDR_SIG		14
+#define HDR_TID		24
+#define HDR_UID		28
+#define HDR_WCT		32
+#define HDR_SIZE	33	/* up to and including WordCount */
+
+#define SMBFLG_RESPONSE		0x80
+#define SMBFLG2_KNOWS_LONG_NAMES 0x0001
+#define SMBFLG2_IS_LONG_NAME	0x0040
+#define SMBFLG2_ERR_STATUS	0x4000
+
+#define SMB_COM_CREATE_DIRECTORY	0x00
+#define SMB_COM_DELETE_DIRECTORY	0x01
+#define SMB_COM_CLOSE			0x04
+#define SMB_COM_FLUSH			0x05
+#define SMB_COM_DELETE			0x06
+#define SMB_COM_RENAME			0x07
+#define SMB_COM_LOCKING_ANDX		0x24
+#define SMB_COM_ECHO			0x2B
+#define SMB_COM_READ_ANDX		0x2E
+#define SMB_COM_WRITE_ANDX		0x2F
+#define SMB_COM_TRANSACTION2		0x32
+#define SMB_COM_FIND_CLOSE2		0x34
+#define SMB_COM_TREE_DISCONNECT		0x71
+#define SMB_COM_NEGOTIATE		0x72
+#define SMB_COM_SESSION_SETUP_ANDX	0x73
+#define SMB_COM_LOGOFF_ANDX		0x74
+#define SMB_COM_TREE_CONNECT_ANDX	0x75
+#define SMB_COM_NT_CREATE_ANDX		0xA2
+#define SMB_COM_NT_CANCEL		0xA4
+
+#define TRANS2_FIND_FIRST		0x01
+#define TRANS2_FIND_NEXT		0x02
+#define TRANS2_QUERY_FS_INFORMATION	0x03
+#define TRANS2_QUERY_PATH_INFORMATION	0x05
+#define TRANS2_SET_PATH_INFORMATION	0x06
+#define TRANS2_QUERY_FILE_INFORMATION	0x07
+#define TRANS2_SET_FILE_INFORMATION	0x08
+
+#define CAP_LARGE_FILES		0x00000008
+#define CAP_NT_SMBS		0x00000010
+#define CAP_STATUS32		0x00000040
+#define CAP_LEVEL_II_OPLOCKS	0x00000080
+#define CAP_NT_FIND		0x00000200
+#define CAP_INFOLEVEL_PASSTHRU	0x00002000
+#define CAP_LARGE_READ_X	0x00004000
+#define CAP_LARGE_WRITE_X	0x00008000
+
+#define ATTR_DIRECTORY		0x0010
+#define ATTR_ARCHIVE		0x0020
+
+#define STATUS_SUCCESS			0x00000000
+#define STATUS_NO_MORE_FILES		0x80000006
+#define STATUS_NOT_IMPLEMENTED		0xC0000002
+#define STATUS_INVALID_HANDLE		0xC0000008
+#define STATUS_INVALID_PARAMETER	0xC000000D
+#define STATUS_NO_SUCH_FILE		0xC000000F
+#define STATUS_NO_MEMORY		0xC0000017
+#define STATUS_OBJECT_NAME_INVALID	0xC0000033
+#define STATUS_OBJECT_NAME_NOT_FOUND	0xC0000034
+#define STATUS_OBJECT_NAME_COLLISION	0xC0000035
+#define STATUS_OBJECT_PATH_NOT_FOUND	0xC000003A
+#define STATUS_DISK_FULL		0xC000007F
+#define STATUS_INSUFF_SERVER_RESOURCES	0xC0000205
+#define STATUS_FILE_IS_A_DIRECTORY	0xC00000BA
+#define STATUS_NOT_SUPPORTED		0xC00000BB
+#define STATUS_DIRECTORY_NOT_EMPTY	0xC0000101
+#define STATUS_NOT_A_DIRECTORY		0xC0000103
+#define STATUS_INVALID_LEVEL		0xC0000148
+
+/* NTCreateAndX */
+#define REQ_OPLOCK		0x02
+#define REQ_BATCHOPLOCK		0x04
+#define OPLOCK_NONE		0
+#define OPLOCK_EXCLUSIVE	1
+#define OPLOCK_BATCH		2
+#define FILE_SUPERSEDE		0
+#define FILE_OPEN		1
+#define FILE_CREATE		2
+#define FILE_OPEN_IF		3
+#define FILE_OVERWRITE		4
+#define FILE_OVERWRITE_IF	5
+#define CREATE_DIRECTORY	0x0001
+#define CREATE_NOT_DIR		0x0040
+#define CREATE_DELETE_ON_CLOSE	0x1000
+
+#define SEARCH_CLOSE_ALWAYS	0x0001
+#define SEARCH_CLOSE_AT_END	0x0002
+
+#define MAX_BUF_SIZE	16644		/* what Samba offers */
+#define MAX_MPX		50
+#define MAX_PDU		(1 << 20)	/* largest request we accept */
+#define MAX_IO		(1 << 17)	/* largest read we return */
+#define MAX_FIDS	65536
+#define MAX_SEARCHES	1024
+#define NODE_HASH_BITS	16
+#define NODE_HASH_SIZE	(1 << NODE_HASH_BITS)
+#define NT_EPOCH_DELTA	11644473600ULL	/* 1601 to 1970 in seconds */
+
+static inline u16 get16(const u8 *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static inline u32 get32(const u8 *p)
+{
+	return get16(p) | (u32)get16(p + 2) << 16;
+}
+
+static inline u64 get64(const u8 *p)
+{
+	return get32(p) | (u64)get32(p + 4) << 32;
+}
+
+static inline void put16(u8 *p, u16 v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static inline void put32(u8 *p, u32 v)
+{
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static inline void put64(u8 *p, u64 v)
+{
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+static inline u32 align4(u32 v)
+{
+	return (v + 3) & ~3;
+}
+
+static inline u32 align8(u32 v)
+{
+	return (v + 7) & ~7;
+}
+
+static unsigned long delay_us;
+static unsigned long jitter_us;
+static int grant_oplocks = 1;
+static int verbose;
+
+static u64 now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static u64 now_nt(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((u64)ts.tv_sec + NT_EPOCH_DELTA) * 10000000 + ts.tv_nsec / 100;
+}
+
+/*
+ * The tree. Every node is hashed on its parent and case folded name, and
+ * directories also keep their children on a list, in creation order, for
+ * searches. A node is referenced by its directory entry, by each open
+ * handle and by each search that has it queued up, so that unlinking an
+ * open file or one a search is about to return is safe.
+ */
+struct node {
+	struct node *parent;
+	struct node *hnext;
+	struct node *first, *last;	/* children */
+	struct node *next, *prev;	/* siblings */
+	char *name;
+	size_t namelen;
+	u32 hash;
+	int dir;
+	int refs;
+	int opens;
+	int delete_pending;
+	u64 ino;
+	u64 ctime, atime, mtime, chtime;
+	u32 attr;
+	u8 *data;
+	u64 size, cap;
+};
+
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct node *node_hash[NODE_HASH_SIZE];
+static struct node *root;
+static u64 next_ino = 2;
+
+static u32 name_hash(const struct node *dir, const char *name, size_t len)
+{
+	u32 h = (u32)((uintptr_t)dir >> 4) * 2654435761u;
+
+	while (len--)
+		h = (h ^ tolower((u8)*name++)) * 16777619u;
+	return h;
+}
+
+static struct node *node_lookup(struct node *dir, const char *name,
+				size_t len)
+{
+	u32 h = name_hash(dir, name, len);
+	struct node *n;
+
+	for (n = node_hash[h & (NODE_HASH_SIZE - 1)]; n; n = n->hnext)
+		if (n->hash == h && n->parent == dir && n->namelen == len &&
+		    strncasecmp(n->name, name, len) == 0)
+			return n;
+	return NULL;
+}
+
+static void node_link(struct node *n, struct node *dir, const char *name,
+		      size_t len)
+{
+	struct node **head;
+
+	n->parent = dir;
+	n->hash = name_hash(dir, name, len);
+	head = &node_hash[n->hash & (NODE_HASH_SIZE - 1)];
+	n->hnext = *head;
+	*head = n;
+
+	n->next = NULL;
+	n->prev = dir->last;
+	if (dir->last)
+		dir->last->next = n;
+	else
+		dir->first = n;
+	dir->last = n;
+	dir->mtime = dir->chtime = now_nt();
+}
+
+static void node_detach(struct node *n)
+{
+	struct node *dir = n->parent;
+	struct node **pp;
+
+	for (pp = &node_hash[n->hash & (NODE_HASH_SIZE - 1)]; *pp;
+	     pp = &(*pp)->hnext) {
+		if (*pp == n) {
+			*pp = n->hnext;
+			break;
+		}
+	}
+	if (n->prev)
+		n->prev->next = n->next;
+	else
+		dir->first = n->next;
+	if (n->next)
+		n->next->prev = n->prev;
+	else
+		dir->last = n->prev;
+	dir->mtime = dir->chtime = now_nt();
+	n->parent = NULL;
+}
+
+static struct node *node_new(struct node *dir, const char *name, size_t len,
+			     int isdir)
+{
+	struct node *n = calloc(1, sizeof(*n));
+
+	if (n == NULL)
+		return NULL;
+	n->name = strndup(name, len);
+	if (n->name == NULL) {
+		free(n);
+		return NULL;
+	}
+	n->namelen = len;
+	n->dir = isdir;
+	n->refs = 1;
+	n->ino = next_ino++;
+	n->ctime = n->atime = n->mtime = n->chtime = now_nt();
+	n->attr = isdir ? ATTR_DIRECTORY : ATTR_ARCHIVE;
+	if (dir)
+		node_link(n, dir, name, len);
+	return n;
+}
+
+static void node_put(struct node *n)
+{
+	if (--n->refs)
+		return;
+	free(n->data);
+	free(n->name);
+	free(n);
+}
+
+static void node_unlink(struct node *n)
+{
+	if (n->parent == NULL)
+		return;
+	node_detach(n);
+	node_put(n);
+}
+
+static int node_rename(struct node *n, struct node *dir, const char *name,
+		       size_t len)
+{
+	char *copy = strndup(name, len);
+
+	if (copy == NULL)
+		return -1;
+	node_detach(n);
+	free(n->name);
+	n->name = copy;
+	n->namelen = len;
+	node_link(n, dir, name, len);
+	n->chtime = now_nt();
+	return 0;
+}
+
+static int node_set_size(struct node *n, u64 size)
+{
+	if (size > n->cap) {
+		u64 cap = n->cap ? n->cap : 4096;
+		u8 *data;
+
+		while (cap < size)
+			cap *= 2;
+		data = realloc(n->data, cap);
+		if (data == NULL)
+			return -1;
+		n->data = data;
+		n->cap = cap;
+	}
+	if (size > n->size)
+		memset(n->data + n->size, 0, size - n->size);
+	n->size = size;
+	n->mtime = n->chtime = now_nt();
+	return 0;
+}
+
+static int is_sep(char c)
+{
+	return c == '\\' || c == '/';
+}
+
+/*
+ * Walk a path from the root of the share. On a miss *parentp is set to
+ * the directory the last component would be created in, or NULL when
+ * one of the directories leading up to it does not exist, and *leafp and
+ * *leaflenp to the last component.
+ */
+static struct node *path_lookup(const char *path, struct node **parentp,
+				const char **leafp, size_t *leaflenp)
+{
+	struct node *n = root, *dir;
+	const char *comp;
+	size_t len;
+
+	*parentp = NULL;
+	*leafp = "";
+	*leaflenp = 0;
+	for (;;) {
+		while (is_sep(*path))
+			path++;
+		if (*path == '\0')
+			return n;
+		comp = path;
+		while (*path && !is_sep(*path))
+			path++;
+		len = path - comp;
+		if (!n->dir)
+			return NULL;
+		dir = n;
+		n = node_lookup(dir, comp, len);
+		if (n == NULL) {
+			while (is_sep(*path))
+				path++;
+			if (*path == '\0') {
+				*parentp = dir;
+				*leafp = comp;
+				*leaflenp = len;
+			}
+			return NULL;
+		}
+	}
+}
+
+static u32 lookup_status(struct node *parent)
+{
+	return parent ? STATUS_OBJECT_NAME_NOT_FOUND :
+			STATUS_OBJECT_PATH_NOT_FOUND;
+}
+
+static u64 alloc_size(const struct node *n)
+{
+	return (n->size + 4095) & ~4095ULL;
+}
+
+/* FILE_BASIC_INFORMATION, 40 bytes */
+static void put_basic_info(u8 *p, const struct node *n)
+{
+	put64(p, n->ctime);
+	put64(p + 8, n->atime);
+	put64(p + 16, n->mtime);
+	put64(p + 24, n->chtime);
+	put32(p + 32, n->attr);
+	put32(p + 36, 0);
+}
+
+/* FILE_STANDARD_INFORMATION, 24 bytes */
+static void put_standard_info(u8 *p, const struct node *n)
+{
+	put64(p, alloc_size(n));
+	put64(p + 8, n->size);
+	put32(p + 16, 1);
+	p[20] = n->delete_pending;
+	p[21] = n->dir;
+	put16(p + 22, 0);
+}
+
+/*
+ * FILE_ALL_INFORMATION without the name. The client copies a fixed size
+ * structure out of the response, so pad it out to well past that.
+ */
+#define ALL_INFO_SIZE	128
+
+static void put_all_info(u8 *p, const struct node *n)
+{
+	memset(p, 0, ALL_INFO_SIZE);
+	put_basic_info(p, n);
+	put_standard_info(p + 40, n);
+	put64(p + 64, n->ino);
+}
+
+/*
+ * Per connection state. Handles and searches are private to the
+ * connection that opened them, everything they point at is shared.
+ */
+struct handle {
+	struct node *node;
+	int delete_on_close;
+};
+
+struct search {
+	struct node **ents;
+	unsigned int count;
+	unsigned int pos;
+};
+
+struct reply {
+	struct reply *next;
+	u64 due;
+	u32 size;		/* including the four byte length */
+	u8 buf[];
+};
+
+struct conn {
+	int fd;
+	u16 uid;
+	u16 next_tid;
+	struct handle *fids[MAX_FIDS];
+	unsigned int fid_hint;
+	struct search *searches[MAX_SEARCHES];
+	pthread_mutex_t send_lock;
+	pthread_cond_t send_cond;
+	struct reply *head, *tail;
+	int done;
+	pthread_t sender;
+};
+
+struct request {
+	u8 *smb;
+	u32 len;
+	u8 wct;
+	u8 *vwv;
+	u8 *bytes;
+	u32 bcc;
+};
+
+static struct reply *reply_new(const struct request *req, u8 wct,
+			       u32 bytes)
+{
+	u32 size = 4 + HDR_SIZE + 2 * wct + 2;
+	struct reply *r = malloc(sizeof(*r) + size + bytes);
+	u8 *smb;
+
+	if (r == NULL)
+		return NULL;
+	memset(r, 0, sizeof(*r) + size);
+	r->size = size;
+	smb = r->buf + 4;
+	memcpy(smb, req->smb, HDR_SIZE);
+	put32(smb + HDR_STATUS, STATUS_SUCCESS);
+	smb[HDR_FLAGS] |= SMBFLG_RESPONSE;
+	put16(smb + HDR_FLAGS2, SMBFLG2_KNOWS_LONG_NAMES |
+	      SMBFLG2_IS_LONG_NAME | SMBFLG2_ERR_STATUS);
+	memset(smb + HDR_SIG, 0, 8);
+	smb[HDR_WCT] = wct;
+	return r;
+}
+
+static u8 *reply_vwv(struct reply *r)
+{
+	return r->buf + 4 + HDR_SIZE;
+}
+
+static u8 *reply_bytes(struct reply *r)
+{
+	return r->buf + 4 + HDR_SIZE + 2 * r->buf[4 + HDR_WCT] + 2;
+}
+
+/* bcc only has 16 bits, large reads let it wrap like Windows does */
+static void reply_set_bcc(struct reply *r, u32 bcc)
+{
+	put16(reply_bytes(r) - 2, bcc);
+	r->size = reply_bytes(r) - r->buf + bcc;
+}
+
+static void reply_andx(struct reply *r)
+{
+	u8 *vwv = reply_vwv(r);
+
+	vwv[0] = 0xff;		/* no further commands */
+	vwv[1] = 0;
+	put16(vwv + 2, 0);
+}
+
+static struct reply *reply_error(const struct request *req, u32 status)
+{
+	struct reply *r = reply_new(req, 0, 0);
+
+	if (r)
+		put32(r->buf + 4 + HDR_STATUS, status);
+	return r;
+}
+
+static struct reply *reply_ok(const struct request *req)
+{
+	return reply_new(req, 0, 0);
+}
+
+/*
+ * Strings in the byte area. Without unicode negotiated the client sends
+ * plain NUL terminated strings; clamp to what is actually there.
+ */
+static char *req_string(const struct request *req, const u8 *p)
+{
+	const u8 *end = req->smb + req->len;
+
+	if (p < req->smb || p >= end)
+		return strdup("");
+	return strndup((const char *)p, end - p);
+}
+
+static struct handle *fid_get(struct conn *c, const u8 *p)
+{
+	return c->fids[get16(p)];
+}
+
+static int fid_new(struct conn *c, struct node *n)
+{
+	struct handle *h;
+	unsigned int i, fid;
+
+	for (i = 0; i < MAX_FIDS - 1; i++) {
+		fid = (c->fid_hint + i) % (MAX_FIDS - 1) + 1;
+		if (c->fids[fid] == NULL)
+			break;
+	}
+	if (i == MAX_FIDS - 1)
+		return -1;
+	h = calloc(1, sizeof(*h));
+	if (h == NULL)
+		return -1;
+	h->node = n;
+	n->refs++;
+	n->opens++;
+	c->fids[fid] = h;
+	c->fid_hint = fid;
+	return fid;
+}
+
+static void fid_close(struct conn *c, unsigned int fid)
+{
+	struct handle *h = c->fids[fid];
+	struct node *n = h->node;
+
+	c->fids[fid] = NULL;
+	if (--n->opens == 0 && (h->delete_on_close || n->delete_pending) &&
+	    n->parent) {
+		/* drop the directory entry, the handle still holds a ref */
+		node_detach(n);
+		n->refs--;
+	}
+	node_put(n);
+	free(h);
+}
+
+static void search_free(struct conn *c, unsigned int sid)
+{
+	struct search *s = c->searches[sid];
+	unsigned int i;
+
+	c->searches[sid] = NULL;
+	for (i = 0; i < s->count; i++)
+		node_put(s->ents[i]);
+	free(s->ents);
+	free(s);
+}
+
+static struct reply *smb_negotiate(struct conn *c, struct request *req)
+{
+	static const char domain[] = "WORKGROUP";
+	const u8 *p = req->bytes, *end = req->bytes + req->bcc;
+	struct reply *r;
+	u8 *vwv, *b;
+	int index = 0, dialect = -1;
+	u64 t;
+
+	while (p < end && *p == 0x02) {
+		const u8 *name = ++p;
+
+		while (p < end && *p)
+			p++;
+		if (p - name == 10 && memcmp(name, "NT LM 0.12", 10) == 0)
+			dialect = index;
+		p++;
+		index++;
+	}
+	if (dialect < 0) {
+		r = reply_new(req, 1, 0);
+		if (r)
+			put16(reply_vwv(r), 0xffff);
+		return r;
+	}
+
+	r = reply_new(req, 17, 8 + sizeof(domain));
+	if (r == NULL)
+		return NULL;
+	vwv = reply_vwv(r);
+	put16(vwv, dialect);
+	vwv[2] = 0x03;			/* user level, encrypted passwords */
+	put16(vwv + 3, MAX_MPX);
+	put16(vwv + 5, 1);
+	put32(vwv + 7, MAX_BUF_SIZE);
+	put32(vwv + 11, 65536);
+	put32(vwv + 15, 0);
+	put32(vwv + 19, CAP_LARGE_FILES | CAP_NT_SMBS | CAP_STATUS32 |
+	      CAP_LEVEL_II_OPLOCKS | CAP_NT_FIND | CAP_INFOLEVEL_PASSTHRU |
+	      CAP_LARGE_READ_X | CAP_LARGE_WRITE_X);
+	t = now_nt();
+	put32(vwv + 23, t);
+	put32(vwv + 27, t >> 32);
+	put16(vwv + 31, 0);
+	vwv[33] = 8;			/* challenge length */
+	b = reply_bytes(r);
+	memcpy(b, "smbloop!", 8);
+	memcpy(b + 8, domain, sizeof(domain));
+	reply_set_bcc(r, 8 + sizeof(domain));
+	return r;
+}
+
+static struct reply *smb_session_setup(struct conn *c, struct request *req)
+{
+	static const char strs[] = "Unix\0smbloop\0WORKGROUP";
+	struct reply *r = reply_new(req, 3, sizeof(strs));
+
+	if (r == NULL)
+		return NULL;
+	reply_andx(r);
+	put16(reply_vwv(r) + 4, 0);
+	put16(r->buf + 4 + HDR_UID, c->uid);
+	memcpy(reply_bytes(r), strs, sizeof(strs));
+	reply_set_bcc(r, sizeof(strs));
+	return r;
+}
+
+static struct reply *smb_tree_connect(struct conn *c, struct request *req)
+{
+	static const char disk[] = "A:\0NTFS";
+	static const char ipc[] = "IPC\0";
+	const u8 *p = req->bytes + (req->wct >= 4 ? get16(req->vwv + 6) : 0);
+	char *path = req_string(req, p);
+	const char *share = strrchr(path, '\\');
+	const char *svc;
+	size_t len;
+	struct reply *r;
+
+	share = share ? share + 1 : path;
+	if (strcasecmp(share, "IPC$") == 0) {
+		svc = ipc;
+		len = sizeof(ipc);
+	} else {
+		svc = disk;
+		len = sizeof(disk);
+	}
+	free(path);
+
+	r = reply_new(req, 3, len);
+	if (r == NULL)
+		return NULL;
+	reply_andx(r);
+	put16(reply_vwv(r) + 4, 0x0001);	/* SMB_SUPPORT_SEARCH_BITS */
+	put16(r->buf + 4 + HDR_TID, c->next_tid++);
+	memcpy(reply_bytes(r), svc, len);
+	reply_set_bcc(r, len);
+	return r;
+}
+
+static struct reply *smb_andx_ok(struct conn *c, struct request *req)
+{
+	struct reply *r = reply_new(req, 2, 0);
+
+	if (r)
+		reply_andx(r);
+	return r;
+}
+
+static struct reply *smb_ok(struct conn *c, struct request *req)
+{
+	return reply_ok(req);
+}
+
+static struct reply *smb_echo(struct conn *c, struct request *req)
+{
+	struct reply *r = reply_new(req, 1, req->bcc);
+
+	if (r == NULL)
+		return NULL;
+	put16(reply_vwv(r), 1);
+	memcpy(reply_bytes(r), req->bytes, req->bcc);
+	reply_set_bcc(r, req->bcc);
+	return r;
+}
+
+static struct reply *smb_nt_create(struct conn *c, struct request *req)
+{
+	struct node *n, *parent;
+	const char *leaf;
+	size_t leaflen;
+	char *path;
+	u32 flags, disposition, options, status = STATUS_SUCCESS;
+	u32 action = 1;		/* FILE_OPENED */
+	u8 oplock = OPLOCK_NONE;
+	struct reply *r;
+	u8 *vwv;
+	int fid;
+
+	if (req->wct < 24)
+		return reply_error(req, STATUS_INVALID_PARAMETER);
+	flags = get32(req->vwv + 7);
+	disposition = get32(req->vwv + 35);
+	options = get32(req->vwv + 39);
+	path = req_string(req, req->bytes);
+
+	pthread_mutex_lock(&tree_lock);
+	n = path_lookup(path, &parent, &leaf, &leaflen);
+	if (n) {
+		if (disposition == FILE_CREATE)
+			status = STATUS_OBJECT_NAME_COLLISION;
+		else if (n->dir && (options & CREATE_NOT_DIR))
+			status = STATUS_FILE_IS_A_DIRECTORY;
+		else if (!n->dir && (options & CREATE_DIRECTORY))
+			status = STATUS_NOT_A_DIRECTORY;
+		else if (!n->dir && (disposition == FILE_SUPERSEDE ||
+				     disposition == FILE_OVERWRITE ||
+				     disposition == FILE_OVERWRITE_IF)) {
+			node_set_size(n, 0);
+			action = 3;	/* FILE_OVERWRITTEN */
+		}
+	} else if (parent == NULL) {
+		status = STATUS_OBJECT_PATH_NOT_FOUND;
+	} else if (disposition == FILE_OPEN || disposition == FILE_OVERWRITE) {
+		status = STATUS_OBJECT_NAME_NOT_FOUND;
+	} else {
+		n = node_new(parent, leaf, leaflen,
+			     !!(options & CREATE_DIRECTORY));
+		if (n == NULL)
+			status = STATUS_NO_MEMORY;
+		action = 2;		/* FILE_CREATED */
+	}
+	if (status == STATUS_SUCCESS) {
+		if (grant_oplocks && !n->dir && n->opens == 0) {
+			if (flags & REQ_BATCHOPLOCK)
+				oplock = OPLOCK_BATCH;
+			else if (flags & REQ_OPLOCK)
+				oplock = OPLOCK_EXCLUSIVE;
+		}
+		fid = fid_new(c, n);
+		if (fid < 0)
+			status = STATUS_INSUFF_SERVER_RESOURCES;
+		else if (options & CREATE_DELETE_ON_CLOSE)
+			c->fids[fid]->delete_on_close = 1;
+	}
+	if (status != STATUS_SUCCESS) {
+		pthread_mutex_unlock(&tree_lock);
+		free(path);
+		return reply_error(req, status);
+	}
+
+	r = reply_new(req, 34, 0);
+	if (r) {
+		reply_andx(r);
+		vwv = reply_vwv(r);
+		vwv[4] = oplock;
+		put16(vwv + 5, fid);
+		put32(vwv + 7, action);
+		put_basic_info(vwv + 11, n);	/* times and attributes */
+		put64(vwv + 47, alloc_size(n));
+		put64(vwv + 55, n->size);
+		put16(vwv + 63, 0);		/* disk file */
+		put16(vwv + 65, 0);
+		vwv[67] = n->dir;
+	}
+	pthread_mutex_unlock(&tree_lock);
+	free(path);
+	return r;
+}
+
+static struct reply *smb_close(struct conn *c, struct request *req)
+{
+	if (req->wct < 1)
+		return reply_error(req, STATUS_INVALID_PARAMETER);
+	pthread_mutex_lock(&tree_lock);
+	if (fid_get(c, req->vwv) == NULL) {
+		pthread_mutex_unlock(&tree_lock);
+		return reply_error(req, STATUS_INVALID_HANDLE);
+	}
+	fid_close(c, get16(req->vwv));
+	pthread_mutex_unlock(&tree_lock);
+	return reply_ok(req);
+}
+
+static struct reply *smb_read(struct conn *c, struct request *req)
+{
+	struct handle *h;
+	struct node *n;
+	u64 offset;
+	u32 count, avail;
+	struct reply *r;
+	u8 *vwv;
+
+	if (req->wct != 10 && req->wct != 12)
+		return reply_error(req, STATUS_INVALID_PARAMETER);
+	offset = get32(req->vwv + 6);
+	count = get16(req->vwv + 10);
+	if (req->wct == 12) {
+		offset |= (u64)get32(req->vwv + 20) << 32;
+		count |= (get32(req->vwv + 14) & 0xffff) << 16;
+	}
+	if (count > MAX_IO)
+		count = MAX_IO;
+
+	pthread_mutex_lock(&tree_lock);
+	h = fid_get(c, req->vwv + 4);
+	if (h == NULL || h->node->dir) {
+		pthread_mutex_unlock(&tree_lock);
+		return reply_error(req, h ? STATUS_FILE_IS_A_DIRECTORY :
+				   STATUS_INVALID_HANDLE);
+	}
+	n = h->node;
+	avail = offset < n->size ? n->size - offset : 0;
+	if (count > avail)
+		count = avail;
+	r = reply_new(req, 12, 1 + count);
+	if (r) {
+		reply_andx(r);
+		vwv = reply_vwv(r);
+		put16(vwv + 10, count);
+		put16(vwv + 12, HDR_SIZE + 24 + 2 + 1);
+		put16(vwv + 14, count >> 16);
+		if (count)
+			memcpy(reply_bytes(r) + 1, n->data + offset, count);
+		reply_set_bcc(r, 1 + count);
+		n->atime = now_nt();
+	}
+	pthread_mutex_unlock(&tree_lock);
+	return r;
+}
+
+static struct reply *smb_write(struct conn *c, struct request *req)
+{
+	struct handle *h;
+	struct node *n;
+	u64 offset;
+	u32 count, data_off;
+	struct reply *r;
+	u8 *vwv;
+
+	if (req->wct != 12 && req->wct != 14)
+		return reply_error(req, STATUS_INVALID_PARAMETER);
+	offset = get32(req->vwv + 6);
+	count = get16(req->vwv + 20);
+	data_off = get16(req->vwv + 22);
+	if (req->wct == 14) {
+		count |= get16(req->vwv + 18) << 16;
+		offset |= (u64)get32(req->vwv + 24) << 32;
+	}
+	if (data_off > req->len || count > req->len - data_off)
+		return reply_error(req, STATUS_INVALID_PARAMETER);
+
+	pthread_mutex_lock(&tree_lock);
+	h = fid_get(c, req->vwv + 4);
+	if (h == NULL || h->node->dir) {
+		pthread_mutex_unlock(&tree_lock);
+		return reply_error(req, h ? STATUS_FILE_IS_A_DIRECTORY :
+				   STATUS_INVALID_HANDLE);
+	}
+	n = h->node;
+	if (offset + count > n->size && node_set_size(n, offset + count)) {
+		pthread_mutex_unlock(&tree_lock);
+		return reply_error(req, STATUS_DISK_FULL);
+	}
+	memcpy(n->data + offset, req->smb + data_off, count);
+	n->mtime = n->chtime = now_nt();
+	pthread_mutex_unlock(&tree_lock);
+
+	r = reply_new(req, 6, 0);
+	if (r) {
+		reply_andx(r);
+		vwv = reply_vwv(r);
+		put16(vwv + 4, count);
+		put16(vwv + 8, count >> 16);
+	}
+	return r;
+}
+
+static struct reply *smb_mkdir(struct conn *c, struct request *req)
+{
+	struct node *n, *parent;
+	const char *leaf;
+	size_t leaflen;
+	char *path = req_string(req, req->bytes + 1);	/* skip 0x04 */
+	u32 status = STATUS_SUCCESS;
+
+	pthread_mutex_lock(&tree_lock);
+	n = path_lookup(path, &parent, &leaf, &leaflen);
+	if (n)
+		status = STATUS_OBJECT_NAME_COLLISION;
+	else if (parent == NULL)
+		status = STATUS_OBJECT_PATH_NOT_FOUND;
+	else if (node_new(parent, leaf, leaflen, 1) == NULL)
+		status = STATUS_NO_MEMORY;
+	pthread_mutex_unlock(&tree_lock);
+	free(path);
+	return status ? reply_error(req, status) : reply_ok(req);
+}
+
+static struct reply *smb_unlink(struct conn *c, struct request *req,
+				int rmdir)
+{
+	struct node *n, *parent;
+	const char *leaf;
+	size_t leaflen;
+	u8 *p = req->bytes + 1;			/* skip 0x04 */
+	char *path = req_string(req, p);
+	u32 status = STATUS_SUCCESS;
+
+	pthread_mutex_lock(&tree_lock);
+	n = path_lookup(path, &parent, &leaf, &leaflen);
+	if (n == NULL)
+		status = lookup_status(parent);
+	else if (n == root)
+		status = STATUS_INVALID_PARAMETER;
+	else if (rmdir && !n->dir)
+		status = STATUS_NOT_A_DIRECTORY;
+	else if (!rmdir && n->dir)
+		status = STATUS_FILE_IS_A_DIRECTORY;
+	else if (n->first)
+		status = STATUS_DIRECTORY_NOT_EMPTY;
+	else
+		node_unlink(n);
+	pthread_mutex_unlock(&tree_lock);
+	free(path);
+	return status ? reply_error(req, status) : reply_ok(req);
+}
+
+static struct reply *smb_rmdir(struct conn *c, struct request *req)
+{
+	return smb_unlink(c, req, 1);
+}
+
+static struct reply *smb_delete(struct conn *c, struct request *req)
+{
+	return smb_unlink(c, req, 0);
+}
+
+static struct reply *smb_rename(struct conn *c, struct request *req)
+{
+	struct node *n, *target, *parent, *dir;
+	const char *leaf;
+	size_t leaflen;
+	char *from, *to;
+	u32 status = STATUS_SUCCESS;
+
+	from = req_string(req, req->bytes + 1);
+	to = req_string(req, req->bytes + 1 + strlen(from) + 2);
+
+	pthread_mutex_lock(&tree_lock);
+	n = path_lookup(from, &parent, &leaf, &leaflen);
+	if (n == NULL) {
+		status = lookup_status(parent);
+		goto out;
+	}
+	target = path_lookup(to, &parent, &leaf, &leaflen);
+	if (target == n) {
+		/* a change of case only */
+		parent = n->parent;
+		leaf = strrchr(to, '\\') ? strrchr(to, '\\') + 1 : to;
+		leaflen = strlen(leaf);
+	} else if (target) {
+		status = STATUS_OBJECT_NAME_COLLISION;
+		goto out;
+	} else if (parent == NULL) {
+		status = STATUS_OBJECT_PATH_NOT_FOUND;
+		goto out;
+	}
+	for (dir = parent; dir; dir = dir->parent) {
+		if (dir == n) {
+			status = STATUS_INVALID_PARAMETER;
+			goto out;
+		}
+	}
+	if (n == root || node_rename(n, parent, leaf, leaflen))
+		status = STATUS_INVALID_PARAMETER;
+out:
+	pthread_mutex_unlock(&tree_lock);
+	free(from);
+	free(to);
+	return status ? reply_error(req, status) : reply_ok(req);
+}
+
+static struct reply *smb_locking(struct conn *c, struct request *req)
+{
+	/* an oplock release on its own gets no response */
+	if (req->wct >= 8 && (req->vwv[6] & 0x02) &&
+	    get16(req->vwv + 12) == 0 && get16(req->vwv + 14) == 0)
+		return NULL;
+	return smb_andx_ok(c, req);
+}
+
+static struct reply *smb_find_close(struct conn *c, struct request *req)
+{
+	unsigned int sid;
+
+	if (req->wct < 1)
+		return reply_error(req, STATUS_INVALID_PARAMETER);
+	sid = get16(req->vwv);
+	pthread_mutex_lock(&tree_lock);
+	if (sid >= MAX_SEARCHES || c->searches[sid] == NULL) {
+		pthread_mutex_unlock(&tree_lock);
+		return reply_error(req, STATUS_INVALID_HANDLE);
+	}
+	search_free(c, sid);
+	pthread_mutex_unlock(&tree_lock);
+	return reply_ok(req);
+}
+
+/*
+ * Transaction2. Parameters and data come back in a single response,
+ * with the parameters at a four byte boundary after the bcc and the data
+ * at the next four byte boundary after them.
+ */
+struct trans2 {
+	u16 sub;
+	const u8 *param;
+	u32 pcount;
+	const u8 *data;
+	u32 dcount;
+	u32 max_data;
+};
+
+#define T2_PARAM_OFF	(HDR_SIZE + 20 + 2 + 1)
+
+static struct reply *t2_reply(const struct request *req, u32 pmax, u32 dmax)
+{
+	return reply_new(req, 10, 1 + pmax + 3 + dmax);
+}
+
+static u8 *t2_param(struct reply *r)
+{
+	return r->buf + 4 + T2_PARAM_OFF;
+}
+
+static u8 *t2_data(struct reply *r, u32 plen)
+{
+	return r->buf + 4 + align4(T2_PARAM_OFF + plen);
+}
+
+static void t2_finish(struct reply *r, u32 plen, u32 dlen)
+{
+	u8 *vwv = reply_vwv(r);
+	u32 doff = align4(T2_PARAM_OFF + plen);
+
+	put16(vwv, plen);
+	put16(vwv + 2, dlen);
+	put16(vwv + 6, plen);
+	put16(vwv + 8, T2_PARAM_OFF);
+	put16(vwv + 12, dlen);
+	put16(vwv + 14, doff);
+	reply_set_bcc(r, doff + dlen - (HDR_SIZE + 20 + 2));
+}
+
+static char *t2_string(const struct request *req, const struct trans2 *t2,
+		       u32 offset)
+{
+	if (offset >= t2->pcount)
+		return strdup("");
+	return strndup((const char *)t2->param + offset, t2->pcount - offset);
+}
+
+/* plain * and ? matching, case insensitive; DOS wildcards treated alike */
+static int wildcard_match(const char *pat, const char *name)
+{
+	for (; *pat; pat++, name++) {
+		if (*pat == '*' || *pat == '<') {
+			while (pat[1] == '*' || pat[1] == '<')
+				pat++;
+			if (pat[1] == '\0')
+				return 1;
+			for (; *name; name++)
+				if (wildcard_match(pat + 1, name))
+					return 1;
+			return 0;
+		}
+		if (*name == '\0')
+			return 0;
+		if (*pat != '?' && *pat != '>' &&
+		    tolower((u8)*pat) != tolower((u8)*name))
+			return 0;
+	}
+	return *name == '\0';
+}
+
+static u32 dirent_size(u16 level, const struct node *n)
+{
+	u32 fixed;
+
+	switch (level) {
+	case 0x101:
+		fixed = 64;
+		break;
+	case 0x102:
+		fixed = 68;
+		break;
+	case 0x105:
+		fixed = 80;
+		break;
+	default:
+		return 0;
+	}
+	return align8(fixed + n->namelen + 1);
+}
+
+static void put_dirent(u8 *p, u32 size, u16 level, const struct node *n,
+		       u32 index)
+{
+	u32 fixed = level == 0x101 ? 64 : level == 0x102 ? 68 : 80;
+
+	memset(p, 0, size);
+	put32(p, size);
+	put32(p + 4, index);
+	put64(p + 8, n->ctime);
+	put64(p + 16, n->atime);
+	put64(p + 24, n->mtime);
+	put64(p + 32, n->chtime);
+	put64(p + 40, n->size);
+	put64(p + 48, alloc_size(n));
+	put32(p + 56, n->attr);
+	put32(p + 60, n->namelen);
+	if (level == 0x105)
+		put64(p + 72, n->ino);
+	memcpy(p + fixed, n->name, n->namelen);
+}
+
+/*
+ * Fill a find response from where the search left off. Returns the
+ * number of entries; the offset of the last one goes in *last.
+ */
+static u32 search_fill(struct search *s, u16 level, u32 max_count, u8 *data,
+		       u32 room, u32 *used, u32 *last)
+{
+	u32 count = 0, off = 0, size;
+	u8 *prev = NULL;
+
+	*last = 0;
+	while (s->pos < s->count && count < max_count) {
+		struct node *n = s->ents[s->pos];
+
+		size = dirent_size(level, n);
+		if (off + size > room)
+			break;
+		put_dirent(data + off, size, level, n, s->pos);
+		prev = data + off;
+		*last = off;
+		off += size;
+		count++;
+		s->pos++;
+	}
+	if (prev)
+		put32(prev, 0);		/* NextEntryOffset of the last one */
+	*used = off;
+	return count;
+}
+
+static u32 find_room(const struct trans2 *t2)
+{
+	return t2->max_data < MAX_IO ? t2->max_data : MAX_IO;
+}
+
+static struct reply *t2_find_first(struct conn *c, struct request *req,
+				   struct trans2 *t2)
+{
+	u16 attrs, max_count, flags, level;
+	char *path, *pattern, *sep;
+	struct node *dir, *parent, *n;
+	const char *leaf;
+	size_t leaflen;
+	struct search *s = NULL;
+	unsigned int sid, count, i;
+	u32 used, last, status = STATUS_SUCCESS;
+	struct reply *r = NULL;
+	u8 *p;
+
+	if (t2->pcount < 12)
+		return reply_error(req, STATUS_INVALID_PARAMETER);
+	attrs = get16(t2->param);
+	max_count = get16(t2->param + 2);
+	flags = get16(t2->param + 4);
+	level = get16(t2->param + 6);
+	if (level != 0x101 && level != 0x102 && level != 0x105)
+		return reply_error(req, STATUS_INVALID_LEVEL);
+
+	path = t2_string(req, t2, 12);
+	sep = strrchr(path, '\\');
+	if (sep) {
+		*sep = '\0';
+		pattern = sep + 1;
+	} else {
+		pattern = path;
+	}
+
+	pthread_mutex_lock(&tree_lock);
+	dir = path_lookup(sep ? path : "", &parent, &leaf, &leaflen);
+	if (dir == NULL) {
+		status = STATUS_OBJECT_PATH_NOT_FOUND;
+		goto out;
+	}
+	if (!dir->dir) {
+		status = STATUS_NOT_A_DIRECTORY;
+		goto out;
+	}
+	for (sid = 1; sid < MAX_SEARCHES; sid++)
+		if (c->searches[sid] == NULL)
+			break;
+	s = calloc(1, sizeof(*s));
+	if (sid == MAX_SEARCHES || s == NULL) {
+		status = STATUS_INSUFF_SERVER_RESOURCES;
+		goto out;
+	}
+
+	count = 0;
+	for (n = dir->first; n; n = n->next)
+		count++;
+	s->ents = malloc((count ? count : 1) * sizeof(*s->ents));
+	if (s->ents == NULL) {
+		status = STATUS_NO_MEMORY;
+		goto out;
+	}
+	for (n = dir->first; n; n = n->next) {
+		if (n->dir && !(attrs & ATTR_DIRECTORY))
+			continue;
+		if (!wildcard_match(pattern, n->name))
+			continue;
+		n->refs++;
+		s->ents[s->count++] = n;
+	}
+	if (s->count == 0) {
+		status = STATUS_NO_SUCH_FILE;
+		goto out;
+	}
+	c->searches[sid] = s;
+
+	r = t2_reply(req, 10, find_room(t2));
+	if (r == NULL) {
+		search_free(c, sid);
+		s = NULL;
+		goto out;
+	}
+	count = search_fill(s, level, max_count, t2_data(r, 10),
+			    find_room(t2), &used, &last);
+	p = t2_param(r);
+	put16(p, sid);
+	put16(p + 2, count);
+	put16(p + 4, s->pos == s->count);
+	put16(p + 6, 0);
+	put16(p + 8, last);
+	t2_finish(r, 10, used);
+	if ((flags & SEARCH_CLOSE_ALWAYS) ||
+	    ((flags & SEARCH_CLOSE_AT_END) && s->pos == s->count))
+		search_free(c, sid);
+	s = NULL;
+out:
+	if (s) {
+		for (i = 0; i < s->count; i++)
+			node_put(s->ents[i]);
+		free(s->ents);
+		free(s);
+	}
+	pthread_mutex_unlock(&tree_lock);
+	free(path);
+	return status ? reply_error(req, status) : r;
+}
+
+static struct reply *t2_find_next(struct conn *c, struct request *req,
+				  struct trans2 *t2)
+{
+	u16 sid, max_count, level, flags;
+	struct search *s;
+	struct reply *r;
+	u32 count, used, last;
+	u8 *p;
+
+	if (t2->pcount < 12)
+		return reply_error(req, STATUS_INVALID_PARAMETER);
+	sid = get16(t2->param);
+	max_count = get16(t2->param + 2);
+	level = get16(t2->param + 4);
+	flags = get16(t2->param + 10);
+	if (level != 0x101 && level != 0x102 && level != 0x105)
+		return reply_error(req, STATUS_INVALID_LEVEL);
+
+	pthread_mutex_lock(&tree_lock);
+	s = sid < MAX_SEARCHES ? c->searches[sid] : NULL;
+	if (s == NULL) {
+		pthread_mutex_unlock(&tree_lock);
+		return reply_error(req, STATUS_INVALID_HANDLE);
+	}
+	if (s->pos == s->count) {
+		search_free(c, sid);
+		pthread_mutex_unlock(&tree_lock);
+		return reply_error(req, STATUS_NO_MORE_FILES);
+	}
+	r = t2_reply(req, 8, find_room(t2));
+	if (r) {
+		count = search_fill(s, level, max_count, t2_data(r, 8),
+				    find_room(t2), &used, &last);
+		p = t2_param(r);
+		put16(p, count);
+		put16(p + 2, s->pos == s->count);
+		put16(p + 4, 0);
+		put16(p + 6, last);
+		t2_finish(r, 8, used);
+		if ((flags & SEARCH_CLOSE_ALWAYS) ||
+		    ((flags & SEARCH_CLOSE_AT_END) && s->pos == s->count))
+			search_free(c, sid);
+	}
+	pthread_mutex_unlock(&tree_lock);
+	return r;
+}
+
+static struct reply *t2_query_fs(struct conn *c, struct request *req,
+				 struct trans2 *t2)
+{
+	static const char fsname[] = "NTFS";
+	u64 units = 1ULL << 26;		/* 256GB in 4K units */
+	struct reply *r;
+	u8 *d;
+	u32 len;
+
+	if (t2->pcount < 2)
+		return reply_error(req, STATUS_INVALID_PARAMETER);
+	r = t2_reply(req, 0, 64);
+	if (r == NULL)
+		return NULL;
+	d = t2_data(r, 0);
+	memset(d, 0, 64);
+	switch (get16(t2->param)) {
+	case 1:				/* SMB_INFO_ALLOCATION */
+		put32(d + 4, 8);
+		put32(d + 8, units);
+		put32(d + 12, units / 2);
+		put16(d + 16, 512);
+		len = 18;
+		break;
+	case 0x103:			/* SMB_QUERY_FS_SIZE_INFO */
+	case 0x3eb:
+		put64(d, units);
+		put64(d + 8, units / 2);
+		put32(d + 16, 8);
+		put32(d + 20, 512);
+		len = 24;
+		break;
+	case 0x104:			/* SMB_QUERY_FS_DEVICE_INFO */
+	case 0x3ec:
+		put32(d, 0x07);		/* FILE_DEVICE_DISK */
+		put32(d + 4, 0x20);	/* FILE_DEVICE_IS_MOUNTED */
+		len = 8;
+		break;
+	case 0x105:			/* SMB_QUERY_FS_ATTRIBUTE_INFO */
+	case 0x3ed:
+		put32(d, 0x3);		/* case sensitive search/preserved */
+		put32(d + 4, 255);
+		put32(d + 8, sizeof(fsname) - 1);
+		memcpy(d + 12, fsname, sizeof(fsname) - 1);
+		len = 12 + sizeof(fsname) - 1;
+		break;
+	case 0x3ef:			/* SMB_QUERY_FS_FULL_SIZE_INFO */
+		put64(d, units);
+		put64(d + 8, units / 2);
+		put64(d + 16, units / 2);
+		put32(d + 24, 8);
+		put32(d + 28, 512);
+		len = 32;
+		break;
+	default:
+		free(r);
+		return reply_error(req, STATUS_INVALID_LEVEL);
+	}
+	t2_finish(r, 0, len);
+	return r;
+}
+
+/* caller holds tree_lock */
+static struct reply *query_info(struct request *req, struct node *n,
+				u16 level)
+{
+	struct reply *r = t2_reply(req, 2, ALL_INFO_SIZE);
+	u8 *d;
+	u32 len;
+
+	if (r == NULL)
+		return NULL;
+	d = t2_data(r, 2);
+	switch (level) {
+	case 0x101:			/* SMB_QUERY_FILE_BASIC_INFO */
+	case 0x3ec:
+		put_basic_info(d, n);
+		len = 40;
+		break;
+	case 0x102:			/* SMB_QUERY_FILE_STANDARD_INFO */
+	case 0x3ed:
+		put_standard_info(d, n);
+		len = 24;
+		break;
+	case 0x103:			/* SMB_QUERY_FILE_EA_INFO */
+	case 0x3ef:
+		put32(d, 0);
+		len = 4;
+		break;
+	case 0x107:			/* SMB_QUERY_FILE_ALL_INFO */
+	case 0x3fa:
+		put_all_info(d, n);
+		len = ALL_INFO_SIZE;
+		break;
+	case 0x3ee:			/* SMB_QUERY_FILE_INTERNAL_INFO */
+		put64(d, n->ino);
+		len = 8;
+		break;
+	default:
+		free(r);
+		return reply_error(req, STATUS_INVALID_LEVEL);
+	}
+	put16(t2_param(r), 0);
+	t2_finish(r, 2, len);
+	return r;
+}
+
+/* caller holds tree_lock */
+static u32 set_info(struct handle *h, struct node *n, u16 level,
+		    const struct trans2 *t2)
+{
+	const u8 *d = t2->data;
+	u64 *times[4] = { &n->ctime, &n->atime, &n->mtime, &n->chtime };
+	u64 t;
+	int i;
+
+	switch (level) {
+	case 0x101:			/* SMB_SET_FILE_BASIC_INFO */
+	case 0x3ec:
+		if (t2->dcount < 36)
+			return STATUS_INVALID_PARAMETER;
+		for (i = 0; i < 4; i++) {
+			t = get64(d + 8 * i);
+			if (t == 0 || t == ~0ULL)
+				continue;
+			*times[i] = t;
+		}
+		if (get32(d + 32))
+			n->attr = get32(d + 32) | (n->dir ? ATTR_DIRECTORY : 0);
+		return STATUS_SUCCESS;
+	case 0x102:			/* SMB_SET_FILE_DISPOSITION_INFO */
+	case 0x3f5:
+		if (h == NULL || t2->dcount < 1)
+			return STATUS_INVALID_PARAMETER;
+		if (d[0] && n->dir && n->first)
+			return STATUS_DIRECTORY_NOT_EMPTY;
+		n->delete_pending = !!d[0];
+		return STATUS_SUCCESS;
+	case 0x103:			/* SMB_SET_FILE_ALLOCATION_INFO */
+	case 0x3fb:
+		return STATUS_SUCCESS;
+	case 0x104:			/* SMB_SET_FILE_END_OF_FILE_INFO */
+	case 0x3fc:
+		if (t2->dcount < 8)
+			return STATUS_INVALID_PARAMETER;
+		if (n->dir)
+			return STATUS_FILE_IS_A_DIRECTORY;
+		if (node_set_size(n, get64(d)))
+			return STATUS_DISK_FULL;
+		return STATUS_SUCCESS;
+	default:
+		return STATUS_INVALID_LEVEL;
+	}
+}
+
+static struct reply *t2_path_info(struct conn *c, struct request *req,
+				  struct trans2 *t2)
+{
+	struct node *n, *parent;
+	const char *leaf;
+	size_t leaflen;
+	struct reply *r;
+	char *path;
+	u16 level;
+	u32 status;
+
+	if (t2->pcount < 6)
+		return reply_error(req, STATUS_INVALID_PARAMETER);
+	level = get16(t2->param);
+	path = t2_string(req, t2, 6);
+	pthread_mutex_lock(&tree_lock);
+	n = path_lookup(path, &parent, &leaf, &leaflen);
+	if (n == NULL) {
+		r = reply_error(req, lookup_status(parent));
+	} else if (t2->sub == TRANS2_QUERY_PATH_INFORMATION) {
+		r = query_info(req, n, level);
+	} else {
+		status = set_info(NULL, n, level, t2);
+		if (status) {
+			r = reply_error(req, status);
+		} else {
+			r = t2_reply(req, 2, 0);
+			if (r) {
+				put16(t2_param(r), 0);
+				t2_finish(r, 2, 0);
+			}
+		}
+	}
+	pthread_mutex_unlock(&tree_lock);
+	free(path);
+	return r;
+}
+
+static struct reply *t2_file_info(struct conn *c, struct request *req,
+				  struct trans2 *t2)
+{
+	struct handle *h;
+	struct reply *r;
+	u16 level;
+	u32 status;
+
+	if (t2->pcount < 4)
+		return reply_error(req, STATUS_INVALID_PARAMETER);
+	level = get16(t2->param + 2);
+	pthread_mutex_lock(&tree_lock);
+	h = fid_get(c, t2->param);
+	if (h == NULL) {
+		r = reply_error(req, STATUS_INVALID_HANDLE);
+	} else if (t2->sub == TRANS2_QUERY_FILE_INFORMATION) {
+		r = query_info(req, h->node, level);
+	} else {
+		status = set_info(h, h->node, level, t2);
+		if (status) {
+			r = reply_error(req, status);
+		} else {
+			r = t2_reply(req, 2, 0);
+			if (r) {
+				put16(t2_param(r), 0);
+				t2_finish(r, 2, 0);
+			}
+		}
+	}
+	pthread_mutex_unlock(&tree_lock);
+	return r;
+}
+
+static struct reply *smb_trans2(struct conn *c, struct request *req)
+{
+	struct trans2 t2;
+	u32 poff, doff;
+
+	if (req->wct < 15)
+		return reply_error(req, STATUS_INVALID_PARAMETER);
+	t2.max_data = get16(req->vwv + 6);
+	t2.pcount = get16(req->vwv + 18);
+	poff = get16(req->vwv + 20);
+	t2.dcount = get16(req->vwv + 22);
+	doff = get16(req->vwv + 24);
+	t2.sub = get16(req->vwv + 28);
+	if (poff > req->len || t2.pcount > req->len - poff ||
+	    doff > req->len || t2.dcount > req->len - doff)
+		return reply_error(req, STATUS_INVALID_PARAMETER);
+	t2.param = req->smb + poff;
+	t2.data = req->smb + doff;
+
+	switch (t2.sub) {
+	case TRANS2_FIND_FIRST:
+		return t2_find_first(c, req, &t2);
+	case TRANS2_FIND_NEXT:
+		return t2_find_next(c, req, &t2);
+	case TRANS2_QUERY_FS_INFORMATION:
+		return t2_query_fs(c, req, &t2);
+	case TRANS2_QUERY_PATH_INFORMATION:
+	case TRANS2_SET_PATH_INFORMATION:
+		return t2_path_info(c, req, &t2);
+	case TRANS2_QUERY_FILE_INFORMATION:
+	case TRANS2_SET_FILE_INFORMATION:
+		return t2_file_info(c, req, &t2);
+	default:
+		return reply_error(req, STATUS_NOT_SUPPORTED);
+	}
+}
+
+static struct reply *smb_cancel(struct conn *c, struct request *req)
+{
+	return NULL;
+}
+
+typedef struct reply *(*smb_handler)(struct conn *, struct request *);
+
+static const smb_handler handlers[256] = {
+	[SMB_COM_CREATE_DIRECTORY]	= smb_mkdir,
+	[SMB_COM_DELETE_DIRECTORY]	= smb_rmdir,
+	[SMB_COM_CLOSE]			= smb_close,
+	[SMB_COM_FLUSH]			= smb_ok,
+	[SMB_COM_DELETE]		= smb_delete,
+	[SMB_COM_RENAME]		= smb_rename,
+	[SMB_COM_LOCKING_ANDX]		= smb_locking,
+	[SMB_COM_ECHO]			= smb_echo,
+	[SMB_COM_READ_ANDX]		= smb_read,
+	[SMB_COM_WRITE_ANDX]		= smb_write,
+	[SMB_COM_TRANSACTION2]		= smb_trans2,
+	[SMB_COM_FIND_CLOSE2]		= smb_find_close,
+	[SMB_COM_TREE_DISCONNECT]	= smb_ok,
+	[SMB_COM_NEGOTIATE]		= smb_negotiate,
+	[SMB_COM_SESSION_SETUP_ANDX]	= smb_session_setup,
+	[SMB_COM_LOGOFF_ANDX]		= smb_andx_ok,
+	[SMB_COM_TREE_CONNECT_ANDX]	= smb_tree_connect,
+	[SMB_COM_NT_CREATE_ANDX]	= smb_nt_create,
+	[SMB_COM_NT_CANCEL]		= smb_cancel,
+};
+
+static int send_all(int fd, const u8 *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int recv_all(int fd, u8 *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = recv(fd, buf, len, 0);
+		if (n == 0)
+			return -1;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void reply_send(struct conn *c, struct reply *r)
+{
+	u32 len = r->size - 4;
+
+	r->buf[0] = 0;
+	r->buf[1] = len >> 16;
+	r->buf[2] = len >> 8;
+	r->buf[3] = len;
+	if (send_all(c->fd, r->buf, r->size))
+		shutdown(c->fd, SHUT_RDWR);
+	free(r);
+}
+
+/*
+ * Delayed responses wait on a list ordered by due time. With a fixed
+ * delay that is arrival order, so new ones nearly always go at the tail.
+ */
+static void reply_queue(struct conn *c, struct reply *r)
+{
+	struct reply **pp;
+
+	if (delay_us == 0 && jitter_us == 0) {
+		reply_send(c, r);
+		return;
+	}
+	r->due = now_us() + delay_us;
+	if (jitter_us)
+		r->due += random() % (jitter_us + 1);
+
+	pthread_mutex_lock(&c->send_lock);
+	if (c->tail == NULL || c->tail->due <= r->due) {
+		r->next = NULL;
+		if (c->tail)
+			c->tail->next = r;
+		else
+			c->head = r;
+		c->tail = r;
+	} else {
+		for (pp = &c->head; (*pp)->due <= r->due; pp = &(*pp)->next)
+			;
+		r->next = *pp;
+		*pp = r;
+	}
+	pthread_cond_signal(&c->send_cond);
+	pthread_mutex_unlock(&c->send_lock);
+}
+
+static void *sender_thread(void *arg)
+{
+	struct conn *c = arg;
+	struct reply *r;
+	struct timespec ts;
+	u64 now;
+
+	pthread_mutex_lock(&c->send_lock);
+	for (;;) {
+		if (c->head == NULL) {
+			if (c->done)
+				break;
+			pthread_cond_wait(&c->send_cond, &c->send_lock);
+			continue;
+		}
+		now = now_us();
+		if (c->head->due > now) {
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			ts.tv_nsec += (c->head->due - now) * 1000;
+			ts.tv_sec += ts.tv_nsec / 1000000000;
+			ts.tv_nsec %= 1000000000;
+			pthread_cond_timedwait(&c->send_cond, &c->send_lock,
+					       &ts);
+			continue;
+		}
+		r = c->head;
+		c->head = r->next;
+		if (c->head == NULL)
+			c->tail = NULL;
+		pthread_mutex_unlock(&c->send_lock);
+		reply_send(c, r);
+		pthread_mutex_lock(&c->send_lock);
+	}
+	pthread_mutex_unlock(&c->send_lock);
+	return NULL;
+}
+
+static void conn_free(struct conn *c)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&tree_lock);
+	for (i = 0; i < MAX_FIDS; i++)
+		if (c->fids[i])
+			fid_close(c, i);
+	for (i = 0; i < MAX_SEARCHES; i++)
+		if (c->searches[i])
+			search_free(c, i);
+	pthread_mutex_unlock(&tree_lock);
+	close(c->fd);
+	free(c);
+}
+
+static void *conn_thread(void *arg)
+{
+	struct conn *c = arg;
+	static const u8 session_ok[4] = { 0x82, 0, 0, 0 };
+	struct request req;
+	struct reply *r;
+	u8 nb[4];
+	u8 *buf;
+	u32 len;
+	pthread_condattr_t attr;
+
+	buf = malloc(MAX_PDU);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&c->send_cond, &attr);
+	pthread_mutex_init(&c->send_lock, NULL);
+	if (buf == NULL ||
+	    pthread_create(&c->sender, NULL, sender_thread, c)) {
+		free(buf);
+		conn_free(c);
+		return NULL;
+	}
+
+	while (recv_all(c->fd, nb, 4) == 0) {
+		len = nb[1] << 16 | nb[2] << 8 | nb[3];
+		if (len > MAX_PDU || recv_all(c->fd, buf, len))
+			break;
+		if (nb[0] == 0x81) {		/* NetBIOS session request */
+			send_all(c->fd, session_ok, 4);
+			continue;
+		}
+		if (nb[0] != 0 || len < HDR_SIZE + 2 ||
+		    memcmp(buf, "\xffSMB", 4))
+			continue;		/* keepalives and junk */
+
+		req.smb = buf;
+		req.len = len;
+		req.wct = buf[HDR_WCT];
+		req.vwv = buf + HDR_SIZE;
+		if (HDR_SIZE + 2 * (u32)req.wct + 2 > len) {
+			r = reply_error(&req, STATUS_INVALID_PARAMETER);
+		} else {
+			req.bytes = req.vwv + 2 * req.wct + 2;
+			req.bcc = get16(req.bytes - 2);
+			if (req.bcc > len - (req.bytes - buf))
+				req.bcc = len - (req.bytes - buf);
+			if (verbose)
+				fprintf(stderr, "fd %d mid %u cmd 0x%02x\n",
+					c->fd, get16(buf + 30), buf[HDR_CMD]);
+			if (handlers[buf[HDR_CMD]])
+				r = handlers[buf[HDR_CMD]](c, &req);
+			else
+				r = reply_error(&req, STATUS_NOT_IMPLEMENTED);
+		}
+		if (r)
+			reply_queue(c, r);
+	}
+
+	pthread_mutex_lock(&c->send_lock);
+	c->done = 1;
+	pthread_cond_signal(&c->send_cond);
+	pthread_mutex_unlock(&c->send_lock);
+	pthread_join(c->sender, NULL);
+	free(buf);
+	conn_free(c);
+	return NULL;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: smbloop [-a addr] [-p port] [-d delay_us] "
+		"[-j jitter_us] [-x] [-v]\n"
+		"  -a  address to listen on (default 127.0.0.1)\n"
+		"  -p  port to listen on (default 4450)\n"
+		"  -d  hold every response back this long\n"
+		"  -j  plus a random extra delay up to this long\n"
+		"  -x  never grant oplocks\n"
+		"  -v  log every request\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in sin;
+	const char *addr = "127.0.0.1";
+	int port = 4450, lfd, fd, opt, one = 1;
+	pthread_attr_t attr;
+	pthread_t tid;
+	struct conn *c;
+	u16 uid = 100;
+
+	while ((opt = getopt(argc, argv, "a:p:d:j:xv")) != -1) {
+		switch (opt) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'd':
+			delay_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			jitter_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'x':
+			grant_oplocks = 0;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	root = node_new(NULL, "", 0, 1);
+	if (root == NULL)
+		return 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1) {
+		fprintf(stderr, "smbloop: bad address %s\n", addr);
+		return 1;
+	}
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0) {
+		perror("socket");
+		return 1;
+	}
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) ||
+	    listen(lfd, 16)) {
+		perror("bind");
+		return 1;
+	}
+	fprintf(stderr, "smbloop: listening on %s:%d, delay %luus "
+		"jitter %luus, oplocks %s\n", addr, port, delay_us,
+		jitter_us, grant_oplocks ? "on" : "off");
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (;;) {
+		fd = accept(lfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			return 1;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		c = calloc(1, sizeof(*c));
+		if (c == NULL) {
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->uid = uid++;
+		c->next_tid = 1;
+		if (pthread_create(&tid, &attr, conn_thread, c)) {
+			close(fd);
+			free(c);
+		}
+	}
+}